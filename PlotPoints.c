@@ -5,10 +5,55 @@
  *  Description: Reads data from a text file, and outputs an HTML file with pinouts that have qualities listed in the text file.
  */
 
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* For syscall, which -profile uses to open hardware counters */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#define HAVE_INOTIFY
+#endif
+/* -serve waits on its clients with epoll */
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <strings.h>
+#define HAVE_EPOLL
+#endif
+/* -profile can be compiled out entirely with -DNO_PROFILE */
+#ifndef NO_PROFILE
+#define HAVE_PROFILE
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define HAVE_PERF_EVENTS
+#endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 /* ========================================================================= */
 /*                              Type Definitions                             */
@@ -26,9 +71,189 @@
 #define ECS_LATITUDE 48.46104
 #define ECS_LONGITUDE -123.31153
 
+/* Stations within this many kilometres of the ECS Building are averaged to estimate its temperature */
+#define ECS_RADIUS 2
+
+/* Mean radius of the Earth in kilometres, as used by surfaceDistance */
+#define EARTH_RADIUS_KM 6371
+
+/* Largest number of points left unsplit in a leaf of the spatial index */
+#define KD_LEAF_SIZE 8
+
 /* Maximum number of stations allowed. Currently there are 201 VWSN stations. */
 #define MAX_STATIONS 201
 
+/* Number of parsed lines the streaming reader holds in memory at once */
+#define STREAM_CHUNK_ROWS 4096
+
+/* Largest number of threads the parallel ingest will use */
+#define MAX_INGEST_THREADS 64
+
+/* Number of timed passes made over the input file by the -bench option */
+#define BENCH_RUNS 5
+
+/* Number of points -bench measures surfaceDistanceBatch on */
+#define BENCH_DISTANCE_POINTS 1000000
+
+/* surfaceDistanceBatch agrees with surfaceDistance to within this many kilometres,
+   plus this fraction of the distance. The relative term allows for points that are
+   nearly antipodal, where the haversine formula is ill-conditioned in float and both
+   functions are only good to a few hundred metres. */
+#define SURFACE_DISTANCE_BATCH_ERROR 0.005
+#define SURFACE_DISTANCE_BATCH_RELATIVE_ERROR 4e-5
+
+/* Size in bytes of the buffer the HTML writer fills before each write */
+#define HTML_WRITER_BUFFER (1 << 20)
+
+/* Upper bound on the bytes of a marker besides its (escaped) name and text */
+#define MARKER_FIXED_BYTES 512
+
+/* The deepest zoom level with clusters; the stations themselves are shown beyond it */
+#define CLUSTER_MAX_ZOOM 15
+
+/* The zoom level writePrologue opens the map at */
+#define CLUSTER_DEFAULT_ZOOM 13
+
+/* Clusters are cells 64 pixels on a side, 4 to a 256 pixel map tile, so at zoom z
+   the map is 2^(z+2) cells on a side */
+#define CLUSTER_FINEST_BITS (CLUSTER_MAX_ZOOM + 2)
+
+/* The Web Mercator projection ends at this latitude */
+#define CLUSTER_MAX_LATITUDE 85.05112878
+
+/* A station registry looks IDs up in a dense table when they span no more than this
+   many times as many values as there are stations (plus 256), and otherwise through
+   a perfect hash, which tries up to PERFECT_HASH_MAX_TRIES displacements per bucket
+   before it is rebuilt with more slots */
+#define STATION_DENSE_RATIO 4
+#define PERFECT_HASH_MAX_TRIES 100000
+
+/* The layout of an ExactSum: its number of limbs of 32 bits, and the power of two its
+   lowest bit is worth. This is below the lowest bit of any product of two floats
+   (2^-298), and the top limb reaches far enough above the largest (below 2^256) to
+   hold the sum of any number of them. Carries are propagated every EXACT_SUM_PENDING
+   additions, before any limb can overflow. */
+#define EXACT_SUM_LIMBS 20
+#define EXACT_SUM_LOWEST_BIT (-300)
+#define EXACT_SUM_PENDING (1L << 30)
+
+/* The heatmap: each cell is estimated from the HEATMAP_NEIGHBOURS nearest sites (the
+   readings within one cell, merged), weighted by the inverse square of their
+   distance, unless one is within HEATMAP_EXACT_DISTANCE kilometres. The grid extends
+   HEATMAP_MARGIN of the extent of the stations beyond them on each side (and at least
+   HEATMAP_MIN_MARGIN degrees), and its threads work on bands of HEATMAP_TILE_ROWS
+   rows. -bench times a grid HEATMAP_BENCH_SIZE cells on a side over HEATMAP_BENCH_ROWS
+   observations generated around the input file, and HEATMAP_MAX_CELLS bounds the
+   grid. The page draws the heatmap with an opacity of HEATMAP_OPACITY. */
+#define HEATMAP_NEIGHBOURS 8
+#define HEATMAP_EXACT_DISTANCE 0.001
+#define HEATMAP_MARGIN 0.1f
+#define HEATMAP_MIN_MARGIN 0.01f
+#define HEATMAP_TILE_ROWS 16
+#define HEATMAP_OPACITY 0.5
+#define HEATMAP_BENCH_SIZE 1024
+#define HEATMAP_BENCH_ROWS 300000
+#define HEATMAP_MAX_CELLS (1L << 26)
+
+/* The bucket length -bench groups observations by, in minutes */
+#define BENCH_INTERVAL 60
+
+/* The most stages -profile times, and the number of hardware counters it reads for
+   each where the system allows it: cycles, instructions, cache misses and branch
+   misses */
+#define PROFILE_MAX_STAGES 16
+#define PROFILE_COUNTERS 4
+
+/* The most measurements a -bench report holds, and the version of the layout of the
+   JSON report written by -json (which must change whenever the layout does) */
+#define BENCH_MAX_STAGES 64
+#define BENCH_REPORT_VERSION 1
+
+/* The stations made by -generate: each is placed a normally distributed distance
+   from a station of the template file, with a standard deviation of
+   GENERATE_SPREAD_KM kilometres in each direction, and reads that station's
+   temperature, moved along a daily swing of GENERATE_DAILY_SWING degrees either side
+   of the mean (warmest at GENERATE_WARMEST_HOUR), plus normally distributed noise
+   with a standard deviation of GENERATE_NOISE degrees.
+   Each round of as many stations as the template file has is GENERATE_INTERVAL
+   minutes after the one before it. */
+#define GENERATE_SPREAD_KM 0.5
+#define GENERATE_DAILY_SWING 3.0
+#define GENERATE_WARMEST_HOUR 15
+#define GENERATE_NOISE 0.5
+#define GENERATE_INTERVAL 10
+
+/* The format of the station cache sidecar: its magic number and version (which must
+   change whenever the layout does), a value that shows the byte order it was written
+   in, the number of columns it holds, the alignment of each column, and the number
+   of bytes at each end of the source file whose hash it records */
+#define STATION_CACHE_MAGIC "PPCACHE"
+#define STATION_CACHE_VERSION 2
+#define STATION_CACHE_BYTE_ORDER 0x01020304
+#define STATION_CACHE_COLUMNS 6
+#define STATION_CACHE_ALIGN 64
+#define STATION_CACHE_SAMPLE 65536
+
+/* How often -watch checks the input file when no change has been reported, in
+   milliseconds */
+#define WATCH_POLL_MS 1000
+
+/* -watch merges its run of recently added stations into the main run once the main
+   run is no more than this many times larger */
+#define WATCH_MERGE_RATIO 16
+
+/* Largest number of clients -serve keeps connected at once */
+#define SERVE_MAX_CONNECTIONS 1024
+
+/* Longest request (its request line and headers) -serve accepts, in bytes */
+#define SERVE_REQUEST_MAX 8192
+
+/* Number of viewport responses -serve keeps cached. Each viewport has one slot, which
+   it takes over from whatever was cached there. */
+#define SERVE_CACHE_SLOTS 1024
+
+/* Number of the most recent request latencies -serve keeps for its percentiles */
+#define SERVE_LATENCY_SAMPLES 65536
+
+/* Number of requests made to -serve by the -bench option */
+#define SERVE_BENCH_REQUESTS 2000
+
+/* -viewport and -centre write the stations within this fraction of the viewport's
+   height and width beyond each of its edges, so that a short pan shows markers at once */
+#define VIEWPORT_MARGIN 0.25
+
+/* The size in pixels of the window -centre fits its viewport to */
+#define VIEWPORT_WIDTH_PIXELS 1280
+#define VIEWPORT_HEIGHT_PIXELS 800
+
+/* Highest zoom level -centre accepts */
+#define VIEWPORT_MAX_ZOOM 21
+
+/* The name of the directory beside the output file that holds the chunks of a culled
+   map is the output file's name followed by this */
+#define MARKER_CHUNK_SUFFIX ".chunks"
+
+/* Number of longitude spans of a GeoBox: its own, and the same one turn east and west */
+#define GEOBOX_SPANS 3
+
+/* Number of rows -serve picks the stations of a viewport from at a time */
+#define SERVE_SELECT_ROWS 1024
+
+/* Most thresholds a table of colour bands may have, so that the colours of its bands
+   fill one vector of 8 ints */
+#define BANDS_MAX_THRESHOLDS 7
+
+/* The kinds of threshold a table of colour bands may have: differences from the
+   average, temperatures, standard deviations from the average, or quantiles of the
+   readings */
+#define BANDS_OFFSET 0
+#define BANDS_ABSOLUTE 1
+#define BANDS_STDDEV 2
+#define BANDS_QUANTILE 3
+
+/* Number of readings the -bench option classifies */
+#define BENCH_CLASSIFY_READINGS 4000000
+
 /* A struct defining a point on the Earth's surface */
 typedef struct{
         float latitude;
@@ -69,6 +294,694 @@ typedef struct{
         int type;
 } MapMarker;
 
+/* A read-only, memory-mapped view of the input file */
+typedef struct{
+        /* The contents of the file (NULL if the file is empty) */
+        char *data;
+        /* The length of the file in bytes */
+        size_t size;
+} InputMap;
+
+/* A cursor over the lines of a mapped input file */
+typedef struct{
+        /* The name of the input file, used in error messages */
+        const char *name;
+        /* The mapped contents of the file, and the start of the next line to be read */
+        const char *start, *next, *end;
+        /* The 1-based line number of the next line to be read */
+        long lineNumber;
+        /* The number of malformed lines skipped so far */
+        long rejected;
+        /* If non-zero, malformed lines are skipped without printing a message */
+        int quiet;
+        /* If non-zero, the line numbers of malformed lines are saved in rejectedLines
+           (counted from the start of the reader's range) instead of being printed */
+        int deferReports;
+        long *rejectedLines;
+        long numDeferred, deferredCapacity;
+} StationReader;
+
+/* One line of the input file as the tokenizer reads it: the station, and the region
+   it belongs to, which StationData does not hold */
+typedef struct{
+        StationData data;
+        float regionID;
+} ParsedStation;
+
+/* Packs the time of an observation into 32 bits, such that later times compare greater:
+   the year takes 12 bits, the month 4, the day 5, the hour 5 and the minute 6 */
+#define PACK_TIMESTAMP(year, month, day, hour, minute) \
+        (((unsigned int)(year) << 20) | ((unsigned int)(month) << 16) | ((unsigned int)(day) << 11) | \
+         ((unsigned int)(hour) << 6) | (unsigned int)(minute))
+#define TIMESTAMP_YEAR(timestamp) ((timestamp) >> 20)
+#define TIMESTAMP_MONTH(timestamp) (((timestamp) >> 16) & 15)
+#define TIMESTAMP_DAY(timestamp) (((timestamp) >> 11) & 31)
+#define TIMESTAMP_HOUR(timestamp) (((timestamp) >> 6) & 31)
+#define TIMESTAMP_MINUTE(timestamp) ((timestamp) & 63)
+
+/* Stations held in structure-of-arrays form: one contiguous column per field, so that
+   each pass over the stations only reads the columns it needs. Row i of every column
+   describes the same observation. Station names are not stored; they are looked up
+   from the station ID only when a marker is written. A store holds every line of its
+   input file, so memory grows with the file (about 26 bytes per line). */
+typedef struct{
+        /* The numerical ID of each station */
+        int *stationID;
+        /* The temperature at each station (NaN if the station sent no reading) */
+        float *temperature;
+        /* Whether each station has a reading: only these are averaged and plotted.
+           A reading of exactly 0 degrees is a reading like any other. */
+        unsigned char *valid;
+        /* The region each station belongs to */
+        float *region;
+        /* The location of each station */
+        float *latitude;
+        float *longitude;
+        /* The time of each observation, packed with PACK_TIMESTAMP */
+        unsigned int *timestamp;
+        /* The colour of each station's marker, filled in by classifyStations */
+        unsigned char *type;
+        /* The number of stations in the store, and the number there is room for */
+        long count, capacity;
+        /* The number of malformed lines skipped while loading the store */
+        long rejected;
+} StationStore;
+
+/* The share of the input file streamed by one thread of the parallel ingest */
+typedef struct{
+        /* The reader over this share of the file */
+        StationReader reader;
+        /* The stations in this share alone */
+        StationStore store;
+        /* The chunk of parsed lines used by this thread */
+        ParsedStation *chunk;
+        /* The thread streaming this share, whether it was started, and whether it ran
+           out of memory */
+        pthread_t thread;
+        int started;
+        int failed;
+} IngestTask;
+
+/* A k-d tree over a set of geographic points. The tree is stored implicitly: the node
+   for the points in positions lo..hi-1 is at (lo + hi)/2, and its subtrees hold the
+   positions before and after it. */
+typedef struct{
+        /* The indexed points, in tree order */
+        GeographicPoint *points;
+        /* The points as unit vectors from the centre of the Earth, in tree order */
+        double (*xyz)[3];
+        /* ids[i] is the position of points[i] in the array the index was built from */
+        long *ids;
+        /* The axis (0, 1 or 2 for x, y or z) each node splits its subtrees on */
+        unsigned char *axes;
+        /* The number of points indexed */
+        long numPoints;
+} SpatialIndex;
+
+/* A point found by a spatial index query */
+typedef struct{
+        /* The position of the point in the array the index was built from */
+        long id;
+        /* The surface distance from the query point, in kilometres */
+        float distance;
+} Neighbour;
+
+/* A growable list of points found by a spatial index query */
+typedef struct{
+        Neighbour *items;
+        long count, capacity;
+} NeighbourList;
+
+/* Geographic points in structure-of-arrays form, as used by surfaceDistanceBatch.
+   The columns are 32-byte aligned and padded to a whole number of SIMD vectors. */
+typedef struct{
+        /* The latitude and longitude of each point, in radians */
+        float *latitude;
+        float *longitude;
+        /* The cosine of each latitude */
+        float *cosLatitude;
+        /* The number of points */
+        long count;
+} PointColumns;
+
+/* One query of a batch answered by answerPointQueries */
+typedef struct{
+        /* The query point */
+        GeographicPoint point;
+        /* Stations within radius kilometres of the point are averaged, unless k > 0,
+           in which case the k stations nearest to the point are averaged instead */
+        float radius;
+        long k;
+        /* The answer: the number of stations averaged, their average temperature and
+           the distance to the farthest of them */
+        long count;
+        float avgTemp;
+        float farthest;
+} PointQuery;
+
+/* A station in a StationRegistry. Its name is held in the registry's arena, both as
+   it is and escaped for a single-quoted string on the page. */
+typedef struct{
+        int id;
+        long name;
+        long escaped;
+        int escapedLength;
+} RegisteredStation;
+
+/* The names of the stations, loaded once at startup. A station's handle is its
+   position in stations; handle 0 is "Unknown", for IDs that are not registered. */
+typedef struct{
+        /* Every name, one after the other */
+        char *arena;
+        size_t arenaSize, arenaUsed;
+        RegisteredStation *stations;
+        long count, capacity;
+        /* The lookup from station ID to handle: either a dense table covering the IDs
+           from minID on, or a perfect hash of numSlots slots, with a displacement for
+           each of numBuckets buckets */
+        long *dense;
+        long minID, denseSize;
+        unsigned int *displacement;
+        long *slots;
+        long numBuckets, numSlots;
+} StationRegistry;
+
+/* An output file written through a large buffer of its own, rather than stdio */
+typedef struct{
+        int fd;
+        char *buffer;
+        size_t used;
+        size_t size;
+        /* The number of markers written so far, which numbers the next marker */
+        long numMarkers;
+        long long bytesWritten;
+        /* The heap allocations made for the buffer */
+        long numAllocations;
+        /* Set once a write has failed */
+        int failed;
+        /* The station names markers are written with */
+        StationRegistry *registry;
+} HtmlWriter;
+
+/* A cluster of stations in one grid cell of one zoom level, with the sums that give
+   its mean position and temperature */
+typedef struct{
+        /* The Morton number of the cell */
+        unsigned long long key;
+        long count;
+        /* The sum of the stations' Web Mercator x coordinates (which, unlike their
+           longitudes, do not wrap around within a cell) */
+        double sumX;
+        double sumLatitude;
+        double sumTemperature;
+} Cluster;
+
+/* The clusters of one zoom level, in order of their cells */
+typedef struct{
+        Cluster *clusters;
+        long count;
+} ClusterLevel;
+
+/* The observations made within one interval of time */
+typedef struct{
+        /* The start of the interval, in intervals from 1 March of year 0 */
+        unsigned long key;
+        /* The position of the bucket's first observation in TimeSeries.order */
+        long first;
+        long count;
+        /* The average of the bucket's readings, summed in double in file order */
+        double totalTemp;
+        float avgTemp;
+} TimeBucket;
+
+/* Observations grouped into buckets of interval minutes */
+typedef struct{
+        long interval;
+        TimeBucket *buckets;
+        long numBuckets;
+        /* The observations with a reading, bucket by bucket, and their number */
+        long *order;
+        long count;
+} TimeSeries;
+
+/* The header at the start of a station cache sidecar. It is followed by the station ID,
+   temperature, latitude, longitude, timestamp and region columns, in that order, each
+   count entries of 4 bytes starting on a STATION_CACHE_ALIGN byte boundary. Whether
+   each station has a reading follows from its temperature, so is not stored. */
+typedef struct{
+        char magic[8];
+        unsigned int version;
+        unsigned int byteOrder;
+        /* The file the sidecar was made from, as it was then */
+        unsigned long long sourceSize;
+        long long sourceMtime;
+        long long sourceMtimeNsec;
+        unsigned long long sourceInode;
+        unsigned long long sourceSampleHash;
+        /* The number of stations, and of malformed lines skipped */
+        long long count;
+        long long rejected;
+        /* The hash of the columns, and of the header up to here */
+        unsigned long long payloadHash;
+        unsigned long long headerHash;
+} StationCacheHeader;
+
+/* A sum of floats, and of products of two floats, held exactly as a fixed point number
+   of EXACT_SUM_LIMBS limbs, limb i being worth 2^(32i + EXACT_SUM_LOWEST_BIT). Each
+   limb is kept in 64 bits, so that carries need only be propagated now and then.
+   Integer addition being associative, partial sums merge into the same total in any
+   order. */
+typedef struct{
+        long long limbs[EXACT_SUM_LIMBS];
+        /* The number of values added since the carries were last propagated */
+        long pending;
+} ExactSum;
+
+/* The statistics of a set of temperature readings, built up one reading at a time or
+   by merging the statistics of parts of the set */
+typedef struct{
+        /* The number of readings, and of stations without a reading */
+        long count;
+        long missing;
+        float min, max;
+        /* The exact sums of the readings and of their squares */
+        ExactSum sum;
+        ExactSum sumSquares;
+} TemperatureStats;
+
+/* The statistics of the stations of one region */
+typedef struct{
+        float region;
+        TemperatureStats stats;
+} RegionStats;
+
+/* The statistics of every region, in order of first appearance, with an open
+   addressed hash table of numSlots slots holding 1 + the position of each region */
+typedef struct{
+        RegionStats *regions;
+        long count, capacity;
+        long *slots;
+        long numSlots;
+} RegionTable;
+
+/* The share of the rows added up by one thread of aggregateTemperatures */
+typedef struct{
+        StationStore *store;
+        long from, to;
+        TemperatureStats stats;
+        /* Set to add up each region too, into regions */
+        int byRegion;
+        RegionTable regions;
+        /* The thread adding up this share, whether it was started, and whether it ran
+           out of memory */
+        pthread_t thread;
+        int started;
+        int failed;
+} AggregateTask;
+
+/* A grid of temperatures estimated between the stations, over a box of latitude and
+   longitude. values holds the cells row by row, from the north-west corner. */
+typedef struct{
+        long columns, rows;
+        float north, south, west, east;
+        float *values;
+        /* The lowest and highest temperatures in the grid */
+        float min, max;
+        /* The sites the cells are estimated from: one for each cell holding readings,
+           at their mean location and with their mean temperature */
+        float *siteLatitude;
+        float *siteLongitude;
+        float *siteTemperature;
+        long numSites;
+} TemperatureGrid;
+
+/* The bands of rows of a grid estimated by one thread of buildTemperatureGrid: bands
+   firstBand, firstBand + step, and so on */
+typedef struct{
+        TemperatureGrid *grid;
+        SpatialIndex *index;
+        long firstBand, step;
+        /* The thread estimating these bands, whether it was started, and whether it ran
+           out of memory */
+        pthread_t thread;
+        int started;
+        int failed;
+} HeatmapTask;
+
+/* An area of the map, and the zoom level it is seen at: the viewport a client of
+   -serve asks for the markers of (which keys its cache), or the area of -viewport and
+   -centre. West may be greater than east for an area across the 180th meridian. */
+typedef struct{
+        double south, west, north, east;
+        int zoom;
+} Viewport;
+
+/* A box of latitudes and longitudes to pick stations by. Its longitudes are given as
+   numSpans spans, so that a station is in it whichever turn of the globe its longitude
+   is given in (such as 236.6 for -123.4). */
+typedef struct{
+        float south, north;
+        int numSpans;
+        float west[GEOBOX_SPANS], east[GEOBOX_SPANS];
+} GeoBox;
+
+/* A table of colour bands for the markers, from -bands: numThresholds thresholds of one
+   kind (BANDS_OFFSET and so on) in ascending order, between numThresholds + 1 marker
+   colours. A reading takes the colour after the last threshold it is not below. A
+   table with no thresholds is the Program Key. */
+typedef struct{
+        int kind;
+        int numThresholds;
+        float values[BANDS_MAX_THRESHOLDS];
+        int colours[BANDS_MAX_THRESHOLDS + 1];
+        /* Set by resolveBands, which turns the thresholds into differences from offset
+           for the readings loaded, against which each reading is compared */
+        int resolved;
+        float offset;
+        float thresholds[BANDS_MAX_THRESHOLDS];
+} BandTable;
+
+/* The form of the map written by writeMap */
+typedef struct{
+        /* Set for the compact or clustered map, or for a time series with buckets of
+           interval minutes (all 0 for the original map) */
+        int compact;
+        int cluster;
+        long interval;
+        /* Set to replace the output file atomically */
+        int atomic;
+        /* The station names */
+        StationRegistry *registry;
+        /* The size of the heatmap laid under the markers (0 for none), and the number
+           of threads that estimate it */
+        long heatmapColumns, heatmapRows;
+        int numThreads;
+        /* Set for a map of the stations within viewport and a margin alone, which loads
+           the rest from chunk files beside it as it is panned (-viewport and -centre) */
+        int culled;
+        Viewport viewport;
+        /* The colour bands of the markers */
+        BandTable bands;
+} MapOptions;
+
+/* Everything one map is made from, owned by the map rather than shared, so that one
+   process can make any number of maps, one after another or at once on different
+   threads. The stages are run through the plot functions: plotLoad, plotAggregate,
+   plotClassify, plotEstimateECS (or plotSumNear for any other point) and plotEmit. */
+typedef struct{
+        /* The form of the map, whose registry is either one given to openPlotContext
+           (which may be shared between contexts, as it is only read) or the built-in
+           names, loaded into ownRegistry. As options may then point into the context
+           itself, a context must stay where openPlotContext set it up, and is never
+           copied. */
+        MapOptions options;
+        StationRegistry ownRegistry;
+        int ownsRegistry;
+        int numThreads;
+        /* The stations, once plotLoad has loaded them */
+        StationStore store;
+        int loaded;
+        /* A spatial index over the stations, built by the first query after each load
+           and kept for the queries after it */
+        SpatialIndex index;
+        int indexed;
+        /* The statistics of the readings and their mean, from plotAggregate, and the
+           estimated temperature at the ECS Building, from plotEstimateECS */
+        TemperatureStats stats;
+        float avgTemp;
+        float ecsTemp;
+} PlotContext;
+
+/* The newest reading of one station among the input files merged by -merge, with
+   its packed timestamp and the position of the file it came from in the list of
+   inputs */
+typedef struct{
+        ParsedStation station;
+        unsigned int timestamp;
+        long file;
+} MergeReading;
+
+/* The newest reading of each station seen so far, found by station ID through an
+   open addressed hash table of 2^bits slots holding 1 + the position of each
+   reading. Its size depends on the number of stations alone, however many readings
+   are folded into it. */
+typedef struct{
+        MergeReading *readings;
+        long count, capacity;
+        long *slots;
+        int bits;
+} LatestReadings;
+
+/* The input files of -merge, in the order they were named (with the files of each
+   directory in name order), and what was found in each. Threads take the next file
+   to read from next, under lock. */
+typedef struct{
+        char **names;
+        long count, capacity;
+        /* The number of malformed lines in each file, and whether it could be opened */
+        long *rejected;
+        unsigned char *unreadable;
+        long next;
+        pthread_mutex_t lock;
+} MergeInputs;
+
+/* One thread of -merge, which folds each file it takes into its own latest readings */
+typedef struct{
+        MergeInputs *inputs;
+        LatestReadings latest;
+        /* The number of rows it has read */
+        long rows;
+        /* The chunk of parsed lines used by this thread */
+        ParsedStation *chunk;
+        /* The thread, whether it was started, and whether it ran out of memory */
+        pthread_t thread;
+        int started;
+        int failed;
+} MergeTask;
+
+/* What plotLoadMerged found: the number of input files and their total size, the rows
+   read and skipped as malformed, and the stations left to map (every other row read
+   was dropped for a newer reading of its station, or as a repeat) */
+typedef struct{
+        long files;
+        double bytes;
+        long rows, rejected;
+        long stations;
+} MergeSummary;
+
+/* A response body of -serve, shared by the cache and every connection sending it,
+   and freed once none of them holds it */
+typedef struct{
+        int references;
+        /* The HTTP status and content type the body is sent with */
+        int status;
+        const char *contentType;
+        size_t length;
+        char body[];
+} ServeResponse;
+
+/* One cached viewport response of -serve (response is NULL in an empty slot) */
+typedef struct{
+        Viewport viewport;
+        ServeResponse *response;
+} ServeCacheEntry;
+
+/* A client connection of -serve: the requests read from it, and the response being
+   sent (its header, then its body). The connections are kept in a list. */
+typedef struct ServeConnection{
+        struct ServeConnection *previous, *next;
+        int fd;
+        /* The bytes read, of which the first consumed are the request being answered */
+        char request[SERVE_REQUEST_MAX];
+        size_t received, consumed;
+        char header[256];
+        size_t headerLength;
+        ServeResponse *response;
+        /* The bytes of the header and body sent so far, and whether to send the header
+           alone (for HEAD) */
+        size_t sent;
+        int headOnly;
+        /* Set to close the connection once the response is sent, and while waiting
+           for the socket to take more of it */
+        int closeAfter;
+        int waiting;
+        /* The time the request being answered was read in full */
+        double started;
+} ServeConnection;
+
+/* Everything -serve holds: the stations of the input file (loaded again whenever it
+   changes), the page and cluster levels made from them, the cached viewport
+   responses, and the counts and latencies of the requests answered */
+typedef struct{
+        const char *inputName;
+        int useCache;
+        int numThreads;
+        MapOptions options;
+        /* The context of the stations served, on the heap (NULL until the first load) */
+        PlotContext *context;
+        ClusterLevel levels[CLUSTER_MAX_ZOOM + 1];
+        /* The page, from writeMapPage (NULL until the first load) */
+        ServeResponse *page;
+        ServeCacheEntry cache[SERVE_CACHE_SLOTS];
+        /* The input file as it was when it was loaded */
+        struct stat loaded;
+        /* The listening socket and its port, the epoll instance, the inotify instance
+           (-1 if there is none), and a pipe written to stop the server */
+        int listenFd, port;
+        int epollFd;
+        int notifyFd;
+        int stopFds[2];
+        /* The time the input file was last checked for changes */
+        double checked;
+        ServeConnection *connections;
+        long numConnections;
+        long requests, cacheHits, cacheMisses, reloads;
+        /* The latencies of the latest SERVE_LATENCY_SAMPLES requests, in seconds, from
+           the time each was read in full to the time its response was sent, in a ring
+           filled in order of request */
+        double *latencies;
+} ServeState;
+
+/* The stations of one chunk of a culled map, which lie in a box of the map's own size */
+typedef struct{
+        float south, west, north, east;
+        /* The place of its first station in the list of stations outside the page */
+        long first, count;
+} MarkerChunk;
+
+/* The stations of a culled map, split into those written into the page (inside its
+   box, with the margin) in order of store row, and those left to chunks, grouped by
+   chunk */
+typedef struct{
+        GeoBox box;
+        long *inside;
+        long numInside;
+        long *outside;
+        long numOutside;
+        MarkerChunk *chunks;
+        long numChunks;
+} CulledStations;
+
+/* A station outside the page of a culled map, and the number of its chunk's box */
+typedef struct{
+        long chunk;
+        long row;
+} ChunkedStation;
+
+/* A plotted station, in the list -watch keeps in order of temperature */
+typedef struct{
+        float temperature;
+        long id;
+} TemperatureRank;
+
+/* The state kept by -watch between updates of the input file */
+typedef struct{
+        const char *inputName;
+        int numThreads;
+        StationStore store;
+        /* The number of bytes of the input file read so far (always whole lines),
+           the number of the next line, and the inode the file had */
+        off_t consumed;
+        long lineNumber;
+        ino_t inode;
+        /* The statistics behind the average, kept up to date as stations are added */
+        TemperatureStats stats;
+        float avgTemp;
+        /* The plotted stations, in two runs each in order of temperature: the main
+           run and the stations added since it was last merged with */
+        TemperatureRank *ranks;
+        long numRanks;
+        TemperatureRank *recent;
+        long numRecent;
+        /* The running total and count behind the ECS estimate */
+        float ecsTotal;
+        int ecsCount;
+        /* The buffer the appended bytes are read into */
+        char *buffer;
+        size_t bufferSize;
+        /* What the last update did: the stations it added and the markers it
+           recoloured, or whether it had to load the file again from scratch */
+        long added;
+        long recoloured;
+        int reloaded;
+} WatchState;
+
+/* One measurement made by -bench: a stage of the pipeline run on a number of threads,
+   the time it took to handle a number of items (rows, markers, cells and so on, named
+   by unit) and of bytes (0 where bytes mean nothing), the heap allocations it made
+   where they were counted (-1 otherwise), and the peak resident set size of the
+   program once it had finished */
+typedef struct{
+        char stage[32];
+        const char *unit;
+        int threads;
+        double seconds;
+        long items;
+        double bytes;
+        long allocations;
+        long peakKiB;
+} BenchStage;
+
+/* The measurements made by one run of -bench, in the order they were made */
+typedef struct{
+        BenchStage stages[BENCH_MAX_STAGES];
+        int count;
+} BenchReport;
+
+/* The state of -generate: the stations of the template file with a reading, around
+   which the observations are made, the time of the first round and the random state */
+typedef struct{
+        StationStore store;
+        long *centres;
+        long numCentres;
+        unsigned long firstMinute;
+        unsigned long long seed;
+} StationGenerator;
+
+/* One observation made by a StationGenerator: the template row it was made around,
+   its time, and its location and temperature at full precision */
+typedef struct{
+        long centre;
+        unsigned int timestamp;
+        double latitude, longitude, temperature;
+} GeneratedReading;
+
+/* One stage timed by -profile: its wall-clock time and the change in each hardware
+   counter over it (scaled up if the counter was only running for part of it) */
+typedef struct{
+        const char *name;
+        double seconds;
+        double counters[PROFILE_COUNTERS];
+} ProfileStage;
+
+/* What -profile gathers over one run: the stages in the order they ran, the totals
+   counted along the way, and the hardware counters (each -1 where the system does
+   not provide it). The value of each counter, with the time it was enabled and
+   running, is kept from the start of the current stage. */
+typedef struct{
+        int enabled;
+        ProfileStage stages[PROFILE_MAX_STAGES];
+        int count;
+        double start, stageStart;
+        int counterFds[PROFILE_COUNTERS];
+        unsigned long long counterStart[PROFILE_COUNTERS][3];
+        int counterError;
+        long rowsParsed, rowsRejected, markersEmitted;
+        long bytesRead, bytesWritten;
+} Profile;
+
+/* Time the stages of a run into a Profile if it is enabled. Without HAVE_PROFILE
+   they expand to nothing, so a build made with -DNO_PROFILE carries no trace of them. */
+#ifdef HAVE_PROFILE
+#define PROFILE_BEGIN(profile, name) do{ if ((profile)->enabled) profileBegin(profile, name); }while(0)
+#define PROFILE_END(profile) do{ if ((profile)->enabled) profileEnd(profile); }while(0)
+#define PROFILE_COUNT(profile, counter, value) ((profile)->counter = (value))
+#else
+#define PROFILE_BEGIN(profile, name) do{ }while(0)
+#define PROFILE_END(profile) do{ }while(0)
+#define PROFILE_COUNT(profile, counter, value) do{ }while(0)
+#endif
+
 /* ========================================================================= */
 /*                       Library Function  Declarations                      */
 /*            These functions are defined at the end of the file.            */
@@ -90,9 +1003,10 @@ void writeEpilogue(FILE *f);
 
 /* writePoint
    This function adds a Google Maps marker to the output file for the MapMarker
-   provided.
+   provided. The markers of a page must be numbered 0, 1, 2 and so on by markerNum,
+   in the order they are written, so that each has variables of its own.
 */
-void writePoint(FILE *f, MapMarker *marker);
+void writePoint(FILE *f, MapMarker *marker, int markerNum);
 
 /* getStationName
    This function takes a numerical VWSN station ID, and returns a C string
@@ -100,497 +1014,8952 @@ void writePoint(FILE *f, MapMarker *marker);
 */
 char* getStationName(int stationID);
 
+/* AllStationNames
+   The name of every VWSN station, indexed by station ID (NULL for unused IDs).
+*/
+extern char *AllStationNames[MAX_STATIONS];
+
 /* surfaceDistance
    Given two geographic points, compute the distance between the two points in kilometers.
 */
 float surfaceDistance(GeographicPoint* point1, GeographicPoint* point2);
 
-/* ========================================================================= */
-/*                              Program Key                                  */
-/*                          												 */
-/*            - Blue    if        (t-A) < -1                                 */
-/*            - Green   if  -1 <= (t-A) < 0                                  */
-/*            - Yellow  if   0 <= (t-A) < 1                                  */
-/*            - Red     if   1 <= (t-A)                                      */
-/*                                                                           */
-/* ========================================================================= */
+/* mapInputFile
+   Maps the named file into memory. Returns 0 on success, or -1 if the file cannot be
+   opened or mapped.
+*/
+int mapInputFile(const char *name, InputMap *map);
 
-int main(){
+/* unmapInputFile
+   Releases a mapping created by mapInputFile.
+*/
+void unmapInputFile(InputMap *map);
 
-        /* Create an array of StationData structs to store all station data points */
-        StationData stationInfo[MAX_STATIONS];
+/* initStationReader
+   Positions a StationReader at the first line of a mapped input file.
+*/
+void initStationReader(StationReader *reader, const char *name, InputMap *map);
 
-        /* Open the input file */
-        FILE *inFp;
-        inFp = fopen(INPUT_FILENAME, "r");
-        if (inFp == NULL){
-                printf("File %s cannot be opened\n", INPUT_FILENAME);
-                return EXIT_FAILURE;
-        }
+/* initStationReaderRange
+   Positions a StationReader at start, reading lines up to end. start must be the
+   beginning of a line.
+*/
+void initStationReaderRange(StationReader *reader, const char *name, const char *start, const char *end);
 
-        /*initialize array at 0*/
-        int i;
-        for(i=0; i < MAX_STATIONS; i++){
-                stationInfo[i].stationID = 0;
-                stationInfo[i].temperature = 0;
-                stationInfo[i].year = 0;
-                stationInfo[i].month = 0;
-                stationInfo[i].day = 0;
-                stationInfo[i].hour = 0;
-                stationInfo[i].minute = 0;
-                stationInfo[i].location.latitude = 0;
-                stationInfo[i].location.longitude = 0;
+/* parseStationLine
+   Parses one line (not including its newline) of the ID/temp/date/lat/lon/region
+   format into a ParsedStation struct. Returns 1 on success, or 0 if the line is malformed.
+*/
+int parseStationLine(const char *line, const char *eol, ParsedStation *station);
 
-        }
+/* parseStationLineScanf
+   The original sscanf-based parser for one line, kept for comparison by -bench.
+*/
+int parseStationLineScanf(const char *line, const char *eol, ParsedStation *station);
 
-        /* Read each line of the input file into a StationData struct in the data array */
-        int j;
-        float regionID;
-        int t = 0;
-        char string[100];
-        float totalTemp = 0;
-        for(j = 0; j < MAX_STATIONS; j++){
+/* readStationChunk
+   Parses up to maxRows lines of the input file into the chunk array, one ParsedStation
+   struct per line, skipping malformed lines. Returns the number of structs filled,
+   or 0 at the end of the file.
+*/
+int readStationChunk(StationReader *reader, ParsedStation *chunk, int maxRows);
 
-                if (fgets(string, sizeof(string), inFp) == 0){
-                        break; /*If there is nothing in the line, break the loop*/
-                }
+/* streamIntoStore
+   Reads the rest of the input file chunk by chunk, appending every station to a store.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int streamIntoStore(StationReader *reader, ParsedStation *chunk, StationStore *store);
 
-                sscanf(string,"%d %f %d %d %d %d %d %f %f %f", &stationInfo[j].stationID, &stationInfo[j].temperature, &stationInfo[j].year, &stationInfo[j].month, &stationInfo[j].day, &stationInfo[j].hour, &stationInfo[j].minute, &stationInfo[j].location.latitude, &stationInfo[j].location.longitude, &regionID);
+/* loadStationStore
+   Reads every station in a mapped file into a new store with numThreads threads, each
+   streaming its own newline-aligned share of the file. Returns 0 on success, or -1 if
+   out of memory.
+*/
+int loadStationStore(const char *name, InputMap *map, int numThreads, int quiet, StationStore *store);
 
-                if(stationInfo[j].temperature != 0){
-                        t++; /*Number of stations with non-zero temperatures, and thus number of stations*/
-                }
+/* reserveStationStore
+   Makes room in a store for at least capacity stations. Returns 0 on success, or -1
+   if out of memory.
+*/
+int reserveStationStore(StationStore *store, long capacity);
 
-                totalTemp += stationInfo[j].temperature; /*total temperatures of stations*/
-        }
+/* setStation
+   Copies a ParsedStation struct into row i of a store.
+*/
+void setStation(StationStore *store, long i, ParsedStation *station);
 
-        /* Close the input file */
-        fclose(inFp);
+/* appendStationStore
+   Appends every station in src to the end of dest. Returns 0 on success, or -1 if
+   out of memory.
+*/
+int appendStationStore(StationStore *dest, StationStore *src);
 
-        /* Compute the average temperature of all stations */
-        float avgTemp = (totalTemp/t);
+/* freeStationStore
+   Releases the memory held by a store.
+*/
+void freeStationStore(StationStore *store);
 
-        /* Open the output file */
-        FILE *outFp;
-                outFp = fopen(OUTPUT_FILENAME, "w");
-                if (outFp == NULL){
-                        printf("File %s cannot be opened\n", OUTPUT_FILENAME);
-                        return EXIT_FAILURE;
-                }
+/* averageTemperature
+   Averages the temperatures of the stations with a reading, storing the number of
+   stations to plot in *t.
+*/
+float averageTemperature(StationStore *store, long *t);
 
-        /* Write the Prologue to the output file */
-        writePrologue(outFp);
+/* markerTypeFor
+   Returns the marker colour of a temperature, following the Program Key.
+*/
+int markerTypeFor(float temperature, float avgTemp);
 
-        /* For each station, create a marker at the correct position containing the
-           station's temperature. Give the marker a name (using the getStationName
-           function) and description text containing the temperature.
-           Use the marker colour scheme described above. */
-        MapMarker mapInfo[MAX_STATIONS];
-        int k;
-        for(k=0; k < t; k++){
-                /*writes the latitude and logitude to location in struct(mapInfo)*/
-                mapInfo[k].location.latitude = stationInfo[k].location.latitude;
-                mapInfo[k].location.longitude = stationInfo[k].location.longitude;
-                char dateStamp[1000];
+/* classifyStations
+   Fills in the marker colour of the first count stations in a store.
+*/
+void classifyStations(StationStore *store, long count, float avgTemp);
 
-                /*writes the stations name to markerName in struct(mapInfo)*/
-                char* stationName = getStationName(stationInfo[k].stationID);
-                strcpy(mapInfo[k].markerName, stationName);
+/* formatMarker
+   Fills in the MapMarker for station i of a store.
+*/
+void formatMarker(StationStore *store, long i, MapMarker *marker);
 
-                /*writes name (In bold), temperature and time to markerText in struct(mapInfo)*/
-                char textInMarker[50];
-                char boldName[100];
-                sprintf(dateStamp, "(%d:%d %d/%d/%d)", stationInfo[k].hour, stationInfo[k].minute, stationInfo[k].month, stationInfo[k].day, stationInfo[k].year);
-                sprintf(boldName, "<b>%s</b>", mapInfo[k].markerName );
-                sprintf(textInMarker, "%s: %1.2f degrees %s", boldName, stationInfo[k].temperature, dateStamp);
-                strcpy(mapInfo[k].markerText, textInMarker);
 
-                /*determine the colour of the pins*/
-                if((stationInfo[k].temperature - avgTemp) < -1){
-                        mapInfo[k].type = MARKER_BLUE;
-                }
-                if((-1 <= (stationInfo[k].temperature - avgTemp)) && ((stationInfo[k].temperature - avgTemp) < 0)){
-                        mapInfo[k].type = MARKER_GREEN;
-                }
-                if((0 <= (stationInfo[k].temperature - avgTemp)) && ((stationInfo[k].temperature - avgTemp) < 1)){
-                        mapInfo[k].type = MARKER_YELLOW;
-                }
-                if(1 <= (stationInfo[k].temperature - avgTemp)){
-                        mapInfo[k].type = MARKER_RED;
-                }
-                writePoint(outFp, &mapInfo[k]);
-        }
+/* buildSpatialIndex
+   Builds a spatial index over numPoints geographic points. Returns 0 on success, or
+   -1 if out of memory.
+*/
+int buildSpatialIndex(SpatialIndex *index, float *latitude, float *longitude, long numPoints);
 
-        /* Compute the average temperature at all stations within 2km from the point
-           (ECS_LATITUDE,ECS_LONGITUDE) to approximate the temperature at the ECS
-           building. Create a purple marker named "ECS Building" containing the
-           approximate temperature in its description.
-           The surfaceDistance function should be used to compute the distance between
-           pairs of (latitude, longitude) points. */
+/* freeSpatialIndex
+   Releases the memory held by a spatial index.
+*/
+void freeSpatialIndex(SpatialIndex *index);
 
-        float tempWithin2km = 0;
-        float ecsTemp = 0;
-        int numValidPoints = 0;
-        MapMarker ECS;
-        ECS.location.latitude = ECS_LATITUDE;
-        ECS.location.longitude = ECS_LONGITUDE;
-        int x;
-        float distanceBetween;
+/* spatialIndexWithinRadius
+   Finds every indexed point within radius kilometres of centre. Returns the number
+   of points found, or -1 if out of memory.
+*/
+long spatialIndexWithinRadius(SpatialIndex *index, GeographicPoint *centre, float radius, NeighbourList *list);
 
-        /*Calculating Avg temp if distance <= 2km from ECS*/
-        for(x=0; x < t; x++){
-        distanceBetween = surfaceDistance(&ECS.location, &mapInfo[x].location);
-                if (distanceBetween <= 2) {
-                        tempWithin2km += stationInfo[x].temperature;
-                        numValidPoints++;
-                }
-        }
-        ecsTemp = (tempWithin2km / numValidPoints);
+/* spatialIndexNearest
+   Finds the k indexed points nearest to centre, nearest first. Returns the number of
+   points found, or -1 if out of memory.
+*/
+long spatialIndexNearest(SpatialIndex *index, GeographicPoint *centre, long k, NeighbourList *list);
 
-        /*Giving the ECS struct it's required qualities*/
+/* freeNeighbourList
+   Releases the memory held by a NeighbourList.
+*/
+void freeNeighbourList(NeighbourList *list);
 
-        ECS.location.latitude = ECS_LATITUDE;
-        ECS.location.longitude = ECS_LONGITUDE;
-        char ecsBody[100];
-        sprintf(ecsBody, "<b>ECS Building</b>: %1.2f degrees", ecsTemp);
-        strcpy(ECS.markerText, ecsBody);
-        ECS.type = MARKER_PURPLE;
-        strcpy(ECS.markerName, "ECS Building");
-        writePoint(outFp,&ECS);
+/* buildReadingIndex
+   Builds a spatial index over the stations of a store that have a reading, indexed by
+   their rows in the store. Returns 0 on success, or -1 if out of memory.
+*/
+int buildReadingIndex(SpatialIndex *index, StationStore *store);
 
-        /* Write the epilogue to the output file */
-        writeEpilogue(outFp);
-        /* Close the output file */
-        fclose(outFp);
-        return EXIT_SUCCESS;
-}
+/* answerPointQueries
+   Answers a batch of "average temperature near a point" queries. Returns 0 on success,
+   or -1 if out of memory.
+*/
+int answerPointQueries(SpatialIndex *index, float *temperature, PointQuery *queries, long numQueries);
 
+/* runPointQueries
+   Loads the input file into a spatial index and answers the queries in queryName.
+*/
+int runPointQueries(const char *inputName, const char *queryName, long nearest, int numThreads, int useCache);
 
-/* ========================================================================= */
-/*                           Library Functions                               */
-/*              These are declared above, and will be useful                 */
-/*                       to generate the output file.                        */
-/* ========================================================================= */
+/* buildPointColumns
+   Copies columns of latitudes and longitudes into the layout used by surfaceDistanceBatch.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int buildPointColumns(PointColumns *columns, float *latitude, float *longitude, long numPoints);
 
-/* writePrologue
-   This function writes the initial part of the HTML file (which sets up the Google
-   maps interface). This must be called before any points are written to the file.
+/* freePointColumns
+   Releases the memory held by a PointColumns.
 */
-void writePrologue(FILE *f){
-        if (!f){
-                printf("writePrologue error: output file == NULL\n");
-                exit(1);
-        }
-        fputs("<!DOCTYPE html>\n",f);
-        fputs("<html>\n",f);
-        fputs("<head>\n",f);
-        fputs("<meta name=\"viewport\" content=\"initial-scale=1.0, user-scalable=no\" />\n",f);
-        fputs("<style type=\"text/css\">\n",f);
-        fputs("  html { height: 100% }\n",f);
-        fputs("  body { height: 100%; margin: 0; padding: 0 }\n",f);
-        fputs("  #map_canvas { height: 100% }\n",f);
-        fputs("</style>\n",f);
-        fputs("<script type=\"text/javascript\"\n",f);
-        fputs("    src=\"http://maps.googleapis.com/maps/api/js?sensor=true\">\n",f);
-        fputs("</script>\n",f);
-        fputs("<script type=\"text/javascript\">\n",f);
-        fputs("  function initialize() {\n",f);
-        fputs("    var latlng = new google.maps.LatLng(48.447,236.643);\n",f);
-        fputs("    var myOptions = {\n",f);
-        fputs("      zoom: 13,\n",f);
-        fputs("      center: latlng,\n",f);
-        fputs("      mapTypeId: google.maps.MapTypeId.ROADMAP\n",f);
-        fputs("    };\n",f);
+void freePointColumns(PointColumns *columns);
+
+/* surfaceDistanceBatch
+   Computes the distance in kilometres from origin to every point in columns.
+*/
+void surfaceDistanceBatch(GeographicPoint *origin, PointColumns *columns, float *distances);
+
+/* benchmarkSurfaceDistance
+   Checks the accuracy of surfaceDistanceBatch against surfaceDistance and compares
+   their speed.
+*/
+int benchmarkSurfaceDistance(BenchReport *report);
+
+/* benchmarkServe
+   Times requests made to a server of -serve, in requests per second, and finds the
+   median and 99th percentile latency seen by the client.
+*/
+int benchmarkServe(const char *inputName, int numThreads, BenchReport *report);
+
+
+/* monotonicSeconds
+   Returns the current time of the monotonic clock, in seconds.
+*/
+double monotonicSeconds();
+
+/* benchmarkIngest
+   Measures and prints the throughput of the streaming ingest pass over a file, of the
+   line tokenizer against the original sscanf parser, and of the parallel ingest with
+   1 up to maxThreads threads.
+*/
+int benchmarkIngest(const char *inputName, int maxThreads, BenchReport *report);
+
+/* openHtmlWriter
+   Creates (or truncates) the named file and sets up a buffered writer for it.
+   Returns 0 on success, or -1 if the file cannot be created.
+*/
+int openHtmlWriter(HtmlWriter *writer, const char *name);
+
+/* closeHtmlWriter
+   Flushes the writer, closes its file and releases its buffer. Returns 0 if
+   everything was written, or -1 if any write failed.
+*/
+int closeHtmlWriter(HtmlWriter *writer);
+
+/* writerCapture
+   Adds whatever a FILE-based writing function (such as writePrologue) writes to the
+   output of a writer.
+*/
+void writerCapture(HtmlWriter *writer, void (*writeSection)(FILE *));
+
+/* writerPoint
+   Adds a Google Maps marker for a MapMarker to the output of a writer, exactly as
+   writePoint would.
+*/
+void writerPoint(HtmlWriter *writer, MapMarker *marker);
+
+/* writerStation
+   Adds the marker for station i of a store to the output of a writer, formatting it
+   straight from the store's columns.
+*/
+void writerStation(HtmlWriter *writer, StationStore *store, long i);
+
+/* writeStationDataStart
+   Starts the array of station data in compact mode.
+*/
+void writeStationDataStart(FILE *f);
+
+/* writerStationRecord
+   Adds the record for station i of a store to the array of station data in compact
+   mode.
+*/
+void writerStationRecord(HtmlWriter *writer, StationStore *store, long i);
+
+/* writeStationLoader
+   Ends the array of station data in compact mode, and writes the addStation function
+   that creates the marker for one station in it.
+*/
+void writeStationLoader(FILE *f);
+
+/* writeStationLoop
+   Writes the loop that creates a marker for each station in compact mode.
+*/
+void writeStationLoop(FILE *f);
+
+/* buildClusterLevels
+   Groups the stations with a reading among the first count stations of a store into
+   clusters for each zoom level from 0 up to CLUSTER_MAX_ZOOM. Returns 0 on success,
+   or -1 if out of memory.
+*/
+int buildClusterLevels(ClusterLevel levels[], StationStore *store, long count);
+
+/* freeClusterLevels
+   Releases the memory held by the levels built by buildClusterLevels.
+*/
+void freeClusterLevels(ClusterLevel levels[]);
+
+/* writerClusterLevels
+   Adds the array of cluster levels to the output of a writer in cluster mode.
+*/
+void writerClusterLevels(HtmlWriter *writer, ClusterLevel levels[], float avgTemp, BandTable *bands);
+
+/* writeClusterLoader
+   Writes the code that shows the clusters or stations for the map's zoom level in
+   cluster mode.
+*/
+void writeClusterLoader(FILE *f);
+
+/* bucketObservations
+   Groups the first count observations of a store into buckets of interval minutes
+   by their timestamps, in time order. Returns 0 on success, or -1 if out of memory.
+*/
+int bucketObservations(TimeSeries *series, StationStore *store, long count, long interval);
+
+/* freeTimeSeries
+   Releases the memory held by a TimeSeries.
+*/
+void freeTimeSeries(TimeSeries *series);
+
+/* classifyTimeBuckets
+   Fills in the marker colour of every observation in a TimeSeries against the
+   average of its own bucket.
+*/
+void classifyTimeBuckets(TimeSeries *series, StationStore *store);
+
+/* writerTimeBuckets
+   Adds the array of time buckets to the output of a writer in time series mode.
+*/
+void writerTimeBuckets(HtmlWriter *writer, TimeSeries *series);
+
+/* writeTimeSliderLoader
+   Writes the code that adds a time slider to the map and shows the observations of
+   the chosen bucket in time series mode.
+*/
+void writeTimeSliderLoader(FILE *f);
+
+/* sumNearECS
+   Adds the temperatures of the stations in rows from up to to of a store that lie
+   within ECS_RADIUS kilometres of the ECS building to *total, and their number to
+   *count. Returns 0 on success, or -1 if out of memory.
+*/
+int sumNearECS(StationStore *store, long from, long to, float *total, int *count);
+
+/* sumIndexedNear
+   Adds the temperatures of the stations within radius kilometres of centre to *total,
+   and their number to *count, through a spatial index over a store from row from on.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int sumIndexedNear(SpatialIndex *index, StationStore *store, long from, GeographicPoint *centre, double radius, float *total, int *count);
+
+/* writeMap
+   Writes the map of the first t stations of a store and the ECS Building marker.
+   Returns the number of markers written, or -1 after printing an error message.
+*/
+long writeMap(const char *outputName, StationStore *store, long t, float avgTemp, float ecsTemp, MapOptions *options);
+
+/* writeMapPage
+   Writes the page of writeMap through an open writer, along with the chunk files of a
+   culled map beside outputName (if it is not NULL). Returns the number of markers
+   written, or -1 after printing an error message.
+*/
+long writeMapPage(HtmlWriter *writer, const char *outputName, StationStore *store, long t, float avgTemp, float ecsTemp, MapOptions *options);
+
+/* watchInputFile
+   Writes the map of the input file, then keeps it up to date as lines are appended
+   to the file. Only returns on an error.
+*/
+int watchInputFile(const char *inputName, const char *outputName, int numThreads, MapOptions *options);
+
+/* stationCacheName
+   Writes the name of the sidecar of an input file to dest.
+*/
+void stationCacheName(char *dest, size_t size, const char *sourceName);
+
+/* saveStationCache
+   Saves the columns of a store loaded from sourceName to the sidecar cacheName.
+   Returns 0 on success, or -1 if it cannot be written.
+*/
+int saveStationCache(const char *cacheName, const char *sourceName, StationStore *store);
+
+/* loadStationCache
+   Loads a store from the sidecar cacheName, if it was made from sourceName as it is
+   now. Returns 0 on success, or -1 if the sidecar is missing, out of date or damaged.
+*/
+int loadStationCache(const char *cacheName, const char *sourceName, StationStore *store);
+
+/* readStations
+   Loads every station of an input file into a store, through its sidecar if useCache
+   is set. Returns 0 on success, or -1 after printing an error message.
+*/
+int readStations(const char *inputName, int numThreads, int useCache, StationStore *store);
+
+/* benchmarkCache
+   Compares the time taken to load the input file by parsing it and from a sidecar.
+*/
+int benchmarkCache(const char *inputName, int numThreads, BenchReport *report);
+
+/* initStationRegistry
+   Starts a registry holding only handle 0, "Unknown". Returns 0 on success, or -1 if
+   out of memory.
+*/
+int initStationRegistry(StationRegistry *registry);
+
+/* registerStation
+   Adds a station to a registry, storing its name as it is and escaped for a
+   single-quoted string on the page. Returns 0 on success, or -1 if out of memory.
+*/
+int registerStation(StationRegistry *registry, int id, const char *name, size_t length);
+
+/* loadDefaultStations
+   Registers every station of the built-in AllStationNames table. Returns 0 on
+   success, or -1 if out of memory.
+*/
+int loadDefaultStations(StationRegistry *registry);
+
+/* loadStationRegistry
+   Registers the stations listed in a registry file of "ID name" lines. Returns 0 on
+   success, or -1 after printing an error message.
+*/
+int loadStationRegistry(StationRegistry *registry, const char *name);
+
+/* freeStationRegistry
+   Releases the memory held by a registry.
+*/
+void freeStationRegistry(StationRegistry *registry);
+
+/* stationNameHandle
+   Returns the handle of the name of a station ID, or 0 ("Unknown") if the ID is not
+   registered.
+*/
+long stationNameHandle(StationRegistry *registry, int id);
+
+/* writerStationNames
+   Adds the table of station names, indexed by handle, to the output of a writer in
+   compact mode.
+*/
+void writerStationNames(HtmlWriter *writer);
+
+/* exactSumAdd
+   Adds a float, or the product of two floats, to an exact sum.
+*/
+void exactSumAdd(ExactSum *sum, double value);
+
+/* exactSumValue
+   Returns an exact sum rounded to a double.
+*/
+double exactSumValue(const ExactSum *sum);
+
+/* initTemperatureStats
+   Empties a set of statistics.
+*/
+void initTemperatureStats(TemperatureStats *stats);
+
+/* addTemperature
+   Adds one reading to a set of statistics.
+*/
+void addTemperature(TemperatureStats *stats, float temperature);
+
+/* mergeTemperatureStats
+   Adds the statistics from to the statistics into.
+*/
+void mergeTemperatureStats(TemperatureStats *into, const TemperatureStats *from);
+
+/* temperatureMean
+   Returns the mean of the readings in a set of statistics.
+*/
+double temperatureMean(const TemperatureStats *stats);
+
+/* temperatureVariance
+   Returns the variance of the readings in a set of statistics.
+*/
+double temperatureVariance(const TemperatureStats *stats);
+
+/* freeRegionTable
+   Releases the memory held by a table of regions.
+*/
+void freeRegionTable(RegionTable *table);
+
+/* aggregateTemperatures
+   Gathers the statistics of the temperatures in rows from up to to of a store, and
+   optionally of each region, using numThreads threads. Returns 0 on success, or -1
+   if out of memory.
+*/
+int aggregateTemperatures(StationStore *store, long from, long to, int numThreads, TemperatureStats *stats, RegionTable *regions);
+
+/* printRegionStatistics
+   Prints the statistics of the temperatures in the input file, over all stations
+   and region by region.
+*/
+int printRegionStatistics(const char *inputName, int numThreads, int useCache);
+
+/* benchmarkAggregate
+   Compares the original float average with the exact aggregation.
+*/
+int benchmarkAggregate(const char *inputName, int maxThreads, BenchReport *report);
+
+/* buildTemperatureGrid
+   Estimates the temperature on a grid of columns by rows cells around the stations
+   with a reading among the first count of a store, using numThreads threads. Returns
+   0 on success, 1 if there are no such stations, or -1 if out of memory.
+*/
+int buildTemperatureGrid(TemperatureGrid *grid, StationStore *store, long count, long columns, long rows, int numThreads);
+
+/* freeTemperatureGrid
+   Releases the memory held by a grid.
+*/
+void freeTemperatureGrid(TemperatureGrid *grid);
+
+/* writerTemperatureGrid
+   Adds a grid to the output of a writer as the data of the heatmap.
+*/
+void writerTemperatureGrid(HtmlWriter *writer, TemperatureGrid *grid);
+
+/* writeHeatmapLoader
+   Writes the code that draws the heatmap and lays it over the map.
+*/
+void writeHeatmapLoader(FILE *f);
+
+/* benchmarkHeatmap
+   Times the estimation of a grid on one thread and on maxThreads, in cells per
+   second.
+*/
+int benchmarkHeatmap(const char *inputName, int maxThreads, BenchReport *report);
+
+/* benchmarkEmit
+   Compares the speed of writing every station's marker through writePoint and
+   through writerStation, and checks that their output is identical. Also measures
+   the size and speed of the compact output and the time taken to build the clusters
+   and the time buckets.
+*/
+int benchmarkEmit(const char *inputName, int numThreads, BenchReport *report);
+
+/* benchRecord
+   Adds a measurement to a report, along with the peak resident set size so far.
+*/
+void benchRecord(BenchReport *report, const char *stage, int threads, double seconds, long items, const char *unit, double bytes);
+
+/* benchRecordAllocations
+   Adds the number of heap allocations made to the last measurement of a report.
+*/
+void benchRecordAllocations(BenchReport *report, long allocations);
+
+/* runBenchmarks
+   Runs every benchmark over the input file in turn, stopping at the first that
+   fails, and then writes their measurements to reportName as JSON (unless it is
+   NULL). Returns EXIT_SUCCESS if every benchmark passed.
+*/
+int runBenchmarks(const char *inputName, int numThreads, const char *reportName);
+
+/* writeBenchReport
+   Writes the measurements of a report to the named file as JSON. Returns 0 on
+   success, or -1 if the file cannot be written.
+*/
+int writeBenchReport(const char *name, BenchReport *report, const char *inputName, int maxThreads, double seconds, int passed);
+
+/* openPlotContext
+   Sets up a context for making maps in the form given by options, using numThreads
+   threads, with the station names of registry (or the built-in names if it is NULL).
+   Returns 0 on success, or -1 if out of memory.
+*/
+int openPlotContext(PlotContext *context, MapOptions *options, StationRegistry *registry, int numThreads);
+
+/* plotLoad
+   Loads the stations of an input file into a context, in place of any loaded before.
+   Returns 0 on success, or -1 after printing an error message.
+*/
+int plotLoad(PlotContext *context, const char *inputName, int useCache);
+
+/* plotAggregate
+   Computes the statistics and the average temperature of the loaded stations.
+*/
+void plotAggregate(PlotContext *context);
+
+/* plotClassify
+   Colours each loaded station by the colour bands of the context.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int plotClassify(PlotContext *context);
+
+/* plotSumNear
+   Adds up the readings of the loaded stations within radius kilometres of centre.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int plotSumNear(PlotContext *context, GeographicPoint *centre, double radius, float *total, int *count);
+
+/* plotEstimateECS
+   Estimates the temperature at the ECS Building from the stations around it.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int plotEstimateECS(PlotContext *context);
+
+/* plotEmit
+   Writes the map of a context to the named file. Returns the number of markers
+   written, or -1 after printing an error message.
+*/
+long plotEmit(PlotContext *context, const char *outputName);
+
+/* closePlotContext
+   Releases everything a context holds.
+*/
+void closePlotContext(PlotContext *context);
+
+/* plotLoadMerged
+   Loads the newest reading of each station found in any of the named files or the
+   files of the named directories into a context, in place of any loaded before,
+   filling in *summary. Returns 0 on success, or -1 after printing an error message.
+*/
+int plotLoadMerged(PlotContext *context, char **paths, int numPaths, MergeSummary *summary);
+
+/* serveMaps
+   Serves the map of the input file, and the markers of any viewport as JSON, over
+   HTTP on the given port of the loopback interface until interrupted. Returns
+   EXIT_SUCCESS or EXIT_FAILURE.
+*/
+int serveMaps(const char *inputName, int port, int numThreads, int useCache, MapOptions *options);
+
+/* wrapLongitude
+   Returns a longitude as one from -180 up to 180 degrees.
+*/
+double wrapLongitude(double longitude);
+
+/* parseBoundingBox
+   Reads a viewport given as "SOUTH,WEST,NORTH,EAST" in degrees. Returns 0 on success,
+   or -1 if it is malformed or empty.
+*/
+int parseBoundingBox(const char *text, Viewport *viewport);
+
+/* parseCentre
+   Reads a viewport given as "LATITUDE,LONGITUDE,ZOOM": the area a window of
+   VIEWPORT_WIDTH_PIXELS by VIEWPORT_HEIGHT_PIXELS shows around that centre at that
+   zoom level. Returns 0 on success, or -1 if it is malformed or out of range.
+*/
+int parseCentre(const char *text, Viewport *viewport);
+
+/* viewportBox
+   Sets up a box holding a viewport and margin times its height and width beyond each
+   of its edges.
+*/
+void viewportBox(Viewport *viewport, double margin, GeoBox *box);
+
+/* selectInBox
+   Stores the rows from row from up to row to of a store that hold stations with a
+   reading within a box into selected, in order, and returns their number.
+*/
+long selectInBox(GeoBox *box, StationStore *store, long from, long to, long *selected);
+
+/* cullStations
+   Splits the stations with a reading among the first t stations of a store into
+   those within a viewport and its margin and (if chunked is set) the chunks of those
+   outside it. Returns 0 on success, or -1 if out of memory.
+*/
+int cullStations(CulledStations *culled, StationStore *store, long t, Viewport *viewport, int chunked);
+
+/* freeCulledStations
+   Releases the memory held by a CulledStations.
+*/
+void freeCulledStations(CulledStations *culled);
+
+/* removeMarkerChunks
+   Removes the chunk files of an earlier culled map written to outputName.
+*/
+void removeMarkerChunks(const char *outputName);
+
+/* writeMarkerChunks
+   Writes each chunk of a culled map to its own file in the chunk directory of
+   outputName. Returns the number of records written, or -1 after printing an error
+   message.
+*/
+long writeMarkerChunks(const char *outputName, StationStore *store, CulledStations *culled, StationRegistry *registry);
+
+/* writerCulledView
+   Adds the code that shows the viewport of a culled map, and the table of its chunks,
+   to the output.
+*/
+void writerCulledView(HtmlWriter *writer, CulledStations *culled, Viewport *viewport, const char *outputName);
+
+/* writeChunkLoader
+   Writes the code that loads the chunks of a culled map as they come into view.
+*/
+void writeChunkLoader(FILE *f);
+
+/* benchmarkViewport
+   Times picking the stations of a viewport with scalar code and with selectInBox,
+   then writing a culled page against the whole compact page.
+*/
+int benchmarkViewport(const char *inputName, int numThreads, BenchReport *report);
+
+/* parseBands
+   Reads a table of colour bands given as "KIND:COLOUR,THRESHOLD,...,COLOUR", or from
+   the named file if the text holds no ':'. Returns 0 on success, or -1 after printing
+   an error message.
+*/
+int parseBands(const char *text, BandTable *bands);
+
+/* resolveBands
+   Turns the thresholds of a table of colour bands into differences from an offset,
+   for the readings among the first count stations of a store, whose statistics are
+   stats (which may be NULL unless the thresholds are standard deviations) and whose
+   average is avgTemp. Returns 0 on success, or -1 if out of memory.
+*/
+int resolveBands(BandTable *bands, StationStore *store, long count, const TemperatureStats *stats, float avgTemp);
+
+/* classifyBands
+   Fills in the marker colour of the first count stations of a store from a resolved
+   table of colour bands.
+*/
+void classifyBands(BandTable *bands, StationStore *store, long count);
+
+/* bandTypeFor
+   Returns the marker colour of one temperature in a resolved table of colour bands,
+   or against avgTemp by the Program Key if the table is unresolved.
+*/
+int bandTypeFor(BandTable *bands, float temperature, float avgTemp);
+
+/* benchmarkClassify
+   Times colouring readings with markerTypeFor and with classifyBands, and finding
+   quantile thresholds by selection and by sorting.
+*/
+int benchmarkClassify(BenchReport *report);
+
+/* openProfile
+   Sets up a profile, enabled or not, and opens its hardware counters if it is
+   enabled and the system provides them.
+*/
+void openProfile(Profile *profile, int enabled);
+
+/* profileBegin
+   Starts timing a stage of the run.
+*/
+void profileBegin(Profile *profile, const char *name);
+
+/* profileEnd
+   Finishes timing the stage begun last.
+*/
+void profileEnd(Profile *profile);
+
+/* printProfile
+   Prints the time and hardware counters of each stage of a profile and its totals,
+   then closes its counters.
+*/
+void printProfile(Profile *profile);
+
+/* generateStations
+   Writes rows lines of synthetic observations in the format of the input file to the
+   named file, spread around the stations of the template file. The same seed always
+   gives the same file. Returns EXIT_SUCCESS or EXIT_FAILURE.
+*/
+int generateStations(const char *templateName, const char *outputName, long rows, unsigned long long seed);
+
+/* openStationGenerator
+   Loads the template file of a generator. Returns 0 on success, or -1 after printing
+   an error message.
+*/
+int openStationGenerator(StationGenerator *generator, const char *templateName, unsigned long long seed);
+
+/* generateReading
+   Makes observation number i of a generator.
+*/
+void generateReading(StationGenerator *generator, long i, GeneratedReading *reading);
+
+/* closeStationGenerator
+   Releases the memory held by a generator.
+*/
+void closeStationGenerator(StationGenerator *generator);
+
+/* generateStationStore
+   Makes rows synthetic observations around the stations of the template file, as
+   generateStations writes them, straight into a new store. Returns 0 on success, or
+   -1 after printing an error message.
+*/
+int generateStationStore(const char *templateName, long rows, unsigned long long seed, StationStore *store);
+
+/* ========================================================================= */
+/*                              Program Key                                  */
+/*                          												 */
+/*            - Blue    if        (t-A) < -1                                 */
+/*            - Green   if  -1 <= (t-A) < 0                                  */
+/*            - Yellow  if   0 <= (t-A) < 1                                  */
+/*            - Red     if   1 <= (t-A)                                      */
+/*                                                                           */
+/* ========================================================================= */
+
+int main(int argc, char *argv[]){
+
+        const char *inputName = INPUT_FILENAME;
+        const char *outputName = OUTPUT_FILENAME;
+        int benchmark = 0;
+        MapOptions options = {0};
+        int useCache = 0;
+        int watch = 0;
+        int numThreads = 1;
+        const char *queryName = NULL;
+        const char *stationsName = NULL;
+        int regions = 0;
+        long nearest = 0;
+        const char *reportName = NULL;
+        const char *generateName = NULL;
+        long generateRows = 0;
+        unsigned long long seed = 1;
+        int profiling = 0;
+        int merge = 0;
+        int servePort = -1;
+        char *paths[argc];
+        int numPaths = 0;
+        const char *usage = "Usage: %s [-bench [-json FILE] | -generate ROWS FILE [-seed N]] [-profile] [-compact | -cluster | -interval MINUTES] [-cache | -watch | -serve PORT] [-heatmap COLUMNSxROWS] [-viewport SOUTH,WEST,NORTH,EAST | -centre LATITUDE,LONGITUDE,ZOOM] [-bands KIND:COLOUR,THRESHOLD,...,COLOUR|FILE] [-stations FILE] [-threads N] [-query FILE [-nearest K] | -regions] [input file [output file] | -merge [-output FILE] FILE|DIRECTORY...]\n";
+
+        /* Read the command line:
+           [-bench [-json FILE] | -generate ROWS FILE [-seed N]] [-profile] [-compact | -cluster | -interval MINUTES] [-cache | -watch | -serve PORT] [-heatmap COLUMNSxROWS] [-viewport SOUTH,WEST,NORTH,EAST | -centre LATITUDE,LONGITUDE,ZOOM] [-bands KIND:COLOUR,THRESHOLD,...,COLOUR|FILE] [-stations FILE] [-threads N] [-query FILE [-nearest K] | -regions] [input file [output file] | -merge [-output FILE] FILE|DIRECTORY...] */
+        int i;
+        for(i = 1; i < argc; i++){
+                if(strcmp(argv[i], "-bench") == 0){
+                        benchmark = 1;
+                }else if(strcmp(argv[i], "-json") == 0 && i + 1 < argc){
+                        reportName = argv[++i];
+                }else if(strcmp(argv[i], "-generate") == 0 && i + 2 < argc){
+                        generateRows = atol(argv[++i]);
+                        generateName = argv[++i];
+                        if(generateRows < 1){
+                                printf("The number of rows to generate must be at least one\n");
+                                return EXIT_FAILURE;
+                        }
+                }else if(strcmp(argv[i], "-seed") == 0 && i + 1 < argc){
+                        seed = strtoull(argv[++i], NULL, 10);
+                }else if(strcmp(argv[i], "-profile") == 0){
+                        profiling = 1;
+                }else if(strcmp(argv[i], "-compact") == 0){
+                        options.compact = 1;
+                }else if(strcmp(argv[i], "-cluster") == 0){
+                        options.cluster = 1;
+                }else if(strcmp(argv[i], "-interval") == 0 && i + 1 < argc){
+                        options.interval = atol(argv[++i]);
+                        if(options.interval < 1){
+                                printf("The interval must be at least one minute\n");
+                                return EXIT_FAILURE;
+                        }
+                }else if(strcmp(argv[i], "-cache") == 0){
+                        useCache = 1;
+                }else if(strcmp(argv[i], "-watch") == 0){
+                        watch = 1;
+                }else if(strcmp(argv[i], "-serve") == 0 && i + 1 < argc){
+                        servePort = atoi(argv[++i]);
+                        if(servePort < 0 || servePort > 65535){
+                                printf("The port must be from 0 to 65535\n");
+                                return EXIT_FAILURE;
+                        }
+                }else if(strcmp(argv[i], "-heatmap") == 0 && i + 1 < argc){
+                        char extra;
+                        if(sscanf(argv[++i], "%ldx%ld%c", &options.heatmapColumns, &options.heatmapRows, &extra) != 2 ||
+                           options.heatmapColumns < 1 || options.heatmapRows < 1 ||
+                           options.heatmapColumns > HEATMAP_MAX_CELLS/options.heatmapRows){
+                                printf("The heatmap must be given as COLUMNSxROWS, with at most %ld cells\n", HEATMAP_MAX_CELLS);
+                                return EXIT_FAILURE;
+                        }
+                }else if(strcmp(argv[i], "-viewport") == 0 && i + 1 < argc){
+                        options.culled = 1;
+                        if(parseBoundingBox(argv[++i], &options.viewport) != 0){
+                                printf("The viewport must be given as SOUTH,WEST,NORTH,EAST in degrees, with south below north\n");
+                                return EXIT_FAILURE;
+                        }
+                }else if(strcmp(argv[i], "-centre") == 0 && i + 1 < argc){
+                        options.culled = 1;
+                        if(parseCentre(argv[++i], &options.viewport) != 0){
+                                printf("The centre must be given as LATITUDE,LONGITUDE,ZOOM, with a zoom level from 0 to %d\n", VIEWPORT_MAX_ZOOM);
+                                return EXIT_FAILURE;
+                        }
+                }else if(strcmp(argv[i], "-bands") == 0 && i + 1 < argc){
+                        if(parseBands(argv[++i], &options.bands) != 0){
+                                return EXIT_FAILURE;
+                        }
+                }else if(strcmp(argv[i], "-stations") == 0 && i + 1 < argc){
+                        stationsName = argv[++i];
+                }else if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc){
+                        numThreads = atoi(argv[++i]);
+                        if(numThreads < 1){
+                                numThreads = sysconf(_SC_NPROCESSORS_ONLN); /*0 means one thread per core*/
+                        }
+                }else if(strcmp(argv[i], "-query") == 0 && i + 1 < argc){
+                        queryName = argv[++i];
+                }else if(strcmp(argv[i], "-regions") == 0){
+                        regions = 1;
+                }else if(strcmp(argv[i], "-nearest") == 0 && i + 1 < argc){
+                        nearest = atol(argv[++i]);
+                }else if(strcmp(argv[i], "-merge") == 0){
+                        merge = 1;
+                }else if(strcmp(argv[i], "-output") == 0 && i + 1 < argc){
+                        outputName = argv[++i];
+                }else if(argv[i][0] != '-'){
+                        paths[numPaths++] = argv[i];
+                }else{
+                        printf(usage, argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        /* Without -merge, the files named are the input file and then the output file.
+           With it, every file named (or every file in a directory named) is an input. */
+        if(!merge){
+                if(numPaths > 2){
+                        printf(usage, argv[0]);
+                        return EXIT_FAILURE;
+                }
+                if(numPaths > 0)
+                        inputName = paths[0];
+                if(numPaths > 1)
+                        outputName = paths[1];
+        }else if(numPaths == 0){
+                printf("-merge needs at least one input file or directory\n");
+                return EXIT_FAILURE;
+        }else if(benchmark || generateName || queryName || regions || watch || servePort >= 0){
+                printf("-merge makes a map, and cannot be used with -bench, -generate, -query, -regions, -watch or -serve\n");
+                return EXIT_FAILURE;
+        }
+
+        if(options.cluster && options.interval > 0){
+                printf("-cluster cannot be used with -interval, whose page shows one time bucket at a time\n");
+                return EXIT_FAILURE;
+        }
+
+        if(options.culled && (options.cluster || options.interval > 0 || servePort >= 0)){
+                printf("-viewport and -centre cannot be used with -cluster, -interval or -serve\n");
+                return EXIT_FAILURE;
+        }
+
+        if(options.bands.numThresholds > 0 && (options.interval > 0 || watch)){
+                printf("-bands cannot be used with -interval or -watch, which colour by the Program Key\n");
+                return EXIT_FAILURE;
+        }
+
+        if(generateName){
+                return generateStations(inputName, generateName, generateRows, seed);
+        }
+        if(benchmark){
+                return runBenchmarks(inputName, numThreads, reportName);
+        }
+        if(queryName){
+                return runPointQueries(inputName, queryName, nearest, numThreads, useCache);
+        }
+        if(regions){
+                return printRegionStatistics(inputName, numThreads, useCache);
+        }
+
+#ifdef HAVE_PROFILE
+        /* With -profile, time each stage below and count what it handled */
+        Profile profile;
+        openProfile(&profile, profiling && !watch && servePort < 0);
+#else
+        if(profiling){
+                printf("This build has no -profile support (it was compiled with NO_PROFILE)\n");
+        }
+#endif
+
+        /* Load the station names, from the -stations file if there is one and otherwise
+           from the built-in table, ready for markers to refer to by handle */
+        PROFILE_BEGIN(&profile, "names");
+        StationRegistry registry;
+        if(stationsName){
+                if (loadStationRegistry(&registry, stationsName) != 0){
+                        return EXIT_FAILURE;
+                }
+        }else if (loadDefaultStations(&registry) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        options.registry = &registry;
+        options.numThreads = numThreads;
+        PROFILE_END(&profile);
+
+        if(watch){
+                return watchInputFile(inputName, outputName, numThreads, &options);
+        }
+        if(servePort >= 0){
+#ifdef HAVE_EPOLL
+                return serveMaps(inputName, servePort, numThreads, useCache, &options);
+#else
+                printf("This build has no -serve support (it needs epoll)\n");
+                return EXIT_FAILURE;
+#endif
+        }
+
+        /* The map is made through a context that holds everything it needs */
+        PlotContext context;
+        if (openPlotContext(&context, &options, &registry, numThreads) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+
+        /* Read every station in the input file into the columnar station store, with
+           each thread reading its own share of the file (or, with -cache, from the
+           file's sidecar if it is up to date). With -merge, each thread reads whole
+           input files in turn, and only the newest reading of each station is kept. */
+        PROFILE_BEGIN(&profile, "read");
+        MergeSummary summary;
+        if(merge){
+                if (plotLoadMerged(&context, paths, numPaths, &summary) != 0){
+                        return EXIT_FAILURE;
+                }
+        }else if (plotLoad(&context, inputName, useCache) != 0){
+                return EXIT_FAILURE;
+        }
+        PROFILE_END(&profile);
+        if(merge){
+                printf("Merged %ld rows from %ld files into the newest readings of %ld stations\n", summary.rows, summary.files, summary.stations);
+        }
+        PROFILE_COUNT(&profile, rowsParsed, merge ? summary.rows : context.store.count);
+        PROFILE_COUNT(&profile, rowsRejected, context.store.rejected);
+
+        /* Compute the average temperature of all stations with a reading, each thread
+           adding up its own share of the stations exactly */
+        PROFILE_BEGIN(&profile, "average");
+        plotAggregate(&context);
+        PROFILE_END(&profile);
+
+        /* Use the marker colour scheme described above to colour each station */
+        PROFILE_BEGIN(&profile, "classify");
+        if (plotClassify(&context) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        PROFILE_END(&profile);
+
+        /* Compute the average temperature at all stations within 2km from the point
+           (ECS_LATITUDE,ECS_LONGITUDE) to approximate the temperature at the ECS
+           building. It is written as a purple marker named "ECS Building" containing the
+           approximate temperature in its description.
+           The stations within range are found through the spatial index, which measures
+           distances with the surfaceDistance function. */
+        PROFILE_BEGIN(&profile, "ecs");
+        if (plotEstimateECS(&context) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        PROFILE_END(&profile);
+
+        /* Write the map to the output file */
+        PROFILE_BEGIN(&profile, "emit");
+        long markers = plotEmit(&context, outputName);
+        if (markers < 0){
+                return EXIT_FAILURE;
+        }
+        PROFILE_END(&profile);
+        PROFILE_COUNT(&profile, markersEmitted, markers);
+        closePlotContext(&context);
+        freeStationRegistry(&registry);
+#ifdef HAVE_PROFILE
+        if(profile.enabled){
+                struct stat info;
+                if(merge)
+                        profile.bytesRead = (long)summary.bytes;
+                else
+                        profile.bytesRead = stat(inputName, &info) == 0 ? (long)info.st_size : -1;
+                profile.bytesWritten = stat(outputName, &info) == 0 ? (long)info.st_size : -1;
+                printProfile(&profile);
+        }
+#endif
+        return EXIT_SUCCESS;
+}
+
+
+/* ========================================================================= */
+/*                               Map Output                                  */
+/* ========================================================================= */
+
+/* sumNearECS
+   Adds the temperatures of the stations in rows from up to (but not including) to of
+   a store that lie within ECS_RADIUS kilometres of the ECS building and have a
+   reading to *total, in order, and their number to *count. Returns 0 on success, or -1 if out of memory.
+*/
+int sumNearECS(StationStore *store, long from, long to, float *total, int *count){
+        GeographicPoint ecsLocation;
+        ecsLocation.latitude = ECS_LATITUDE;
+        ecsLocation.longitude = ECS_LONGITUDE;
+        SpatialIndex index;
+        if (buildSpatialIndex(&index, store->latitude + from, store->longitude + from, to - from) != 0)
+                return -1;
+        int result = sumIndexedNear(&index, store, from, &ecsLocation, ECS_RADIUS, total, count);
+        freeSpatialIndex(&index);
+        return result;
+} /* sumNearECS */
+
+/* sumIndexedNear
+   Adds the temperatures of the stations within radius kilometres of centre that have
+   a reading to *total, in order, and their number to *count, given a spatial index
+   over the rows of a store from row from onwards. Returns 0 on success, or -1 if out
+   of memory.
+*/
+int sumIndexedNear(SpatialIndex *index, StationStore *store, long from, GeographicPoint *centre, double radius, float *total, int *count){
+        NeighbourList near = {0};
+        if (spatialIndexWithinRadius(index, centre, radius, &near) < 0)
+                return -1;
+
+        /*Calculating Avg temp if distance <= 2km from ECS*/
+        long k;
+        for(k = 0; k < near.count; k++){
+                long i = from + near.items[k].id;
+                if (store->valid[i]){
+                        *total += store->temperature[i];
+                        (*count)++;
+                }
+        }
+        freeNeighbourList(&near);
+        return 0;
+} /* sumIndexedNear */
+
+/* writeMap
+   Writes the map of the first t stations of a store, coloured against avgTemp, along
+   with the ECS Building marker, in the form chosen by options. Returns the number of
+   markers written (those of writeMapPage), or -1 after printing an error message.
+*/
+long writeMap(const char *outputName, StationStore *store, long t, float avgTemp, float ecsTemp, MapOptions *options){
+        /* Open the output file, which is written through one large buffer. To replace
+           the file atomically, the map is written to a temporary file which is then
+           renamed over it. */
+        char tempName[PATH_MAX];
+        const char *writeName = outputName;
+        if (options->atomic){
+                snprintf(tempName, sizeof(tempName), "%s.%ld.tmp", outputName, (long)getpid());
+                writeName = tempName;
+        }
+        HtmlWriter writer;
+        if (openHtmlWriter(&writer, writeName) != 0){
+                printf("File %s cannot be opened\n", writeName);
+                return -1;
+        }
+        /* A culled map writes its chunks anew, and any other map has none, so the chunks
+           of an earlier culled map of the same name are removed either way */
+        removeMarkerChunks(outputName);
+        long markers = writeMapPage(&writer, outputName, store, t, avgTemp, ecsTemp, options);
+        if (markers < 0){
+                closeHtmlWriter(&writer);
+                if (options->atomic)
+                        unlink(tempName);
+                return -1;
+        }
+
+        /* Close the output file */
+        if (closeHtmlWriter(&writer) != 0 || (options->atomic && rename(tempName, outputName) != 0)){
+                if (options->atomic)
+                        unlink(tempName);
+                printf("File %s cannot be written\n", outputName);
+                return -1;
+        }
+        return markers;
+} /* writeMap */
+
+/* writeMapPage
+   Writes the page of writeMap, from the prologue to the epilogue, through an open
+   writer, which may be a file or (as for -serve) memory. The chunks of a culled map
+   are written to files beside outputName, or left out if it is NULL. Returns the
+   number of markers written: the station markers (or records) in the page and in any
+   chunk files, and the ECS Building marker. Returns -1 after printing an error
+   message.
+*/
+long writeMapPage(HtmlWriter *writer, const char *outputName, StationStore *store, long t, float avgTemp, float ecsTemp, MapOptions *options){
+        writer->registry = options->registry;
+        long firstMarker = writer->numMarkers, chunkMarkers = 0;
+
+        /* Write the Prologue to the output file */
+        writerCapture(writer, writePrologue);
+
+        /* For each station, create a marker at the correct position containing the
+           station's temperature. Give the marker a name (using the getStationName
+           function) and description text containing the temperature.
+           Each marker is formatted straight from the station store into the buffer.
+           In compact mode, only an array of the stations' data is written here, and
+           the page creates the markers from it. In cluster mode, the clusters of each
+           zoom level are written as well, and the page shows the clusters of its
+           zoom level instead of the stations until it is zoomed in past them.
+           In time series mode, the stations are written bucket by bucket, each
+           coloured against the average of its own bucket, and the page shows one
+           bucket at a time. In culled mode, only the stations within the viewport and
+           its margin are written into the page, and the rest go to chunk files which
+           the page loads as they come into view. */
+        long k;
+        if(options->interval > 0){
+                TimeSeries series;
+                if (bucketObservations(&series, store, t, options->interval) != 0){
+                        printf("Out of memory\n");
+                        return -1;
+                }
+                classifyTimeBuckets(&series, store);
+                writerCapture(writer, writeStationDataStart);
+                for(k = 0; k < series.count; k++){
+                        writerStationRecord(writer, store, series.order[k]);
+                }
+                writerCapture(writer, writeStationLoader);
+                writerStationNames(writer);
+                writerTimeBuckets(writer, &series);
+                freeTimeSeries(&series);
+                writerCapture(writer, writeTimeSliderLoader);
+        }else if(options->culled){
+                CulledStations culled;
+                if (cullStations(&culled, store, t, &options->viewport, outputName != NULL) != 0){
+                        printf("Out of memory\n");
+                        return -1;
+                }
+                writerCapture(writer, writeStationDataStart);
+                for(k = 0; k < culled.numInside; k++){
+                        writerStationRecord(writer, store, culled.inside[k]);
+                }
+                writerCapture(writer, writeStationLoader);
+                writerStationNames(writer);
+                writerCapture(writer, writeStationLoop);
+                if (outputName)
+                        chunkMarkers = writeMarkerChunks(outputName, store, &culled, options->registry);
+                if (chunkMarkers < 0){
+                        freeCulledStations(&culled);
+                        return -1;
+                }
+                writerCulledView(writer, &culled, &options->viewport, outputName);
+                freeCulledStations(&culled);
+                writerCapture(writer, writeChunkLoader);
+        }else if(options->compact || options->cluster){
+                writerCapture(writer, writeStationDataStart);
+                for(k = 0; k < t; k++){
+                        writerStationRecord(writer, store, k);
+                }
+                writerCapture(writer, writeStationLoader);
+                writerStationNames(writer);
+                if(options->cluster){
+                        ClusterLevel levels[CLUSTER_MAX_ZOOM + 1];
+                        if (buildClusterLevels(levels, store, t) != 0){
+                                printf("Out of memory\n");
+                                return -1;
+                        }
+                        writerClusterLevels(writer, levels, avgTemp, &options->bands);
+                        freeClusterLevels(levels);
+                        writerCapture(writer, writeClusterLoader);
+                }else{
+                        writerCapture(writer, writeStationLoop);
+                }
+        }else{
+                for(k = 0; k < t; k++){
+                        writerStation(writer, store, k);
+                }
+        }
+
+        /* With -heatmap, the estimated temperature between the stations is drawn under
+           the markers */
+        if(options->heatmapColumns > 0){
+                TemperatureGrid grid;
+                int result = buildTemperatureGrid(&grid, store, t, options->heatmapColumns, options->heatmapRows, options->numThreads);
+                if (result < 0){
+                        printf("Out of memory\n");
+                        return -1;
+                }
+                if (result == 0){
+                        writerTemperatureGrid(writer, &grid);
+                        freeTemperatureGrid(&grid);
+                        writerCapture(writer, writeHeatmapLoader);
+                }
+        }
+
+        /*Giving the ECS struct it's required qualities*/
+        MapMarker ECS;
+        ECS.location.latitude = ECS_LATITUDE;
+        ECS.location.longitude = ECS_LONGITUDE;
+        char ecsBody[100];
+        sprintf(ecsBody, "<b>ECS Building</b>: %1.2f degrees", ecsTemp);
+        strcpy(ECS.markerText, ecsBody);
+        ECS.type = MARKER_PURPLE;
+        strcpy(ECS.markerName, "ECS Building");
+        writerPoint(writer,&ECS);
+
+        /* Write the epilogue to the output file */
+        writerCapture(writer, writeEpilogue);
+        return writer->numMarkers - firstMarker + chunkMarkers;
+} /* writeMapPage */
+
+
+/* ========================================================================= */
+/*                               Map Contexts                                */
+/*     The stages of making a map, run on a PlotContext that owns all it     */
+/*     needs, so that any number of maps can be made in one process.         */
+/* ========================================================================= */
+
+/* openPlotContext
+   Sets up a context for making maps in the form given by options (which are copied),
+   using numThreads threads. The station names are those of registry, which is only
+   read and may be shared by any number of contexts, or the built-in names if it is
+   NULL, which the context then loads and holds itself.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int openPlotContext(PlotContext *context, MapOptions *options, StationRegistry *registry, int numThreads){
+        memset(context, 0, sizeof(PlotContext));
+        context->options = *options;
+        context->numThreads = numThreads;
+        context->options.numThreads = numThreads;
+        if (registry == NULL){
+                if (loadDefaultStations(&context->ownRegistry) != 0)
+                        return -1;
+                context->ownsRegistry = 1;
+                registry = &context->ownRegistry;
+        }
+        context->options.registry = registry;
+        return 0;
+} /* openPlotContext */
+
+/* Utility function releasing the stations of a context and the index over them */
+void unloadPlotContext(PlotContext *context){
+        if (context->indexed)
+                freeSpatialIndex(&context->index);
+        if (context->loaded)
+                freeStationStore(&context->store);
+        context->indexed = 0;
+        context->loaded = 0;
+} /* unloadPlotContext */
+
+/* plotLoad
+   Loads every station of an input file into a context, in place of any it held
+   before, with each thread reading its own share of the file (or, if useCache is
+   set, from the file's sidecar if it is up to date). Returns 0 on success, or -1
+   after printing an error message.
+*/
+int plotLoad(PlotContext *context, const char *inputName, int useCache){
+        unloadPlotContext(context);
+        if (readStations(inputName, context->numThreads, useCache, &context->store) != 0)
+                return -1;
+        context->loaded = 1;
+        return 0;
+} /* plotLoad */
+
+/* plotAggregate
+   Computes the statistics of the readings of the loaded stations and their average
+   temperature, each thread adding up its own share of the stations exactly.
+*/
+void plotAggregate(PlotContext *context){
+        aggregateTemperatures(&context->store, 0, context->store.count, context->numThreads, &context->stats, NULL);
+        context->avgTemp = temperatureMean(&context->stats);
+} /* plotAggregate */
+
+/* plotClassify
+   Colours each loaded station by the colour bands of the context (the Program Key,
+   against the average found by plotAggregate, unless other bands were given), once
+   they are resolved against the loaded stations. Returns 0 on success, or -1 if out
+   of memory.
+*/
+int plotClassify(PlotContext *context){
+        if (resolveBands(&context->options.bands, &context->store, context->store.count, &context->stats, context->avgTemp) != 0)
+                return -1;
+        classifyBands(&context->options.bands, &context->store, context->store.count);
+        return 0;
+} /* plotClassify */
+
+/* plotSumNear
+   Adds the temperatures of the loaded stations within radius kilometres of centre
+   that have a reading to *total, in order, and their number to *count. The spatial
+   index this searches is built by the first call after each load and kept for the
+   calls after it. Returns 0 on success, or -1 if out of memory.
+*/
+int plotSumNear(PlotContext *context, GeographicPoint *centre, double radius, float *total, int *count){
+        if (!context->indexed){
+                StationStore *store = &context->store;
+                if (buildSpatialIndex(&context->index, store->latitude, store->longitude, store->count) != 0)
+                        return -1;
+                context->indexed = 1;
+        }
+        return sumIndexedNear(&context->index, &context->store, 0, centre, radius, total, count);
+} /* plotSumNear */
+
+/* plotEstimateECS
+   Estimates the temperature at the ECS Building as the average of the stations
+   within ECS_RADIUS kilometres of it. Returns 0 on success, or -1 if out of memory.
+*/
+int plotEstimateECS(PlotContext *context){
+        GeographicPoint ecsLocation;
+        ecsLocation.latitude = ECS_LATITUDE;
+        ecsLocation.longitude = ECS_LONGITUDE;
+        float total = 0;
+        int count = 0;
+        if (plotSumNear(context, &ecsLocation, ECS_RADIUS, &total, &count) != 0)
+                return -1;
+        context->ecsTemp = total/count;
+        return 0;
+} /* plotEstimateECS */
+
+/* plotEmit
+   Writes the map of the loaded stations, coloured by plotClassify and with the ECS
+   estimate of plotEstimateECS, to the named file. Contexts working at the same time
+   must write to different files. Returns the number of markers written, or -1 after
+   printing an error message.
+*/
+long plotEmit(PlotContext *context, const char *outputName){
+        return writeMap(outputName, &context->store, context->store.count, context->avgTemp, context->ecsTemp, &context->options);
+} /* plotEmit */
+
+/* closePlotContext
+   Releases the stations, the index and the station names (if the context loaded them
+   itself) held by a context.
+*/
+void closePlotContext(PlotContext *context){
+        unloadPlotContext(context);
+        if (context->ownsRegistry)
+                freeStationRegistry(&context->ownRegistry);
+        context->ownsRegistry = 0;
+} /* closePlotContext */
+
+/* ========================================================================= */
+/*                              Streaming Ingest                             */
+/*          The input file is parsed in bounded chunks of ParsedStation      */
+/*             and each chunk is appended to the station store.              */
+/* ========================================================================= */
+
+/* mapInputFile
+   Maps the named file into memory for reading. The pages are only faulted in as the
+   readers touch them, and the kernel is told that access will be sequential so it can
+   read ahead and drop pages behind the cursor.
+   Returns 0 on success, or -1 if the file cannot be opened or mapped.
+*/
+int mapInputFile(const char *name, InputMap *map){
+        map->data = NULL;
+        map->size = 0;
+        int fd = open(name, O_RDONLY);
+        if (fd < 0){
+                return -1;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0){
+                close(fd);
+                return -1;
+        }
+        map->size = info.st_size;
+        if (map->size > 0){
+                void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED){
+                        close(fd);
+                        return -1;
+                }
+                posix_madvise(data, map->size, POSIX_MADV_SEQUENTIAL);
+                map->data = data;
+        }
+        close(fd);
+        return 0;
+} /* mapInputFile */
+
+/* unmapInputFile
+   Releases a mapping created by mapInputFile.
+*/
+void unmapInputFile(InputMap *map){
+        if (map->data){
+                munmap(map->data, map->size);
+        }
+        map->data = NULL;
+        map->size = 0;
+} /* unmapInputFile */
+
+/* initStationReader
+   Positions a StationReader at the first line of a mapped input file.
+*/
+void initStationReader(StationReader *reader, const char *name, InputMap *map){
+        initStationReaderRange(reader, name, map->data, map->data + map->size);
+} /* initStationReader */
+
+/* initStationReaderRange
+   Positions a StationReader at start, reading lines up to end. Line numbers are
+   counted from 1 at start.
+*/
+void initStationReaderRange(StationReader *reader, const char *name, const char *start, const char *end){
+        reader->name = name;
+        reader->start = start;
+        reader->next = start;
+        reader->end = end;
+        reader->lineNumber = 1;
+        reader->rejected = 0;
+        reader->quiet = 0;
+        reader->deferReports = 0;
+        reader->rejectedLines = NULL;
+        reader->numDeferred = 0;
+        reader->deferredCapacity = 0;
+} /* initStationReaderRange */
+
+/* Powers of ten used to scale the digits after the decimal point */
+const double PowersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+        1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+/* Largest number of digits parseFloatField converts itself before handing a
+   number to strtod. Any 18 digit integer fits exactly in an unsigned long long. */
+#define MAX_FAST_DIGITS 18
+
+/* Utility function to test for the blanks that separate columns */
+int isBlank(char c){
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+} /* isBlank */
+
+/* parseIntField
+   Parses the next blank-separated integer column of a line, starting at *p and stopping
+   before eol. On success, stores the value, advances *p past the column and returns 1.
+   Returns 0 if the column is missing, is not an integer, or does not fit in an int.
+*/
+int parseIntField(const char **p, const char *eol, int *value){
+        const char *s = *p;
+        while (s < eol && isBlank(*s))
+                s++;
+        int negative = 0;
+        if (s < eol && (*s == '-' || *s == '+')){
+                negative = (*s == '-');
+                s++;
+        }
+        const char *digits = s;
+        long long v = 0;
+        while (s < eol && (unsigned)(*s - '0') < 10){
+                v = v*10 + (*s - '0');
+                s++;
+                if (v > 2147483648LL)
+                        return 0;
+        }
+        if (s == digits || (s < eol && !isBlank(*s)))
+                return 0;
+        if (negative)
+                v = -v;
+        if (v > 2147483647LL)
+                return 0;
+        *value = (int)v;
+        *p = s;
+        return 1;
+} /* parseIntField */
+
+/* parseFloatField
+   Parses the next blank-separated decimal column of a line, in the same way as
+   parseIntField. Plain decimals such as "-12.50" or "236.68118" are converted directly;
+   anything longer or written with an exponent is passed on to strtod.
+*/
+int parseFloatField(const char **p, const char *eol, float *value){
+        const char *s = *p;
+        while (s < eol && isBlank(*s))
+                s++;
+        const char *field = s;
+        int negative = 0;
+        if (s < eol && (*s == '-' || *s == '+')){
+                negative = (*s == '-');
+                s++;
+        }
+        unsigned long long mantissa = 0;
+        int numDigits = 0, fracDigits = 0;
+        while (s < eol && (unsigned)(*s - '0') < 10){
+                mantissa = mantissa*10 + (*s - '0');
+                numDigits++;
+                s++;
+        }
+        if (s < eol && *s == '.'){
+                s++;
+                while (s < eol && (unsigned)(*s - '0') < 10){
+                        mantissa = mantissa*10 + (*s - '0');
+                        numDigits++;
+                        fracDigits++;
+                        s++;
+                }
+        }
+        if (numDigits == 0)
+                return 0;
+        if (numDigits > MAX_FAST_DIGITS || (s < eol && (*s == 'e' || *s == 'E'))){
+                /* Rare long or scientific numbers: let the C library convert them */
+                char buffer[64];
+                const char *fieldEnd = s;
+                while (fieldEnd < eol && !isBlank(*fieldEnd))
+                        fieldEnd++;
+                if (fieldEnd - field >= (long)sizeof(buffer))
+                        return 0;
+                memcpy(buffer, field, fieldEnd - field);
+                buffer[fieldEnd - field] = '\0';
+                char *converted;
+                double v = strtod(buffer, &converted);
+                if (*converted != '\0')
+                        return 0;
+                *value = (float)v;
+                *p = fieldEnd;
+                return 1;
+        }
+        if (s < eol && !isBlank(*s))
+                return 0;
+        double v = mantissa/PowersOfTen[fracDigits];
+        *value = (float)(negative ? -v : v);
+        *p = s;
+        return 1;
+} /* parseFloatField */
+
+/* Utility function parsing the temperature column as parseFloatField does, except that NaN (in any case) is taken as a station that sent no reading */
+int parseTemperatureField(const char **p, const char *eol, float *value){
+        const char *s = *p;
+        while (s < eol && isBlank(*s))
+                s++;
+        if (eol - s >= 3 && (s[0] | 0x20) == 'n' && (s[1] | 0x20) == 'a' && (s[2] | 0x20) == 'n' &&
+            (eol - s == 3 || isBlank(s[3]))){
+                *value = NAN;
+                *p = s + 3;
+                return 1;
+        }
+        return parseFloatField(p, eol, value);
+} /* parseTemperatureField */
+
+/* parseStationLine
+   Parses one line of the input file, not including its newline. Each line holds the
+   columns "ID temp year month day hour minute latitude longitude regionID", separated
+   by blanks. A temperature of NaN marks a station that sent no reading.
+   Returns 1 if all ten columns were read, the date and time are valid, and nothing but
+   blanks follows them, or 0 if the line is malformed (in which case the contents of station are unspecified).
+*/
+int parseStationLine(const char *line, const char *eol, ParsedStation *parsed){
+        StationData *station = &parsed->data;
+        const char *p = line;
+        if (!parseIntField(&p, eol, &station->stationID) ||
+            !parseTemperatureField(&p, eol, &station->temperature) ||
+            !parseIntField(&p, eol, &station->year) ||
+            !parseIntField(&p, eol, &station->month) ||
+            !parseIntField(&p, eol, &station->day) ||
+            !parseIntField(&p, eol, &station->hour) ||
+            !parseIntField(&p, eol, &station->minute) ||
+            !parseFloatField(&p, eol, &station->location.latitude) ||
+            !parseFloatField(&p, eol, &station->location.longitude) ||
+            !parseFloatField(&p, eol, &parsed->regionID))
+                return 0;
+        /* The date must fit in a packed timestamp */
+        if (station->year < 0 || station->year > 4095 || station->month < 1 || station->month > 12 ||
+            station->day < 1 || station->day > 31 || station->hour < 0 || station->hour > 23 ||
+            station->minute < 0 || station->minute > 59)
+                return 0;
+        while (p < eol && isBlank(*p))
+                p++;
+        return p == eol;
+} /* parseStationLine */
+
+/* parseStationLineScanf
+   The original parser for one line: the line is copied into a 100 byte buffer (as
+   fgets did) and converted with a single sscanf call. Kept so that -bench can compare
+   parseStationLine against it.
+*/
+int parseStationLineScanf(const char *line, const char *eol, ParsedStation *parsed){
+        StationData *station = &parsed->data;
+        char string[100];
+        size_t length = eol - line;
+        if (length >= sizeof(string))
+                length = sizeof(string) - 1;
+        memcpy(string, line, length);
+        string[length] = '\0';
+        return sscanf(string,"%d %f %d %d %d %d %d %f %f %f", &station->stationID, &station->temperature, &station->year, &station->month, &station->day, &station->hour, &station->minute, &station->location.latitude, &station->location.longitude, &parsed->regionID) == 10;
+} /* parseStationLineScanf */
+
+/* Utility function to test whether a line holds nothing but blanks */
+int isBlankLine(const char *line, const char *eol){
+        while (line < eol && isBlank(*line))
+                line++;
+        return line == eol;
+} /* isBlankLine */
+
+/* deferReport
+   Saves the line number of a malformed line so that it can be reported later.
+   If there is no memory left to save it, the line is only counted.
+*/
+void deferReport(StationReader *reader, long lineNumber){
+        if (reader->numDeferred == reader->deferredCapacity){
+                long capacity = reader->deferredCapacity ? 2*reader->deferredCapacity : 64;
+                long *lines = realloc(reader->rejectedLines, capacity*sizeof(long));
+                if (lines == NULL)
+                        return;
+                reader->rejectedLines = lines;
+                reader->deferredCapacity = capacity;
+        }
+        reader->rejectedLines[reader->numDeferred++] = lineNumber;
+} /* deferReport */
+
+/* readStationChunk
+   Parses up to maxRows lines of the input file into the chunk array, one ParsedStation
+   struct per line. Blank lines are skipped silently; malformed lines are skipped and,
+   unless the reader is quiet, reported with their line number (either immediately,
+   or later by the caller if reports are deferred).
+   Returns the number of structs filled, or 0 once the end of the file has been reached.
+*/
+int readStationChunk(StationReader *reader, ParsedStation *chunk, int maxRows){
+        int j = 0;
+        while (j < maxRows && reader->next < reader->end){
+                const char *line = reader->next;
+                const char *eol = memchr(line, '\n', reader->end - line);
+                if (eol == NULL){
+                        eol = reader->end; /*The last line may have no newline*/
+                        reader->next = reader->end;
+                }else{
+                        reader->next = eol + 1;
+                }
+                long lineNumber = reader->lineNumber++;
+
+                if (parseStationLine(line, eol, &chunk[j])){
+                        j++;
+                }else if (!isBlankLine(line, eol)){
+                        reader->rejected++;
+                        if (reader->deferReports)
+                                deferReport(reader, lineNumber);
+                        else if (!reader->quiet)
+                                printf("%s:%ld: malformed station line skipped\n", reader->name, lineNumber);
+                }
+        }
+        return j;
+} /* readStationChunk */
+
+/* streamIntoStore
+   Reads the rest of the input file chunk by chunk, appending every station to store.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int streamIntoStore(StationReader *reader, ParsedStation *chunk, StationStore *store){
+        int n, c;
+        while((n = readStationChunk(reader, chunk, STREAM_CHUNK_ROWS)) > 0){
+                if (reserveStationStore(store, store->count + n) != 0)
+                        return -1;
+                for(c = 0; c < n; c++){
+                        setStation(store, store->count++, &chunk[c]);
+                }
+        }
+        store->rejected += reader->rejected;
+        return 0;
+} /* streamIntoStore */
+
+/* ingestTaskMain
+   Thread body used by loadStationStore: streams one share of the input file into
+   the task's own store.
+*/
+void *ingestTaskMain(void *arg){
+        IngestTask *task = arg;
+        task->failed = streamIntoStore(&task->reader, task->chunk, &task->store) != 0;
+        return NULL;
+} /* ingestTaskMain */
+
+/* loadStationStore
+   Reads every station in a mapped input file into a new store, using numThreads
+   threads. The file is cut into numThreads shares of roughly equal size, each ending
+   at a newline, and every share is streamed by its own thread into its own store.
+   The stores are then joined in file order, and malformed lines are reported in file
+   order with their line numbers in the whole file (unless quiet is set), so the result
+   does not depend on how the threads were scheduled.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int loadStationStore(const char *name, InputMap *map, int numThreads, int quiet, StationStore *store){
+        IngestTask tasks[MAX_INGEST_THREADS];
+        if (numThreads < 1)
+                numThreads = 1;
+        if (numThreads > MAX_INGEST_THREADS)
+                numThreads = MAX_INGEST_THREADS;
+        memset(store, 0, sizeof(StationStore));
+
+        /* Cut the file into shares at newline boundaries */
+        const char *end = map->data + map->size;
+        const char *from = map->data;
+        int i;
+        for(i = 0; i < numThreads; i++){
+                const char *to = end;
+                if (i < numThreads - 1){
+                        to = map->data + map->size*(i + 1)/numThreads;
+                        if (to < from)
+                                to = from;
+                        if (to < end){
+                                const char *newline = memchr(to, '\n', end - to);
+                                to = newline ? newline + 1 : end;
+                        }
+                }
+                initStationReaderRange(&tasks[i].reader, name, from, to);
+                tasks[i].reader.deferReports = !quiet;
+                tasks[i].reader.quiet = quiet;
+                memset(&tasks[i].store, 0, sizeof(StationStore));
+                tasks[i].chunk = malloc(STREAM_CHUNK_ROWS*sizeof(ParsedStation));
+                tasks[i].started = 0;
+                tasks[i].failed = 0;
+                if (tasks[i].chunk == NULL){
+                        while (i-- > 0)
+                                free(tasks[i].chunk);
+                        return -1;
+                }
+                from = to;
+        }
+
+        /* The first share is streamed on this thread. If a thread cannot be started,
+           its share is streamed here too once the others are under way. */
+        for(i = 1; i < numThreads; i++){
+                tasks[i].started = (pthread_create(&tasks[i].thread, NULL, ingestTaskMain, &tasks[i]) == 0);
+        }
+        ingestTaskMain(&tasks[0]);
+        for(i = 1; i < numThreads; i++){
+                if (tasks[i].started)
+                        pthread_join(tasks[i].thread, NULL);
+                else
+                        ingestTaskMain(&tasks[i]);
+        }
+
+        /* Join the stores in file order. The first store is taken over as it is, and
+           each later one is freed as soon as it has been copied. */
+        int failed = 0;
+        long firstLine = 0;
+        long r;
+        for(i = 0; i < numThreads; i++){
+                StationReader *reader = &tasks[i].reader;
+                failed = failed || tasks[i].failed;
+                if (i == 0){
+                        *store = tasks[0].store;
+                }else{
+                        failed = failed || appendStationStore(store, &tasks[i].store) != 0;
+                        freeStationStore(&tasks[i].store);
+                }
+                for(r = 0; r < reader->numDeferred; r++){
+                        printf("%s:%ld: malformed station line skipped\n", name, firstLine + reader->rejectedLines[r]);
+                }
+                firstLine += reader->lineNumber - 1;
+                free(reader->rejectedLines);
+                free(tasks[i].chunk);
+        }
+        if (failed){
+                freeStationStore(store);
+                return -1;
+        }
+        return 0;
+} /* loadStationStore */
+
+
+/* ========================================================================= */
+/*                               Station Store                               */
+/*        Stations are kept column by column, and each pass over them        */
+/*                   reads only the columns it needs.                        */
+/* ========================================================================= */
+
+/* reserveStationStore
+   Makes room in a store for at least capacity stations, growing every column
+   together. Returns 0 on success, or -1 if out of memory (in which case the store is
+   left as it was).
+*/
+int reserveStationStore(StationStore *store, long capacity){
+        if (capacity <= store->capacity)
+                return 0;
+        if (capacity < 2*store->capacity)
+                capacity = 2*store->capacity;
+        if (capacity < STREAM_CHUNK_ROWS)
+                capacity = STREAM_CHUNK_ROWS;
+        int *stationID = realloc(store->stationID, capacity*sizeof(int));
+        if (stationID == NULL)
+                return -1;
+        store->stationID = stationID;
+        float *temperature = realloc(store->temperature, capacity*sizeof(float));
+        if (temperature == NULL)
+                return -1;
+        store->temperature = temperature;
+        unsigned char *valid = realloc(store->valid, capacity);
+        if (valid == NULL)
+                return -1;
+        store->valid = valid;
+        float *region = realloc(store->region, capacity*sizeof(float));
+        if (region == NULL)
+                return -1;
+        store->region = region;
+        float *latitude = realloc(store->latitude, capacity*sizeof(float));
+        if (latitude == NULL)
+                return -1;
+        store->latitude = latitude;
+        float *longitude = realloc(store->longitude, capacity*sizeof(float));
+        if (longitude == NULL)
+                return -1;
+        store->longitude = longitude;
+        unsigned int *timestamp = realloc(store->timestamp, capacity*sizeof(unsigned int));
+        if (timestamp == NULL)
+                return -1;
+        store->timestamp = timestamp;
+        unsigned char *type = realloc(store->type, capacity);
+        if (type == NULL)
+                return -1;
+        store->type = type;
+        store->capacity = capacity;
+        return 0;
+} /* reserveStationStore */
+
+/* setStation
+   Copies a ParsedStation struct into row i of a store, which must already have
+   room for it.
+*/
+void setStation(StationStore *store, long i, ParsedStation *parsed){
+        StationData *station = &parsed->data;
+        store->stationID[i] = station->stationID;
+        store->temperature[i] = station->temperature;
+        store->valid[i] = isfinite(station->temperature) != 0;
+        store->region[i] = parsed->regionID;
+        store->latitude[i] = station->location.latitude;
+        store->longitude[i] = station->location.longitude;
+        store->timestamp[i] = PACK_TIMESTAMP(station->year, station->month, station->day, station->hour, station->minute);
+        store->type[i] = MARKER_RED;
+} /* setStation */
+
+/* appendStationStore
+   Appends every station in src to the end of dest. Returns 0 on success, or -1 if
+   out of memory.
+*/
+int appendStationStore(StationStore *dest, StationStore *src){
+        if (reserveStationStore(dest, dest->count + src->count) != 0)
+                return -1;
+        long n = src->count;
+        memcpy(dest->stationID + dest->count, src->stationID, n*sizeof(int));
+        memcpy(dest->temperature + dest->count, src->temperature, n*sizeof(float));
+        memcpy(dest->valid + dest->count, src->valid, n);
+        memcpy(dest->region + dest->count, src->region, n*sizeof(float));
+        memcpy(dest->latitude + dest->count, src->latitude, n*sizeof(float));
+        memcpy(dest->longitude + dest->count, src->longitude, n*sizeof(float));
+        memcpy(dest->timestamp + dest->count, src->timestamp, n*sizeof(unsigned int));
+        memcpy(dest->type + dest->count, src->type, n);
+        dest->count += n;
+        dest->rejected += src->rejected;
+        return 0;
+} /* appendStationStore */
+
+/* freeStationStore
+   Releases the memory held by a store and empties it.
+*/
+void freeStationStore(StationStore *store){
+        free(store->stationID);
+        free(store->temperature);
+        free(store->valid);
+        free(store->region);
+        free(store->latitude);
+        free(store->longitude);
+        free(store->timestamp);
+        free(store->type);
+        memset(store, 0, sizeof(StationStore));
+} /* freeStationStore */
+
+/* averageTemperature
+   Averages the temperatures of the stations with a reading, summed exactly on one
+   thread by aggregateTemperatures. Stores the number of stations to plot in *t: every
+   row of the store, as the stations without a reading are skipped when written.
+*/
+float averageTemperature(StationStore *store, long *t){
+        TemperatureStats stats;
+        aggregateTemperatures(store, 0, store->count, 1, &stats, NULL);
+        *t = store->count;
+        return temperatureMean(&stats);
+} /* averageTemperature */
+
+/* markerTypeFor
+   Returns the marker colour of a temperature from its difference with avgTemp,
+   following the Program Key.
+*/
+int markerTypeFor(float temperature, float avgTemp){
+        float difference = temperature - avgTemp;
+        return (difference < -1) ? MARKER_BLUE :
+               (difference < 0) ? MARKER_GREEN :
+               (difference < 1) ? MARKER_YELLOW : MARKER_RED;
+} /* markerTypeFor */
+
+/* classifyStations
+   Fills in the marker colour of the first count stations from the difference between
+   each station's temperature and avgTemp, following the Program Key.
+*/
+void classifyStations(StationStore *store, long count, float avgTemp){
+        BandTable bands;
+        memset(&bands, 0, sizeof(BandTable));
+        resolveBands(&bands, store, count, NULL, avgTemp);
+        classifyBands(&bands, store, count);
+} /* classifyStations */
+
+/* The description of a station's marker: its name in bold, then its temperature and
+   the time of the observation, given as the arguments of MARKER_TEXT_ARGUMENTS */
+#define MARKER_TEXT_FORMAT "<b>%s</b>: %1.2f degrees (%u:%u %u/%u/%u)"
+#define MARKER_TEXT_ARGUMENTS(name, temperature, timestamp) \
+        (name), (temperature), TIMESTAMP_HOUR(timestamp), TIMESTAMP_MINUTE(timestamp), \
+        TIMESTAMP_MONTH(timestamp), TIMESTAMP_DAY(timestamp), TIMESTAMP_YEAR(timestamp)
+
+/* formatMarker
+   Fills in the MapMarker for station i of a store: its location, its name (from
+   getStationName), a description containing the temperature and time of the
+   observation, and the colour chosen by classifyStations. The name and description
+   are formatted straight into the marker, and cut short should they not fit.
+*/
+void formatMarker(StationStore *store, long i, MapMarker *marker){
+        /*writes the latitude and logitude to location in struct(mapInfo)*/
+        marker->location.latitude = store->latitude[i];
+        marker->location.longitude = store->longitude[i];
+
+        /*writes the stations name to markerName in struct(mapInfo)*/
+        snprintf(marker->markerName, sizeof(marker->markerName), "%s", getStationName(store->stationID[i]));
+
+        /*writes name (In bold), temperature and time to markerText in struct(mapInfo)*/
+        snprintf(marker->markerText, sizeof(marker->markerText), MARKER_TEXT_FORMAT,
+                 MARKER_TEXT_ARGUMENTS(marker->markerName, store->temperature[i], store->timestamp[i]));
+
+        marker->type = store->type[i];
+} /* formatMarker */
+
+/* monotonicSeconds
+   Returns the current time of the monotonic clock, in seconds.
+*/
+double monotonicSeconds(){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec*1e-9;
+} /* monotonicSeconds */
+
+/* timeLineParser
+   Times one pass of a line parser over every line of a mapped file, without any of
+   the chunking or storing done by streamIntoStore. Returns the elapsed seconds and
+   stores the number of lines that parsed successfully in *rows.
+*/
+double timeLineParser(InputMap *map, int (*parseLine)(const char *, const char *, ParsedStation *), long *rows){
+        const char *line = map->data;
+        const char *end = map->data + map->size;
+        ParsedStation station;
+        long parsed = 0;
+        double start = monotonicSeconds();
+        while (line < end){
+                const char *eol = memchr(line, '\n', end - line);
+                if (eol == NULL)
+                        eol = end;
+                parsed += parseLine(line, eol, &station);
+                line = eol + 1;
+        }
+        *rows = parsed;
+        return monotonicSeconds() - start;
+} /* timeLineParser */
+
+/* benchmarkIngest
+   Measures the throughput of loading the given input file into a station store and
+   of the averaging and colouring passes over it, then compares the line tokenizer
+   against the original sscanf parser, and finally measures how the parallel load
+   scales from 1 to maxThreads threads (doubling the number of threads each step).
+   Each figure is the best of BENCH_RUNS runs.
+*/
+int benchmarkIngest(const char *inputName, int maxThreads, BenchReport *report){
+        InputMap inMap;
+        if (mapInputFile(inputName, &inMap) != 0){
+                printf("File %s cannot be opened\n", inputName);
+                return EXIT_FAILURE;
+        }
+        StationStore store;
+        double best = 0, bestAverage = 0, bestClassify = 0, bestTokenizer = 0, bestScanf = 0;
+        long tokenizerRows = 0, scanfRows = 0, rows = 0, rejected = 0;
+        int run;
+        for(run = 0; run < BENCH_RUNS; run++){
+                double start = monotonicSeconds();
+                if (loadStationStore(inputName, &inMap, 1, run > 0, &store) != 0){
+                        printf("Out of memory\n");
+                        return EXIT_FAILURE;
+                }
+                double elapsed = monotonicSeconds() - start;
+                if(run == 0 || elapsed < best){
+                        best = elapsed;
+                }
+
+                long t;
+                start = monotonicSeconds();
+                float avgTemp = averageTemperature(&store, &t);
+                elapsed = monotonicSeconds() - start;
+                if(run == 0 || elapsed < bestAverage){
+                        bestAverage = elapsed;
+                }
+                start = monotonicSeconds();
+                classifyStations(&store, t, avgTemp);
+                elapsed = monotonicSeconds() - start;
+                if(run == 0 || elapsed < bestClassify){
+                        bestClassify = elapsed;
+                }
+                rows = store.count;
+                rejected = store.rejected;
+                freeStationStore(&store);
+        }
+        for(run = 0; run < BENCH_RUNS; run++){
+                double elapsed = timeLineParser(&inMap, parseStationLine, &tokenizerRows);
+                if(run == 0 || elapsed < bestTokenizer){
+                        bestTokenizer = elapsed;
+                }
+                elapsed = timeLineParser(&inMap, parseStationLineScanf, &scanfRows);
+                if(run == 0 || elapsed < bestScanf){
+                        bestScanf = elapsed;
+                }
+        }
+        double bytes = inMap.size;
+        printf("ingest: %ld rows (%ld rejected), %.0f bytes, best of %d runs: %.4f s, %.1f MB/s, %.0f rows/s\n",
+                                rows, rejected, bytes, BENCH_RUNS, best, bytes/best/1e6, rows/best);
+        printf("average and colour: %.4f s (average %.4f s, colour %.4f s), %.0f rows/s\n",
+                                bestAverage + bestClassify, bestAverage, bestClassify, rows/(bestAverage + bestClassify));
+        printf("parse: tokenizer %ld rows %.1f MB/s, sscanf %ld rows %.1f MB/s, speedup %.1fx\n",
+                                tokenizerRows, bytes/bestTokenizer/1e6, scanfRows, bytes/bestScanf/1e6, bestScanf/bestTokenizer);
+        benchRecord(report, "ingest", 1, best, rows, "rows", bytes);
+        benchRecord(report, "average", 1, bestAverage, rows, "rows", 0);
+        benchRecord(report, "classify", 1, bestClassify, rows, "rows", 0);
+        benchRecord(report, "parse.tokenizer", 1, bestTokenizer, tokenizerRows, "rows", bytes);
+        benchRecord(report, "parse.sscanf", 1, bestScanf, scanfRows, "rows", bytes);
+
+        double singleThread = 0;
+        int numThreads = 1;
+        while(1){
+                double bestParallel = 0;
+                for(run = 0; run < BENCH_RUNS; run++){
+                        double start = monotonicSeconds();
+                        if (loadStationStore(inputName, &inMap, numThreads, 1, &store) != 0){
+                                printf("Out of memory\n");
+                                return EXIT_FAILURE;
+                        }
+                        double elapsed = monotonicSeconds() - start;
+                        freeStationStore(&store);
+                        if(run == 0 || elapsed < bestParallel){
+                                bestParallel = elapsed;
+                        }
+                }
+                if(numThreads == 1){
+                        singleThread = bestParallel;
+                }
+                printf("threads %d: %.4f s, %.1f MB/s, speedup %.2fx\n",
+                                        numThreads, bestParallel, bytes/bestParallel/1e6, singleThread/bestParallel);
+                benchRecord(report, "ingest.parallel", numThreads, bestParallel, rows, "rows", bytes);
+                if(numThreads >= maxThreads || numThreads >= MAX_INGEST_THREADS){
+                        break;
+                }
+                numThreads = (2*numThreads < maxThreads) ? 2*numThreads : maxThreads;
+        }
+
+        unmapInputFile(&inMap);
+        return EXIT_SUCCESS;
+} /* benchmarkIngest */
+
+
+/* ========================================================================= */
+/*                               Spatial Index                               */
+/*          A k-d tree over station locations, answering "stations           */
+/*           within R km of a point" and "k nearest stations".               */
+/* ========================================================================= */
+
+/* Utility function converting a geographic point to a unit vector from the centre of the Earth */
+void unitVector(GeographicPoint *point, double v[3]){
+        double lat = point->latitude*M_PI/180.0;
+        double lon = point->longitude*M_PI/180.0;
+        v[0] = cos(lat)*cos(lon);
+        v[1] = cos(lat)*sin(lon);
+        v[2] = sin(lat);
+} /* unitVector */
+
+/* Utility function returning the squared straight-line distance between a unit vector and a node of the tree */
+double chordSquared(SpatialIndex *index, long node, double q[3]){
+        double dx = index->xyz[node][0] - q[0];
+        double dy = index->xyz[node][1] - q[1];
+        double dz = index->xyz[node][2] - q[2];
+        return dx*dx + dy*dy + dz*dz;
+} /* chordSquared */
+
+/* selectMedian
+   Partially sorts order[lo..hi) so that order[mid] holds the point with the median
+   coordinate along axis, with no larger coordinates before it and no smaller ones
+   after it (Hoare's quickselect).
+*/
+void selectMedian(long *order, double (*xyz)[3], long lo, long hi, long mid, int axis){
+        hi--;
+        while (lo < hi){
+                double pivot = xyz[order[(lo + hi)/2]][axis];
+                long i = lo, j = hi;
+                while (i <= j){
+                        while (xyz[order[i]][axis] < pivot)
+                                i++;
+                        while (xyz[order[j]][axis] > pivot)
+                                j--;
+                        if (i <= j){
+                                long swap = order[i];
+                                order[i] = order[j];
+                                order[j] = swap;
+                                i++;
+                                j--;
+                        }
+                }
+                if (mid <= j)
+                        hi = j;
+                else if (mid >= i)
+                        lo = i;
+                else
+                        break;
+        }
+} /* selectMedian */
+
+/* buildSubtree
+   Builds the k-d tree over order[lo..hi): the point with the median coordinate along
+   the axis of greatest spread becomes the node at mid = (lo + hi)/2, and the points
+   before and after it become its two subtrees. Ranges of at most KD_LEAF_SIZE points
+   are left as leaves that are scanned directly.
+*/
+void buildSubtree(SpatialIndex *index, long *order, double (*xyz)[3], long lo, long hi){
+        if (hi - lo <= KD_LEAF_SIZE)
+                return;
+        double low[3], high[3];
+        long i;
+        int axis;
+        for (axis = 0; axis < 3; axis++){
+                low[axis] = high[axis] = xyz[order[lo]][axis];
+        }
+        for (i = lo + 1; i < hi; i++){
+                for (axis = 0; axis < 3; axis++){
+                        double value = xyz[order[i]][axis];
+                        if (value < low[axis])
+                                low[axis] = value;
+                        if (value > high[axis])
+                                high[axis] = value;
+                }
+        }
+        int splitAxis = 0;
+        for (axis = 1; axis < 3; axis++){
+                if (high[axis] - low[axis] > high[splitAxis] - low[splitAxis])
+                        splitAxis = axis;
+        }
+        long mid = (lo + hi)/2;
+        selectMedian(order, xyz, lo, hi, mid, splitAxis);
+        index->axes[mid] = splitAxis;
+        buildSubtree(index, order, xyz, lo, mid);
+        buildSubtree(index, order, xyz, mid + 1, hi);
+} /* buildSubtree */
+
+/* buildSpatialIndex
+   Builds a k-d tree over numPoints geographic points, given as columns of latitudes
+   and longitudes in degrees, in O(N log N) time. The points
+   are indexed as unit vectors in three dimensions, so distances are correct across
+   the poles and the antimeridian (and for longitudes given either as -123 or 237).
+   The points are copied, so the caller's columns may be freed afterwards.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int buildSpatialIndex(SpatialIndex *index, float *latitude, float *longitude, long numPoints){
+        memset(index, 0, sizeof(SpatialIndex));
+        long *order = malloc((numPoints + 1)*sizeof(long));
+        double (*xyz)[3] = malloc((numPoints + 1)*sizeof(*xyz));
+        index->points = malloc((numPoints + 1)*sizeof(GeographicPoint));
+        index->xyz = malloc((numPoints + 1)*sizeof(*index->xyz));
+        index->ids = malloc((numPoints + 1)*sizeof(long));
+        index->axes = malloc(numPoints + 1);
+        if (!order || !xyz || !index->points || !index->xyz || !index->ids || !index->axes){
+                free(order);
+                free(xyz);
+                freeSpatialIndex(index);
+                return -1;
+        }
+        long i;
+        for (i = 0; i < numPoints; i++){
+                double v[3];
+                index->points[i].latitude = latitude[i];
+                index->points[i].longitude = longitude[i];
+                unitVector(&index->points[i], v);
+                xyz[i][0] = v[0];
+                xyz[i][1] = v[1];
+                xyz[i][2] = v[2];
+                order[i] = i;
+        }
+        buildSubtree(index, order, xyz, 0, numPoints);
+
+        /* Lay the points out in tree order so that queries walk contiguous memory */
+        for (i = 0; i < numPoints; i++){
+                index->points[i].latitude = latitude[order[i]];
+                index->points[i].longitude = longitude[order[i]];
+                memcpy(index->xyz[i], xyz[order[i]], sizeof(*xyz));
+                index->ids[i] = order[i];
+        }
+        index->numPoints = numPoints;
+        free(order);
+        free(xyz);
+        return 0;
+} /* buildSpatialIndex */
+
+/* freeSpatialIndex
+   Releases the memory held by a spatial index.
+*/
+void freeSpatialIndex(SpatialIndex *index){
+        free(index->points);
+        free(index->xyz);
+        free(index->ids);
+        free(index->axes);
+        memset(index, 0, sizeof(SpatialIndex));
+} /* freeSpatialIndex */
+
+/* appendNeighbour
+   Adds a neighbour to the end of a NeighbourList, growing the list as needed.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int appendNeighbour(NeighbourList *list, long id, float distance){
+        if (list->count == list->capacity){
+                long capacity = list->capacity ? 2*list->capacity : 64;
+                Neighbour *items = realloc(list->items, capacity*sizeof(Neighbour));
+                if (items == NULL)
+                        return -1;
+                list->items = items;
+                list->capacity = capacity;
+        }
+        list->items[list->count].id = id;
+        list->items[list->count].distance = distance;
+        list->count++;
+        return 0;
+} /* appendNeighbour */
+
+/* freeNeighbourList
+   Releases the memory held by a NeighbourList and empties it.
+*/
+void freeNeighbourList(NeighbourList *list){
+        free(list->items);
+        memset(list, 0, sizeof(NeighbourList));
+} /* freeNeighbourList */
+
+/* The state of one radius search through the tree */
+typedef struct{
+        SpatialIndex *index;
+        GeographicPoint *centre;
+        double q[3];
+        double maxChordSquared;
+        float radius;
+        NeighbourList *results;
+        int failed;
+} RadiusSearch;
+
+/* Utility function adding a node of the tree to the results of a radius search if it is close enough */
+void radiusVisit(RadiusSearch *search, long node){
+        if (chordSquared(search->index, node, search->q) > search->maxChordSquared)
+                return;
+        /* The tree only narrows down the candidates; the distance itself is always
+           measured by surfaceDistance so that results agree with it exactly */
+        float distance = surfaceDistance(search->centre, &search->index->points[node]);
+        if (distance <= search->radius && appendNeighbour(search->results, search->index->ids[node], distance) != 0)
+                search->failed = 1;
+} /* radiusVisit */
+
+/* Utility function searching the subtree over nodes lo..hi-1 for points within the search radius */
+void radiusSubtree(RadiusSearch *search, long lo, long hi){
+        long i;
+        if (hi - lo <= KD_LEAF_SIZE){
+                for (i = lo; i < hi; i++)
+                        radiusVisit(search, i);
+                return;
+        }
+        long mid = (lo + hi)/2;
+        int axis = search->index->axes[mid];
+        double diff = search->q[axis] - search->index->xyz[mid][axis];
+        radiusVisit(search, mid);
+        if (diff <= 0){
+                radiusSubtree(search, lo, mid);
+                if (diff*diff <= search->maxChordSquared)
+                        radiusSubtree(search, mid + 1, hi);
+        }else{
+                radiusSubtree(search, mid + 1, hi);
+                if (diff*diff <= search->maxChordSquared)
+                        radiusSubtree(search, lo, mid);
+        }
+} /* radiusSubtree */
+
+/* Utility function for qsort, ordering neighbours by id */
+int compareNeighbourIds(const void *a, const void *b){
+        long idA = ((const Neighbour *)a)->id, idB = ((const Neighbour *)b)->id;
+        return (idA > idB) - (idA < idB);
+} /* compareNeighbourIds */
+
+/* Utility function for qsort, ordering neighbours by distance, then by id */
+int compareNeighbourDistances(const void *a, const void *b){
+        const Neighbour *nA = a, *nB = b;
+        if (nA->distance != nB->distance)
+                return (nA->distance > nB->distance) - (nA->distance < nB->distance);
+        return compareNeighbourIds(a, b);
+} /* compareNeighbourDistances */
+
+/* Converts a surface distance in kilometres to the squared straight-line distance between two unit vectors that far apart, with a little slack for rounding */
+double radiusToChordSquared(float radius){
+        double angle = radius/EARTH_RADIUS_KM;
+        if (angle >= M_PI)
+                return 4.0 + 1e-6;
+        double chord = 2*sin(angle/2);
+        return chord*chord*(1 + 1e-4) + 1e-10;
+} /* radiusToChordSquared */
+
+/* spatialIndexWithinRadius
+   Finds every indexed point whose surfaceDistance from centre is at most radius
+   kilometres. The results replace the contents of list, in the order the points were
+   originally given to buildSpatialIndex.
+   Returns the number of points found, or -1 if out of memory.
+*/
+long spatialIndexWithinRadius(SpatialIndex *index, GeographicPoint *centre, float radius, NeighbourList *list){
+        RadiusSearch search;
+        search.index = index;
+        search.centre = centre;
+        unitVector(centre, search.q);
+        search.maxChordSquared = radiusToChordSquared(radius);
+        search.radius = radius;
+        search.results = list;
+        search.failed = 0;
+        list->count = 0;
+        if (radius >= 0)
+                radiusSubtree(&search, 0, index->numPoints);
+        if (search.failed)
+                return -1;
+        qsort(list->items, list->count, sizeof(Neighbour), compareNeighbourIds);
+        return list->count;
+} /* spatialIndexWithinRadius */
+
+/* The state of one k-nearest search through the tree: a max-heap of the best k
+   candidates found so far, keyed by squared chord length, and the offset along each
+   axis from the query to the region of the subtree being searched. bound is a squared
+   chord length known to hold at least k points (INFINITY if none is known), beyond
+   which points and subtrees are passed over. */
+typedef struct{
+        SpatialIndex *index;
+        double q[3];
+        long k;
+        long count;
+        long *heapNodes;
+        double *heapKeys;
+        double offset[3];
+        double bound;
+} NearestSearch;
+
+/* Utility function offering a node of the tree to the heap of a k-nearest search */
+void nearestVisit(NearestSearch *search, long node){
+        double key = chordSquared(search->index, node, search->q);
+        long i;
+        if (key > search->bound)
+                return;
+        if (search->count < search->k){
+                /* Sift the new candidate up */
+                i = search->count++;
+                while (i > 0 && search->heapKeys[(i - 1)/2] < key){
+                        search->heapKeys[i] = search->heapKeys[(i - 1)/2];
+                        search->heapNodes[i] = search->heapNodes[(i - 1)/2];
+                        i = (i - 1)/2;
+                }
+        }else if (key < search->heapKeys[0]){
+                /* Replace the farthest candidate and sift down */
+                i = 0;
+                while (1){
+                        long child = 2*i + 1;
+                        if (child >= search->count)
+                                break;
+                        if (child + 1 < search->count && search->heapKeys[child + 1] > search->heapKeys[child])
+                                child++;
+                        if (search->heapKeys[child] <= key)
+                                break;
+                        search->heapKeys[i] = search->heapKeys[child];
+                        search->heapNodes[i] = search->heapNodes[child];
+                        i = child;
+                }
+        }else{
+                return;
+        }
+        search->heapKeys[i] = key;
+        search->heapNodes[i] = node;
+} /* nearestVisit */
+
+/* Utility function searching the subtree over nodes lo..hi-1, whose region lies regionSquared (squared) from the query, for nearer points
+   than those in the heap. The distance to the region of each subtree is kept up to date from the offsets along each axis (Arya and Mount's
+   incremental distance), so that subtrees are skipped even when the query lies far outside all of them. */
+void nearestSubtree(NearestSearch *search, long lo, long hi, double regionSquared){
+        long i;
+        if (hi - lo <= KD_LEAF_SIZE){
+                for (i = lo; i < hi; i++)
+                        nearestVisit(search, i);
+                return;
+        }
+        long mid = (lo + hi)/2;
+        int axis = search->index->axes[mid];
+        double diff = search->q[axis] - search->index->xyz[mid][axis];
+        nearestVisit(search, mid);
+        long nearLo = lo, nearHi = mid, farLo = mid + 1, farHi = hi;
+        if (diff > 0){
+                nearLo = mid + 1;
+                nearHi = hi;
+                farLo = lo;
+                farHi = mid;
+        }
+        nearestSubtree(search, nearLo, nearHi, regionSquared);
+        double oldOffset = search->offset[axis];
+        double farSquared = regionSquared - oldOffset*oldOffset + diff*diff;
+        if (farSquared <= search->bound && (search->count < search->k || farSquared < search->heapKeys[0])){
+                search->offset[axis] = diff;
+                nearestSubtree(search, farLo, farHi, farSquared);
+                search->offset[axis] = oldOffset;
+        }
+} /* nearestSubtree */
+
+/* spatialIndexNearest
+   Finds the k indexed points closest to centre. The results replace the contents of
+   list, nearest first, with their surfaceDistance from centre.
+   Returns the number of points found (fewer than k if fewer points are indexed), or
+   -1 if out of memory.
+*/
+long spatialIndexNearest(SpatialIndex *index, GeographicPoint *centre, long k, NeighbourList *list){
+        NearestSearch search;
+        list->count = 0;
+        if (k > index->numPoints)
+                k = index->numPoints;
+        if (k <= 0)
+                return 0;
+        search.index = index;
+        unitVector(centre, search.q);
+        search.k = k;
+        search.count = 0;
+        search.bound = INFINITY;
+        search.heapNodes = malloc(k*sizeof(long));
+        search.heapKeys = malloc(k*sizeof(double));
+        if (!search.heapNodes || !search.heapKeys){
+                free(search.heapNodes);
+                free(search.heapKeys);
+                return -1;
+        }
+        search.offset[0] = search.offset[1] = search.offset[2] = 0;
+        nearestSubtree(&search, 0, index->numPoints, 0);
+        long i;
+        int failed = 0;
+        for (i = 0; i < search.count && !failed; i++){
+                long node = search.heapNodes[i];
+                failed = appendNeighbour(list, index->ids[node], surfaceDistance(centre, &index->points[node])) != 0;
+        }
+        free(search.heapNodes);
+        free(search.heapKeys);
+        if (failed)
+                return -1;
+        qsort(list->items, list->count, sizeof(Neighbour), compareNeighbourDistances);
+        return list->count;
+} /* spatialIndexNearest */
+
+/* buildReadingIndex
+   Builds a spatial index over the stations of a store that have a reading, leaving
+   out those with a missing temperature, so that they are never found as neighbours.
+   The ids of the index are the stations' rows in the store. Returns 0 on success, or
+   -1 if out of memory.
+*/
+int buildReadingIndex(SpatialIndex *index, StationStore *store){
+        long count = store->count;
+        float *latitude = malloc((count > 0 ? count : 1)*sizeof(float));
+        float *longitude = malloc((count > 0 ? count : 1)*sizeof(float));
+        long *rows = malloc((count > 0 ? count : 1)*sizeof(long));
+        if (latitude == NULL || longitude == NULL || rows == NULL){
+                free(latitude);
+                free(longitude);
+                free(rows);
+                return -1;
+        }
+        long i, numReadings = 0;
+        for (i = 0; i < count; i++){
+                if (!store->valid[i])
+                        continue;
+                latitude[numReadings] = store->latitude[i];
+                longitude[numReadings] = store->longitude[i];
+                rows[numReadings++] = i;
+        }
+        int result = buildSpatialIndex(index, latitude, longitude, numReadings);
+        if (result == 0){
+                for (i = 0; i < index->numPoints; i++)
+                        index->ids[i] = rows[index->ids[i]];
+        }
+        free(latitude);
+        free(longitude);
+        free(rows);
+        return result;
+} /* buildReadingIndex */
+
+/* answerPointQueries
+   Answers a batch of "average temperature near a point" queries against an index
+   whose ids are rows of the temperature column. Each query averages either its k nearest
+   stations (if k > 0) or every station within its radius. Returns 0 on success,
+   or -1 if out of memory.
+*/
+int answerPointQueries(SpatialIndex *index, float *temperature, PointQuery *queries, long numQueries){
+        NeighbourList list = {0};
+        long q, i;
+        for (q = 0; q < numQueries; q++){
+                PointQuery *query = &queries[q];
+                long found = (query->k > 0) ? spatialIndexNearest(index, &query->point, query->k, &list)
+                                            : spatialIndexWithinRadius(index, &query->point, query->radius, &list);
+                if (found < 0){
+                        freeNeighbourList(&list);
+                        return -1;
+                }
+                double total = 0;
+                query->farthest = 0;
+                for (i = 0; i < found; i++){
+                        total += temperature[list.items[i].id];
+                        if (list.items[i].distance > query->farthest)
+                                query->farthest = list.items[i].distance;
+                }
+                query->count = found;
+                query->avgTemp = found ? total/found : 0;
+        }
+        freeNeighbourList(&list);
+        return 0;
+} /* answerPointQueries */
+
+/* runPointQueries
+   The -query mode: loads every station with a reading in the input file into a
+   spatial index, then reads query points from queryName, one "latitude longitude
+   radius" line per query (or "latitude longitude" if nearest > 0, to use the nearest
+   stations instead), and prints one line per query to standard output:
+       latitude longitude count averageTemperature farthestDistance
+*/
+int runPointQueries(const char *inputName, const char *queryName, long nearest, int numThreads, int useCache){
+        FILE *queryFp = fopen(queryName, "r");
+        if (queryFp == NULL){
+                printf("File %s cannot be opened\n", queryName);
+                return EXIT_FAILURE;
+        }
+        PointQuery *queries = NULL;
+        long numQueries = 0, queryCapacity = 0;
+
+        /* Load every station */
+        StationStore store;
+        if (readStations(inputName, numThreads, useCache, &store) != 0){
+                fclose(queryFp);
+                return EXIT_FAILURE;
+        }
+        int failed = 0;
+
+        /* Read the batch of query points */
+        char string[100];
+        long lineNumber = 0;
+        while (!failed && fgets(string, sizeof(string), queryFp) != 0){
+                PointQuery query;
+                lineNumber++;
+                memset(&query, 0, sizeof(query));
+                query.k = nearest;
+                int fields = sscanf(string, "%f %f %f", &query.point.latitude, &query.point.longitude, &query.radius);
+                if (fields < (nearest > 0 ? 2 : 3)){
+                        if (fields > 0)
+                                printf("%s:%ld: malformed query line skipped\n", queryName, lineNumber);
+                        continue;
+                }
+                if (numQueries == queryCapacity){
+                        queryCapacity = queryCapacity ? 2*queryCapacity : 64;
+                        PointQuery *grown = realloc(queries, queryCapacity*sizeof(PointQuery));
+                        if (grown == NULL){
+                                failed = 1;
+                                break;
+                        }
+                        queries = grown;
+                }
+                queries[numQueries++] = query;
+        }
+        fclose(queryFp);
+
+        SpatialIndex index;
+        if (failed || buildReadingIndex(&index, &store) != 0){
+                printf("Out of memory\n");
+                freeStationStore(&store);
+                free(queries);
+                return EXIT_FAILURE;
+        }
+        if (answerPointQueries(&index, store.temperature, queries, numQueries) != 0){
+                printf("Out of memory\n");
+                freeSpatialIndex(&index);
+                freeStationStore(&store);
+                free(queries);
+                return EXIT_FAILURE;
+        }
+        long q;
+        for (q = 0; q < numQueries; q++){
+                printf("%f %f %ld %1.2f %1.3f\n", queries[q].point.latitude, queries[q].point.longitude,
+                                        queries[q].count, queries[q].avgTemp, queries[q].farthest);
+        }
+        freeSpatialIndex(&index);
+        freeStationStore(&store);
+        free(queries);
+        return EXIT_SUCCESS;
+} /* runPointQueries */
+
+/* ========================================================================= */
+/*                          Batched Surface Distance                         */
+/*      surfaceDistance from one origin to many points at once, using        */
+/*      polynomial sin/asin on float vectors (AVX2 or SSE2 where the CPU     */
+/*                  supports them, scalar code otherwise).                   */
+/* ========================================================================= */
+
+/* Coefficients of the Taylor series of sin(x), accurate to float precision on [-pi/2, pi/2] */
+#define SIN_C3 -1.6666667e-1f
+#define SIN_C5 8.3333333e-3f
+#define SIN_C7 -1.9841270e-4f
+#define SIN_C9 2.7557319e-6f
+#define SIN_C11 -2.5052108e-8f
+
+/* Coefficients of the Cephes polynomial for asin(x) on [0, 0.5] */
+#define ASIN_C1 1.6666752422e-1f
+#define ASIN_C3 7.4953002686e-2f
+#define ASIN_C5 4.5470025998e-2f
+#define ASIN_C7 2.4181311049e-2f
+#define ASIN_C9 4.2163199048e-2f
+
+/* pi split in two so that multiples of it can be subtracted without losing precision */
+#define PI_HI 3.140625f
+#define PI_LO 9.67653589793e-4f
+
+/* buildPointColumns
+   Copies columns of numPoints latitudes and longitudes (in degrees), such as those of
+   a StationStore, into the layout used by surfaceDistanceBatch, converting them to radians and precomputing the cosine of each latitude once.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int buildPointColumns(PointColumns *columns, float *latitude, float *longitude, long numPoints){
+        /* Columns are padded to a whole number of vectors so the kernels can load past the end */
+        long padded = (numPoints + 7) & ~7L;
+        memset(columns, 0, sizeof(PointColumns));
+        columns->count = numPoints;
+        if (posix_memalign((void **)&columns->latitude, 32, (padded + 8)*sizeof(float)) != 0 ||
+            posix_memalign((void **)&columns->longitude, 32, (padded + 8)*sizeof(float)) != 0 ||
+            posix_memalign((void **)&columns->cosLatitude, 32, (padded + 8)*sizeof(float)) != 0){
+                freePointColumns(columns);
+                return -1;
+        }
+        long i;
+        for (i = 0; i < padded + 8; i++){
+                if (i < numPoints){
+                        columns->latitude[i] = latitude[i]*M_PI/180.0;
+                        columns->longitude[i] = longitude[i]*M_PI/180.0;
+                        columns->cosLatitude[i] = cos(columns->latitude[i]);
+                }else{
+                        columns->latitude[i] = 0;
+                        columns->longitude[i] = 0;
+                        columns->cosLatitude[i] = 1;
+                }
+        }
+        return 0;
+} /* buildPointColumns */
+
+/* freePointColumns
+   Releases the memory held by a PointColumns.
+*/
+void freePointColumns(PointColumns *columns){
+        free(columns->latitude);
+        free(columns->longitude);
+        free(columns->cosLatitude);
+        memset(columns, 0, sizeof(PointColumns));
+} /* freePointColumns */
+
+/* Utility function returning sin(x)^2, for any x, using the Taylor series after reducing x to [-pi/2, pi/2] */
+float sinSquared(float x){
+        float k = nearbyintf(x*(float)M_1_PI);
+        x = (x - k*PI_HI) - k*PI_LO;
+        float x2 = x*x;
+        float s = x + x*x2*(SIN_C3 + x2*(SIN_C5 + x2*(SIN_C7 + x2*(SIN_C9 + x2*SIN_C11))));
+        return s*s;
+} /* sinSquared */
+
+/* Utility function returning asin(x) for x in [0, 1], using the Cephes polynomial */
+float polyAsin(float x){
+        int big = x > 0.5f;
+        float z = big ? 0.5f*(1 - x) : x*x;
+        if (big)
+                x = sqrtf(z);
+        float p = (((((ASIN_C9*z + ASIN_C7)*z + ASIN_C5)*z + ASIN_C3)*z + ASIN_C1)*z)*x + x;
+        return big ? (float)M_PI_2 - 2*p : p;
+} /* polyAsin */
+
+/* surfaceDistanceScalar
+   The scalar form of the batch kernel, used for the points after the last whole
+   vector and on CPUs without SIMD support.
+*/
+void surfaceDistanceScalar(float lat1, float lon1, float cosLat1, PointColumns *columns, long from, long to, float *distances){
+        long i;
+        for (i = from; i < to; i++){
+                float a = sinSquared((columns->latitude[i] - lat1)*0.5f) +
+                          cosLat1*columns->cosLatitude[i]*sinSquared((columns->longitude[i] - lon1)*0.5f);
+                a = a < 0 ? 0 : (a > 1 ? 1 : a);
+                distances[i] = 2*EARTH_RADIUS_KM*polyAsin(sqrtf(a));
+        }
+} /* surfaceDistanceScalar */
+
+#ifdef HAVE_X86_SIMD
+
+/* Utility function returning sin(x)^2 for a vector of 8 floats */
+__attribute__((target("avx2,fma")))
+__m256 sinSquaredAvx2(__m256 x){
+        __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps((float)M_1_PI)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        x = _mm256_fnmadd_ps(k, _mm256_set1_ps(PI_HI), x);
+        x = _mm256_fnmadd_ps(k, _mm256_set1_ps(PI_LO), x);
+        __m256 x2 = _mm256_mul_ps(x, x);
+        __m256 p = _mm256_fmadd_ps(x2, _mm256_set1_ps(SIN_C11), _mm256_set1_ps(SIN_C9));
+        p = _mm256_fmadd_ps(x2, p, _mm256_set1_ps(SIN_C7));
+        p = _mm256_fmadd_ps(x2, p, _mm256_set1_ps(SIN_C5));
+        p = _mm256_fmadd_ps(x2, p, _mm256_set1_ps(SIN_C3));
+        __m256 s = _mm256_fmadd_ps(_mm256_mul_ps(x, x2), p, x);
+        return _mm256_mul_ps(s, s);
+} /* sinSquaredAvx2 */
+
+/* Utility function returning asin(x) for a vector of 8 floats in [0, 1] */
+__attribute__((target("avx2,fma")))
+__m256 polyAsinAvx2(__m256 x){
+        __m256 half = _mm256_set1_ps(0.5f);
+        __m256 big = _mm256_cmp_ps(x, half, _CMP_GT_OQ);
+        __m256 zBig = _mm256_mul_ps(half, _mm256_sub_ps(_mm256_set1_ps(1), x));
+        __m256 z = _mm256_blendv_ps(_mm256_mul_ps(x, x), zBig, big);
+        x = _mm256_blendv_ps(x, _mm256_sqrt_ps(zBig), big);
+        __m256 p = _mm256_fmadd_ps(z, _mm256_set1_ps(ASIN_C9), _mm256_set1_ps(ASIN_C7));
+        p = _mm256_fmadd_ps(z, p, _mm256_set1_ps(ASIN_C5));
+        p = _mm256_fmadd_ps(z, p, _mm256_set1_ps(ASIN_C3));
+        p = _mm256_fmadd_ps(z, p, _mm256_set1_ps(ASIN_C1));
+        p = _mm256_fmadd_ps(_mm256_mul_ps(p, z), x, x);
+        __m256 pBig = _mm256_fnmadd_ps(_mm256_set1_ps(2), p, _mm256_set1_ps((float)M_PI_2));
+        return _mm256_blendv_ps(p, pBig, big);
+} /* polyAsinAvx2 */
+
+/* surfaceDistanceAvx2
+   The batch kernel for 8 points at a time, for CPUs with AVX2 and FMA. Returns the
+   number of points done; the rest are left to surfaceDistanceScalar.
+*/
+__attribute__((target("avx2,fma")))
+long surfaceDistanceAvx2(float lat1, float lon1, float cosLat1, PointColumns *columns, float *distances){
+        __m256 vLat1 = _mm256_set1_ps(lat1), vLon1 = _mm256_set1_ps(lon1), vCos1 = _mm256_set1_ps(cosLat1);
+        __m256 half = _mm256_set1_ps(0.5f), zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+        __m256 diameter = _mm256_set1_ps(2*EARTH_RADIUS_KM);
+        long i, end = columns->count & ~7L;
+        for (i = 0; i < end; i += 8){
+                __m256 dLat = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(columns->latitude + i), vLat1), half);
+                __m256 dLon = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(columns->longitude + i), vLon1), half);
+                __m256 cosProduct = _mm256_mul_ps(vCos1, _mm256_load_ps(columns->cosLatitude + i));
+                __m256 a = _mm256_fmadd_ps(cosProduct, sinSquaredAvx2(dLon), sinSquaredAvx2(dLat));
+                a = _mm256_min_ps(_mm256_max_ps(a, zero), one);
+                _mm256_storeu_ps(distances + i, _mm256_mul_ps(diameter, polyAsinAvx2(_mm256_sqrt_ps(a))));
+        }
+        return end;
+} /* surfaceDistanceAvx2 */
+
+/* Utility function choosing each lane of b where mask is set, and of a elsewhere (SSE2 has no blend) */
+__m128 selectSse2(__m128 a, __m128 b, __m128 mask){
+        return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+} /* selectSse2 */
+
+/* Utility function returning sin(x)^2 for a vector of 4 floats */
+__m128 sinSquaredSse2(__m128 x){
+        /* Converting to int rounds to nearest in the default rounding mode */
+        __m128 k = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps((float)M_1_PI))));
+        x = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(PI_HI)));
+        x = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(PI_LO)));
+        __m128 x2 = _mm_mul_ps(x, x);
+        __m128 p = _mm_add_ps(_mm_mul_ps(x2, _mm_set1_ps(SIN_C11)), _mm_set1_ps(SIN_C9));
+        p = _mm_add_ps(_mm_mul_ps(x2, p), _mm_set1_ps(SIN_C7));
+        p = _mm_add_ps(_mm_mul_ps(x2, p), _mm_set1_ps(SIN_C5));
+        p = _mm_add_ps(_mm_mul_ps(x2, p), _mm_set1_ps(SIN_C3));
+        __m128 s = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(x, x2), p), x);
+        return _mm_mul_ps(s, s);
+} /* sinSquaredSse2 */
+
+/* Utility function returning asin(x) for a vector of 4 floats in [0, 1] */
+__m128 polyAsinSse2(__m128 x){
+        __m128 half = _mm_set1_ps(0.5f);
+        __m128 big = _mm_cmpgt_ps(x, half);
+        __m128 zBig = _mm_mul_ps(half, _mm_sub_ps(_mm_set1_ps(1), x));
+        __m128 z = selectSse2(_mm_mul_ps(x, x), zBig, big);
+        x = selectSse2(x, _mm_sqrt_ps(zBig), big);
+        __m128 p = _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(ASIN_C9)), _mm_set1_ps(ASIN_C7));
+        p = _mm_add_ps(_mm_mul_ps(z, p), _mm_set1_ps(ASIN_C5));
+        p = _mm_add_ps(_mm_mul_ps(z, p), _mm_set1_ps(ASIN_C3));
+        p = _mm_add_ps(_mm_mul_ps(z, p), _mm_set1_ps(ASIN_C1));
+        p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, z), x), x);
+        __m128 pBig = _mm_sub_ps(_mm_set1_ps((float)M_PI_2), _mm_mul_ps(_mm_set1_ps(2), p));
+        return selectSse2(p, pBig, big);
+} /* polyAsinSse2 */
+
+/* surfaceDistanceSse2
+   The batch kernel for 4 points at a time, for any x86 CPU with SSE2. Returns the
+   number of points done; the rest are left to surfaceDistanceScalar.
+*/
+long surfaceDistanceSse2(float lat1, float lon1, float cosLat1, PointColumns *columns, float *distances){
+        __m128 vLat1 = _mm_set1_ps(lat1), vLon1 = _mm_set1_ps(lon1), vCos1 = _mm_set1_ps(cosLat1);
+        __m128 half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+        __m128 diameter = _mm_set1_ps(2*EARTH_RADIUS_KM);
+        long i, end = columns->count & ~3L;
+        for (i = 0; i < end; i += 4){
+                __m128 dLat = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(columns->latitude + i), vLat1), half);
+                __m128 dLon = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(columns->longitude + i), vLon1), half);
+                __m128 cosProduct = _mm_mul_ps(vCos1, _mm_load_ps(columns->cosLatitude + i));
+                __m128 a = _mm_add_ps(sinSquaredSse2(dLat), _mm_mul_ps(cosProduct, sinSquaredSse2(dLon)));
+                a = _mm_min_ps(_mm_max_ps(a, zero), one);
+                _mm_storeu_ps(distances + i, _mm_mul_ps(diameter, polyAsinSse2(_mm_sqrt_ps(a))));
+        }
+        return end;
+} /* surfaceDistanceSse2 */
+
+#endif /* HAVE_X86_SIMD */
+
+/* The vector kernel surfaceDistanceBatch uses on this CPU (NULL if there is none,
+   leaving every point to the scalar code) and its name, chosen once, on first use */
+long (*surfaceDistanceVector)(float lat1, float lon1, float cosLat1, PointColumns *columns, float *distances) = NULL;
+const char *surfaceDistanceVectorName = "scalar";
+pthread_once_t surfaceDistanceChosen = PTHREAD_ONCE_INIT;
+
+/* Utility function choosing the kernel surfaceDistanceBatch uses on this CPU */
+void chooseSurfaceDistanceKernel(){
+#ifdef HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+                surfaceDistanceVector = surfaceDistanceAvx2;
+                surfaceDistanceVectorName = "avx2";
+        }else{
+                surfaceDistanceVector = surfaceDistanceSse2;
+                surfaceDistanceVectorName = "sse2";
+        }
+#endif
+} /* chooseSurfaceDistanceKernel */
+
+/* Utility function naming the kernel surfaceDistanceBatch uses on this CPU */
+const char *surfaceDistanceKernel(){
+        pthread_once(&surfaceDistanceChosen, chooseSurfaceDistanceKernel);
+        return surfaceDistanceVectorName;
+} /* surfaceDistanceKernel */
+
+/* surfaceDistanceBatch
+   Computes the distance in kilometres from origin to every point in columns, storing
+   them in distances (which must have room for columns->count floats). The result
+   for each point agrees with surfaceDistance to within SURFACE_DISTANCE_BATCH_ERROR
+   kilometres plus SURFACE_DISTANCE_BATCH_RELATIVE_ERROR of the distance. It is an
+   API for callers with many points per origin: the program itself only measures it,
+   as the k-d tree compares chord lengths of unit vectors rather than distances.
+*/
+void surfaceDistanceBatch(GeographicPoint *origin, PointColumns *columns, float *distances){
+        float lat1 = origin->latitude*M_PI/180.0;
+        float lon1 = origin->longitude*M_PI/180.0;
+        float cosLat1 = cos(lat1);
+        long done = 0;
+        surfaceDistanceKernel();
+        if (surfaceDistanceVector != NULL)
+                done = surfaceDistanceVector(lat1, lon1, cosLat1, columns, distances);
+        surfaceDistanceScalar(lat1, lon1, cosLat1, columns, done, columns->count, distances);
+} /* surfaceDistanceBatch */
+
+/* Utility function returning the next value of a deterministic pseudo-random sequence in [0, 1) */
+double nextRandom(unsigned long long *state){
+        *state = *state*6364136223846793005ULL + 1442695040888963407ULL;
+        return (*state >> 11)*(1.0/9007199254740992.0);
+} /* nextRandom */
+
+/* benchmarkSurfaceDistance
+   Checks surfaceDistanceBatch against surfaceDistance over BENCH_DISTANCE_POINTS
+   pseudo-random points (half spread over the globe, half within 50km of the ECS
+   Building), then compares their speed in points per second.
+   Returns EXIT_FAILURE if any distance is outside the documented error bound.
+*/
+int benchmarkSurfaceDistance(BenchReport *report){
+        long numPoints = BENCH_DISTANCE_POINTS;
+        GeographicPoint *points = malloc(numPoints*sizeof(GeographicPoint));
+        float *latitude = malloc(numPoints*sizeof(float));
+        float *longitude = malloc(numPoints*sizeof(float));
+        float *distances = malloc(numPoints*sizeof(float));
+        float *expected = malloc(numPoints*sizeof(float));
+        PointColumns columns;
+        if (!points || !latitude || !longitude || !distances || !expected){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        unsigned long long seed = 1;
+        long i;
+        for (i = 0; i < numPoints; i++){
+                if (i % 2){
+                        points[i].latitude = 180*nextRandom(&seed) - 90;
+                        points[i].longitude = 720*nextRandom(&seed) - 360;
+                }else{
+                        points[i].latitude = ECS_LATITUDE + 0.9*nextRandom(&seed) - 0.45;
+                        points[i].longitude = 360 + ECS_LONGITUDE + 1.3*nextRandom(&seed) - 0.65;
+                }
+                latitude[i] = points[i].latitude;
+                longitude[i] = points[i].longitude;
+        }
+        if (buildPointColumns(&columns, latitude, longitude, numPoints) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        GeographicPoint origin;
+        origin.latitude = ECS_LATITUDE;
+        origin.longitude = ECS_LONGITUDE;
+
+        double bestScalar = 0, bestBatch = 0;
+        int run;
+        for (run = 0; run < BENCH_RUNS; run++){
+                double start = monotonicSeconds();
+                for (i = 0; i < numPoints; i++)
+                        expected[i] = surfaceDistance(&origin, &points[i]);
+                double elapsed = monotonicSeconds() - start;
+                if (run == 0 || elapsed < bestScalar)
+                        bestScalar = elapsed;
+                start = monotonicSeconds();
+                surfaceDistanceBatch(&origin, &columns, distances);
+                elapsed = monotonicSeconds() - start;
+                if (run == 0 || elapsed < bestBatch)
+                        bestBatch = elapsed;
+        }
+
+        /* Check every point against surfaceDistance */
+        double maxError = 0, maxLocalError = 0;
+        long outside = 0;
+        for (i = 0; i < numPoints; i++){
+                double error = fabs(distances[i] - expected[i]);
+                if (error > maxError)
+                        maxError = error;
+                if (expected[i] < 100 && error > maxLocalError)
+                        maxLocalError = error;
+                if (error > SURFACE_DISTANCE_BATCH_ERROR + SURFACE_DISTANCE_BATCH_RELATIVE_ERROR*expected[i])
+                        outside++;
+        }
+        printf("distance: surfaceDistance %.1f Mpoints/s, batch (%s) %.1f Mpoints/s, speedup %.1fx\n",
+                                numPoints/bestScalar/1e6, surfaceDistanceKernel(), numPoints/bestBatch/1e6, bestScalar/bestBatch);
+        printf("distance accuracy: max error %.2f m (%.2f m within 100km) over %ld points, %ld outside bound: %s\n",
+                                maxError*1000, maxLocalError*1000, numPoints, outside, outside ? "FAIL" : "ok");
+        benchRecord(report, "distance.scalar", 1, bestScalar, numPoints, "points", 0);
+        benchRecord(report, "distance.batch", 1, bestBatch, numPoints, "points", 0);
+
+        freePointColumns(&columns);
+        free(points);
+        free(latitude);
+        free(longitude);
+        free(distances);
+        free(expected);
+        return outside ? EXIT_FAILURE : EXIT_SUCCESS;
+} /* benchmarkSurfaceDistance */
+
+/* ========================================================================= */
+/*                           Library Functions                               */
+/*              These are declared above, and will be useful                 */
+/*                       to generate the output file.                        */
+/* ========================================================================= */
+
+/* writePrologue
+   This function writes the initial part of the HTML file (which sets up the Google
+   maps interface). This must be called before any points are written to the file.
+*/
+void writePrologue(FILE *f){
+        if (!f){
+                printf("writePrologue error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("<!DOCTYPE html>\n",f);
+        fputs("<html>\n",f);
+        fputs("<head>\n",f);
+        fputs("<meta name=\"viewport\" content=\"initial-scale=1.0, user-scalable=no\" />\n",f);
+        fputs("<style type=\"text/css\">\n",f);
+        fputs("  html { height: 100% }\n",f);
+        fputs("  body { height: 100%; margin: 0; padding: 0 }\n",f);
+        fputs("  #map_canvas { height: 100% }\n",f);
+        fputs("</style>\n",f);
+        fputs("<script type=\"text/javascript\"\n",f);
+        fputs("    src=\"http://maps.googleapis.com/maps/api/js?sensor=true\">\n",f);
+        fputs("</script>\n",f);
+        fputs("<script type=\"text/javascript\">\n",f);
+        fputs("  function initialize() {\n",f);
+        fputs("    var latlng = new google.maps.LatLng(48.447,236.643);\n",f);
+        fputs("    var myOptions = {\n",f);
+        fputs("      zoom: 13,\n",f);
+        fputs("      center: latlng,\n",f);
+        fputs("      mapTypeId: google.maps.MapTypeId.ROADMAP\n",f);
+        fputs("    };\n",f);
         fputs("    var map = new google.maps.Map(document.getElementById(\"map_canvas\"),\n",f);
         fputs("             myOptions);\n",f);
 } /* writePrologue */
 
-/* writeEpilogue
-   This function writes the final part of the HTML file. This must be called
-   after all points have been written, but before the file is closed.
-   (The caller is responsible for closing the file afterwards).
+/* writeEpilogue
+   This function writes the final part of the HTML file. This must be called
+   after all points have been written, but before the file is closed.
+   (The caller is responsible for closing the file afterwards).
+*/
+void writeEpilogue(FILE *f){
+        if (!f){
+                printf("writeEpilogue error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("  }\n",f);
+        fputs("</script>\n",f);
+        fputs("</head>\n",f);
+        fputs("<body onload=\"initialize()\">\n",f);
+        fputs("  <div id=\"map_canvas\" style=\"width:100%; height:100%\"></div>\n",f);
+        fputs("</body>\n",f);
+        fputs("</html>\n",f);
+} /* writeEpilogue */
+
+/* Utility function to change ' to \' in strings */
+void escapeQuotes(char *dest, char *src){
+        while (*src){
+                if (*src == '\'')
+                        *dest++ = '\\';
+                *dest++ = *src++;
+        }
+        *dest = '\0';
+} /* escapeQuotes */
+
+/* Utility function to implement the strnlen library function,
+   which may not be available on some platforms
+*/
+int strnlen2(char* str, int maxSize){
+        int i;
+        for (i = 0; i < maxSize; i++)
+                if (str[i] == '\0')
+                        break;
+        return i;
+} /* strnlen2 */
+
+#define NUM_MARKER_TYPES 5
+char *MarkerPaths[] = {
+        [MARKER_RED] = "http://maps.google.com/mapfiles/ms/icons/red-dot.png",
+        [MARKER_GREEN] = "http://maps.google.com/mapfiles/ms/icons/green-dot.png",
+        [MARKER_BLUE] = "http://maps.google.com/mapfiles/ms/icons/blue-dot.png",
+        [MARKER_PURPLE] = "http://maps.google.com/mapfiles/ms/icons/purple-dot.png",
+    [MARKER_YELLOW] = "http://maps.google.com/mapfiles/ms/icons/yellow-dot.png"
+};
+
+/* writePoint
+   This function adds a Google Maps marker to the output file for the MapMarker
+   provided, as the markerNum-th marker of the page. The caller keeps the count, so
+   any number of pages can be written, one after another or at once.
+*/
+void writePoint(FILE *f, MapMarker *marker, int markerNum){
+        char escapedName[2*sizeof(marker->markerName)],escapedText[2*sizeof(marker->markerText)];
+        if (!f){
+                printf("writePoint error: output file == NULL\n");
+                exit(1);
+        }
+        /* Try to make sure that the input data is properly set */
+        if (!marker){
+                printf("writePoint error: marker == NULL\n");
+                exit(1);
+        }
+        if (strnlen2(marker->markerName,sizeof(marker->markerName)) == sizeof(marker->markerName)){
+                printf("writePoint error: marker->markerName is not null-terminated\n");
+                exit(1);
+        }
+        if (strnlen2(marker->markerText,sizeof(marker->markerText)) == sizeof(marker->markerText)){
+                printf("writePoint error: marker->markerText is not null-terminated\n");
+                exit(1);
+        }
+        if (marker->type < 0 || marker->type >= NUM_MARKER_TYPES || !MarkerPaths[marker->type]){
+                printf("writePoint error: invalid marker type\n");
+                exit(1);
+        }
+        escapeQuotes(escapedName,marker->markerName);
+        escapeQuotes(escapedText,marker->markerText);
+        fprintf(f,"\tvar iw%d = new google.maps.InfoWindow({content: '%s'});\n",markerNum,escapedText);
+        fprintf(f,"\tvar marker%d = new google.maps.Marker({position: new google.maps.LatLng(%f,%f), map: map, title: '%s', icon: '%s'});\n",
+                                markerNum,marker->location.latitude,marker->location.longitude,escapedName,MarkerPaths[marker->type]);
+        fprintf(f,"\tgoogle.maps.event.addListener(marker%d, 'click', function(){ iw%d.open(map,marker%d); } );\n",
+                                markerNum, markerNum, markerNum);
+} /* writePoint */
+
+/* A large array of every VWSN station name, for use by the getStationName function */
+/* Notice that the C99 sparse array initializer syntax is used here, since some entries */
+/* of the array have no value (due to some stations being retired) */
+char *AllStationNames[MAX_STATIONS] = {
+[1] = "Ian Stewart Complex/Mt. Douglas High School",
+[3] = "Strawberry Vale Elementary School",
+[4] = "Oaklands Elementary School",
+[5] = "Cedar Hill Middle School",
+[6] = "Marigold Elementary School/Spectrum High School",
+[7] = "Campus View Elementary",
+[8] = "Victoria High School",
+[9] = "Frank Hobbs Elementary School",
+[10] = "MacAulay Elementary School",
+[11] = "James Bay Elementary School",
+[12] = "Victoria West Elementary School",
+[13] = "Shoreline Middle School",
+[14] = "Willows Elementary School",
+[15] = "Sir James Douglas Elementary School",
+[16] = "Tillicum Elementary School",
+[17] = "Eagle View Elementary School",
+[18] = "Torquay Elementary School",
+[19] = "Monterey Middle School",
+[20] = "Lake Hill Elementary School",
+[21] = "Rogers Elementary School",
+[22] = "Cloverdale Elementary School",
+[24] = "Hillcrest Elementary School",
+[25] = "Lansdowne Middle School",
+[26] = "Doncaster Elementary School",
+[27] = "Glanford Middle School",
+[28] = "Sundance Elementary School",
+[29] = "George Jay Elementary School",
+[30] = "Northridge Elementary School",
+[31] = "Sangster Elementary School",
+[32] = "Colwood Elementary School",
+[33] = "Reynolds High School",
+[34] = "Crystal View Elementary School",
+[35] = "David Cameron Elementary School",
+[36] = "Hans Helgesen Elementary School",
+[37] = "John Muir Elementary School",
+[39] = "Lakewood Elementary School",
+[40] = "Ruth King Elementary School",
+[41] = "CTV Victoria",
+[42] = "Butchart Gardens",
+[46] = "CTV Nanaimo",
+[50] = "Ocean Trails Resort",
+[55] = "Savory Elementary School",
+[56] = "Willway Elementary School",
+[57] = "Wishart Elementary School",
+[58] = "Dunsmuir Middle School",
+[59] = "Journey Middle School/Poirier Elementary School",
+[60] = "Esquimalt High School",
+[61] = "Cordova Bay Elementary School",
+[62] = "Deep Cove Elementary School",
+[63] = "Keating Elementary School",
+[64] = "Lochside Elementary School",
+[66] = "Prospect Lake Elementary School",
+[67] = "Sidney Elementary School",
+[68] = "Bayside Middle School",
+[70] = "Parkland Secondary School",
+[71] = "Cal Revelle Nature Sanctuary",
+[72] = "Race Rocks Ecological Reserve",
+[73] = "Craigflower Elementary School",
+[75] = "Central Middle School",
+[76] = "Lambrick Park High School",
+[77] = "McKenzie Elementary School",
+[78] = "SJ Willis Alternative School",
+[79] = "Arbutus Middle School",
+[80] = "Gordon Head Middle School",
+[81] = "Braefoot Elementary School",
+[82] = "Colquitz Middle School",
+[83] = "Winchelsea Elementary School",
+[84] = "Qualicum Beach Middle School",
+[85] = "Palsson Elementary School",
+[86] = "Randerson Ridge Elementary School",
+[88] = "PASS/Woodwinds Alternate School",
+[89] = "Springwood Middle School",
+[90] = "View Royal Elementary School",
+[91] = "French Creek Community School",
+[92] = "False Bay School",
+[93] = "Shawnigan Lake Museum",
+[94] = "Pender Islands Elementary and Secondary School",
+[95] = "Arrowview Elementary School",
+[96] = "Bowser Elementary School",
+[97] = "Qualicum Beach Elementary School",
+[98] = "Margaret Jenkins Elementary School",
+[99] = "East Highlands District Firehall",
+[100] = "District of Highlands Office",
+[101] = "West Highlands District Firehall",
+[103] = "Frances Kelsey Secondary School",
+[104] = "Happy Valley Elementary School",
+[105] = "Port Renfrew Elementary School",
+[106] = "Edward Milne Community School",
+[107] = "Millstream Elementary School",
+[108] = "Alberni Weather",
+[109] = "Brentwood Elementary School",
+[110] = "Nanoose Bay Elementary School",
+[111] = "Parksville Elementary School",
+[112] = "Saturna Elementary School",
+[113] = "Mayne Island Elementary &amp; Junior Secondary School",
+[114] = "Galiano Island Community School",
+[115] = "L'Ecole Victor Brodeur",
+[117] = "Salt Spring Elementary School &amp;Saltspring Middle School",
+[119] = "Fernwood Elementary School",
+[120] = "Fulford Elementary School",
+[121] = "Gulf Islands Secondary School",
+[122] = "Phoenix Elementary School",
+[123] = "Vancouver Island University",
+[124] = "Seaview Elementary School",
+[125] = "St. Patrick's Elementary School",
+[126] = "Quamichan Middle School",
+[127] = "Cowichan Valley Open Learning Cooperative",
+[128] = "John Stubbs Memorial School",
+[129] = "G.R. Paine Horticultural Training Centre",
+[131] = "Glenlyon Norfolk Junior School",
+[132] = "Shawnigan Lake",
+[133] = "Discovery Elementary School",
+[134] = "Swan Lake Nature House",
+[136] = "Pleasant Valley Elementary School",
+[137] = "McGirr Elementary School",
+[138] = "Bayview Elementary School",
+[139] = "L'Ecole Hammond Bay Elementary",
+[140] = "Uplands Park Elementary",
+[141] = "Mountain View Elementary",
+[142] = "View Royal Fire Department",
+[143] = "UVic Science Building",
+[144] = "Elizabeth Buckley School - Cridge Centre",
+[145] = "Chilliwack Education Centre",
+[159] = "Camosun College Lansdowne",
+[160] = "Shawnigan Lake School",
+[161] = "Bamfield Marine Sciences Centre",
+[162] = "St. Michaels University School Senior Campus",
+[163] = "UVic Social Sciences and Mathematics Building",
+[165] = "Alberni Elementary School",
+[166] = "Maquinna Elementary School",
+[167] = "Wikaninnish Community School",
+[168] = "Ucluelet High School",
+[169] = "Lighthouse Christian Academy",
+[174] = "Kelset Elementary School",
+[176] = "St. Michaels University School Junior Campus",
+[177] = "Ladysmith Secondary School",
+[179] = "Ray Watkins Elementary",
+[180] = "Captain Meares Elementary Secondary School",
+[181] = "West-Mont Montessori School",
+[182] = "Pacific Biological Station, DFO-MPO",
+[183] = "Brentwood College",
+[184] = "NEPTUNE Port Alberni",
+[185] = "Mt. Washington Alpine Resort-Nordic",
+[186] = "Mt. Washington Alpine Resort-Alpine",
+[187] = "Portage Inlet",
+[188] = "North Saanich Middle School",
+[189] = "Airport Elementary School",
+[190] = "Courtenay Elementary School",
+[191] = "Cumberland Junior Secondary School",
+[192] = "Denman Island Community School",
+[193] = "Hornby Island Community School",
+[194] = "Miracle Beach Elementary",
+[195] = "North Island Distance Education School",
+[196] = "Valley View Elementary School",
+[197] = "RASC Victoria Centre",
+[199] = "Trial Island Lightstation",
+[200] = "Longacre",
+};
+
+/* getStationName
+   This function takes a numerical VWSN station ID, and returns a C string
+   containing the station name, or "Unknown" if no station with that name is found.
+*/
+char* getStationName(int stationID){
+        if (stationID < 0 || stationID >= MAX_STATIONS || !AllStationNames[stationID])
+                return "Unknown";
+        return AllStationNames[stationID];
+} /* getStationName */
+
+/* surfaceDistance
+   Given two geographic points, compute the distance between the two points in kilometers.
+
+   The formula used in this function is called the "Haversine formula". More information
+   can be found at its Wikipedia page: http://en.wikipedia.org/wiki/Haversine_formula.
+   Note that the distance computed here is approximate, since the Earth is not a perfect
+   sphere, but the formula is sufficiently accurate for this assignment.
+*/
+float surfaceDistance(GeographicPoint* point1, GeographicPoint* point2){
+        if (!point1){
+                printf("surfaceDistance error: point1 is invalid\n");
+                exit(1);
+        }
+        if (!point2){
+                printf("surfaceDistance error: point2 is invalid\n");
+                exit(1);
+        }
+        const float RADIUS_OF_EARTH = 6371;
+        float lat1 = point1->latitude*M_PI/180.0;
+        float lon1 = point1->longitude*M_PI/180.0;
+        float lat2 = point2->latitude*M_PI/180.0;
+        float lon2 = point2->longitude*M_PI/180.0;
+        float lat_diff = fabs(lat1-lat2);
+        float lon_diff = fabs(lon1-lon2);
+        float latsin = sin(lat_diff/2);
+        float lonsin = sin(lon_diff/2);
+        float angle_diff = 2*asin(sqrt(latsin*latsin + cos(lat1)*cos(lat2)*lonsin*lonsin));
+        return RADIUS_OF_EARTH*angle_diff;
+} /* surfaceDistance */
+
+
+/* ========================================================================= */
+/*                           Buffered HTML Output                            */
+/*      Markers are formatted straight into one large reusable buffer,       */
+/*      which is written out with a single write call whenever it fills.    */
+/*          The output is byte-identical to that of writePoint.              */
+/* ========================================================================= */
+
+/* initHtmlWriter
+   Sets up a writer for an open file descriptor, or for memory if fd is -1, in which
+   case the buffer grows to hold the whole output. Returns 0 on success, or -1 if out
+   of memory.
+*/
+int initHtmlWriter(HtmlWriter *writer, int fd){
+        writer->fd = fd;
+        writer->used = 0;
+        writer->size = HTML_WRITER_BUFFER;
+        writer->numMarkers = 0;
+        writer->bytesWritten = 0;
+        writer->failed = 0;
+        writer->registry = NULL;
+        writer->buffer = malloc(writer->size);
+        writer->numAllocations = 1;
+        return writer->buffer ? 0 : -1;
+} /* initHtmlWriter */
+
+/* openHtmlWriter
+   Creates (or truncates) the named file and sets up a writer for it. Returns 0 on
+   success, or -1 if the file cannot be created.
+*/
+int openHtmlWriter(HtmlWriter *writer, const char *name){
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+                return -1;
+        if (initHtmlWriter(writer, fd) != 0){
+                close(fd);
+                return -1;
+        }
+        return 0;
+} /* openHtmlWriter */
+
+/* Utility function writing all of a block of bytes to a file descriptor, retrying short writes */
+int writeFully(int fd, const char *data, size_t length){
+        while (length > 0){
+                ssize_t written = write(fd, data, length);
+                if (written < 0){
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                data += written;
+                length -= written;
+        }
+        return 0;
+} /* writeFully */
+
+/* flushHtmlWriter
+   Writes out everything in the writer's buffer. Returns 0 on success, or -1 if the
+   write failed (in which case every later write is skipped).
+*/
+int flushHtmlWriter(HtmlWriter *writer){
+        if (writer->fd < 0)
+                return writer->failed ? -1 : 0;
+        if (writer->used > 0 && !writer->failed){
+                if (writeFully(writer->fd, writer->buffer, writer->used) != 0)
+                        writer->failed = 1;
+                else
+                        writer->bytesWritten += writer->used;
+        }
+        writer->used = 0;
+        return writer->failed ? -1 : 0;
+} /* flushHtmlWriter */
+
+/* closeHtmlWriter
+   Flushes the writer, closes its file and releases its buffer. Returns 0 if
+   everything was written, or -1 if any write failed.
+*/
+int closeHtmlWriter(HtmlWriter *writer){
+        flushHtmlWriter(writer);
+        if (writer->fd >= 0 && close(writer->fd) != 0)
+                writer->failed = 1;
+        free(writer->buffer);
+        writer->buffer = NULL;
+        return writer->failed ? -1 : 0;
+} /* closeHtmlWriter */
+
+/* Utility function returning room for at least length more bytes at the end of the writer's buffer, flushing it first if need be */
+char *writerReserve(HtmlWriter *writer, size_t length){
+        if (writer->used + length > writer->size){
+                flushHtmlWriter(writer);
+                if (writer->used + length > writer->size){
+                        size_t size = writer->fd < 0 ? 2*writer->size : 0;
+                        if (size < writer->used + length)
+                                size = writer->used + length;
+                        char *buffer = realloc(writer->buffer, size);
+                        if (buffer == NULL){
+                                printf("Out of memory\n");
+                                exit(1);
+                        }
+                        writer->buffer = buffer;
+                        writer->size = size;
+                        writer->numAllocations++;
+                }
+        }
+        return writer->buffer + writer->used;
+} /* writerReserve */
+
+/* writerAppend
+   Adds a block of bytes to the output.
+*/
+void writerAppend(HtmlWriter *writer, const char *data, size_t length){
+        memcpy(writerReserve(writer, length), data, length);
+        writer->used += length;
+} /* writerAppend */
+
+/* writerCapture
+   Adds whatever a FILE-based writing function (such as writePrologue) writes to the
+   output, so that the sections of the page have only one definition.
+*/
+void writerCapture(HtmlWriter *writer, void (*writeSection)(FILE *)){
+        char *text = NULL;
+        size_t length = 0;
+        FILE *memFp = open_memstream(&text, &length);
+        if (memFp == NULL){
+                printf("Out of memory\n");
+                exit(1);
+        }
+        writeSection(memFp);
+        fclose(memFp);
+        writerAppend(writer, text, length);
+        free(text);
+} /* writerCapture */
+
+/* Utility function copying a C string, returning the end of the copy */
+char *copyText(char *p, const char *text){
+        while (*text)
+                *p++ = *text++;
+        return p;
+} /* copyText */
+
+/* Utility function copying a C string with ' changed to \', returning the end of the copy (escapeQuotes in one pass, without a terminator) */
+char *copyEscaped(char *p, const char *text){
+        while (*text){
+                if (*text == '\'')
+                        *p++ = '\\';
+                *p++ = *text++;
+        }
+        return p;
+} /* copyEscaped */
+
+/* Utility function copying a C string escaped for a single-quoted JavaScript string on the page: \ and ' are backslashed, and control characters and < become \u escapes so that a name cannot end the string or close the script. Returns the end of the copy, which is at most 6 bytes per character */
+char *copyJsEscaped(char *p, const char *text){
+        for (; *text; text++){
+                unsigned char c = *text;
+                if (c == '\'' || c == '\\'){
+                        *p++ = '\\';
+                        *p++ = c;
+                }else if (c < ' ' || c == '<'){
+                        p += sprintf(p, "\\u%04x", c);
+                }else{
+                        *p++ = c;
+                }
+        }
+        return p;
+} /* copyJsEscaped */
+
+/* Utility function writing a decimal integer, as %ld would, returning the end of the text */
+char *formatLong(char *p, long value){
+        char digits[24];
+        int n = 0;
+        unsigned long magnitude = value < 0 ? -(unsigned long)value : (unsigned long)value;
+        do {
+                digits[n++] = '0' + magnitude % 10;
+                magnitude /= 10;
+        } while (magnitude);
+        if (value < 0)
+                *p++ = '-';
+        while (n > 0)
+                *p++ = digits[--n];
+        return p;
+} /* formatLong */
+
+/* formatFixed
+   Writes a float with the given number of decimals (at most 6), exactly as printf's
+   %.*f would, returning the end of the text. Scaling a float by a power of ten up to
+   10^6 is exact in double precision, so rounding the scaled value to the nearest
+   integer (ties to even, as glibc does) gives the same digits as printf.
+   Values too large for this (or not finite) are passed on to sprintf.
+*/
+char *formatFixed(char *p, float value, int decimals){
+        double scaled = (double)value*PowersOfTen[decimals];
+        if (!(fabs(scaled) < 1e15))
+                return p + sprintf(p, "%.*f", decimals, value);
+        if (signbit(value))
+                *p++ = '-';
+        long long units = (long long)nearbyint(fabs(scaled));
+        long long whole = units/(long long)PowersOfTen[decimals];
+        long long fraction = units - whole*(long long)PowersOfTen[decimals];
+        p = formatLong(p, (long)whole);
+        if (decimals > 0){
+                *p++ = '.';
+                int d;
+                for (d = decimals - 1; d >= 0; d--){
+                        p[d] = '0' + fraction % 10;
+                        fraction /= 10;
+                }
+                p += decimals;
+        }
+        return p;
+} /* formatFixed */
+
+/* Utility function writing the two lines that follow a marker's InfoWindow: the marker itself (titled with an already escaped name) and its click listener */
+char *formatMarkerTail(char *p, long markerNum, float latitude, float longitude, const char *escapedName, int nameLength, int type){
+        p = copyText(p, "\tvar marker");
+        p = formatLong(p, markerNum);
+        p = copyText(p, " = new google.maps.Marker({position: new google.maps.LatLng(");
+        p = formatFixed(p, latitude, 6);
+        *p++ = ',';
+        p = formatFixed(p, longitude, 6);
+        p = copyText(p, "), map: map, title: '");
+        memcpy(p, escapedName, nameLength);
+        p += nameLength;
+        p = copyText(p, "', icon: '");
+        p = copyText(p, MarkerPaths[type]);
+        p = copyText(p, "'});\n\tgoogle.maps.event.addListener(marker");
+        p = formatLong(p, markerNum);
+        p = copyText(p, ", 'click', function(){ iw");
+        p = formatLong(p, markerNum);
+        p = copyText(p, ".open(map,marker");
+        p = formatLong(p, markerNum);
+        p = copyText(p, "); } );\n");
+        return p;
+} /* formatMarkerTail */
+
+/* writerPoint
+   Adds a Google Maps marker for a MapMarker to the output, exactly as writePoint would,
+   numbered by the count of markers the writer has written.
+*/
+void writerPoint(HtmlWriter *writer, MapMarker *marker){
+        if (!marker){
+                printf("writerPoint error: marker == NULL\n");
+                exit(1);
+        }
+        if (strnlen2(marker->markerName,sizeof(marker->markerName)) == sizeof(marker->markerName)){
+                printf("writerPoint error: marker->markerName is not null-terminated\n");
+                exit(1);
+        }
+        if (strnlen2(marker->markerText,sizeof(marker->markerText)) == sizeof(marker->markerText)){
+                printf("writerPoint error: marker->markerText is not null-terminated\n");
+                exit(1);
+        }
+        if (marker->type < 0 || marker->type >= NUM_MARKER_TYPES || !MarkerPaths[marker->type]){
+                printf("writerPoint error: invalid marker type\n");
+                exit(1);
+        }
+        long markerNum = writer->numMarkers++;
+        char *start = writerReserve(writer, MARKER_FIXED_BYTES + 2*sizeof(marker->markerName) + 2*sizeof(marker->markerText));
+        char *p = start;
+        p = copyText(p, "\tvar iw");
+        p = formatLong(p, markerNum);
+        p = copyText(p, " = new google.maps.InfoWindow({content: '");
+        p = copyEscaped(p, marker->markerText);
+        p = copyText(p, "'});\n");
+        char escapedName[2*sizeof(marker->markerName)];
+        int nameLength = copyEscaped(escapedName, marker->markerName) - escapedName;
+        p = formatMarkerTail(p, markerNum, marker->location.latitude, marker->location.longitude, escapedName, nameLength, marker->type);
+        writer->used += p - start;
+} /* writerPoint */
+
+/* writerStation
+   Adds the marker for station i of a store to the output, formatting it straight
+   from the store's columns and the writer's registry, whose names are escaped once
+   when they are loaded. The output is the same as formatMarker followed by
+   writePoint. A station without a reading is skipped.
+*/
+void writerStation(HtmlWriter *writer, StationStore *store, long i){
+        if (!store->valid[i])
+                return;
+        StationRegistry *registry = writer->registry;
+        RegisteredStation *station = &registry->stations[stationNameHandle(registry, store->stationID[i])];
+        const char *name = registry->arena + station->escaped;
+        long markerNum = writer->numMarkers++;
+        unsigned int timestamp = store->timestamp[i];
+        char *start = writerReserve(writer, MARKER_FIXED_BYTES + 2*station->escapedLength);
+        char *p = start;
+        p = copyText(p, "\tvar iw");
+        p = formatLong(p, markerNum);
+        p = copyText(p, " = new google.maps.InfoWindow({content: '<b>");
+        memcpy(p, name, station->escapedLength);
+        p += station->escapedLength;
+        p = copyText(p, "</b>: ");
+        p = formatFixed(p, store->temperature[i], 2);
+        p = copyText(p, " degrees (");
+        p = formatLong(p, TIMESTAMP_HOUR(timestamp));
+        *p++ = ':';
+        p = formatLong(p, TIMESTAMP_MINUTE(timestamp));
+        *p++ = ' ';
+        p = formatLong(p, TIMESTAMP_MONTH(timestamp));
+        *p++ = '/';
+        p = formatLong(p, TIMESTAMP_DAY(timestamp));
+        *p++ = '/';
+        p = formatLong(p, TIMESTAMP_YEAR(timestamp));
+        p = copyText(p, ")'});\n");
+        p = formatMarkerTail(p, markerNum, store->latitude[i], store->longitude[i], name, station->escapedLength, store->type[i]);
+        writer->used += p - start;
+} /* writerStation */
+
+/* ========================================================================= */
+/*                           Compact Marker Output                           */
+/*     With -compact, the stations are written as one flat array of numbers  */
+/*     (six per station) and a single loop in the page creates the markers.  */
+/* ========================================================================= */
+
+/* Utility function writing a float as a JavaScript number with at most the given number of decimals, leaving off trailing zeros */
+char *formatTrimmed(char *p, float value, int decimals){
+        if (isnan(value))
+                return copyText(p, "NaN");
+        if (isinf(value))
+                return copyText(p, value < 0 ? "-Infinity" : "Infinity");
+        char *end = formatFixed(p, value, decimals);
+        if (memchr(p, '.', end - p) == NULL)
+                return end;
+        while (end[-1] == '0')
+                end--;
+        if (end[-1] == '.')
+                end--;
+        return end;
+} /* formatTrimmed */
+
+/* Utility function writing a C string as a double-quoted JavaScript string literal, with < escaped so that it cannot close the script */
+void writeJsString(FILE *f, const char *text){
+        fputc('"', f);
+        for (; *text; text++){
+                unsigned char c = *text;
+                if (c == '"' || c == '\\')
+                        fprintf(f, "\\%c", c);
+                else if (c < ' ' || c == '<')
+                        fprintf(f, "\\u%04x", c);
+                else
+                        fputc(c, f);
+        }
+        fputc('"', f);
+} /* writeJsString */
+
+/* writeStationDataStart
+   Starts the array of station data in compact mode. Each station's record is then
+   written with writerStationRecord.
+*/
+void writeStationDataStart(FILE *f){
+        if (!f){
+                printf("writeStationDataStart error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("\t/* latitude, longitude, temperature, marker type, name handle, packed time */\n",f);
+        fputs("\tvar stationData = [\n",f);
+} /* writeStationDataStart */
+
+/* writeStationLoader
+   Ends the array of station data in compact mode, and writes the table of marker
+   icons along with the addStation function that creates the marker (and its
+   InfoWindow) for one station. The markers look and behave exactly as those written
+   by writePoint, once the table of station names (from writerStationNames) follows.
+*/
+void writeStationLoader(FILE *f){
+        int i;
+        if (!f){
+                printf("writeStationLoader error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("\n\t];\n",f);
+        fputs("\tvar markerIcons = [",f);
+        for (i = 0; i < NUM_MARKER_TYPES; i++){
+                if (i > 0)
+                        fputc(',', f);
+                writeJsString(f, MarkerPaths[i]);
+        }
+        fputs("];\n",f);
+        fputs("\tfunction addStation(i) {\n",f);
+        fputs("\t\tvar s = stationData, t = s[i+5], name = stationNames[s[i+4]];\n",f);
+        fputs("\t\tvar iw = new google.maps.InfoWindow({content: '<b>' + name + '</b>: ' + s[i+2].toFixed(2) + ' degrees ('\n",f);
+        fputs("\t\t\t+ ((t >> 6) & 31) + ':' + (t & 63) + ' ' + ((t >> 16) & 15) + '/' + ((t >> 11) & 31) + '/' + (t >>> 20) + ')'});\n",f);
+        fputs("\t\tvar marker = new google.maps.Marker({position: new google.maps.LatLng(s[i],s[i+1]), map: map, title: name, icon: markerIcons[s[i+3]]});\n",f);
+        fputs("\t\tgoogle.maps.event.addListener(marker, 'click', function(){ iw.open(map,marker); } );\n",f);
+        fputs("\t\treturn marker;\n",f);
+        fputs("\t}\n",f);
+} /* writeStationLoader */
+
+/* writeStationLoop
+   Writes the loop that creates a marker for each station in compact mode.
+*/
+void writeStationLoop(FILE *f){
+        if (!f){
+                printf("writeStationLoop error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("\tfor (var i = 0; i < stationData.length; i += 6) addStation(i);\n",f);
+} /* writeStationLoop */
+
+/* writerStationRecord
+   Adds the record for station i of a store to the array of station data in compact
+   mode: its latitude and longitude (to 6 decimals, as writePoint gives them), its
+   temperature (to 2 decimals), its marker type, the handle of its name and its
+   packed time. A station without a reading is skipped.
+*/
+void writerStationRecord(HtmlWriter *writer, StationStore *store, long i){
+        if (!store->valid[i])
+                return;
+        char *start = writerReserve(writer, MARKER_FIXED_BYTES);
+        char *p = start;
+        if (writer->numMarkers++ > 0){
+                *p++ = ',';
+                *p++ = '\n';
+        }
+        p = formatTrimmed(p, store->latitude[i], 6);
+        *p++ = ',';
+        p = formatTrimmed(p, store->longitude[i], 6);
+        *p++ = ',';
+        p = formatTrimmed(p, store->temperature[i], 2);
+        *p++ = ',';
+        p = formatLong(p, store->type[i]);
+        *p++ = ',';
+        p = formatLong(p, stationNameHandle(writer->registry, store->stationID[i]));
+        *p++ = ',';
+        p = formatLong(p, store->timestamp[i]);
+        writer->used += p - start;
+} /* writerStationRecord */
+
+/* benchmarkEmit
+   Writes the markers for every station of the input file to temporary files twice,
+   once through formatMarker and writePoint and once through writerStation, checks
+   that the two outputs are identical and prints their speed in MB/s of HTML, along
+   with the heap allocations the writer made for them.
+*/
+int benchmarkEmit(const char *inputName, int numThreads, BenchReport *report){
+        InputMap inMap;
+        if (mapInputFile(inputName, &inMap) != 0){
+                printf("File %s cannot be opened\n", inputName);
+                return EXIT_FAILURE;
+        }
+        StationStore store;
+        if (loadStationStore(inputName, &inMap, numThreads, 1, &store) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        unmapInputFile(&inMap);
+        StationRegistry registry;
+        if (loadDefaultStations(&registry) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+
+        /* A -stations file may hold any name: check that one ending in a backslash and
+           holding a quote, a control character and </script> is escaped so that it stays
+           inside its string on the page */
+        StationRegistry hostile;
+        const char hostileName[] = "O'Hare</script>\tGate\\";
+        const char hostileEscaped[] = "O\\'Hare\\u003c/script>\\u0009Gate\\\\";
+        if (initStationRegistry(&hostile) != 0 || registerStation(&hostile, 1, hostileName, strlen(hostileName)) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        RegisteredStation *hostileStation = &hostile.stations[hostile.count - 1];
+        int namesEscaped = hostileStation->escapedLength == (int)strlen(hostileEscaped)
+                        && strcmp(hostile.arena + hostileStation->escaped, hostileEscaped) == 0;
+        freeStationRegistry(&hostile);
+        printf("station names: hostile name %s\n", namesEscaped ? "escaped" : "NOT ESCAPED");
+
+        long t, i;
+        float avgTemp = averageTemperature(&store, &t);
+        classifyStations(&store, t, avgTemp);
+
+        FILE *legacyFp = tmpfile();
+        FILE *fastFp = tmpfile();
+        if (legacyFp == NULL || fastFp == NULL){
+                printf("Temporary files cannot be created\n");
+                return EXIT_FAILURE;
+        }
+        MapMarker marker;
+        int numMarkers = 0;
+        double start = monotonicSeconds();
+        for (i = 0; i < t; i++){
+                if (!store.valid[i])
+                        continue;
+                formatMarker(&store, i, &marker);
+                writePoint(legacyFp, &marker, numMarkers++);
+        }
+        fflush(legacyFp);
+        double legacyTime = monotonicSeconds() - start;
+        long legacyBytes = ftell(legacyFp);
+
+        HtmlWriter writer;
+        if (initHtmlWriter(&writer, fileno(fastFp)) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        writer.registry = &registry;
+        start = monotonicSeconds();
+        for (i = 0; i < t; i++){
+                writerStation(&writer, &store, i);
+        }
+        flushHtmlWriter(&writer);
+        double fastTime = monotonicSeconds() - start;
+        long fastBytes = writer.bytesWritten;
+        long fastAllocations = writer.numAllocations;
+        int fastFailed = writer.failed;
+        free(writer.buffer);
+
+        FILE *compactFp = tmpfile();
+        if (compactFp == NULL || initHtmlWriter(&writer, fileno(compactFp)) != 0){
+                printf("Temporary files cannot be created\n");
+                return EXIT_FAILURE;
+        }
+        writer.registry = &registry;
+        start = monotonicSeconds();
+        writerCapture(&writer, writeStationDataStart);
+        for (i = 0; i < t; i++){
+                writerStationRecord(&writer, &store, i);
+        }
+        writerCapture(&writer, writeStationLoader);
+        writerStationNames(&writer);
+        writerCapture(&writer, writeStationLoop);
+        flushHtmlWriter(&writer);
+        double compactTime = monotonicSeconds() - start;
+        long compactBytes = writer.bytesWritten;
+        free(writer.buffer);
+        fclose(compactFp);
+
+        ClusterLevel levels[CLUSTER_MAX_ZOOM + 1];
+        start = monotonicSeconds();
+        if (buildClusterLevels(levels, &store, t) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        double clusterTime = monotonicSeconds() - start;
+        long clustersAtDefaultZoom = levels[CLUSTER_DEFAULT_ZOOM].count;
+        freeClusterLevels(levels);
+
+        TimeSeries series;
+        start = monotonicSeconds();
+        if (bucketObservations(&series, &store, t, BENCH_INTERVAL) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        classifyTimeBuckets(&series, &store);
+        double bucketTime = monotonicSeconds() - start;
+        long numBuckets = series.numBuckets;
+        freeTimeSeries(&series);
+
+        /* Compare the two outputs */
+        int identical = (legacyBytes == fastBytes) && !fastFailed;
+        char legacyBlock[65536], fastBlock[65536];
+        rewind(legacyFp);
+        lseek(fileno(fastFp), 0, SEEK_SET);
+        while (identical){
+                size_t n = fread(legacyBlock, 1, sizeof(legacyBlock), legacyFp);
+                ssize_t m = read(fileno(fastFp), fastBlock, sizeof(fastBlock));
+                if (n == 0 && m == 0)
+                        break;
+                identical = (m >= 0 && (size_t)m == n && memcmp(legacyBlock, fastBlock, n) == 0);
+        }
+        fclose(legacyFp);
+        fclose(fastFp);
+        freeStationStore(&store);
+        freeStationRegistry(&registry);
+
+        printf("emit: %ld markers, %ld bytes, writePoint %.1f MB/s, HtmlWriter %.1f MB/s (%ld heap allocations), speedup %.1fx, output %s\n",
+                                t, fastBytes, legacyBytes/legacyTime/1e6, fastBytes/fastTime/1e6, fastAllocations, legacyTime/fastTime,
+                                identical ? "identical" : "DIFFERENT");
+        printf("emit compact: %ld bytes (%.1f%% of writePoint), %.4f s, %.1fx faster than writePoint\n",
+                                compactBytes, 100.0*compactBytes/legacyBytes, compactTime, legacyTime/compactTime);
+        printf("cluster: %d zoom levels built in %.4f s, %ld clusters at zoom %d\n",
+                                CLUSTER_MAX_ZOOM + 1, clusterTime, clustersAtDefaultZoom, CLUSTER_DEFAULT_ZOOM);
+        printf("time buckets: %ld observations into %ld buckets of %d minutes in %.4f s, %.0f observations/s\n",
+                                t, numBuckets, BENCH_INTERVAL, bucketTime, t/bucketTime);
+        benchRecord(report, "emit.writePoint", 1, legacyTime, t, "markers", legacyBytes);
+        benchRecord(report, "emit.writer", 1, fastTime, t, "markers", fastBytes);
+        benchRecordAllocations(report, fastAllocations);
+        benchRecord(report, "emit.compact", 1, compactTime, t, "markers", compactBytes);
+        benchRecord(report, "cluster", 1, clusterTime, t, "rows", 0);
+        benchRecord(report, "timeBuckets", 1, bucketTime, t, "rows", 0);
+        return identical && namesEscaped ? EXIT_SUCCESS : EXIT_FAILURE;
+} /* benchmarkEmit */
+
+
+/* ========================================================================= */
+/*                              Marker Clusters                              */
+/*     With -cluster, the stations are also grouped into clusters for each   */
+/*     zoom level up to CLUSTER_MAX_ZOOM: one per grid cell of the map's     */
+/*     Web Mercator projection, carrying a count and a mean temperature.     */
+/*     Cells are numbered in Morton (Z) order, so the four cells of one      */
+/*     zoom level that make up a cell of the next level down are adjacent    */
+/*     once sorted, and each level is built from the one above it in a      */
+/*     single pass. Only the finest level needs a sort: O(N log N) overall.  */
+/* ========================================================================= */
+
+/* Utility function spreading the low 32 bits of a value out to the even bits of a 64 bit value */
+unsigned long long spreadBits(unsigned long long v){
+        v &= 0xffffffffULL;
+        v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ffULL;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        v = (v | (v << 2)) & 0x3333333333333333ULL;
+        v = (v | (v << 1)) & 0x5555555555555555ULL;
+        return v;
+} /* spreadBits */
+
+/* Utility function giving the Web Mercator x coordinate of a longitude, from 0 (180 W) up to 1 (180 E) */
+double mercatorX(float longitude){
+        double x = (longitude + 180.0)/360.0;
+        if (!isfinite(x))
+                return 0;
+        x -= floor(x);
+        return x;
+} /* mercatorX */
+
+/* Utility function giving the Web Mercator y coordinate of a latitude, from 0 (north edge of the map) to 1 (south edge) */
+double mercatorY(float latitude){
+        double lat = latitude;
+        if (!isfinite(lat))
+                return 0.5;
+        if (lat > CLUSTER_MAX_LATITUDE)
+                lat = CLUSTER_MAX_LATITUDE;
+        if (lat < -CLUSTER_MAX_LATITUDE)
+                lat = -CLUSTER_MAX_LATITUDE;
+        double s = sin(lat*M_PI/180);
+        return 0.5 - log((1 + s)/(1 - s))/(4*M_PI);
+} /* mercatorY */
+
+/* Utility function giving the Morton number of the cell of the finest cluster level that holds a point */
+unsigned long long clusterCellKey(float latitude, float longitude){
+        unsigned long long side = 1ULL << CLUSTER_FINEST_BITS;
+        unsigned long long cx = (unsigned long long)(mercatorX(longitude)*side);
+        unsigned long long cy = (unsigned long long)(mercatorY(latitude)*side);
+        if (cx >= side)
+                cx = side - 1;
+        if (cy >= side)
+                cy = side - 1;
+        return spreadBits(cx) | (spreadBits(cy) << 1);
+} /* clusterCellKey */
+
+/* Utility function to compare clusters by cell, for qsort */
+int compareClusterKeys(const void *a, const void *b){
+        unsigned long long ka = ((const Cluster *)a)->key, kb = ((const Cluster *)b)->key;
+        return (ka > kb) - (ka < kb);
+} /* compareClusterKeys */
+
+/* Utility function merging the clusters in a sorted array that lie in the same cell once shift bits are dropped from their keys, returning the number left */
+long mergeClusters(Cluster *dest, Cluster *src, long count, int shift){
+        long i, n = 0;
+        for (i = 0; i < count; i++){
+                unsigned long long key = src[i].key >> shift;
+                if (n > 0 && dest[n - 1].key == key){
+                        dest[n - 1].count += src[i].count;
+                        dest[n - 1].sumX += src[i].sumX;
+                        dest[n - 1].sumLatitude += src[i].sumLatitude;
+                        dest[n - 1].sumTemperature += src[i].sumTemperature;
+                }else{
+                        dest[n] = src[i];
+                        dest[n].key = key;
+                        n++;
+                }
+        }
+        return n;
+} /* mergeClusters */
+
+/* buildClusterLevels
+   Groups the stations with a reading among the first count stations of a store into
+   clusters for each zoom level from 0 up to CLUSTER_MAX_ZOOM. Returns 0 on success,
+   or -1 if out of memory.
+*/
+int buildClusterLevels(ClusterLevel levels[], StationStore *store, long count){
+        int z;
+        long i;
+        for (z = 0; z <= CLUSTER_MAX_ZOOM; z++){
+                levels[z].clusters = NULL;
+                levels[z].count = 0;
+        }
+        Cluster *stations = malloc((count > 0 ? count : 1)*sizeof(Cluster));
+        if (stations == NULL)
+                return -1;
+        long numStations = 0;
+        for (i = 0; i < count; i++){
+                if (!store->valid[i])
+                        continue;
+                Cluster *station = &stations[numStations++];
+                station->key = clusterCellKey(store->latitude[i], store->longitude[i]);
+                station->count = 1;
+                station->sumX = mercatorX(store->longitude[i]);
+                station->sumLatitude = store->latitude[i];
+                station->sumTemperature = store->temperature[i];
+        }
+        qsort(stations, numStations, sizeof(Cluster), compareClusterKeys);
+
+        /* Each level has at most as many clusters as the one above it; the merges work
+           in place, and each level is then copied down to its own array */
+        long n = mergeClusters(stations, stations, numStations, 0);
+        for (z = CLUSTER_MAX_ZOOM; z >= 0; z--){
+                if (z < CLUSTER_MAX_ZOOM)
+                        n = mergeClusters(stations, stations, n, 2);
+                levels[z].clusters = malloc((n > 0 ? n : 1)*sizeof(Cluster));
+                if (levels[z].clusters == NULL){
+                        free(stations);
+                        freeClusterLevels(levels);
+                        return -1;
+                }
+                memcpy(levels[z].clusters, stations, n*sizeof(Cluster));
+                levels[z].count = n;
+        }
+        free(stations);
+        return 0;
+} /* buildClusterLevels */
+
+/* freeClusterLevels
+   Releases the memory held by the levels built by buildClusterLevels.
+*/
+void freeClusterLevels(ClusterLevel levels[]){
+        int z;
+        for (z = 0; z <= CLUSTER_MAX_ZOOM; z++){
+                free(levels[z].clusters);
+                levels[z].clusters = NULL;
+                levels[z].count = 0;
+        }
+} /* freeClusterLevels */
+
+/* writerClusterLevels
+   Adds the array of cluster levels to the output in cluster mode. Each level is a
+   flat array holding, for each cluster, the mean latitude and longitude of its
+   stations, their number, their mean temperature and the marker colour of that
+   temperature in a table of bands (or against avgTemp, if the table is unresolved).
+*/
+void writerClusterLevels(HtmlWriter *writer, ClusterLevel levels[], float avgTemp, BandTable *bands){
+        int z;
+        long i;
+        writerAppend(writer, "\tvar clusterLevels = [\n", strlen("\tvar clusterLevels = [\n"));
+        for (z = 0; z <= CLUSTER_MAX_ZOOM; z++){
+                writerAppend(writer, z > 0 ? ",\n\t[" : "\t[", z > 0 ? 4 : 2);
+                for (i = 0; i < levels[z].count; i++){
+                        Cluster *c = &levels[z].clusters[i];
+                        float temperature = c->sumTemperature/c->count;
+                        char *start = writerReserve(writer, MARKER_FIXED_BYTES);
+                        char *p = start;
+                        if (i > 0)
+                                *p++ = ',';
+                        p = formatTrimmed(p, c->sumLatitude/c->count, 6);
+                        *p++ = ',';
+                        p = formatTrimmed(p, c->sumX/c->count*360 - 180, 6);
+                        *p++ = ',';
+                        p = formatLong(p, c->count);
+                        *p++ = ',';
+                        p = formatTrimmed(p, temperature, 2);
+                        *p++ = ',';
+                        p = formatLong(p, bandTypeFor(bands, temperature, avgTemp));
+                        writer->used += p - start;
+                }
+                writerAppend(writer, "]", 1);
+        }
+        writerAppend(writer, "\n\t];\n", 5);
+} /* writerClusterLevels */
+
+/* writeClusterLoader
+   Writes the code that shows the clusters of the map's zoom level (or, beyond
+   CLUSTER_MAX_ZOOM, the stations themselves), swapping them whenever the zoom
+   changes. The markers of each level are only created the first time it is shown.
+*/
+void writeClusterLoader(FILE *f){
+        if (!f){
+                printf("writeClusterLoader error: output file == NULL\n");
+                exit(1);
+        }
+        fprintf(f,"\tvar clusterMaxZoom = %d, levelMarkers = [], shownLevel = -1;\n",CLUSTER_MAX_ZOOM);
+        fputs("\tfunction addCluster(c, i) {\n",f);
+        fputs("\t\tvar title = c[i+2] + (c[i+2] == 1 ? ' station' : ' stations');\n",f);
+        fputs("\t\tvar iw = new google.maps.InfoWindow({content: '<b>' + title + '</b>: ' + c[i+3].toFixed(2) + ' degrees'});\n",f);
+        fputs("\t\tvar marker = new google.maps.Marker({position: new google.maps.LatLng(c[i],c[i+1]), map: map, title: title,\n",f);
+        fputs("\t\t\tlabel: c[i+2] > 1 ? String(c[i+2]) : undefined, icon: markerIcons[c[i+4]]});\n",f);
+        fputs("\t\tgoogle.maps.event.addListener(marker, 'click', function(){ iw.open(map,marker); } );\n",f);
+        fputs("\t\treturn marker;\n",f);
+        fputs("\t}\n",f);
+        fputs("\tfunction showLevel() {\n",f);
+        fputs("\t\tvar level = Math.min(map.getZoom(), clusterMaxZoom + 1), i, markers;\n",f);
+        fputs("\t\tif (level == shownLevel) return;\n",f);
+        fputs("\t\tif (shownLevel >= 0) for (i = 0; i < levelMarkers[shownLevel].length; i++) levelMarkers[shownLevel][i].setMap(null);\n",f);
+        fputs("\t\tshownLevel = level;\n",f);
+        fputs("\t\tif (markers = levelMarkers[level]) { for (i = 0; i < markers.length; i++) markers[i].setMap(map); return; }\n",f);
+        fputs("\t\tmarkers = levelMarkers[level] = [];\n",f);
+        fputs("\t\tif (level > clusterMaxZoom) for (i = 0; i < stationData.length; i += 6) markers.push(addStation(i));\n",f);
+        fputs("\t\telse for (i = 0; i < clusterLevels[level].length; i += 5) markers.push(addCluster(clusterLevels[level], i));\n",f);
+        fputs("\t}\n",f);
+        fputs("\tgoogle.maps.event.addListener(map, 'zoom_changed', showLevel);\n",f);
+        fputs("\tshowLevel();\n",f);
+} /* writeClusterLoader */
+
+
+/* ========================================================================= */
+/*                               Time Series                                 */
+/*     With -interval MINUTES, the observations are grouped into buckets of  */
+/*     that many minutes by their timestamps, each bucket is averaged and    */
+/*     coloured on its own, and the page gets a slider to step through them. */
+/*     Buckets are found with a hash table and put in time order with a      */
+/*     radix sort of their keys, so the work is linear in the observations.  */
+/* ========================================================================= */
+
+/* timestampMinutes
+   Returns the number of minutes from 1 March of year 0 to a packed timestamp.
+*/
+unsigned long timestampMinutes(unsigned int timestamp){
+        /* Count years from March, so that the leap day comes last */
+        long year = TIMESTAMP_YEAR(timestamp);
+        long month = TIMESTAMP_MONTH(timestamp);
+        if (month <= 2)
+                year--;
+        long era = (year >= 0 ? year : year - 399)/400;
+        long yearOfEra = year - era*400;
+        long dayOfYear = (153*(month > 2 ? month - 3 : month + 9) + 2)/5 + TIMESTAMP_DAY(timestamp) - 1;
+        long dayOfEra = yearOfEra*365 + yearOfEra/4 - yearOfEra/100 + dayOfYear;
+        long days = era*146097 + dayOfEra + 365; /* Day 0 is 1 March of year -1 */
+        return (unsigned long)days*1440 + TIMESTAMP_HOUR(timestamp)*60 + TIMESTAMP_MINUTE(timestamp);
+} /* timestampMinutes */
+
+/* minutesTimestamp
+   Returns the packed timestamp of a number of minutes from 1 March of year 0 (the
+   inverse of timestampMinutes).
+*/
+unsigned int minutesTimestamp(unsigned long minutes){
+        long days = minutes/1440 - 365;
+        long era = (days >= 0 ? days : days - 146096)/146097;
+        long dayOfEra = days - era*146097;
+        long yearOfEra = (dayOfEra - dayOfEra/1460 + dayOfEra/36524 - dayOfEra/146096)/365;
+        long dayOfYear = dayOfEra - (365*yearOfEra + yearOfEra/4 - yearOfEra/100);
+        long monthFromMarch = (5*dayOfYear + 2)/153;
+        long day = dayOfYear - (153*monthFromMarch + 2)/5 + 1;
+        long month = monthFromMarch < 10 ? monthFromMarch + 3 : monthFromMarch - 9;
+        long year = yearOfEra + era*400 + (month <= 2);
+        return PACK_TIMESTAMP((unsigned)year, (unsigned)month, (unsigned)day, (unsigned)(minutes/60%24), (unsigned)(minutes%60));
+} /* minutesTimestamp */
+
+/* Utility function hashing a bucket key to a slot of a table of 2^bits slots */
+unsigned long hashBucketKey(unsigned long key, int bits){
+        return (unsigned long)(((unsigned long long)key*0x9E3779B97F4A7C15ULL) >> (64 - bits));
+} /* hashBucketKey */
+
+/* Utility function doubling the slots of a bucket hash table (which holds bucket numbers plus one, 0 for empty) */
+long *growBucketTable(long *slots, int *bits, TimeBucket *buckets, long numBuckets){
+        long *grown = calloc(1UL << (*bits + 1), sizeof(long));
+        if (grown == NULL)
+                return NULL;
+        (*bits)++;
+        long b;
+        unsigned long mask = (1UL << *bits) - 1;
+        for (b = 0; b < numBuckets; b++){
+                unsigned long slot = hashBucketKey(buckets[b].key, *bits);
+                while (grown[slot])
+                        slot = (slot + 1) & mask;
+                grown[slot] = b + 1;
+        }
+        free(slots);
+        return grown;
+} /* growBucketTable */
+
+/* bucketObservations
+   Groups the observations with a reading among the first count of a store into
+   buckets of interval minutes by their timestamps. On return, series->buckets holds the buckets in time order,
+   and series->order the observations bucket by bucket (each bucket in file order).
+   Returns 0 on success, or -1 if out of memory.
+*/
+int bucketObservations(TimeSeries *series, StationStore *store, long count, long interval){
+        int bits = 10;
+        long capacity = 1024, numBuckets = 0, i, b;
+        long *slots = calloc(1UL << bits, sizeof(long));
+        TimeBucket *buckets = malloc(capacity*sizeof(TimeBucket));
+        long *bucketOf = malloc((count > 0 ? count : 1)*sizeof(long));
+        series->buckets = NULL;
+        series->order = NULL;
+        series->numBuckets = 0;
+        series->count = 0;
+        series->interval = interval;
+        if (slots == NULL || buckets == NULL || bucketOf == NULL)
+                goto outOfMemory;
+
+        /* Give each bucket a number in order of first appearance; feeds are mostly in
+           time order, so the last bucket found is tried first */
+        long last = -1;
+        for (i = 0; i < count; i++){
+                if (!store->valid[i]){
+                        bucketOf[i] = -1;
+                        continue;
+                }
+                unsigned long key = timestampMinutes(store->timestamp[i])/interval;
+                if (last < 0 || buckets[last].key != key){
+                        unsigned long mask = (1UL << bits) - 1;
+                        unsigned long slot = hashBucketKey(key, bits);
+                        while (slots[slot] && buckets[slots[slot] - 1].key != key)
+                                slot = (slot + 1) & mask;
+                        if (slots[slot]){
+                                last = slots[slot] - 1;
+                        }else{
+                                if (numBuckets == capacity){
+                                        TimeBucket *grown = realloc(buckets, 2*capacity*sizeof(TimeBucket));
+                                        if (grown == NULL)
+                                                goto outOfMemory;
+                                        buckets = grown;
+                                        capacity *= 2;
+                                }
+                                buckets[numBuckets].key = key;
+                                buckets[numBuckets].count = 0;
+                                buckets[numBuckets].totalTemp = 0;
+                                slots[slot] = numBuckets + 1;
+                                last = numBuckets++;
+                                if (2*numBuckets > (1L << bits)){
+                                        long *grown = growBucketTable(slots, &bits, buckets, numBuckets);
+                                        if (grown == NULL)
+                                                goto outOfMemory;
+                                        slots = grown;
+                                }
+                        }
+                }
+                bucketOf[i] = last;
+                buckets[last].count++;
+                buckets[last].totalTemp += store->temperature[i];
+        }
+        free(slots);
+        slots = NULL;
+
+        /* Put the buckets in time order with a least significant digit radix sort of
+           their keys, 16 bits at a time */
+        long *rank = malloc((numBuckets > 0 ? numBuckets : 1)*sizeof(long));
+        long *scratch = malloc((numBuckets > 0 ? numBuckets : 1)*sizeof(long));
+        long *digitCount = malloc(65537*sizeof(long));
+        if (rank == NULL || scratch == NULL || digitCount == NULL){
+                free(rank);
+                free(scratch);
+                free(digitCount);
+                goto outOfMemory;
+        }
+        unsigned long maxKey = 0;
+        for (b = 0; b < numBuckets; b++){
+                rank[b] = b;
+                if (buckets[b].key > maxKey)
+                        maxKey = buckets[b].key;
+        }
+        int shift;
+        for (shift = 0; shift == 0 || (shift < 64 && (maxKey >> shift) != 0); shift += 16){
+                memset(digitCount, 0, 65537*sizeof(long));
+                for (b = 0; b < numBuckets; b++)
+                        digitCount[((buckets[rank[b]].key >> shift) & 0xffff) + 1]++;
+                for (b = 0; b < 65536; b++)
+                        digitCount[b + 1] += digitCount[b];
+                for (b = 0; b < numBuckets; b++)
+                        scratch[digitCount[(buckets[rank[b]].key >> shift) & 0xffff]++] = rank[b];
+                long *swap = rank;
+                rank = scratch;
+                scratch = swap;
+        }
+        free(digitCount);
+
+        /* Lay the buckets out in that order, and place each observation after the
+           observations of the buckets before its own */
+        series->buckets = malloc((numBuckets > 0 ? numBuckets : 1)*sizeof(TimeBucket));
+        series->order = malloc((count > 0 ? count : 1)*sizeof(long));
+        if (series->buckets == NULL || series->order == NULL){
+                free(rank);
+                free(scratch);
+                goto outOfMemory;
+        }
+        long first = 0;
+        for (b = 0; b < numBuckets; b++){
+                TimeBucket *bucket = &series->buckets[b];
+                *bucket = buckets[rank[b]];
+                bucket->first = first;
+                bucket->avgTemp = bucket->totalTemp/bucket->count;
+                first += bucket->count;
+                scratch[rank[b]] = b;
+        }
+        for (b = 0; b < numBuckets; b++)
+                buckets[b].first = series->buckets[scratch[b]].first;
+        for (i = 0; i < count; i++)
+                if (bucketOf[i] >= 0)
+                        series->order[buckets[bucketOf[i]].first++] = i;
+        series->numBuckets = numBuckets;
+        series->count = first;
+        free(rank);
+        free(scratch);
+        free(buckets);
+        free(bucketOf);
+        return 0;
+
+outOfMemory:
+        free(slots);
+        free(buckets);
+        free(bucketOf);
+        freeTimeSeries(series);
+        return -1;
+} /* bucketObservations */
+
+/* freeTimeSeries
+   Releases the memory held by a TimeSeries.
+*/
+void freeTimeSeries(TimeSeries *series){
+        free(series->buckets);
+        free(series->order);
+        series->buckets = NULL;
+        series->order = NULL;
+        series->numBuckets = 0;
+} /* freeTimeSeries */
+
+/* classifyTimeBuckets
+   Fills in the marker colour of every observation in a TimeSeries from the
+   difference between its temperature and the average of its own bucket.
+*/
+void classifyTimeBuckets(TimeSeries *series, StationStore *store){
+        long b, j;
+        for (b = 0; b < series->numBuckets; b++){
+                TimeBucket *bucket = &series->buckets[b];
+                for (j = bucket->first; j < bucket->first + bucket->count; j++){
+                        long i = series->order[j];
+                        store->type[i] = markerTypeFor(store->temperature[i], bucket->avgTemp);
+                }
+        }
+} /* classifyTimeBuckets */
+
+/* writerTimeBuckets
+   Adds the array of time buckets to the output in time series mode. Each bucket
+   holds the time it starts at, the position of its first observation in the array
+   of station data, its number of observations and their average temperature.
+*/
+void writerTimeBuckets(HtmlWriter *writer, TimeSeries *series){
+        long b;
+        writerAppend(writer, "\tvar timeBuckets = [\n", strlen("\tvar timeBuckets = [\n"));
+        for (b = 0; b < series->numBuckets; b++){
+                TimeBucket *bucket = &series->buckets[b];
+                unsigned int start = minutesTimestamp(bucket->key*series->interval);
+                char *begin = writerReserve(writer, MARKER_FIXED_BYTES);
+                char *p = begin;
+                p = copyText(p, b > 0 ? ",\n\t[\"" : "\t[\"");
+                p = formatLong(p, TIMESTAMP_HOUR(start));
+                *p++ = ':';
+                p = formatLong(p, TIMESTAMP_MINUTE(start));
+                *p++ = ' ';
+                p = formatLong(p, TIMESTAMP_MONTH(start));
+                *p++ = '/';
+                p = formatLong(p, TIMESTAMP_DAY(start));
+                *p++ = '/';
+                p = formatLong(p, TIMESTAMP_YEAR(start));
+                p = copyText(p, "\",");
+                p = formatLong(p, bucket->first);
+                *p++ = ',';
+                p = formatLong(p, bucket->count);
+                *p++ = ',';
+                p = formatTrimmed(p, bucket->avgTemp, 2);
+                *p++ = ']';
+                writer->used += p - begin;
+        }
+        writerAppend(writer, "\n\t];\n", 5);
+} /* writerTimeBuckets */
+
+/* writeTimeSliderLoader
+   Writes the code that adds a slider to the map for choosing a time bucket, and
+   shows the observations of the chosen bucket. The markers of each bucket are only
+   created the first time it is shown.
+*/
+void writeTimeSliderLoader(FILE *f){
+        if (!f){
+                printf("writeTimeSliderLoader error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("\tvar bucketMarkers = [], shownBucket = -1;\n",f);
+        fputs("\tvar timeControl = document.createElement('div'), timeSlider = document.createElement('input'), timeLabel = document.createElement('span');\n",f);
+        fputs("\tfunction showBucket(b) {\n",f);
+        fputs("\t\tvar bucket = timeBuckets[b], i, markers;\n",f);
+        fputs("\t\tif (b == shownBucket) return;\n",f);
+        fputs("\t\tif (shownBucket >= 0) for (i = 0; i < bucketMarkers[shownBucket].length; i++) bucketMarkers[shownBucket][i].setMap(null);\n",f);
+        fputs("\t\tshownBucket = b;\n",f);
+        fputs("\t\ttimeLabel.innerHTML = ' ' + bucket[0] + ': ' + bucket[2] + ' observations, average ' + bucket[3].toFixed(2) + ' degrees';\n",f);
+        fputs("\t\tif (markers = bucketMarkers[b]) { for (i = 0; i < markers.length; i++) markers[i].setMap(map); return; }\n",f);
+        fputs("\t\tmarkers = bucketMarkers[b] = [];\n",f);
+        fputs("\t\tfor (i = bucket[1]; i < bucket[1] + bucket[2]; i++) markers.push(addStation(6*i));\n",f);
+        fputs("\t}\n",f);
+        fputs("\ttimeControl.style.cssText = 'background: white; margin: 6px; padding: 4px; font: 13px sans-serif';\n",f);
+        fputs("\ttimeSlider.type = 'range';\n",f);
+        fputs("\ttimeSlider.min = 0;\n",f);
+        fputs("\ttimeSlider.max = Math.max(timeBuckets.length - 1, 0);\n",f);
+        fputs("\ttimeSlider.value = 0;\n",f);
+        fputs("\ttimeControl.appendChild(timeSlider);\n",f);
+        fputs("\ttimeControl.appendChild(timeLabel);\n",f);
+        fputs("\tmap.controls[google.maps.ControlPosition.TOP_CENTER].push(timeControl);\n",f);
+        fputs("\tgoogle.maps.event.addDomListener(timeSlider, 'input', function(){ showBucket(+timeSlider.value); });\n",f);
+        fputs("\tif (timeBuckets.length > 0) showBucket(0);\n",f);
+} /* writeTimeSliderLoader */
+
+
+/* ========================================================================= */
+/*                               Station Cache                               */
+/*     With -cache, the parsed columns of an input file are saved beside it  */
+/*     in a binary sidecar (the input's name followed by .cache), which      */
+/*     later runs map into memory and copy from instead of parsing the       */
+/*     text again. The sidecar records the size, modification time and      */
+/*     inode of the file it was made from, along with a hash of the start    */
+/*     and end of that file, and is only used while they all still match.    */
+/*     A hash of the sidecar's own contents guards against a damaged file.   */
+/* ========================================================================= */
+
+/* hashBytes
+   Returns a 64 bit hash of a block of bytes. Four independent lanes of 8 byte words
+   keep the multiplies from waiting on each other.
+*/
+unsigned long long hashBytes(const void *data, size_t length, unsigned long long seed){
+        const unsigned char *p = data;
+        unsigned long long lane[4] = {seed ^ 0x9E3779B97F4A7C15ULL, seed ^ 0xC2B2AE3D27D4EB4FULL,
+                                      seed ^ 0x165667B19E3779F9ULL, seed ^ 0x27D4EB2F165667C5ULL};
+        unsigned long long word;
+        int k;
+        while (length >= 32){
+                for (k = 0; k < 4; k++){
+                        memcpy(&word, p + 8*k, 8);
+                        lane[k] = (lane[k] ^ word)*0x100000001B3ULL;
+                        lane[k] ^= lane[k] >> 29;
+                }
+                p += 32;
+                length -= 32;
+        }
+        unsigned long long h = lane[0] ^ (lane[1] << 1) ^ (lane[2] << 2) ^ (lane[3] << 3) ^ length;
+        while (length > 0){
+                h = (h ^ *p++)*0x100000001B3ULL;
+                length--;
+        }
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return h;
+} /* hashBytes */
+
+/* Utility function hashing the first and last STATION_CACHE_SAMPLE bytes of an open file */
+unsigned long long hashFileSample(int fd, off_t size){
+        char *sample = malloc(2*STATION_CACHE_SAMPLE);
+        if (sample == NULL)
+                return 0;
+        size_t head = size < STATION_CACHE_SAMPLE ? (size_t)size : STATION_CACHE_SAMPLE;
+        size_t tail = size - (off_t)head < STATION_CACHE_SAMPLE ? (size_t)(size - head) : STATION_CACHE_SAMPLE;
+        ssize_t got = pread(fd, sample, head, 0);
+        ssize_t gotTail = pread(fd, sample + head, tail, size - tail);
+        unsigned long long h = 0;
+        if (got == (ssize_t)head && gotTail == (ssize_t)tail)
+                h = hashBytes(sample, head + tail, size);
+        free(sample);
+        return h;
+} /* hashFileSample */
+
+/* Utility function describing the source file of a sidecar in its header, returning 0 on success or -1 if it cannot be read */
+int describeCacheSource(const char *sourceName, StationCacheHeader *header){
+        int fd = open(sourceName, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        struct stat info;
+        if (fstat(fd, &info) != 0){
+                close(fd);
+                return -1;
+        }
+        header->sourceSize = info.st_size;
+        header->sourceMtime = info.st_mtim.tv_sec;
+        header->sourceMtimeNsec = info.st_mtim.tv_nsec;
+        header->sourceInode = info.st_ino;
+        header->sourceSampleHash = hashFileSample(fd, info.st_size);
+        close(fd);
+        return 0;
+} /* describeCacheSource */
+
+/* Utility function giving the offset of each column in a sidecar holding count stations, each column starting on a STATION_CACHE_ALIGN byte boundary */
+size_t cacheColumnOffset(long long count, int column){
+        size_t columnBytes = ((size_t)count*4 + STATION_CACHE_ALIGN - 1)/STATION_CACHE_ALIGN*STATION_CACHE_ALIGN;
+        size_t headerBytes = (sizeof(StationCacheHeader) + STATION_CACHE_ALIGN - 1)/STATION_CACHE_ALIGN*STATION_CACHE_ALIGN;
+        return headerBytes + column*columnBytes;
+} /* cacheColumnOffset */
+
+/* stationCacheName
+   Writes the name of the sidecar of an input file to dest.
+*/
+void stationCacheName(char *dest, size_t size, const char *sourceName){
+        snprintf(dest, size, "%s.cache", sourceName);
+} /* stationCacheName */
+
+/* saveStationCache
+   Saves the columns of a store loaded from sourceName to the sidecar cacheName. The
+   sidecar is written under a temporary name and renamed into place, so a reader
+   never sees it half written. Returns 0 on success, or -1 if it cannot be written.
+*/
+int saveStationCache(const char *cacheName, const char *sourceName, StationStore *store){
+        StationCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, STATION_CACHE_MAGIC, sizeof(header.magic));
+        header.version = STATION_CACHE_VERSION;
+        header.byteOrder = STATION_CACHE_BYTE_ORDER;
+        if (describeCacheSource(sourceName, &header) != 0)
+                return -1;
+        header.count = store->count;
+        header.rejected = store->rejected;
+
+        void *columns[STATION_CACHE_COLUMNS] = {store->stationID, store->temperature, store->latitude, store->longitude, store->timestamp, store->region};
+        size_t columnBytes = (size_t)store->count*4;
+        int c;
+        unsigned long long payloadHash = 0;
+        for (c = 0; c < STATION_CACHE_COLUMNS; c++)
+                payloadHash = hashBytes(columns[c], columnBytes, payloadHash);
+        header.payloadHash = payloadHash;
+        header.headerHash = hashBytes(&header, offsetof(StationCacheHeader, headerHash), 0);
+
+        char tempName[PATH_MAX];
+        snprintf(tempName, sizeof(tempName), "%s.%ld.tmp", cacheName, (long)getpid());
+        FILE *cacheFp = fopen(tempName, "wb");
+        if (cacheFp == NULL)
+                return -1;
+        static const char padding[STATION_CACHE_ALIGN];
+        int failed = fwrite(&header, sizeof(header), 1, cacheFp) != 1;
+        long written = sizeof(header);
+        for (c = 0; c < STATION_CACHE_COLUMNS && !failed; c++){
+                long offset = cacheColumnOffset(header.count, c);
+                failed = fwrite(padding, 1, offset - written, cacheFp) != (size_t)(offset - written) ||
+                         fwrite(columns[c], 1, columnBytes, cacheFp) != columnBytes;
+                written = offset + columnBytes;
+        }
+        failed = (fclose(cacheFp) != 0) || failed;
+        if (failed || rename(tempName, cacheName) != 0){
+                unlink(tempName);
+                return -1;
+        }
+        return 0;
+} /* saveStationCache */
+
+/* loadStationCache
+   Loads a store from the sidecar cacheName, if it was made from sourceName as it is
+   now. Returns 0 on success, or -1 if the sidecar is missing, out of date or damaged
+   (or if out of memory), in which case the store is left empty.
+*/
+int loadStationCache(const char *cacheName, const char *sourceName, StationStore *store){
+        memset(store, 0, sizeof(StationStore));
+        InputMap cacheMap;
+        if (mapInputFile(cacheName, &cacheMap) != 0)
+                return -1;
+        StationCacheHeader header, source;
+        int valid = cacheMap.size >= sizeof(header);
+        if (valid){
+                memcpy(&header, cacheMap.data, sizeof(header));
+                valid = memcmp(header.magic, STATION_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                        header.version == STATION_CACHE_VERSION &&
+                        header.byteOrder == STATION_CACHE_BYTE_ORDER &&
+                        header.headerHash == hashBytes(&header, offsetof(StationCacheHeader, headerHash), 0) &&
+                        header.count >= 0 &&
+                        cacheMap.size >= cacheColumnOffset(header.count, STATION_CACHE_COLUMNS - 1) + (size_t)header.count*4;
+        }
+        if (valid){
+                memset(&source, 0, sizeof(source));
+                valid = describeCacheSource(sourceName, &source) == 0 &&
+                        source.sourceSize == header.sourceSize &&
+                        source.sourceMtime == header.sourceMtime &&
+                        source.sourceMtimeNsec == header.sourceMtimeNsec &&
+                        source.sourceInode == header.sourceInode &&
+                        source.sourceSampleHash == header.sourceSampleHash;
+        }
+        if (valid){
+                posix_madvise((void *)cacheMap.data, cacheMap.size, POSIX_MADV_WILLNEED);
+                unsigned long long payloadHash = 0;
+                int c;
+                for (c = 0; c < STATION_CACHE_COLUMNS; c++)
+                        payloadHash = hashBytes(cacheMap.data + cacheColumnOffset(header.count, c), (size_t)header.count*4, payloadHash);
+                valid = payloadHash == header.payloadHash && reserveStationStore(store, header.count) == 0;
+        }
+        if (valid){
+                size_t columnBytes = (size_t)header.count*4;
+                memcpy(store->stationID, cacheMap.data + cacheColumnOffset(header.count, 0), columnBytes);
+                memcpy(store->temperature, cacheMap.data + cacheColumnOffset(header.count, 1), columnBytes);
+                memcpy(store->latitude, cacheMap.data + cacheColumnOffset(header.count, 2), columnBytes);
+                memcpy(store->longitude, cacheMap.data + cacheColumnOffset(header.count, 3), columnBytes);
+                memcpy(store->timestamp, cacheMap.data + cacheColumnOffset(header.count, 4), columnBytes);
+                memcpy(store->region, cacheMap.data + cacheColumnOffset(header.count, 5), columnBytes);
+                long i;
+                for (i = 0; i < header.count; i++)
+                        store->valid[i] = isfinite(store->temperature[i]) != 0;
+                store->count = header.count;
+                store->rejected = header.rejected;
+        }else{
+                freeStationStore(store);
+        }
+        unmapInputFile(&cacheMap);
+        return valid ? 0 : -1;
+} /* loadStationCache */
+
+/* readStations
+   Loads every station of an input file into a store: from its sidecar if useCache
+   is set and the sidecar is up to date, and otherwise by parsing the file (and then,
+   if useCache is set, saving a new sidecar). Returns 0 on success, or -1 after
+   printing an error message.
+*/
+int readStations(const char *inputName, int numThreads, int useCache, StationStore *store){
+        char cacheName[PATH_MAX];
+        stationCacheName(cacheName, sizeof(cacheName), inputName);
+        if (useCache && loadStationCache(cacheName, inputName, store) == 0){
+                if (store->rejected > 0)
+                        printf("%s: %ld malformed station lines skipped\n", inputName, store->rejected);
+                return 0;
+        }
+
+        /* Map the input file into memory */
+        InputMap inMap;
+        if (mapInputFile(inputName, &inMap) != 0){
+                printf("File %s cannot be opened\n", inputName);
+                return -1;
+        }
+
+        /* Read every station in the input file into the columnar station store, with
+           each thread reading its own share of the file */
+        if (loadStationStore(inputName, &inMap, numThreads, 0, store) != 0){
+                unmapInputFile(&inMap);
+                printf("Out of memory\n");
+                return -1;
+        }
+        unmapInputFile(&inMap);
+        if (useCache && saveStationCache(cacheName, inputName, store) != 0)
+                printf("Cache file %s cannot be written\n", cacheName);
+        return 0;
+} /* readStations */
+
+/* benchmarkCache
+   Times loading the input file by parsing it and saving a sidecar (a cold start)
+   against loading it from that sidecar (a warm start), and checks that both give
+   the same stations. The sidecar is removed afterwards.
+*/
+int benchmarkCache(const char *inputName, int numThreads, BenchReport *report){
+        char cacheName[PATH_MAX];
+        snprintf(cacheName, sizeof(cacheName), "%s.bench-cache", inputName);
+        InputMap inMap;
+        StationStore parsed, cached;
+        double start = monotonicSeconds();
+        if (mapInputFile(inputName, &inMap) != 0){
+                printf("File %s cannot be opened\n", inputName);
+                return EXIT_FAILURE;
+        }
+        if (loadStationStore(inputName, &inMap, numThreads, 1, &parsed) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        double bytes = inMap.size;
+        unmapInputFile(&inMap);
+        double parseTime = monotonicSeconds() - start;
+        start = monotonicSeconds();
+        if (saveStationCache(cacheName, inputName, &parsed) != 0){
+                printf("cache: %s cannot be written, skipped\n", cacheName);
+                freeStationStore(&parsed);
+                return EXIT_SUCCESS;
+        }
+        double saveTime = monotonicSeconds() - start;
+
+        double warmTime = 0;
+        int run, same = 1;
+        for (run = 0; run < BENCH_RUNS && same; run++){
+                start = monotonicSeconds();
+                same = loadStationCache(cacheName, inputName, &cached) == 0;
+                double elapsed = monotonicSeconds() - start;
+                if (run == 0 || elapsed < warmTime)
+                        warmTime = elapsed;
+                if (same){
+                        size_t columnBytes = parsed.count*4;
+                        same = cached.count == parsed.count &&
+                               memcmp(cached.stationID, parsed.stationID, columnBytes) == 0 &&
+                               memcmp(cached.temperature, parsed.temperature, columnBytes) == 0 &&
+                               memcmp(cached.latitude, parsed.latitude, columnBytes) == 0 &&
+                               memcmp(cached.longitude, parsed.longitude, columnBytes) == 0 &&
+                               memcmp(cached.timestamp, parsed.timestamp, columnBytes) == 0 &&
+                               memcmp(cached.region, parsed.region, columnBytes) == 0 &&
+                               memcmp(cached.valid, parsed.valid, parsed.count) == 0;
+                        freeStationStore(&cached);
+                }
+        }
+        unlink(cacheName);
+        printf("cache: cold %.4f s (parse %.4f s, save %.4f s), warm %.4f s, speedup %.1fx, stations %s\n",
+                                parseTime + saveTime, parseTime, saveTime, warmTime, parseTime/warmTime,
+                                same ? "identical" : "DIFFERENT");
+        benchRecord(report, "cache.cold", numThreads, parseTime + saveTime, parsed.count, "rows", bytes);
+        benchRecord(report, "cache.warm", 1, warmTime, parsed.count, "rows", bytes);
+        freeStationStore(&parsed);
+        return same ? EXIT_SUCCESS : EXIT_FAILURE;
+} /* benchmarkCache */
+
+
+/* ========================================================================= */
+/*                                Watch Mode                                 */
+/*     With -watch, the program keeps running after writing the map, and     */
+/*     brings the map up to date whenever lines are appended to the input    */
+/*     file. Only the appended lines are parsed; the average is kept as a    */
+/*     running total, and the plotted stations are kept in order of          */
+/*     temperature so that the only markers recoloured are those whose       */
+/*     temperatures lie between the old and new colour boundaries.           */
+/* ========================================================================= */
+
+/* Utility function to compare TemperatureRanks by temperature (with NaN last), for qsort */
+int compareTemperatureRanks(const void *a, const void *b){
+        const TemperatureRank *ra = a, *rb = b;
+        int nanA = isnan(ra->temperature), nanB = isnan(rb->temperature);
+        if (nanA || nanB)
+                return nanA - nanB;
+        if (ra->temperature != rb->temperature)
+                return ra->temperature < rb->temperature ? -1 : 1;
+        return (ra->id > rb->id) - (ra->id < rb->id);
+} /* compareTemperatureRanks */
+
+/* Utility function returning the number of ranks whose temperature is below boundary degrees from avgTemp, as markerTypeFor decides it.
+   The test is monotonic in the temperature, so these are the first ranks. */
+long ranksBelowBoundary(TemperatureRank *ranks, long count, float avgTemp, float boundary){
+        long lo = 0, hi = count;
+        while (lo < hi){
+                long mid = lo + (hi - lo)/2;
+                float difference = ranks[mid].temperature - avgTemp;
+                if (difference < boundary)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+} /* ranksBelowBoundary */
+
+/* Utility function adding the temperatures of rows from up to to of the watched store to its statistics. The sums are exact, so the average is the one a fresh run would give. */
+void accumulateTemperatures(WatchState *state, long from, long to){
+        float *temperature = state->store.temperature;
+        long i;
+        for (i = from; i < to; i++){
+                if (state->store.valid[i])
+                        addTemperature(&state->stats, temperature[i]);
+                else
+                        state->stats.missing++;
+        }
+} /* accumulateTemperatures */
+
+/* Utility function merging two runs of TemperatureRanks into a new array, returning it (or NULL if out of memory) */
+TemperatureRank *mergeRanks(TemperatureRank *first, long numFirst, TemperatureRank *second, long numSecond){
+        TemperatureRank *merged = malloc((numFirst + numSecond > 0 ? numFirst + numSecond : 1)*sizeof(TemperatureRank));
+        if (merged == NULL)
+                return NULL;
+        long a = 0, b = 0, m = 0;
+        while (a < numFirst || b < numSecond){
+                if (b == numSecond || (a < numFirst && compareTemperatureRanks(&first[a], &second[b]) <= 0))
+                        merged[m++] = first[a++];
+                else
+                        merged[m++] = second[b++];
+        }
+        return merged;
+} /* mergeRanks */
+
+/* Utility function adding the stations with a reading in rows from up to to of the watched store to the stations plotted, keeping them in order of temperature. Returns 0 on success, or -1 if out of memory.
+   New stations go into the small run of recent ranks, which is only merged into the main run once it holds more than 1/WATCH_MERGE_RATIO as many, so each station is moved a bounded number of times on average. */
+int addPlottedStations(WatchState *state, long from, long to){
+        long n = 0, i;
+        TemperatureRank *added = malloc((to > from ? to - from : 1)*sizeof(TemperatureRank));
+        if (added == NULL)
+                return -1;
+        for (i = from; i < to; i++){
+                if (state->store.valid[i]){
+                        added[n].temperature = state->store.temperature[i];
+                        added[n].id = i;
+                        n++;
+                }
+        }
+        qsort(added, n, sizeof(TemperatureRank), compareTemperatureRanks);
+        TemperatureRank *recent = mergeRanks(state->recent, state->numRecent, added, n);
+        free(added);
+        if (recent == NULL)
+                return -1;
+        free(state->recent);
+        state->recent = recent;
+        state->numRecent += n;
+        if (state->numRecent*WATCH_MERGE_RATIO > state->numRanks){
+                TemperatureRank *ranks = mergeRanks(state->ranks, state->numRanks, state->recent, state->numRecent);
+                if (ranks == NULL)
+                        return -1;
+                free(state->ranks);
+                free(state->recent);
+                state->ranks = ranks;
+                state->numRanks += state->numRecent;
+                state->recent = NULL;
+                state->numRecent = 0;
+        }
+        return 0;
+} /* addPlottedStations */
+
+/* Utility function recolouring the stations of a run of ranks whose temperatures lie between a colour boundary around oldAvg and the same boundary around the current average, returning the number whose colour changed */
+long recolourRanks(WatchState *state, TemperatureRank *ranks, long count, float oldAvg){
+        static const float Boundaries[] = {-1, 0, 1};
+        long recoloured = 0;
+        int b;
+        for (b = 0; b < 3; b++){
+                long from = ranksBelowBoundary(ranks, count, oldAvg, Boundaries[b]);
+                long to = ranksBelowBoundary(ranks, count, state->avgTemp, Boundaries[b]);
+                long r;
+                if (from > to){
+                        long swap = from;
+                        from = to;
+                        to = swap;
+                }
+                for (r = from; r < to; r++){
+                        long id = ranks[r].id;
+                        int type = markerTypeFor(state->store.temperature[id], state->avgTemp);
+                        recoloured += (type != state->store.type[id]);
+                        state->store.type[id] = type;
+                }
+        }
+        return recoloured;
+} /* recolourRanks */
+
+/* Utility function resetting a WatchState to hold no stations */
+void clearWatchState(WatchState *state){
+        freeStationStore(&state->store);
+        free(state->ranks);
+        free(state->recent);
+        state->ranks = NULL;
+        state->recent = NULL;
+        state->numRanks = 0;
+        state->numRecent = 0;
+        state->consumed = 0;
+        state->lineNumber = 1;
+        initTemperatureStats(&state->stats);
+        state->ecsTotal = 0;
+        state->ecsCount = 0;
+} /* clearWatchState */
+
+/* loadWatchedFile
+   (Re)loads the input file from scratch, up to the end of its last complete line.
+   Returns 0 on success, or -1 after printing an error message.
+*/
+int loadWatchedFile(WatchState *state){
+        clearWatchState(state);
+        InputMap inMap;
+        if (mapInputFile(state->inputName, &inMap) != 0){
+                printf("File %s cannot be opened\n", state->inputName);
+                return -1;
+        }
+        struct stat info;
+        if (stat(state->inputName, &info) == 0)
+                state->inode = info.st_ino;
+
+        /* A line still being written is left for the next update */
+        InputMap complete = inMap;
+        while (complete.size > 0 && complete.data[complete.size - 1] != '\n')
+                complete.size--;
+        const char *p = complete.data, *end = complete.data + complete.size;
+        while (p < end && (p = memchr(p, '\n', end - p)) != NULL){
+                state->lineNumber++;
+                p++;
+        }
+        state->consumed = complete.size;
+        int failed = loadStationStore(state->inputName, &complete, state->numThreads, 0, &state->store) != 0;
+        unmapInputFile(&inMap);
+
+        accumulateTemperatures(state, 0, state->store.count);
+        state->avgTemp = temperatureMean(&state->stats);
+        classifyStations(&state->store, state->store.count, state->avgTemp);
+        if (failed || addPlottedStations(state, 0, state->store.count) != 0 ||
+            sumNearECS(&state->store, 0, state->store.count, &state->ecsTotal, &state->ecsCount) != 0){
+                printf("Out of memory\n");
+                return -1;
+        }
+        return 0;
+} /* loadWatchedFile */
+
+/* updateWatchedFile
+   Parses the complete lines appended to the input file since it was last read, and
+   brings the averages and marker colours up to date. If the file has shrunk or been
+   replaced, it is loaded again from scratch. Sets *changed if any stations were
+   added. Returns 0 on success, or -1 after printing an error message.
+*/
+int updateWatchedFile(WatchState *state, int *changed){
+        *changed = 0;
+        struct stat info;
+        if (stat(state->inputName, &info) != 0)
+                return 0; /* The file may be in the middle of being replaced */
+        state->reloaded = (info.st_ino != state->inode || info.st_size < state->consumed);
+        if (state->reloaded){
+                *changed = 1;
+                return loadWatchedFile(state);
+        }
+        if (info.st_size == state->consumed)
+                return 0;
+
+        /* Read the appended bytes, up to the end of the last complete line */
+        size_t appended = info.st_size - state->consumed;
+        if (appended > state->bufferSize){
+                char *buffer = realloc(state->buffer, appended);
+                if (buffer == NULL){
+                        printf("Out of memory\n");
+                        return -1;
+                }
+                state->buffer = buffer;
+                state->bufferSize = appended;
+        }
+        int fd = open(state->inputName, O_RDONLY);
+        if (fd < 0)
+                return 0;
+        ssize_t got = pread(fd, state->buffer, appended, state->consumed);
+        close(fd);
+        if (got <= 0)
+                return 0;
+        const char *end = state->buffer + got;
+        while (end > state->buffer && end[-1] != '\n')
+                end--;
+        if (end == state->buffer)
+                return 0;
+
+        /* Parse the new lines straight into the store */
+        StationReader reader;
+        ParsedStation *chunk = malloc(STREAM_CHUNK_ROWS*sizeof(ParsedStation));
+        long oldCount = state->store.count;
+        initStationReaderRange(&reader, state->inputName, state->buffer, end);
+        reader.lineNumber = state->lineNumber;
+        if (chunk == NULL || streamIntoStore(&reader, chunk, &state->store) != 0){
+                free(chunk);
+                printf("Out of memory\n");
+                return -1;
+        }
+        free(chunk);
+        state->lineNumber = reader.lineNumber;
+        state->consumed += end - state->buffer;
+        state->added = state->store.count - oldCount;
+        if (state->added == 0)
+                return 0;
+        *changed = 1;
+
+        /* Update the average. Stations already plotted only change colour if their
+           temperatures lie between a colour boundary around the old average and the
+           same boundary around the new one. */
+        float oldAvg = state->avgTemp;
+        accumulateTemperatures(state, oldCount, state->store.count);
+        state->avgTemp = temperatureMean(&state->stats);
+        state->recoloured = recolourRanks(state, state->ranks, state->numRanks, oldAvg) +
+                            recolourRanks(state, state->recent, state->numRecent, oldAvg);
+
+        /* Colour the stations plotted for the first time, and add them to the ECS
+           estimate */
+        long i;
+        for (i = oldCount; i < state->store.count; i++){
+                state->store.type[i] = markerTypeFor(state->store.temperature[i], state->avgTemp);
+        }
+        if (addPlottedStations(state, oldCount, state->store.count) != 0 ||
+            sumNearECS(&state->store, oldCount, state->store.count, &state->ecsTotal, &state->ecsCount) != 0){
+                printf("Out of memory\n");
+                return -1;
+        }
+        return 0;
+} /* updateWatchedFile */
+
+/* Utility function waiting until the watched file may have changed: until inotify reports an event, or WATCH_POLL_MS milliseconds have passed */
+void waitForChange(int notifyFd){
+        if (notifyFd >= 0){
+                struct pollfd ready;
+                ready.fd = notifyFd;
+                ready.events = POLLIN;
+                ready.revents = 0;
+                if (poll(&ready, 1, WATCH_POLL_MS) > 0){
+                        char events[4096];
+                        if (read(notifyFd, events, sizeof(events)) < 0)
+                                return;
+                }
+        }else{
+                poll(NULL, 0, WATCH_POLL_MS);
+        }
+} /* waitForChange */
+
+/* watchInputFile
+   Writes the map of the input file, then keeps it up to date as lines are appended
+   to the file, replacing the output file atomically after each update. Only returns
+   on an error.
+*/
+int watchInputFile(const char *inputName, const char *outputName, int numThreads, MapOptions *options){
+        WatchState state;
+        memset(&state, 0, sizeof(state));
+        state.inputName = inputName;
+        state.numThreads = numThreads;
+        options->atomic = 1;
+        if (loadWatchedFile(&state) != 0 ||
+            writeMap(outputName, &state.store, state.store.count, state.avgTemp, state.ecsTotal/state.ecsCount, options) < 0)
+                return EXIT_FAILURE;
+        printf("%s: %ld stations written, watching %s\n", outputName, state.stats.count, inputName);
+        fflush(stdout);
+
+        int notifyFd = -1;
+#ifdef HAVE_INOTIFY
+        notifyFd = inotify_init();
+        if (notifyFd >= 0 && inotify_add_watch(notifyFd, inputName, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0){
+                close(notifyFd);
+                notifyFd = -1;
+        }
+#endif
+        while (1){
+                int changed;
+                waitForChange(notifyFd);
+                double start = monotonicSeconds();
+                if (updateWatchedFile(&state, &changed) != 0)
+                        return EXIT_FAILURE;
+                fflush(stdout);
+                if (!changed)
+                        continue;
+#ifdef HAVE_INOTIFY
+                if (notifyFd >= 0 && state.reloaded)
+                        inotify_add_watch(notifyFd, inputName, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+                double updateTime = monotonicSeconds() - start;
+                if (writeMap(outputName, &state.store, state.store.count, state.avgTemp, state.ecsTotal/state.ecsCount, options) < 0)
+                        return EXIT_FAILURE;
+                double writeTime = monotonicSeconds() - start - updateTime;
+                if (state.reloaded)
+                        printf("%s: input file replaced, %ld stations reloaded in %.4f s, map written in %.4f s\n",
+                                                inputName, state.store.count, updateTime, writeTime);
+                else
+                        printf("%s: %ld stations appended, %ld markers recoloured in %.4f s, map written in %.4f s\n",
+                                                inputName, state.added, state.recoloured, updateTime, writeTime);
+                fflush(stdout);
+        }
+} /* watchInputFile */
+
+
+/* ========================================================================= */
+/*                             Station Registry                              */
+/*     Station names are held once each in a single string arena, both as    */
+/*     they are and escaped for the page, and are referred to by handle:     */
+/*     their position in the registry, with handle 0 for "Unknown". A        */
+/*     station ID is turned into a handle through a dense table when the     */
+/*     IDs are close enough together, and otherwise through a perfect hash.  */
+/* ========================================================================= */
+
+/* Utility function making room for length more bytes at the end of a registry's arena, returning 0 on success or -1 if out of memory */
+int arenaReserve(StationRegistry *registry, size_t length){
+        if (registry->arenaUsed + length > registry->arenaSize){
+                size_t size = registry->arenaSize ? 2*registry->arenaSize : 4096;
+                while (size < registry->arenaUsed + length)
+                        size *= 2;
+                char *arena = realloc(registry->arena, size);
+                if (arena == NULL)
+                        return -1;
+                registry->arena = arena;
+                registry->arenaSize = size;
+        }
+        return 0;
+} /* arenaReserve */
+
+/* Utility function adding a station to a registry, returning 0 on success or -1 if out of memory.
+   The name is stored in the arena twice: as it is, and escaped (by copyJsEscaped) for a single-quoted string on the page. */
+int registerStation(StationRegistry *registry, int id, const char *name, size_t length){
+        if (registry->count == registry->capacity){
+                long capacity = registry->capacity ? 2*registry->capacity : 256;
+                RegisteredStation *stations = realloc(registry->stations, capacity*sizeof(RegisteredStation));
+                if (stations == NULL)
+                        return -1;
+                registry->stations = stations;
+                registry->capacity = capacity;
+        }
+        if (arenaReserve(registry, 7*length + 2) != 0)
+                return -1;
+        char *raw = registry->arena + registry->arenaUsed;
+        memcpy(raw, name, length);
+        raw[length] = '\0';
+        char *escaped = raw + length + 1;
+        char *end = copyJsEscaped(escaped, raw);
+        *end = '\0';
+        RegisteredStation *station = &registry->stations[registry->count++];
+        station->id = id;
+        station->name = raw - registry->arena;
+        station->escaped = escaped - registry->arena;
+        station->escapedLength = end - escaped;
+        registry->arenaUsed = (end + 1) - registry->arena;
+        return 0;
+} /* registerStation */
+
+/* initStationRegistry
+   Starts a registry holding only handle 0, "Unknown". Returns 0 on success, or -1 if
+   out of memory.
+*/
+int initStationRegistry(StationRegistry *registry){
+        memset(registry, 0, sizeof(StationRegistry));
+        return registerStation(registry, -1, "Unknown", strlen("Unknown"));
+} /* initStationRegistry */
+
+/* freeStationRegistry
+   Releases the memory held by a registry.
+*/
+void freeStationRegistry(StationRegistry *registry){
+        free(registry->arena);
+        free(registry->stations);
+        free(registry->dense);
+        free(registry->displacement);
+        free(registry->slots);
+        memset(registry, 0, sizeof(StationRegistry));
+} /* freeStationRegistry */
+
+/* Utility function hashing a station ID with a seed, for the perfect hash */
+unsigned long hashStationID(int id, unsigned long seed){
+        unsigned long long h = ((unsigned long long)(unsigned int)id + 0x9E3779B97F4A7C15ULL*(seed + 1))*0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+        h *= 0x94D049BB133111EBULL;
+        return (unsigned long)(h ^ (h >> 29));
+} /* hashStationID */
+
+/* Utility function to compare bucket sizes, largest first, for qsort */
+int compareBucketSizes(const void *a, const void *b){
+        const long *ba = a, *bb = b;
+        return (ba[1] < bb[1]) - (ba[1] > bb[1]);
+} /* compareBucketSizes */
+
+/* Utility function building a perfect hash of a registry's station IDs with numSlots slots, by hash and displace: the
+   IDs are split into small buckets, and each bucket, largest first, is given the first displacement that sends all of
+   its IDs to free slots. Returns 0 on success, 1 if some bucket cannot be placed, or -1 if out of memory. */
+int buildPerfectHash(StationRegistry *registry, long numSlots){
+        long n = registry->count - 1, h, k;
+        registry->numBuckets = n/4 + 1;
+        registry->numSlots = numSlots;
+        registry->displacement = calloc(registry->numBuckets, sizeof(unsigned int));
+        registry->slots = calloc(numSlots, sizeof(long));
+        long *bucketOf = malloc(n*sizeof(long));
+        long *order = malloc(2*registry->numBuckets*sizeof(long));
+        long *start = calloc(registry->numBuckets, sizeof(long));
+        long *members = malloc(n*sizeof(long));
+        long *trial = malloc(n*sizeof(long));
+        int result = (registry->displacement == NULL || registry->slots == NULL || bucketOf == NULL ||
+                      order == NULL || start == NULL || members == NULL || trial == NULL) ? -1 : 0;
+        if (result == 0){
+                /* Group the handles by bucket, leaving start[k] where bucket k begins in members */
+                for (h = 1; h <= n; h++){
+                        bucketOf[h - 1] = hashStationID(registry->stations[h].id, 0) % registry->numBuckets;
+                        start[bucketOf[h - 1]]++;
+                }
+                for (k = 0; k < registry->numBuckets; k++){
+                        order[2*k] = k;
+                        order[2*k + 1] = start[k];
+                        if (k > 0)
+                                start[k] += start[k - 1];
+                }
+                for (h = n; h >= 1; h--)
+                        members[--start[bucketOf[h - 1]]] = h;
+                qsort(order, registry->numBuckets, 2*sizeof(long), compareBucketSizes);
+
+                /* Place the buckets, largest first */
+                for (k = 0; k < registry->numBuckets && result == 0 && order[2*k + 1] > 0; k++){
+                        long bucket = order[2*k], size = order[2*k + 1], m;
+                        unsigned int d;
+                        for (d = 1; ; d++){
+                                for (m = 0; m < size; m++){
+                                        long slot = hashStationID(registry->stations[members[start[bucket] + m]].id, d) % numSlots;
+                                        long other;
+                                        for (other = 0; other < m && trial[other] != slot; other++)
+                                                ;
+                                        if (registry->slots[slot] || other < m)
+                                                break;
+                                        trial[m] = slot;
+                                }
+                                if (m == size){
+                                        for (m = 0; m < size; m++)
+                                                registry->slots[trial[m]] = members[start[bucket] + m];
+                                        registry->displacement[bucket] = d;
+                                        break;
+                                }
+                                if (d == PERFECT_HASH_MAX_TRIES){
+                                        result = 1;
+                                        break;
+                                }
+                        }
+                }
+        }
+        free(bucketOf);
+        free(order);
+        free(start);
+        free(members);
+        free(trial);
+        if (result != 0){
+                free(registry->displacement);
+                free(registry->slots);
+                registry->displacement = NULL;
+                registry->slots = NULL;
+        }
+        return result;
+} /* buildPerfectHash */
+
+/* Utility function to compare registered stations by ID, and then by handle, for qsort */
+int compareRegisteredIDs(const void *a, const void *b){
+        const long *ra = a, *rb = b;
+        if (ra[0] != rb[0])
+                return ra[0] < rb[0] ? -1 : 1;
+        return (ra[1] > rb[1]) - (ra[1] < rb[1]);
+} /* compareRegisteredIDs */
+
+/* finishStationRegistry
+   Builds the lookup from station ID to handle once every station has been registered.
+   Stations whose IDs were registered before are reported (as coming from the file
+   name) and dropped. The lookup is a dense table if the IDs span no more than
+   STATION_DENSE_RATIO times as many values as there are stations, and a perfect hash
+   otherwise. Returns 0 on success, or -1 if out of memory.
+*/
+int finishStationRegistry(StationRegistry *registry, const char *name){
+        long n = registry->count - 1, h, k;
+        if (n <= 0)
+                return 0;
+
+        /* Find the repeated IDs, and drop all but the first station with each */
+        long *byID = malloc(2*n*sizeof(long));
+        if (byID == NULL)
+                return -1;
+        for (h = 1; h <= n; h++){
+                byID[2*(h - 1)] = registry->stations[h].id;
+                byID[2*(h - 1) + 1] = h;
+        }
+        qsort(byID, n, 2*sizeof(long), compareRegisteredIDs);
+        int repeated = 0;
+        for (k = 1; k < n; k++){
+                if (byID[2*k] == byID[2*(k - 1)]){
+                        printf("%s: station ID %ld is listed more than once, only its first name is kept\n", name, byID[2*k]);
+                        registry->stations[byID[2*k + 1]].escapedLength = -1; /* Marks it to be dropped */
+                        repeated = 1;
+                }
+        }
+        long minID = byID[0], maxID = byID[2*(n - 1)];
+        free(byID);
+        if (repeated){
+                long kept = 1;
+                for (h = 1; h <= n; h++)
+                        if (registry->stations[h].escapedLength >= 0)
+                                registry->stations[kept++] = registry->stations[h];
+                registry->count = kept;
+                n = kept - 1;
+        }
+
+        if (maxID - minID + 1 <= STATION_DENSE_RATIO*n + 256){
+                registry->minID = minID;
+                registry->denseSize = maxID - minID + 1;
+                registry->dense = calloc(registry->denseSize, sizeof(long));
+                if (registry->dense == NULL)
+                        return -1;
+                for (h = 1; h <= n; h++)
+                        registry->dense[registry->stations[h].id - minID] = h;
+                return 0;
+        }
+        long numSlots = n + n/4 + 1;
+        int result;
+        while ((result = buildPerfectHash(registry, numSlots)) == 1)
+                numSlots *= 2;
+        return result;
+} /* finishStationRegistry */
+
+/* stationNameHandle
+   Returns the handle of the name of a station ID, or 0 ("Unknown") if the ID is not
+   registered.
+*/
+long stationNameHandle(StationRegistry *registry, int id){
+        if (registry->dense){
+                long index = (long)id - registry->minID;
+                return (index >= 0 && index < registry->denseSize) ? registry->dense[index] : 0;
+        }
+        if (registry->slots == NULL)
+                return 0;
+        unsigned long bucket = hashStationID(id, 0) % registry->numBuckets;
+        long handle = registry->slots[hashStationID(id, registry->displacement[bucket]) % registry->numSlots];
+        return (handle > 0 && registry->stations[handle].id == id) ? handle : 0;
+} /* stationNameHandle */
+
+/* loadDefaultStations
+   Registers every station of the built-in AllStationNames table. Returns 0 on
+   success, or -1 if out of memory.
+*/
+int loadDefaultStations(StationRegistry *registry){
+        int id;
+        if (initStationRegistry(registry) != 0)
+                return -1;
+        for (id = 0; id < MAX_STATIONS; id++){
+                if (AllStationNames[id] && registerStation(registry, id, AllStationNames[id], strlen(AllStationNames[id])) != 0)
+                        return -1;
+        }
+        return finishStationRegistry(registry, "AllStationNames");
+} /* loadDefaultStations */
+
+/* loadStationRegistry
+   Registers the stations listed in a registry file, one "ID name" pair per line (the
+   name being the rest of the line). Blank lines and lines starting with # are
+   ignored; malformed lines and repeated IDs are reported and skipped. Returns 0 on
+   success, or -1 after printing an error message.
+*/
+int loadStationRegistry(StationRegistry *registry, const char *name){
+        InputMap inMap;
+        if (mapInputFile(name, &inMap) != 0){
+                printf("File %s cannot be opened\n", name);
+                return -1;
+        }
+        if (initStationRegistry(registry) != 0){
+                unmapInputFile(&inMap);
+                printf("Out of memory\n");
+                return -1;
+        }
+        const char *line = inMap.data, *end = inMap.data + inMap.size;
+        long lineNumber = 0;
+        int failed = 0;
+        while (line < end && !failed){
+                const char *eol = memchr(line, '\n', end - line);
+                const char *next = eol ? eol + 1 : end;
+                if (eol == NULL)
+                        eol = end;
+                lineNumber++;
+                const char *p = line;
+                while (p < eol && isBlank(*p))
+                        p++;
+                if (p < eol && *p != '#'){
+                        int id;
+                        const char *nameEnd = eol;
+                        if (nameEnd > p && nameEnd[-1] == '\r')
+                                nameEnd--;
+                        if (parseIntField(&p, eol, &id) && p < nameEnd && isBlank(*p)){
+                                while (p < nameEnd && isBlank(*p))
+                                        p++;
+                                while (nameEnd > p && isBlank(nameEnd[-1]))
+                                        nameEnd--;
+                        }else{
+                                p = nameEnd;
+                        }
+                        if (p == nameEnd){
+                                printf("%s:%ld: malformed station name line skipped\n", name, lineNumber);
+                        }else{
+                                failed = registerStation(registry, id, p, nameEnd - p) != 0;
+                        }
+                }
+                line = next;
+        }
+        unmapInputFile(&inMap);
+        if (failed || finishStationRegistry(registry, name) != 0){
+                printf("Out of memory\n");
+                return -1;
+        }
+        return 0;
+} /* loadStationRegistry */
+
+/* Utility function copying a C string as a double-quoted JavaScript string literal (as writeJsString does), returning the end of the copy */
+char *copyJsString(char *p, const char *text){
+        *p++ = '"';
+        for (; *text; text++){
+                unsigned char c = *text;
+                if (c == '"' || c == '\\'){
+                        *p++ = '\\';
+                        *p++ = c;
+                }else if (c < ' ' || c == '<'){
+                        p += sprintf(p, "\\u%04x", c);
+                }else{
+                        *p++ = c;
+                }
+        }
+        *p++ = '"';
+        return p;
+} /* copyJsString */
+
+/* writerStationNames
+   Adds the table of station names, indexed by handle, to the output in compact mode.
+*/
+void writerStationNames(HtmlWriter *writer){
+        StationRegistry *registry = writer->registry;
+        long h;
+        writerAppend(writer, "\tvar stationNames = [", strlen("\tvar stationNames = ["));
+        for (h = 0; h < registry->count; h++){
+                const char *name = registry->arena + registry->stations[h].name;
+                char *start = writerReserve(writer, 6*strlen(name) + 3);
+                char *p = start;
+                if (h > 0)
+                        *p++ = ',';
+                p = copyJsString(p, name);
+                writer->used += p - start;
+        }
+        writerAppend(writer, "];\n", 3);
+} /* writerStationNames */
+
+
+/* ========================================================================= */
+/*                          Temperature Statistics                           */
+/*     Temperatures are summed exactly, in fixed point, so partial sums      */
+/*     over any split of the rows merge into the same total, bit for bit.    */
+/*     Only stations with a reading are counted; a reading of 0 degrees is   */
+/*     a reading like any other.                                             */
+/* ========================================================================= */
+
+/* normalizeExactSum
+   Propagates the carries of an exact sum, leaving every limb but the top one between
+   0 and 2^32 - 1. The value is unchanged.
+*/
+void normalizeExactSum(ExactSum *sum){
+        int i;
+        for (i = 0; i < EXACT_SUM_LIMBS - 1; i++){
+                long long low = sum->limbs[i] & 0xffffffffLL;
+                sum->limbs[i + 1] += (sum->limbs[i] - low)/4294967296LL;
+                sum->limbs[i] = low;
+        }
+        sum->pending = 0;
+} /* normalizeExactSum */
+
+/* exactSumAdd
+   Adds a value to an exact sum. The value must be a float, or the product of two
+   floats, so that its lowest set bit is within the range of the sum.
+*/
+void exactSumAdd(ExactSum *sum, double value){
+        unsigned long long bits;
+        memcpy(&bits, &value, sizeof(bits));
+        int exponent = (bits >> 52) & 0x7ff;
+        unsigned long long mantissa = bits & 0xfffffffffffffULL;
+        if (exponent)
+                mantissa |= 1ULL << 52;
+        else
+                exponent = 1;
+        if (mantissa == 0)
+                return;
+
+        /* The value is mantissa*2^(exponent - 1075). Any bits below the lowest limb are
+           zero, as the value is a product of floats. */
+        int shift = exponent - 1075 - EXACT_SUM_LOWEST_BIT;
+        if (shift < 0){
+                mantissa >>= -shift;
+                shift = 0;
+        }
+        int limb = shift/32, bit = shift%32;
+        long long low = (mantissa << bit) & 0xffffffffULL;
+        unsigned long long high = mantissa >> (32 - bit);
+        long long middle = high & 0xffffffffULL;
+        long long top = high >> 32;
+        if (bits >> 63){
+                sum->limbs[limb] -= low;
+                sum->limbs[limb + 1] -= middle;
+                sum->limbs[limb + 2] -= top;
+        }else{
+                sum->limbs[limb] += low;
+                sum->limbs[limb + 1] += middle;
+                sum->limbs[limb + 2] += top;
+        }
+        if (++sum->pending == EXACT_SUM_PENDING)
+                normalizeExactSum(sum);
+} /* exactSumAdd */
+
+/* mergeExactSum
+   Adds the exact sum from to the exact sum into.
+*/
+void mergeExactSum(ExactSum *into, const ExactSum *from){
+        ExactSum other = *from;
+        int i;
+        normalizeExactSum(into);
+        normalizeExactSum(&other);
+        for (i = 0; i < EXACT_SUM_LIMBS; i++)
+                into->limbs[i] += other.limbs[i];
+        normalizeExactSum(into);
+} /* mergeExactSum */
+
+/* exactSumValue
+   Returns an exact sum rounded to a double. Equal sums give equal doubles, however
+   they were built up.
+*/
+double exactSumValue(const ExactSum *sum){
+        ExactSum magnitude = *sum;
+        int i;
+        normalizeExactSum(&magnitude);
+        int negative = magnitude.limbs[EXACT_SUM_LIMBS - 1] < 0;
+        if (negative){
+                for (i = 0; i < EXACT_SUM_LIMBS; i++)
+                        magnitude.limbs[i] = -magnitude.limbs[i];
+                normalizeExactSum(&magnitude);
+        }
+        int top = EXACT_SUM_LIMBS - 1;
+        while (top > 0 && magnitude.limbs[top] == 0)
+                top--;
+
+        /* The top three limbs hold at least 64 significant bits, more than a double can */
+        double value = 0;
+        for (i = (top >= 2 ? top - 2 : 0); i <= top; i++)
+                value += ldexp((double)magnitude.limbs[i], 32*i + EXACT_SUM_LOWEST_BIT);
+        return negative ? -value : value;
+} /* exactSumValue */
+
+/* initTemperatureStats
+   Empties a set of statistics.
+*/
+void initTemperatureStats(TemperatureStats *stats){
+        memset(stats, 0, sizeof(TemperatureStats));
+        stats->min = INFINITY;
+        stats->max = -INFINITY;
+} /* initTemperatureStats */
+
+/* addTemperature
+   Adds one reading to a set of statistics.
+*/
+void addTemperature(TemperatureStats *stats, float temperature){
+        stats->count++;
+        if (temperature < stats->min)
+                stats->min = temperature;
+        if (temperature > stats->max)
+                stats->max = temperature;
+        exactSumAdd(&stats->sum, temperature);
+        exactSumAdd(&stats->sumSquares, (double)temperature*temperature);
+} /* addTemperature */
+
+/* mergeTemperatureStats
+   Adds the statistics from to the statistics into. Merging is associative and
+   commutative, exactly, so partial statistics may be merged in any order.
+*/
+void mergeTemperatureStats(TemperatureStats *into, const TemperatureStats *from){
+        into->count += from->count;
+        into->missing += from->missing;
+        if (from->min < into->min)
+                into->min = from->min;
+        if (from->max > into->max)
+                into->max = from->max;
+        mergeExactSum(&into->sum, &from->sum);
+        mergeExactSum(&into->sumSquares, &from->sumSquares);
+} /* mergeTemperatureStats */
+
+/* temperatureMean
+   Returns the mean of the readings in a set of statistics (NaN if there are none).
+*/
+double temperatureMean(const TemperatureStats *stats){
+        return stats->count ? exactSumValue(&stats->sum)/stats->count : NAN;
+} /* temperatureMean */
+
+/* temperatureVariance
+   Returns the variance of the readings in a set of statistics, taken over all of them
+   (NaN if there are none).
+*/
+double temperatureVariance(const TemperatureStats *stats){
+        if (stats->count == 0)
+                return NAN;
+        double sum = exactSumValue(&stats->sum);
+        double variance = (exactSumValue(&stats->sumSquares) - sum*(sum/stats->count))/stats->count;
+        return variance > 0 ? variance : 0;
+} /* temperatureVariance */
+
+/* Utility function returning the statistics of a region in a table, adding the region if it is new (NULL if out of memory) */
+RegionStats *regionStatsFor(RegionTable *table, float region){
+        unsigned int bits;
+        region += 0.0f; /* -0 and 0 are the same region */
+        memcpy(&bits, &region, sizeof(bits));
+        if (2*(table->count + 1) > table->numSlots){
+                long numSlots = table->numSlots ? 2*table->numSlots : 64, r;
+                long *slots = calloc(numSlots, sizeof(long));
+                if (slots == NULL)
+                        return NULL;
+                for (r = 0; r < table->count; r++){
+                        unsigned int key;
+                        memcpy(&key, &table->regions[r].region, sizeof(key));
+                        long slot = (key*2654435761U) & (numSlots - 1);
+                        while (slots[slot])
+                                slot = (slot + 1) & (numSlots - 1);
+                        slots[slot] = r + 1;
+                }
+                free(table->slots);
+                table->slots = slots;
+                table->numSlots = numSlots;
+        }
+        long slot = (bits*2654435761U) & (table->numSlots - 1);
+        while (table->slots[slot]){
+                RegionStats *found = &table->regions[table->slots[slot] - 1];
+                if (found->region == region)
+                        return found;
+                slot = (slot + 1) & (table->numSlots - 1);
+        }
+        if (table->count == table->capacity){
+                long capacity = table->capacity ? 2*table->capacity : 16;
+                RegionStats *regions = realloc(table->regions, capacity*sizeof(RegionStats));
+                if (regions == NULL)
+                        return NULL;
+                table->regions = regions;
+                table->capacity = capacity;
+        }
+        RegionStats *added = &table->regions[table->count++];
+        added->region = region;
+        initTemperatureStats(&added->stats);
+        table->slots[slot] = table->count;
+        return added;
+} /* regionStatsFor */
+
+/* freeRegionTable
+   Releases the memory held by a table of regions and empties it.
+*/
+void freeRegionTable(RegionTable *table){
+        free(table->regions);
+        free(table->slots);
+        memset(table, 0, sizeof(RegionTable));
+} /* freeRegionTable */
+
+/* Utility function to compare regions, for qsort */
+int compareRegions(const void *a, const void *b){
+        const RegionStats *ra = a, *rb = b;
+        return (ra->region > rb->region) - (ra->region < rb->region);
+} /* compareRegions */
+
+/* Utility function run by each thread of aggregateTemperatures, adding up the rows of its share */
+void *aggregateTaskMain(void *argument){
+        AggregateTask *task = argument;
+        StationStore *store = task->store;
+        const unsigned char *valid = store->valid;
+        const float *temperature = store->temperature;
+        long i;
+        initTemperatureStats(&task->stats);
+        for (i = task->from; i < task->to; i++){
+                if (valid[i])
+                        addTemperature(&task->stats, temperature[i]);
+                else
+                        task->stats.missing++;
+        }
+        if (task->byRegion){
+                for (i = task->from; i < task->to && !task->failed; i++){
+                        RegionStats *region = regionStatsFor(&task->regions, store->region[i]);
+                        if (region == NULL)
+                                task->failed = 1;
+                        else if (valid[i])
+                                addTemperature(&region->stats, temperature[i]);
+                        else
+                                region->stats.missing++;
+                }
+        }
+        return NULL;
+} /* aggregateTaskMain */
+
+/* aggregateTemperatures
+   Gathers the statistics of the temperatures in rows from up to (but not including)
+   to of a store, using numThreads threads, each of which adds up its own share of the
+   rows before the shares are merged. Stations without a reading are only counted as
+   missing. If regions is not NULL, the statistics of each region are added to it as
+   well. The results are the same for any number of threads. Returns 0 on success, or
+   -1 if out of memory.
+*/
+int aggregateTemperatures(StationStore *store, long from, long to, int numThreads, TemperatureStats *stats, RegionTable *regions){
+        AggregateTask tasks[MAX_INGEST_THREADS];
+        if (numThreads < 1)
+                numThreads = 1;
+        if (numThreads > MAX_INGEST_THREADS)
+                numThreads = MAX_INGEST_THREADS;
+        int i;
+        for (i = 0; i < numThreads; i++){
+                tasks[i].store = store;
+                tasks[i].from = from + (to - from)*i/numThreads;
+                tasks[i].to = from + (to - from)*(i + 1)/numThreads;
+                tasks[i].byRegion = (regions != NULL);
+                memset(&tasks[i].regions, 0, sizeof(RegionTable));
+                tasks[i].failed = 0;
+        }
+        for (i = 1; i < numThreads; i++){
+                tasks[i].started = (pthread_create(&tasks[i].thread, NULL, aggregateTaskMain, &tasks[i]) == 0);
+        }
+        aggregateTaskMain(&tasks[0]);
+        for (i = 1; i < numThreads; i++){
+                if (tasks[i].started)
+                        pthread_join(tasks[i].thread, NULL);
+                else
+                        aggregateTaskMain(&tasks[i]);
+        }
+
+        initTemperatureStats(stats);
+        int failed = 0;
+        long r;
+        for (i = 0; i < numThreads; i++){
+                mergeTemperatureStats(stats, &tasks[i].stats);
+                failed = failed || tasks[i].failed;
+                for (r = 0; r < tasks[i].regions.count && !failed; r++){
+                        RegionStats *region = regionStatsFor(regions, tasks[i].regions.regions[r].region);
+                        if (region == NULL)
+                                failed = 1;
+                        else
+                                mergeTemperatureStats(&region->stats, &tasks[i].regions.regions[r].stats);
+                }
+                freeRegionTable(&tasks[i].regions);
+        }
+        return failed ? -1 : 0;
+} /* aggregateTemperatures */
+
+/* Utility function printing one line of statistics for -regions */
+void printTemperatureStats(const char *label, const TemperatureStats *stats){
+        printf("%s: %ld readings, %ld missing", label, stats->count, stats->missing);
+        if (stats->count > 0)
+                printf(", mean %.4f, min %.2f, max %.2f, standard deviation %.4f",
+                                        temperatureMean(stats), stats->min, stats->max, sqrt(temperatureVariance(stats)));
+        printf("\n");
+} /* printTemperatureStats */
+
+/* printRegionStatistics
+   Prints the statistics of the temperatures in the input file, over all stations
+   and then region by region in order of region ID. Returns EXIT_SUCCESS, or
+   EXIT_FAILURE after printing an error message.
+*/
+int printRegionStatistics(const char *inputName, int numThreads, int useCache){
+        StationStore store;
+        if (readStations(inputName, numThreads, useCache, &store) != 0)
+                return EXIT_FAILURE;
+        TemperatureStats stats;
+        RegionTable regions = {0};
+        if (aggregateTemperatures(&store, 0, store.count, numThreads, &stats, &regions) != 0){
+                printf("Out of memory\n");
+                freeStationStore(&store);
+                freeRegionTable(&regions);
+                return EXIT_FAILURE;
+        }
+        qsort(regions.regions, regions.count, sizeof(RegionStats), compareRegions);
+        printTemperatureStats("all regions", &stats);
+        long r;
+        for (r = 0; r < regions.count; r++){
+                char label[64];
+                snprintf(label, sizeof(label), "region %g", regions.regions[r].region);
+                printTemperatureStats(label, &regions.regions[r].stats);
+        }
+        freeRegionTable(&regions);
+        freeStationStore(&store);
+        return EXIT_SUCCESS;
+} /* printRegionStatistics */
+
+/* benchmarkAggregate
+   Compares the original float average with the exact aggregation, on one thread and
+   on every core, with and without grouping by region, and checks that the results do
+   not depend on the number of threads.
+*/
+int benchmarkAggregate(const char *inputName, int maxThreads, BenchReport *report){
+        InputMap inMap;
+        if (mapInputFile(inputName, &inMap) != 0){
+                printf("File %s cannot be opened\n", inputName);
+                return EXIT_FAILURE;
+        }
+        StationStore store;
+        if (loadStationStore(inputName, &inMap, maxThreads, 1, &store) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        unmapInputFile(&inMap);
+
+        /* The original average: one float total, with readings of 0 left uncounted */
+        double start = monotonicSeconds();
+        float totalTemp = 0;
+        long nonZero = 0, i;
+        for (i = 0; i < store.count; i++){
+                nonZero += (store.temperature[i] != 0);
+                totalTemp += store.temperature[i];
+        }
+        float floatAvg = totalTemp/nonZero;
+        double floatTime = monotonicSeconds() - start;
+
+        TemperatureStats single, parallel;
+        RegionTable singleRegions = {0}, parallelRegions = {0};
+        start = monotonicSeconds();
+        aggregateTemperatures(&store, 0, store.count, 1, &single, NULL);
+        double singleTime = monotonicSeconds() - start;
+        start = monotonicSeconds();
+        aggregateTemperatures(&store, 0, store.count, maxThreads, &parallel, NULL);
+        double parallelTime = monotonicSeconds() - start;
+        start = monotonicSeconds();
+        int failed = aggregateTemperatures(&store, 0, store.count, maxThreads, &parallel, &parallelRegions) != 0;
+        double regionTime = monotonicSeconds() - start;
+        failed = failed || aggregateTemperatures(&store, 0, store.count, 1, &single, &singleRegions) != 0;
+        if (failed){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+
+        /* The results must match bit for bit, region by region */
+        int identical = single.count == parallel.count && single.missing == parallel.missing &&
+                        memcmp(&single.min, &parallel.min, sizeof(float)) == 0 &&
+                        memcmp(&single.max, &parallel.max, sizeof(float)) == 0 &&
+                        exactSumValue(&single.sum) == exactSumValue(&parallel.sum) &&
+                        exactSumValue(&single.sumSquares) == exactSumValue(&parallel.sumSquares) &&
+                        singleRegions.count == parallelRegions.count;
+        qsort(singleRegions.regions, singleRegions.count, sizeof(RegionStats), compareRegions);
+        qsort(parallelRegions.regions, parallelRegions.count, sizeof(RegionStats), compareRegions);
+        long r;
+        for (r = 0; r < singleRegions.count && identical; r++){
+                TemperatureStats *a = &singleRegions.regions[r].stats, *b = &parallelRegions.regions[r].stats;
+                identical = singleRegions.regions[r].region == parallelRegions.regions[r].region &&
+                            a->count == b->count && a->missing == b->missing &&
+                            exactSumValue(&a->sum) == exactSumValue(&b->sum) &&
+                            exactSumValue(&a->sumSquares) == exactSumValue(&b->sumSquares);
+        }
+        long numRegions = parallelRegions.count;
+        freeRegionTable(&singleRegions);
+        freeRegionTable(&parallelRegions);
+        freeStationStore(&store);
+
+        printf("aggregate: %ld rows, float average %.6f in %.4f s, exact average %.6f in %.4f s on 1 thread, %.4f s on %d threads, %.4f s with %ld regions, results %s\n",
+                                single.count + single.missing, floatAvg, floatTime, temperatureMean(&parallel), singleTime,
+                                parallelTime, maxThreads, regionTime, numRegions, identical ? "identical" : "DIFFERENT");
+        long rows = single.count + single.missing;
+        benchRecord(report, "average.float", 1, floatTime, rows, "rows", 0);
+        benchRecord(report, "aggregate", 1, singleTime, rows, "rows", 0);
+        benchRecord(report, "aggregate", maxThreads, parallelTime, rows, "rows", 0);
+        benchRecord(report, "aggregate.regions", maxThreads, regionTime, rows, "rows", 0);
+        return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+} /* benchmarkAggregate */
+
+
+/* ========================================================================= */
+/*                                 Heatmap                                   */
+/*     The temperature between the stations is estimated on a grid by        */
+/*     inverse distance weighting of the nearest stations, and laid over     */
+/*     the map as an image the page draws from one byte per cell.            */
+/* ========================================================================= */
+
+/* Utility function giving the latitude of a Web Mercator y coordinate, the inverse of mercatorY */
+double mercatorLatitude(double y){
+        return atan(sinh(M_PI*(1 - 2*y)))*180/M_PI;
+} /* mercatorLatitude */
+
+/* collectHeatmapSites
+   Gathers the stations with a reading among the first count of a store into sites,
+   one for each cell of the grid (whose bounds must already be set) that holds any of
+   them, placed at the mean location of the readings in the cell and with their mean
+   temperature, into the arrays of a grid. A cell cannot show more than one site, and
+   there are never more sites than cells, however many readings the store holds or
+   however scattered their locations. Returns 0 on success, or -1 if out of memory.
+*/
+int collectHeatmapSites(TemperatureGrid *grid, StationStore *store, long count){
+        long numSlots = 64, i;
+        while (numSlots < 2*count)
+                numSlots *= 2;
+        long *slots = calloc(numSlots, sizeof(long));
+        long *cells = malloc((count > 0 ? count : 1)*sizeof(long));
+        double (*total)[3] = malloc((count > 0 ? count : 1)*sizeof(*total));
+        long *readings = malloc((count > 0 ? count : 1)*sizeof(long));
+        grid->siteLatitude = malloc((count > 0 ? count : 1)*sizeof(float));
+        grid->siteLongitude = malloc((count > 0 ? count : 1)*sizeof(float));
+        grid->siteTemperature = malloc((count > 0 ? count : 1)*sizeof(float));
+        grid->numSites = 0;
+        int failed = (slots == NULL || cells == NULL || total == NULL || readings == NULL || grid->siteLatitude == NULL ||
+                      grid->siteLongitude == NULL || grid->siteTemperature == NULL);
+        double northY = mercatorY(grid->north), southY = mercatorY(grid->south);
+        for (i = 0; i < count && !failed; i++){
+                if (!store->valid[i])
+                        continue;
+                long column = (long)((store->longitude[i] - grid->west)*grid->columns/(grid->east - grid->west));
+                long row = (long)((mercatorY(store->latitude[i]) - northY)*grid->rows/(southY - northY));
+                column = column < 0 ? 0 : (column >= grid->columns ? grid->columns - 1 : column);
+                row = row < 0 ? 0 : (row >= grid->rows ? grid->rows - 1 : row);
+                long cell = row*grid->columns + column;
+                long slot = (((unsigned long long)cell*0x9E3779B97F4A7C15ULL) >> 32) & (numSlots - 1);
+                while (slots[slot] && cells[slots[slot] - 1] != cell)
+                        slot = (slot + 1) & (numSlots - 1);
+                if (!slots[slot]){
+                        long site = grid->numSites++;
+                        cells[site] = cell;
+                        total[site][0] = total[site][1] = total[site][2] = 0;
+                        readings[site] = 0;
+                        slots[slot] = site + 1;
+                }
+                long site = slots[slot] - 1;
+                total[site][0] += store->latitude[i];
+                total[site][1] += store->longitude[i];
+                total[site][2] += store->temperature[i];
+                readings[site]++;
+        }
+        for (i = 0; i < grid->numSites && !failed; i++){
+                grid->siteLatitude[i] = total[i][0]/readings[i];
+                grid->siteLongitude[i] = total[i][1]/readings[i];
+                grid->siteTemperature[i] = total[i][2]/readings[i];
+        }
+        free(slots);
+        free(cells);
+        free(total);
+        free(readings);
+        return failed ? -1 : 0;
+} /* collectHeatmapSites */
+
+/* Utility function run by each thread of buildTemperatureGrid, estimating the cells of every numThreads-th band of HEATMAP_TILE_ROWS rows.
+   The nearest sites are found with one k-nearest search reused from cell to cell, and weighted by their chord distance, which the search
+   already has: over the distances between neighbouring stations it differs from the surface distance by a negligible factor. The k sites
+   nearest one cell are k sites near the next cell of the row too, so the farthest of them from it bounds the search for that cell. */
+void *heatmapTaskMain(void *argument){
+        HeatmapTask *task = argument;
+        TemperatureGrid *grid = task->grid;
+        NearestSearch search;
+        search.index = task->index;
+        search.k = HEATMAP_NEIGHBOURS < task->index->numPoints ? HEATMAP_NEIGHBOURS : task->index->numPoints;
+        search.heapNodes = malloc(search.k*sizeof(long));
+        search.heapKeys = malloc(search.k*sizeof(double));
+        double *cosLongitude = malloc(grid->columns*sizeof(double));
+        double *sinLongitude = malloc(grid->columns*sizeof(double));
+        if (search.heapNodes == NULL || search.heapKeys == NULL || cosLongitude == NULL || sinLongitude == NULL){
+                task->failed = 1;
+                free(search.heapNodes);
+                free(search.heapKeys);
+                free(cosLongitude);
+                free(sinLongitude);
+                return NULL;
+        }
+        long band, row, column, i;
+        for (column = 0; column < grid->columns; column++){
+                double longitude = (grid->west + (column + 0.5)*(grid->east - grid->west)/grid->columns)*M_PI/180;
+                cosLongitude[column] = cos(longitude);
+                sinLongitude[column] = sin(longitude);
+        }
+        double exactChord = HEATMAP_EXACT_DISTANCE/EARTH_RADIUS_KM;
+        double northY = mercatorY(grid->north), southY = mercatorY(grid->south);
+        for (band = task->firstBand; band*HEATMAP_TILE_ROWS < grid->rows; band += task->step){
+                for (row = band*HEATMAP_TILE_ROWS; row < (band + 1)*HEATMAP_TILE_ROWS && row < grid->rows; row++){
+                        double latitude = mercatorLatitude(northY + (row + 0.5)*(southY - northY)/grid->rows)*M_PI/180;
+                        double cosLatitude = cos(latitude), sinLatitude = sin(latitude);
+                        float *values = grid->values + row*grid->columns;
+                        search.bound = INFINITY;
+                        for (column = 0; column < grid->columns; column++){
+                                search.q[0] = cosLatitude*cosLongitude[column];
+                                search.q[1] = cosLatitude*sinLongitude[column];
+                                search.q[2] = sinLatitude;
+                                if (column > 0){
+                                        search.bound = 0;
+                                        for (i = 0; i < search.count; i++)
+                                                search.bound = fmax(search.bound, chordSquared(task->index, search.heapNodes[i], search.q));
+                                }
+                                search.count = 0;
+                                search.offset[0] = search.offset[1] = search.offset[2] = 0;
+                                nearestSubtree(&search, 0, task->index->numPoints, 0);
+
+                                /* A cell on top of a site takes its temperature; otherwise each
+                                   site is weighted by the inverse square of its distance */
+                                double weighted = 0, weights = 0;
+                                for (i = 0; i < search.count; i++){
+                                        float temperature = grid->siteTemperature[task->index->ids[search.heapNodes[i]]];
+                                        double chordSquared = search.heapKeys[i];
+                                        if (chordSquared < exactChord*exactChord){
+                                                weighted = temperature;
+                                                weights = 1;
+                                                break;
+                                        }
+                                        weighted += temperature/chordSquared;
+                                        weights += 1/chordSquared;
+                                }
+                                values[column] = weighted/weights;
+                        }
+                }
+        }
+        free(search.heapNodes);
+        free(search.heapKeys);
+        free(cosLongitude);
+        free(sinLongitude);
+        return NULL;
+} /* heatmapTaskMain */
+
+/* buildTemperatureGrid
+   Estimates the temperature on a grid of columns by rows cells over the stations with
+   a reading among the first count of a store, using numThreads threads. The grid
+   covers the stations with a margin of HEATMAP_MARGIN of their extent on each side;
+   its columns are evenly spaced in longitude and its rows in Web Mercator y, so that
+   it lines up with the map. Each cell is the inverse distance weighted mean of the
+   HEATMAP_NEIGHBOURS nearest sites, found through a spatial index over the sites of
+   collectHeatmapSites (the readings within one cell count once, with their mean), so
+   that the work depends on the size of the grid rather than on the number of
+   readings. The result does not depend on the number of threads. Returns 0 on
+   success, 1 if there are no stations with a reading, or -1 if out of memory.
+*/
+int buildTemperatureGrid(TemperatureGrid *grid, StationStore *store, long count, long columns, long rows, int numThreads){
+        memset(grid, 0, sizeof(TemperatureGrid));
+        grid->columns = columns;
+        grid->rows = rows;
+
+        /* Cover the stations with a reading, with a margin */
+        long i, numReadings = 0;
+        for (i = 0; i < count; i++){
+                if (!store->valid[i])
+                        continue;
+                if (numReadings++ == 0){
+                        grid->north = grid->south = store->latitude[i];
+                        grid->west = grid->east = store->longitude[i];
+                }
+                if (store->latitude[i] > grid->north) grid->north = store->latitude[i];
+                if (store->latitude[i] < grid->south) grid->south = store->latitude[i];
+                if (store->longitude[i] < grid->west) grid->west = store->longitude[i];
+                if (store->longitude[i] > grid->east) grid->east = store->longitude[i];
+        }
+        if (numReadings == 0)
+                return 1;
+        float latitudeMargin = fmaxf((grid->north - grid->south)*HEATMAP_MARGIN, HEATMAP_MIN_MARGIN);
+        float longitudeMargin = fmaxf((grid->east - grid->west)*HEATMAP_MARGIN, HEATMAP_MIN_MARGIN);
+        grid->north = fminf(grid->north + latitudeMargin, CLUSTER_MAX_LATITUDE);
+        grid->south = fmaxf(grid->south - latitudeMargin, -CLUSTER_MAX_LATITUDE);
+        grid->west -= longitudeMargin;
+        grid->east += longitudeMargin;
+
+        if (collectHeatmapSites(grid, store, count) != 0){
+                freeTemperatureGrid(grid);
+                return -1;
+        }
+        grid->min = grid->max = grid->siteTemperature[0];
+        for (i = 1; i < grid->numSites; i++){
+                if (grid->siteTemperature[i] < grid->min) grid->min = grid->siteTemperature[i];
+                if (grid->siteTemperature[i] > grid->max) grid->max = grid->siteTemperature[i];
+        }
+
+        SpatialIndex index;
+        grid->values = malloc(columns*rows*sizeof(float));
+        if (grid->values == NULL || buildSpatialIndex(&index, grid->siteLatitude, grid->siteLongitude, grid->numSites) != 0){
+                freeTemperatureGrid(grid);
+                return -1;
+        }
+
+        /* Each thread takes every numThreads-th band of rows, so that the work is spread
+           evenly however the stations are placed */
+        HeatmapTask tasks[MAX_INGEST_THREADS];
+        if (numThreads < 1)
+                numThreads = 1;
+        if (numThreads > MAX_INGEST_THREADS)
+                numThreads = MAX_INGEST_THREADS;
+        int t;
+        for (t = 0; t < numThreads; t++){
+                tasks[t].grid = grid;
+                tasks[t].index = &index;
+                tasks[t].firstBand = t;
+                tasks[t].step = numThreads;
+                tasks[t].failed = 0;
+        }
+        for (t = 1; t < numThreads; t++){
+                tasks[t].started = (pthread_create(&tasks[t].thread, NULL, heatmapTaskMain, &tasks[t]) == 0);
+        }
+        heatmapTaskMain(&tasks[0]);
+        int failed = tasks[0].failed;
+        for (t = 1; t < numThreads; t++){
+                if (tasks[t].started)
+                        pthread_join(tasks[t].thread, NULL);
+                else
+                        heatmapTaskMain(&tasks[t]);
+                failed = failed || tasks[t].failed;
+        }
+        freeSpatialIndex(&index);
+        if (failed){
+                freeTemperatureGrid(grid);
+                return -1;
+        }
+        return 0;
+} /* buildTemperatureGrid */
+
+/* freeTemperatureGrid
+   Releases the memory held by a grid.
+*/
+void freeTemperatureGrid(TemperatureGrid *grid){
+        free(grid->values);
+        free(grid->siteLatitude);
+        free(grid->siteLongitude);
+        free(grid->siteTemperature);
+        memset(grid, 0, sizeof(TemperatureGrid));
+} /* freeTemperatureGrid */
+
+/* writerTemperatureGrid
+   Adds a grid to the output as the heatmap object the page draws: its size, its
+   bounds, the range of its temperatures, and its cells row by row from the north,
+   each scaled to a byte from min to max, in base64.
+*/
+void writerTemperatureGrid(HtmlWriter *writer, TemperatureGrid *grid){
+        static const char Base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        char *start = writerReserve(writer, MARKER_FIXED_BYTES);
+        char *p = start;
+        p = copyText(p, "\tvar heatmap = {columns: ");
+        p = formatLong(p, grid->columns);
+        p = copyText(p, ", rows: ");
+        p = formatLong(p, grid->rows);
+        p = copyText(p, ", north: ");
+        p = formatTrimmed(p, grid->north, 6);
+        p = copyText(p, ", south: ");
+        p = formatTrimmed(p, grid->south, 6);
+        p = copyText(p, ", west: ");
+        p = formatTrimmed(p, grid->west, 6);
+        p = copyText(p, ", east: ");
+        p = formatTrimmed(p, grid->east, 6);
+        p = copyText(p, ", min: ");
+        p = formatTrimmed(p, grid->min, 2);
+        p = copyText(p, ", max: ");
+        p = formatTrimmed(p, grid->max, 2);
+        p = copyText(p, ",\n\t\tcells: \"");
+        writer->used += p - start;
+
+        /* Three cells at a time become four characters */
+        float range = grid->max - grid->min;
+        long numCells = grid->columns*grid->rows, i;
+        unsigned char group[3];
+        int inGroup = 0;
+        for (i = 0; i < numCells; i++){
+                group[inGroup++] = range > 0 ? (unsigned char)lrintf((grid->values[i] - grid->min)/range*255) : 0;
+                if (inGroup == 3 || i == numCells - 1){
+                        p = writerReserve(writer, 4);
+                        if (inGroup < 3)
+                                memset(group + inGroup, 0, 3 - inGroup);
+                        p[0] = Base64[group[0] >> 2];
+                        p[1] = Base64[((group[0] & 3) << 4) | (group[1] >> 4)];
+                        p[2] = inGroup > 1 ? Base64[((group[1] & 15) << 2) | (group[2] >> 6)] : '=';
+                        p[3] = inGroup > 2 ? Base64[group[2] & 63] : '=';
+                        writer->used += 4;
+                        inGroup = 0;
+                }
+        }
+        writerAppend(writer, "\"};\n", 4);
+} /* writerTemperatureGrid */
+
+/* writeHeatmapLoader
+   Writes the code that draws the heatmap object onto a canvas, one pixel per cell
+   coloured from blue (its lowest temperature) through green to red (its highest),
+   and lays the canvas over the map beneath the markers.
+*/
+void writeHeatmapLoader(FILE *f){
+        if (!f){
+                printf("writeHeatmapLoader error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("\tvar heatmapCanvas = document.createElement('canvas');\n",f);
+        fputs("\theatmapCanvas.width = heatmap.columns;\n",f);
+        fputs("\theatmapCanvas.height = heatmap.rows;\n",f);
+        fputs("\tvar heatmapContext = heatmapCanvas.getContext('2d');\n",f);
+        fputs("\tvar heatmapImage = heatmapContext.createImageData(heatmap.columns, heatmap.rows);\n",f);
+        fputs("\tvar heatmapStops = [[0,0,255], [0,255,255], [0,255,0], [255,255,0], [255,0,0]], heatmapPalette = [];\n",f);
+        fputs("\tfor (var i = 0; i < 256; i++) {\n",f);
+        fputs("\t\tvar s = i/255*4, k = Math.min(Math.floor(s), 3), f = s - k;\n",f);
+        fputs("\t\tfor (var c = 0; c < 3; c++) heatmapPalette[3*i+c] = Math.round(heatmapStops[k][c]*(1-f) + heatmapStops[k+1][c]*f);\n",f);
+        fputs("\t}\n",f);
+        fputs("\tvar heatmapCells = atob(heatmap.cells), pixels = heatmapImage.data;\n",f);
+        fputs("\tfor (var i = 0; i < heatmap.columns*heatmap.rows; i++) {\n",f);
+        fputs("\t\tvar v = heatmapCells.charCodeAt(i);\n",f);
+        fputs("\t\tpixels[4*i] = heatmapPalette[3*v]; pixels[4*i+1] = heatmapPalette[3*v+1]; pixels[4*i+2] = heatmapPalette[3*v+2]; pixels[4*i+3] = 255;\n",f);
+        fputs("\t}\n",f);
+        fputs("\theatmapContext.putImageData(heatmapImage, 0, 0);\n",f);
+        fputs("\tvar heatmapBounds = new google.maps.LatLngBounds(new google.maps.LatLng(heatmap.south, heatmap.west), new google.maps.LatLng(heatmap.north, heatmap.east));\n",f);
+        fprintf(f,"\tnew google.maps.GroundOverlay(heatmapCanvas.toDataURL(), heatmapBounds, {opacity: %.2f, clickable: false}).setMap(map);\n",HEATMAP_OPACITY);
+} /* writeHeatmapLoader */
+
+/* benchmarkHeatmap
+   Times the estimation of a HEATMAP_BENCH_SIZE by HEATMAP_BENCH_SIZE grid over
+   HEATMAP_BENCH_ROWS observations generated around the stations of the input file,
+   as -generate makes them, on one thread and on maxThreads, in cells per second, and
+   checks that both grids are the same.
+*/
+int benchmarkHeatmap(const char *inputName, int maxThreads, BenchReport *report){
+        StationStore store;
+        if (generateStationStore(inputName, HEATMAP_BENCH_ROWS, 1, &store) != 0)
+                return EXIT_FAILURE;
+
+        TemperatureGrid single, parallel;
+        double start = monotonicSeconds();
+        int result = buildTemperatureGrid(&single, &store, store.count, HEATMAP_BENCH_SIZE, HEATMAP_BENCH_SIZE, 1);
+        double singleTime = monotonicSeconds() - start;
+        if (result != 0){
+                freeStationStore(&store);
+                printf(result > 0 ? "heatmap: no stations with a reading\n" : "Out of memory\n");
+                return result > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        start = monotonicSeconds();
+        result = buildTemperatureGrid(&parallel, &store, store.count, HEATMAP_BENCH_SIZE, HEATMAP_BENCH_SIZE, maxThreads);
+        double parallelTime = monotonicSeconds() - start;
+        freeStationStore(&store);
+        if (result != 0){
+                freeTemperatureGrid(&single);
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        long numCells = (long)HEATMAP_BENCH_SIZE*HEATMAP_BENCH_SIZE;
+        int identical = memcmp(single.values, parallel.values, numCells*sizeof(float)) == 0;
+        printf("heatmap: %ld cells from %ld readings at %ld sites, 1 thread %.4f s (%.0f cells/s), %d threads %.4f s (%.0f cells/s), grids %s\n",
+                                numCells, (long)HEATMAP_BENCH_ROWS, single.numSites, singleTime, numCells/singleTime, maxThreads, parallelTime,
+                                numCells/parallelTime, identical ? "identical" : "DIFFERENT");
+        benchRecord(report, "heatmap", 1, singleTime, numCells, "cells", 0);
+        benchRecord(report, "heatmap", maxThreads, parallelTime, numCells, "cells", 0);
+        freeTemperatureGrid(&single);
+        freeTemperatureGrid(&parallel);
+        return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+} /* benchmarkHeatmap */
+
+
+/* ========================================================================= */
+/*                           Benchmarks and Test Data                        */
+/*     -bench times each stage of the pipeline and can save the times as     */
+/*     JSON; -generate makes input files of any size to run it on.           */
+/* ========================================================================= */
+
+/* Utility function returning the peak resident set size of the program in KiB, or -1 if it is not known */
+long peakResidentKiB(){
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+                return -1;
+#ifdef __APPLE__
+        return usage.ru_maxrss/1024; /* Reported in bytes rather than KiB */
+#else
+        return usage.ru_maxrss;
+#endif
+} /* peakResidentKiB */
+
+/* benchRecord
+   Adds a measurement to a report, along with the peak resident set size so far.
+   Measurements beyond BENCH_MAX_STAGES are dropped.
+*/
+void benchRecord(BenchReport *report, const char *stage, int threads, double seconds, long items, const char *unit, double bytes){
+        if (report->count == BENCH_MAX_STAGES)
+                return;
+        BenchStage *entry = &report->stages[report->count++];
+        snprintf(entry->stage, sizeof(entry->stage), "%s", stage);
+        entry->unit = unit;
+        entry->threads = threads;
+        entry->seconds = seconds;
+        entry->items = items;
+        entry->bytes = bytes;
+        entry->allocations = -1;
+        entry->peakKiB = peakResidentKiB();
+} /* benchRecord */
+
+/* benchRecordAllocations
+   Adds the number of heap allocations made to the last measurement of a report.
+*/
+void benchRecordAllocations(BenchReport *report, long allocations){
+        if (report->count > 0)
+                report->stages[report->count - 1].allocations = allocations;
+} /* benchRecordAllocations */
+
+/* runBenchmarks
+   Runs benchmarkIngest, benchmarkCache, benchmarkAggregate, benchmarkEmit,
+   benchmarkHeatmap, benchmarkSurfaceDistance and (where there is epoll)
+   benchmarkServe in turn, stopping at the first that fails, then writes every
+   measurement they made to reportName as JSON (unless it is NULL), whether they
+   passed or not. The ingest, aggregation and heatmap are scaled up to numThreads
+   threads, or to one per core if numThreads is 1.
+*/
+int runBenchmarks(const char *inputName, int numThreads, const char *reportName){
+        int maxThreads = numThreads > 1 ? numThreads : sysconf(_SC_NPROCESSORS_ONLN);
+        BenchReport report;
+        report.count = 0;
+        double start = monotonicSeconds();
+        int result = benchmarkIngest(inputName, maxThreads, &report);
+        if (result == EXIT_SUCCESS)
+                result = benchmarkCache(inputName, numThreads, &report);
+        if (result == EXIT_SUCCESS)
+                result = benchmarkAggregate(inputName, maxThreads, &report);
+        if (result == EXIT_SUCCESS)
+                result = benchmarkEmit(inputName, numThreads, &report);
+        if (result == EXIT_SUCCESS)
+                result = benchmarkHeatmap(inputName, maxThreads, &report);
+        if (result == EXIT_SUCCESS)
+                result = benchmarkSurfaceDistance(&report);
+        if (result == EXIT_SUCCESS)
+                result = benchmarkViewport(inputName, numThreads, &report);
+        if (result == EXIT_SUCCESS)
+                result = benchmarkClassify(&report);
+#ifdef HAVE_EPOLL
+        if (result == EXIT_SUCCESS)
+                result = benchmarkServe(inputName, numThreads, &report);
+#endif
+        double elapsed = monotonicSeconds() - start;
+        if (reportName && writeBenchReport(reportName, &report, inputName, maxThreads, elapsed, result == EXIT_SUCCESS) != 0){
+                printf("File %s cannot be written\n", reportName);
+                return EXIT_FAILURE;
+        }
+        return result;
+} /* runBenchmarks */
+
+/* writeBenchReport
+   Writes a report to the named file as one JSON object: the version of its layout,
+   the input file and its size, the most threads used, the surfaceDistanceBatch
+   kernel, whether every benchmark passed, the total time and peak resident set size,
+   and then each measurement with its throughput in items (and bytes, where it has
+   them) per second. Returns 0 on success, or -1 if the file cannot be written.
+*/
+int writeBenchReport(const char *name, BenchReport *report, const char *inputName, int maxThreads, double seconds, int passed){
+        FILE *f = fopen(name, "w");
+        if (f == NULL)
+                return -1;
+        struct stat info;
+        long inputBytes = stat(inputName, &info) == 0 ? (long)info.st_size : -1;
+        fprintf(f, "{\n\t\"version\": %d,\n\t\"input\": ", BENCH_REPORT_VERSION);
+        writeJsString(f, inputName);
+        fprintf(f, ",\n\t\"inputBytes\": %ld,\n\t\"maxThreads\": %d,\n\t\"distanceKernel\": ", inputBytes, maxThreads);
+        writeJsString(f, surfaceDistanceKernel());
+        fprintf(f, ",\n\t\"passed\": %s,\n\t\"seconds\": %.6f,\n\t\"peakRssKiB\": %ld,\n\t\"stages\": [",
+                passed ? "true" : "false", seconds, peakResidentKiB());
+        int i;
+        for (i = 0; i < report->count; i++){
+                BenchStage *entry = &report->stages[i];
+                double perSecond = entry->seconds > 0 ? 1/entry->seconds : 0;
+                fprintf(f, "%s\n\t\t{\"stage\": \"%s\", \"threads\": %d, \"seconds\": %.9f, \"%s\": %ld, \"%sPerSecond\": %.1f",
+                        i ? "," : "", entry->stage, entry->threads, entry->seconds, entry->unit, entry->items, entry->unit,
+                        entry->items*perSecond);
+                if (entry->bytes > 0)
+                        fprintf(f, ", \"bytes\": %.0f, \"bytesPerSecond\": %.1f", entry->bytes, entry->bytes*perSecond);
+                if (entry->allocations >= 0)
+                        fprintf(f, ", \"allocations\": %ld", entry->allocations);
+                fprintf(f, ", \"peakRssKiB\": %ld}", entry->peakKiB);
+        }
+        fprintf(f, "\n\t]\n}\n");
+        int failed = ferror(f);
+        if (fclose(f) != 0 || failed)
+                return -1;
+        return 0;
+} /* writeBenchReport */
+
+/* Utility function returning a normally distributed pseudo-random number with mean 0 and standard deviation 1 (by the Box-Muller transform) */
+double nextGaussian(unsigned long long *state){
+        double u = nextRandom(state);
+        double v = nextRandom(state);
+        return sqrt(-2*log(1 - u))*cos(2*M_PI*v);
+} /* nextGaussian */
+
+/* openStationGenerator
+   Loads the template file of a generator and picks out its stations with a reading,
+   which the observations are made around, and the earliest time among them, at which
+   the first round is made. Returns 0 on success, or -1 after printing an error
+   message.
+*/
+int openStationGenerator(StationGenerator *generator, const char *templateName, unsigned long long seed){
+        memset(generator, 0, sizeof(StationGenerator));
+        generator->seed = seed;
+        InputMap inMap;
+        if (mapInputFile(templateName, &inMap) != 0){
+                printf("File %s cannot be opened\n", templateName);
+                return -1;
+        }
+        StationStore *store = &generator->store;
+        if (loadStationStore(templateName, &inMap, 1, 0, store) != 0){
+                unmapInputFile(&inMap);
+                printf("Out of memory\n");
+                return -1;
+        }
+        unmapInputFile(&inMap);
+        generator->centres = malloc((store->count + 1)*sizeof(long));
+        if (generator->centres == NULL){
+                printf("Out of memory\n");
+                closeStationGenerator(generator);
+                return -1;
+        }
+        long i;
+        for (i = 0; i < store->count; i++){
+                if (!store->valid[i])
+                        continue;
+                unsigned long minute = timestampMinutes(store->timestamp[i]);
+                if (generator->numCentres == 0 || minute < generator->firstMinute)
+                        generator->firstMinute = minute;
+                generator->centres[generator->numCentres++] = i;
+        }
+        if (generator->numCentres == 0){
+                printf("%s has no stations with a reading to generate from\n", templateName);
+                closeStationGenerator(generator);
+                return -1;
+        }
+        return 0;
+} /* openStationGenerator */
+
+/* generateReading
+   Makes observation number i of a generator, around one of its centres picked at
+   random, as described with GENERATE_SPREAD_KM. The observations are made in rounds
+   of as many as there are centres, each GENERATE_INTERVAL minutes after the one
+   before, so they must be made in order of i for the same seed to give the same
+   observations.
+*/
+void generateReading(StationGenerator *generator, long i, GeneratedReading *reading){
+        StationStore *store = &generator->store;
+        double kmPerDegree = M_PI*EARTH_RADIUS_KM/180;
+        long c = generator->centres[(long)(nextRandom(&generator->seed)*generator->numCentres)];
+        unsigned long minute = generator->firstMinute + (unsigned long)(i/generator->numCentres)*GENERATE_INTERVAL;
+        reading->centre = c;
+        reading->timestamp = minutesTimestamp(minute);
+        reading->latitude = store->latitude[c] + GENERATE_SPREAD_KM*nextGaussian(&generator->seed)/kmPerDegree;
+        reading->longitude = store->longitude[c] +
+                             GENERATE_SPREAD_KM*nextGaussian(&generator->seed)/(kmPerDegree*cos(reading->latitude*M_PI/180));
+        /* The daily swing is relative to the time of the centre's own reading */
+        double hours = (minute % 1440)/60.0 - GENERATE_WARMEST_HOUR;
+        double centreHours = TIMESTAMP_HOUR(store->timestamp[c]) + TIMESTAMP_MINUTE(store->timestamp[c])/60.0 -
+                             GENERATE_WARMEST_HOUR;
+        reading->temperature = store->temperature[c] +
+                               GENERATE_DAILY_SWING*(cos(2*M_PI*hours/24) - cos(2*M_PI*centreHours/24)) +
+                               GENERATE_NOISE*nextGaussian(&generator->seed);
+} /* generateReading */
+
+/* closeStationGenerator
+   Releases the memory held by a generator.
+*/
+void closeStationGenerator(StationGenerator *generator){
+        free(generator->centres);
+        freeStationStore(&generator->store);
+        memset(generator, 0, sizeof(StationGenerator));
+} /* closeStationGenerator */
+
+/* generateStations
+   Writes rows lines of synthetic observations in the format of the input file to the
+   named file. The stations of the template file with a reading are the centres of
+   the clusters: each line takes the station ID and region of one of them, picked at
+   random, and is placed around it with a temperature around its own, as described
+   with GENERATE_SPREAD_KM. The lines are
+   made in rounds of as many lines as there are centres, the first at the earliest
+   time in the template file and each GENERATE_INTERVAL minutes after the one before,
+   so the observations are in time order. The same seed always gives the same file.
+   Returns EXIT_SUCCESS or EXIT_FAILURE.
+*/
+int generateStations(const char *templateName, const char *outputName, long rows, unsigned long long seed){
+        StationGenerator generator;
+        if (openStationGenerator(&generator, templateName, seed) != 0)
+                return EXIT_FAILURE;
+        FILE *f = fopen(outputName, "w");
+        if (f == NULL){
+                printf("File %s cannot be created\n", outputName);
+                closeStationGenerator(&generator);
+                return EXIT_FAILURE;
+        }
+
+        StationStore *store = &generator.store;
+        long i;
+        for (i = 0; i < rows; i++){
+                GeneratedReading reading;
+                generateReading(&generator, i, &reading);
+                unsigned int timestamp = reading.timestamp;
+                fprintf(f, "%5d %9.2f  %4u %02u %02u %02u %02u %10.5f %10.5f %5g\n",
+                        store->stationID[reading.centre], reading.temperature, TIMESTAMP_YEAR(timestamp),
+                        TIMESTAMP_MONTH(timestamp), TIMESTAMP_DAY(timestamp), TIMESTAMP_HOUR(timestamp),
+                        TIMESTAMP_MINUTE(timestamp), reading.latitude, reading.longitude, store->region[reading.centre]);
+        }
+        int failed = ferror(f);
+        if (fclose(f) != 0 || failed){
+                printf("File %s cannot be written\n", outputName);
+                failed = 1;
+        }else{
+                printf("%ld rows around %ld stations written to %s\n", rows, generator.numCentres, outputName);
+        }
+        closeStationGenerator(&generator);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+} /* generateStations */
+
+/* generateStationStore
+   Makes rows synthetic observations around the stations of the template file, the
+   same as generateStations writes with the same seed (but not rounded to the places
+   of the file), straight into a new store, so that -bench can time a stage on as
+   many stations as it needs without writing them out. Returns 0 on success, or -1
+   after printing an error message.
+*/
+int generateStationStore(const char *templateName, long rows, unsigned long long seed, StationStore *store){
+        StationGenerator generator;
+        memset(store, 0, sizeof(StationStore));
+        if (openStationGenerator(&generator, templateName, seed) != 0)
+                return -1;
+        if (reserveStationStore(store, rows) != 0){
+                printf("Out of memory\n");
+                closeStationGenerator(&generator);
+                freeStationStore(store);
+                return -1;
+        }
+        long i;
+        for (i = 0; i < rows; i++){
+                GeneratedReading reading;
+                ParsedStation station;
+                generateReading(&generator, i, &reading);
+                station.data.stationID = generator.store.stationID[reading.centre];
+                station.data.location.latitude = reading.latitude;
+                station.data.location.longitude = reading.longitude;
+                station.data.temperature = reading.temperature;
+                station.data.year = TIMESTAMP_YEAR(reading.timestamp);
+                station.data.month = TIMESTAMP_MONTH(reading.timestamp);
+                station.data.day = TIMESTAMP_DAY(reading.timestamp);
+                station.data.hour = TIMESTAMP_HOUR(reading.timestamp);
+                station.data.minute = TIMESTAMP_MINUTE(reading.timestamp);
+                station.regionID = generator.store.region[reading.centre];
+                setStation(store, store->count++, &station);
+        }
+        closeStationGenerator(&generator);
+        return 0;
+} /* generateStationStore */
+
+
+/* ========================================================================= */
+/*                                 Profiling                                 */
+/*     With -profile, each stage of a run is timed by the monotonic clock    */
+/*     and, where perf_event_open allows, by the CPU's hardware counters.    */
+/* ========================================================================= */
+
+#ifdef HAVE_PROFILE
+
+/* Utility function reading a hardware counter of a profile: its value, and the time it was enabled and running. Returns 0 on success, or -1 */
+int readProfileCounter(Profile *profile, int counter, unsigned long long values[3]){
+        if (profile->counterFds[counter] < 0)
+                return -1;
+        return read(profile->counterFds[counter], values, 3*sizeof(unsigned long long)) == 3*sizeof(unsigned long long) ? 0 : -1;
+} /* readProfileCounter */
+
+/* openProfile
+   Sets up a profile, enabled or not. An enabled profile opens a counter of cycles,
+   instructions, cache misses and branch misses in user space for this process and
+   the threads it starts from now on; any the system does not provide (perf_event_open
+   is often not allowed in containers and virtual machines) are left out, and the
+   reason the first could not be opened is kept for printProfile.
+*/
+void openProfile(Profile *profile, int enabled){
+        int i;
+        memset(profile, 0, sizeof(Profile));
+        profile->enabled = enabled;
+        for (i = 0; i < PROFILE_COUNTERS; i++)
+                profile->counterFds[i] = -1;
+        profile->counterError = ENOSYS;
+        if (!enabled)
+                return;
+#ifdef HAVE_PERF_EVENTS
+        static const unsigned long long configs[PROFILE_COUNTERS] = {
+                PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        profile->counterError = 0;
+        for (i = 0; i < PROFILE_COUNTERS; i++){
+                struct perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = configs[i];
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.inherit = 1;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                profile->counterFds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+                if (profile->counterFds[i] < 0 && profile->counterError == 0)
+                        profile->counterError = errno;
+        }
+#endif
+        profile->start = monotonicSeconds();
+} /* openProfile */
+
+/* profileBegin
+   Starts timing a stage of the run, taking the time and the value of each hardware
+   counter. Stages beyond PROFILE_MAX_STAGES are not timed.
+*/
+void profileBegin(Profile *profile, const char *name){
+        int i;
+        if (profile->count == PROFILE_MAX_STAGES)
+                return;
+        profile->stages[profile->count].name = name;
+        for (i = 0; i < PROFILE_COUNTERS; i++){
+                if (readProfileCounter(profile, i, profile->counterStart[i]) != 0)
+                        profile->counterStart[i][0] = profile->counterStart[i][1] = profile->counterStart[i][2] = 0;
+        }
+        profile->stageStart = monotonicSeconds();
+} /* profileBegin */
+
+/* profileEnd
+   Finishes timing the stage begun last, recording its time and the change in each
+   hardware counter (scaled by the share of the stage the counter was running for,
+   when the kernel had to take turns between them), or -1 for a counter that could
+   not be read.
+*/
+void profileEnd(Profile *profile){
+        double end = monotonicSeconds();
+        int i;
+        if (profile->count == PROFILE_MAX_STAGES)
+                return;
+        ProfileStage *stage = &profile->stages[profile->count++];
+        stage->seconds = end - profile->stageStart;
+        for (i = 0; i < PROFILE_COUNTERS; i++){
+                unsigned long long values[3];
+                stage->counters[i] = -1;
+                if (readProfileCounter(profile, i, values) != 0)
+                        continue;
+                double enabled = values[1] - profile->counterStart[i][1];
+                double running = values[2] - profile->counterStart[i][2];
+                double counted = values[0] - profile->counterStart[i][0];
+                if (running > 0)
+                        stage->counters[i] = counted*enabled/running;
+                else if (enabled == 0)
+                        stage->counters[i] = 0;
+        }
+} /* profileEnd */
+
+/* Utility function printing one hardware counter of a stage in millions, or a dash if it could not be read */
+void printProfileCounter(double value){
+        if (value < 0)
+                printf(" %12s", "-");
+        else
+                printf(" %12.3f", value/1e6);
+} /* printProfileCounter */
+
+/* printProfile
+   Prints a table of the stages of a profile, each with its time, its share of the
+   whole run and its hardware counters in millions (with the instructions per cycle),
+   followed by the rows parsed and rejected, the markers emitted, the bytes read and
+   written and the peak resident set size. Then closes the counters.
+*/
+void printProfile(Profile *profile){
+        double total = monotonicSeconds() - profile->start;
+        int i, j, haveCounters = 0;
+        for (i = 0; i < PROFILE_COUNTERS; i++)
+                haveCounters = haveCounters || profile->counterFds[i] >= 0;
+        printf("profile: %-8s %10s %7s", "stage", "seconds", "share");
+        if (haveCounters)
+                printf(" %12s %12s %6s %12s %12s", "Mcycles", "Minstr", "IPC", "Mcachemiss", "Mbranchmiss");
+        printf("\n");
+        for (i = 0; i < profile->count; i++){
+                ProfileStage *stage = &profile->stages[i];
+                printf("profile: %-8s %10.6f %6.1f%%", stage->name, stage->seconds, total > 0 ? 100*stage->seconds/total : 0);
+                if (haveCounters){
+                        printProfileCounter(stage->counters[0]);
+                        printProfileCounter(stage->counters[1]);
+                        if (stage->counters[0] > 0 && stage->counters[1] >= 0)
+                                printf(" %6.2f", stage->counters[1]/stage->counters[0]);
+                        else
+                                printf(" %6s", "-");
+                        for (j = 2; j < PROFILE_COUNTERS; j++)
+                                printProfileCounter(stage->counters[j]);
+                }
+                printf("\n");
+        }
+        printf("profile: %-8s %10.6f %6.1f%%\n", "total", total, 100.0);
+        printf("profile: %ld rows parsed, %ld rejected, %ld markers emitted, %ld bytes read, %ld bytes written, peak RSS %ld KiB\n",
+                                profile->rowsParsed, profile->rowsRejected, profile->markersEmitted, profile->bytesRead,
+                                profile->bytesWritten, peakResidentKiB());
+        if (!haveCounters)
+                printf("profile: hardware counters unavailable (%s)\n", strerror(profile->counterError));
+        for (i = 0; i < PROFILE_COUNTERS; i++){
+                if (profile->counterFds[i] >= 0)
+                        close(profile->counterFds[i]);
+                profile->counterFds[i] = -1;
+        }
+} /* printProfile */
+
+#endif /* HAVE_PROFILE */
+
+
+/* ========================================================================= */
+/*                            Merging Input Files                            */
+/*     With -merge, any number of input files (or directories of them) are   */
+/*     read at once, one file per thread at a time. Each thread keeps only   */
+/*     the newest reading of each station in the files it has read, so      */
+/*     memory grows with the number of stations rather than with the input. */
+/*     The threads' readings are then merged newest first, and the first     */
+/*     reading of each station met is the one mapped.                        */
+/* ========================================================================= */
+
+/* Utility function comparing merged readings: newest first, then by descending station ID, then from the earliest input file */
+int compareMergeReadings(const void *a, const void *b){
+        const MergeReading *x = a, *y = b;
+        if (x->timestamp != y->timestamp)
+                return x->timestamp > y->timestamp ? -1 : 1;
+        if (x->station.data.stationID != y->station.data.stationID)
+                return x->station.data.stationID > y->station.data.stationID ? -1 : 1;
+        return (x->file > y->file) - (x->file < y->file);
+} /* compareMergeReadings */
+
+/* Utility function doubling the slots of the hash table of a LatestReadings */
+int growLatestReadings(LatestReadings *latest){
+        int bits = latest->bits ? latest->bits + 1 : 8;
+        long *slots = calloc(1UL << bits, sizeof(long));
+        if (slots == NULL)
+                return -1;
+        unsigned long mask = (1UL << bits) - 1;
+        long r;
+        for (r = 0; r < latest->count; r++){
+                unsigned long slot = hashBucketKey((unsigned int)latest->readings[r].station.data.stationID, bits);
+                while (slots[slot])
+                        slot = (slot + 1) & mask;
+                slots[slot] = r + 1;
+        }
+        free(latest->slots);
+        latest->slots = slots;
+        latest->bits = bits;
+        return 0;
+} /* growLatestReadings */
+
+/* noteReading
+   Folds one reading from input file number file into the newest readings of each
+   station. It is kept if it is the first of its station, or newer than the one kept,
+   or as new but from an earlier file (replacing the one kept); otherwise it is
+   dropped. Returns 0 on success, or -1 if out of memory.
+*/
+int noteReading(LatestReadings *latest, ParsedStation *station, unsigned int timestamp, long file){
+        if (2*(latest->count + 1) > (1L << latest->bits) && growLatestReadings(latest) != 0)
+                return -1;
+        unsigned long mask = (1UL << latest->bits) - 1;
+        unsigned long slot = hashBucketKey((unsigned int)station->data.stationID, latest->bits);
+        while (latest->slots[slot]){
+                MergeReading *kept = &latest->readings[latest->slots[slot] - 1];
+                if (kept->station.data.stationID == station->data.stationID){
+                        if (timestamp < kept->timestamp || (timestamp == kept->timestamp && file >= kept->file))
+                                return 0;
+                        kept->station = *station;
+                        kept->timestamp = timestamp;
+                        kept->file = file;
+                        return 0;
+                }
+                slot = (slot + 1) & mask;
+        }
+        if (latest->count == latest->capacity){
+                long capacity = latest->capacity ? 2*latest->capacity : 256;
+                MergeReading *readings = realloc(latest->readings, capacity*sizeof(MergeReading));
+                if (readings == NULL)
+                        return -1;
+                latest->readings = readings;
+                latest->capacity = capacity;
+        }
+        MergeReading *reading = &latest->readings[latest->count++];
+        reading->station = *station;
+        reading->timestamp = timestamp;
+        reading->file = file;
+        latest->slots[slot] = latest->count;
+        return 0;
+} /* noteReading */
+
+/* Utility function releasing the memory held by a LatestReadings */
+void freeLatestReadings(LatestReadings *latest){
+        free(latest->readings);
+        free(latest->slots);
+        memset(latest, 0, sizeof(LatestReadings));
+} /* freeLatestReadings */
+
+/* Utility function adding a copy of a file name to the inputs of -merge. Returns 0 on success, or -1 if out of memory. */
+int addMergeFile(MergeInputs *inputs, const char *name){
+        if (inputs->count == inputs->capacity){
+                long capacity = inputs->capacity ? 2*inputs->capacity : 16;
+                char **names = realloc(inputs->names, capacity*sizeof(char *));
+                if (names == NULL)
+                        return -1;
+                inputs->names = names;
+                inputs->capacity = capacity;
+        }
+        inputs->names[inputs->count] = strdup(name);
+        if (inputs->names[inputs->count] == NULL)
+                return -1;
+        inputs->count++;
+        return 0;
+} /* addMergeFile */
+
+/* Utility function comparing file names for qsort */
+int compareFileNames(const void *a, const void *b){
+        return strcmp(*(char *const *)a, *(char *const *)b);
+} /* compareFileNames */
+
+/* addMergeInput
+   Adds a file to the inputs of -merge, or if path is a directory, every regular file
+   in it in name order, leaving out hidden files and the sidecars of -cache. Returns
+   0 on success, or -1 after printing an error message.
+*/
+int addMergeInput(MergeInputs *inputs, const char *path){
+        struct stat info;
+        if (stat(path, &info) != 0){
+                printf("File %s cannot be opened\n", path);
+                return -1;
+        }
+        if (!S_ISDIR(info.st_mode)){
+                if (addMergeFile(inputs, path) != 0){
+                        printf("Out of memory\n");
+                        return -1;
+                }
+                return 0;
+        }
+        DIR *directory = opendir(path);
+        if (directory == NULL){
+                printf("Directory %s cannot be opened\n", path);
+                return -1;
+        }
+        long first = inputs->count;
+        int result = 0;
+        struct dirent *entry;
+        char name[PATH_MAX];
+        char cacheSuffix[PATH_MAX];
+        stationCacheName(cacheSuffix, sizeof(cacheSuffix), "");
+        size_t suffix = strlen(cacheSuffix);
+        while (result == 0 && (entry = readdir(directory)) != NULL){
+                if (entry->d_name[0] == '.')
+                        continue;
+                snprintf(name, sizeof(name), "%s%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/", entry->d_name);
+                size_t length = strlen(name);
+                if (length > suffix && strcmp(name + length - suffix, cacheSuffix) == 0)
+                        continue;
+                if (stat(name, &info) != 0 || !S_ISREG(info.st_mode))
+                        continue;
+                if (addMergeFile(inputs, name) != 0){
+                        printf("Out of memory\n");
+                        result = -1;
+                }
+        }
+        closedir(directory);
+        qsort(inputs->names + first, inputs->count - first, sizeof(char *), compareFileNames);
+        return result;
+} /* addMergeInput */
+
+/* Utility function releasing the memory held by the inputs of -merge */
+void freeMergeInputs(MergeInputs *inputs){
+        long f;
+        for (f = 0; f < inputs->count; f++)
+                free(inputs->names[f]);
+        free(inputs->names);
+        free(inputs->rejected);
+        free(inputs->unreadable);
+        memset(inputs, 0, sizeof(MergeInputs));
+} /* freeMergeInputs */
+
+/* foldInputFile
+   Streams input file number file chunk by chunk into the newest readings of a
+   thread of -merge. Only rows with a reading take part, so a row whose temperature
+   is missing never hides an older reading of its station. A file that cannot be
+   opened is marked as such. Returns 0 on success, or -1 if out of memory.
+*/
+int foldInputFile(MergeTask *task, long file){
+        MergeInputs *inputs = task->inputs;
+        InputMap map;
+        if (mapInputFile(inputs->names[file], &map) != 0){
+                inputs->unreadable[file] = 1;
+                return 0;
+        }
+        StationReader reader;
+        initStationReader(&reader, inputs->names[file], &map);
+        reader.quiet = 1;
+        int result = 0;
+        int n, c;
+        while (result == 0 && (n = readStationChunk(&reader, task->chunk, STREAM_CHUNK_ROWS)) > 0){
+                task->rows += n;
+                for (c = 0; c < n && result == 0; c++){
+                        StationData *station = &task->chunk[c].data;
+                        if (!isfinite(station->temperature))
+                                continue;
+                        unsigned int timestamp = PACK_TIMESTAMP(station->year, station->month, station->day, station->hour, station->minute);
+                        result = noteReading(&task->latest, &task->chunk[c], timestamp, file);
+                }
+        }
+        inputs->rejected[file] = reader.rejected;
+        unmapInputFile(&map);
+        return result;
+} /* foldInputFile */
+
+/* mergeTaskMain
+   Thread body used by loadMergedStations: takes the next input file not yet taken
+   and folds it in, until every file has been taken. As each thread takes files in
+   increasing order, the file of a reading decides between readings of the same
+   station and time whichever thread read them.
+*/
+void *mergeTaskMain(void *arg){
+        MergeTask *task = arg;
+        MergeInputs *inputs = task->inputs;
+        while (!task->failed){
+                pthread_mutex_lock(&inputs->lock);
+                long file = inputs->next < inputs->count ? inputs->next++ : -1;
+                pthread_mutex_unlock(&inputs->lock);
+                if (file < 0)
+                        break;
+                task->failed = foldInputFile(task, file) != 0;
+        }
+        return NULL;
+} /* mergeTaskMain */
+
+/* Utility function restoring the heap order of the runs of a k-way merge from position p down */
+void siftMergeHeap(int *heap, int size, MergeReading **heads, int p){
+        for (;;){
+                int least = p;
+                int child;
+                for (child = 2*p + 1; child <= 2*p + 2 && child < size; child++){
+                        if (compareMergeReadings(heads[heap[child]], heads[heap[least]]) < 0)
+                                least = child;
+                }
+                if (least == p)
+                        return;
+                int swap = heap[p];
+                heap[p] = heap[least];
+                heap[least] = swap;
+                p = least;
+        }
+} /* siftMergeHeap */
+
+/* loadMergedStations
+   Reads every input file of -merge with numThreads threads, then merges the newest
+   readings kept by each thread, newest first, into a store holding the newest reading
+   of each station, oldest first (ties in station ID order). Counts are added to
+   *summary, and the files that could not be opened or held malformed lines are
+   reported in the order they were named. Returns 0 on success, or -1 after printing
+   an error message.
+*/
+int loadMergedStations(MergeInputs *inputs, int numThreads, StationStore *store, MergeSummary *summary){
+        MergeTask tasks[MAX_INGEST_THREADS];
+        if (numThreads > inputs->count)
+                numThreads = inputs->count;
+        if (numThreads < 1)
+                numThreads = 1;
+        if (numThreads > MAX_INGEST_THREADS)
+                numThreads = MAX_INGEST_THREADS;
+        memset(store, 0, sizeof(StationStore));
+        memset(tasks, 0, sizeof(tasks));
+        inputs->rejected = calloc(inputs->count + 1, sizeof(long));
+        inputs->unreadable = calloc(inputs->count + 1, 1);
+        inputs->next = 0;
+        int failed = inputs->rejected == NULL || inputs->unreadable == NULL;
+        int i;
+        for (i = 0; i < numThreads && !failed; i++){
+                tasks[i].inputs = inputs;
+                tasks[i].chunk = malloc(STREAM_CHUNK_ROWS*sizeof(ParsedStation));
+                failed = tasks[i].chunk == NULL;
+        }
+
+        /* Fold the files in, with this thread taking files as well. If a thread cannot
+           be started, the others take its files. */
+        if (!failed){
+                pthread_mutex_init(&inputs->lock, NULL);
+                for (i = 1; i < numThreads; i++){
+                        tasks[i].started = (pthread_create(&tasks[i].thread, NULL, mergeTaskMain, &tasks[i]) == 0);
+                }
+                mergeTaskMain(&tasks[0]);
+                for (i = 1; i < numThreads; i++){
+                        if (tasks[i].started)
+                                pthread_join(tasks[i].thread, NULL);
+                }
+                pthread_mutex_destroy(&inputs->lock);
+        }
+
+        /* Merge the threads' readings, each sorted newest first, with a heap of the
+           next reading of each thread. The first reading of each station met is its
+           newest, and any later one is dropped. */
+        LatestReadings merged = {0};
+        MergeReading *heads[MAX_INGEST_THREADS], *ends[MAX_INGEST_THREADS];
+        int heap[MAX_INGEST_THREADS];
+        int size = 0;
+        for (i = 0; i < numThreads; i++){
+                failed = failed || tasks[i].failed;
+                summary->rows += tasks[i].rows;
+                LatestReadings *latest = &tasks[i].latest;
+                qsort(latest->readings, latest->count, sizeof(MergeReading), compareMergeReadings);
+                heads[i] = latest->readings;
+                ends[i] = latest->readings + latest->count;
+                if (latest->count > 0)
+                        heap[size++] = i;
+        }
+        for (i = size/2 - 1; i >= 0; i--)
+                siftMergeHeap(heap, size, heads, i);
+        while (size > 0 && !failed){
+                int run = heap[0];
+                MergeReading *reading = heads[run]++;
+                failed = noteReading(&merged, &reading->station, reading->timestamp, reading->file) != 0;
+                if (heads[run] == ends[run])
+                        heap[0] = heap[--size];
+                siftMergeHeap(heap, size, heads, 0);
+        }
+        for (i = 0; i < numThreads; i++){
+                freeLatestReadings(&tasks[i].latest);
+                free(tasks[i].chunk);
+        }
+
+        /* The merged readings are newest first, so they are stored from the last */
+        long r;
+        if (!failed && merged.count > 0){
+                failed = reserveStationStore(store, merged.count) != 0;
+                for (r = merged.count - 1; r >= 0 && !failed; r--)
+                        setStation(store, store->count++, &merged.readings[r].station);
+        }
+        freeLatestReadings(&merged);
+        if (failed){
+                freeStationStore(store);
+                printf("Out of memory\n");
+                return -1;
+        }
+        long f;
+        int unreadable = 0;
+        for (f = 0; f < inputs->count; f++){
+                if (inputs->unreadable[f]){
+                        printf("File %s cannot be opened\n", inputs->names[f]);
+                        unreadable = 1;
+                }else if (inputs->rejected[f] > 0){
+                        printf("%s: %ld malformed station lines skipped\n", inputs->names[f], inputs->rejected[f]);
+                }
+                store->rejected += inputs->rejected[f];
+        }
+        if (unreadable){
+                freeStationStore(store);
+                return -1;
+        }
+        summary->rejected += store->rejected;
+        summary->stations = store->count;
+        return 0;
+} /* loadMergedStations */
+
+/* plotLoadMerged
+   Loads the newest reading of each station found in any of the named files, or the
+   files of the named directories, into a context in place of any it held before,
+   with the files read by the context's threads. Readings of the same station at the
+   same time are kept once, from the file named first. Only the newest reading of each
+   station is held while reading, so memory grows with the number of stations and
+   threads, and not with the size of the input. Returns 0 on success, or -1 after
+   printing an error message.
+*/
+int plotLoadMerged(PlotContext *context, char **paths, int numPaths, MergeSummary *summary){
+        unloadPlotContext(context);
+        memset(summary, 0, sizeof(MergeSummary));
+        MergeInputs inputs;
+        memset(&inputs, 0, sizeof(MergeInputs));
+        int p;
+        for (p = 0; p < numPaths; p++){
+                if (addMergeInput(&inputs, paths[p]) != 0){
+                        freeMergeInputs(&inputs);
+                        return -1;
+                }
+        }
+        if (inputs.count == 0){
+                printf("No input files to merge\n");
+                freeMergeInputs(&inputs);
+                return -1;
+        }
+        summary->files = inputs.count;
+        long f;
+        struct stat info;
+        for (f = 0; f < inputs.count; f++){
+                if (stat(inputs.names[f], &info) == 0)
+                        summary->bytes += info.st_size;
+        }
+        int result = loadMergedStations(&inputs, context->numThreads, &context->store, summary);
+        freeMergeInputs(&inputs);
+        if (result != 0)
+                return -1;
+        context->loaded = 1;
+        return 0;
+} /* plotLoadMerged */
+
+
+/* ========================================================================= */
+/*                                HTTP Server                                */
+/*     With -serve PORT, the stations stay loaded and the map is served     */
+/*     over HTTP from one thread, which waits on every client at once with  */
+/*     epoll. The page and the markers of each viewport asked for are made  */
+/*     once and then sent from memory until the input file changes.         */
+/* ========================================================================= */
+
+#ifdef HAVE_EPOLL
+
+/* Set by the handler of SIGINT and SIGTERM to stop serveMaps */
+volatile sig_atomic_t serveInterrupted = 0;
+
+/* Utility function noting that -serve has been asked to stop */
+void interruptServer(int signalNumber){
+        (void)signalNumber;
+        serveInterrupted = 1;
+} /* interruptServer */
+
+/* Utility function making a response of -serve holding a copy of length bytes of body, or returning NULL if out of memory */
+ServeResponse *newServeResponse(int status, const char *contentType, const char *body, size_t length){
+        ServeResponse *response = malloc(sizeof(ServeResponse) + length);
+        if (response == NULL)
+                return NULL;
+        response->references = 1;
+        response->status = status;
+        response->contentType = contentType;
+        response->length = length;
+        memcpy(response->body, body, length);
+        return response;
+} /* newServeResponse */
+
+/* Utility function dropping one holder of a response of -serve, and freeing it with the last */
+void releaseServeResponse(ServeResponse *response){
+        if (response && --response->references == 0)
+                free(response);
+} /* releaseServeResponse */
+
+/* Utility function emptying the viewport cache of -serve */
+void clearServeCache(ServeState *state){
+        int slot;
+        for (slot = 0; slot < SERVE_CACHE_SLOTS; slot++){
+                releaseServeResponse(state->cache[slot].response);
+                state->cache[slot].response = NULL;
+        }
+} /* clearServeCache */
+
+/* Utility function closing a context of -serve and releasing the memory it was set up in */
+void freeServedContext(PlotContext *context){
+        closePlotContext(context);
+        free(context);
+} /* freeServedContext */
+
+/* loadServedStations
+   Loads the input file of -serve into a new context and makes the page and the
+   cluster levels of its stations, then puts them in place of those served before
+   and empties the cache. If anything fails, the stations served before are kept.
+   Returns 0 on success, or -1 after printing an error message.
 */
-void writeEpilogue(FILE *f){
-        if (!f){
-                printf("writeEpilogue error: output file == NULL\n");
-                exit(1);
+int loadServedStations(ServeState *state){
+        struct stat info;
+        if (stat(state->inputName, &info) != 0){
+                printf("File %s cannot be opened\n", state->inputName);
+                return -1;
+        }
+        PlotContext *context = malloc(sizeof(PlotContext));
+        if (context == NULL || openPlotContext(context, &state->options, state->options.registry, state->numThreads) != 0){
+                free(context);
+                printf("Out of memory\n");
+                return -1;
+        }
+        if (plotLoad(context, state->inputName, state->useCache) != 0){
+                freeServedContext(context);
+                return -1;
+        }
+        plotAggregate(context);
+        ClusterLevel levels[CLUSTER_MAX_ZOOM + 1];
+        if (plotClassify(context) != 0 || plotEstimateECS(context) != 0 || buildClusterLevels(levels, &context->store, context->store.count) != 0){
+                freeServedContext(context);
+                printf("Out of memory\n");
+                return -1;
         }
-        fputs("  }\n",f);
-        fputs("</script>\n",f);
-        fputs("</head>\n",f);
-        fputs("<body onload=\"initialize()\">\n",f);
-        fputs("  <div id=\"map_canvas\" style=\"width:100%; height:100%\"></div>\n",f);
-        fputs("</body>\n",f);
-        fputs("</html>\n",f);
-} /* writeEpilogue */
 
-/* Utility function to change ' to \' in strings */
-void escapeQuotes(char *dest, char *src){
-        while (*src){
-                if (*src == '\'')
-                        *dest++ = '\\';
-                *dest++ = *src++;
+        /* The page is written into memory, exactly as writeMap would write it */
+        HtmlWriter writer;
+        ServeResponse *page = NULL;
+        int written = 0;
+        if (initHtmlWriter(&writer, -1) == 0){
+                written = writeMapPage(&writer, NULL, &context->store, context->store.count, context->avgTemp, context->ecsTemp, &context->options) >= 0;
+                if (written)
+                        page = newServeResponse(200, "text/html; charset=utf-8", writer.buffer, writer.used);
+                closeHtmlWriter(&writer);
+        }
+        if (page == NULL){
+                if (written)
+                        printf("Out of memory\n");
+                freeClusterLevels(levels);
+                freeServedContext(context);
+                return -1;
         }
-        *dest = '\0';
-} /* escapeQuotes */
 
-/* Utility function to implement the strnlen library function,
-   which may not be available on some platforms
+        if (state->page){
+                freeClusterLevels(state->levels);
+                freeServedContext(state->context);
+                releaseServeResponse(state->page);
+        }
+        state->context = context;
+        memcpy(state->levels, levels, sizeof(levels));
+        state->page = page;
+        state->loaded = info;
+        clearServeCache(state);
+        return 0;
+} /* loadServedStations */
+
+/* Utility function loading the input file of -serve again if it has changed since it was last loaded */
+void reloadIfChanged(ServeState *state){
+        struct stat info;
+        state->checked = monotonicSeconds();
+        if (stat(state->inputName, &info) != 0)
+                return;
+        if (info.st_size == state->loaded.st_size && info.st_ino == state->loaded.st_ino &&
+            info.st_mtim.tv_sec == state->loaded.st_mtim.tv_sec && info.st_mtim.tv_nsec == state->loaded.st_mtim.tv_nsec)
+                return;
+        double start = monotonicSeconds();
+        if (loadServedStations(state) == 0){
+                state->reloads++;
+                printf("%s: changed, %ld stations reloaded in %.4f s and the cache emptied\n",
+                       state->inputName, state->context->store.count, monotonicSeconds() - start);
+        }else{
+                /* Wait for the next change rather than failing again every check */
+                state->loaded = info;
+        }
+        fflush(stdout);
+#ifdef HAVE_INOTIFY
+        if (state->notifyFd >= 0)
+                inotify_add_watch(state->notifyFd, state->inputName, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+} /* reloadIfChanged */
+
+/* Utility function writing a number as JSON with the given decimals, or null if it is not finite */
+void writeJsonNumber(FILE *f, double value, int decimals){
+        if (isfinite(value))
+                fprintf(f, "%.*f", decimals, value);
+        else
+                fputs("null", f);
+} /* writeJsonNumber */
+
+/* Utility function telling whether a viewport holds a point, given its longitude from -180 up to 180 degrees */
+int viewportContains(Viewport *viewport, double latitude, double longitude){
+        if (latitude < viewport->south || latitude > viewport->north)
+                return 0;
+        if (viewport->west <= viewport->east)
+                return longitude >= viewport->west && longitude <= viewport->east;
+        return longitude >= viewport->west || longitude <= viewport->east;
+} /* viewportContains */
+
+/* parseViewport
+   Reads a viewport from the query string of a request for /markers: its south, west,
+   north and east edges in degrees and its zoom level, each defaulting to the whole
+   world as seen beyond CLUSTER_MAX_ZOOM (which every zoom level past it is taken to
+   be, as the page shows the same stations at all of them). Other parameters are
+   ignored. Returns 0 on success, or -1 if a value is malformed or out of range.
 */
-int strnlen2(char* str, int maxSize){
-        int i;
-        for (i = 0; i < maxSize; i++)
-                if (str[i] == '\0')
+int parseViewport(const char *query, Viewport *viewport){
+        /* Zeroed first, so that the padding of the cache key is always the same */
+        memset(viewport, 0, sizeof(Viewport));
+        viewport->south = -90;
+        viewport->west = -180;
+        viewport->north = 90;
+        viewport->east = 180;
+        viewport->zoom = CLUSTER_MAX_ZOOM + 1;
+        while (*query){
+                const char *end = strchr(query, '&');
+                if (end == NULL)
+                        end = query + strlen(query);
+                const char *equals = memchr(query, '=', end - query);
+                if (equals){
+                        size_t nameLength = equals - query;
+                        char *stop;
+                        double value = strtod(equals + 1, &stop);
+                        double *edge = NULL;
+                        if (nameLength == 5 && strncmp(query, "south", 5) == 0)
+                                edge = &viewport->south;
+                        else if (nameLength == 4 && strncmp(query, "west", 4) == 0)
+                                edge = &viewport->west;
+                        else if (nameLength == 5 && strncmp(query, "north", 5) == 0)
+                                edge = &viewport->north;
+                        else if (nameLength == 4 && strncmp(query, "east", 4) == 0)
+                                edge = &viewport->east;
+                        else if (nameLength == 4 && strncmp(query, "zoom", 4) == 0){
+                                if (stop != end || stop == equals + 1 || value < 0 || value != floor(value))
+                                        return -1;
+                                viewport->zoom = value > CLUSTER_MAX_ZOOM ? CLUSTER_MAX_ZOOM + 1 : (int)value;
+                        }
+                        if (edge){
+                                if (stop != end || stop == equals + 1 || !isfinite(value))
+                                        return -1;
+                                *edge = value;
+                        }
+                }
+                query = *end ? end + 1 : end;
+        }
+        if (viewport->south < -90 || viewport->north > 90 || viewport->south > viewport->north ||
+            viewport->west < -180 || viewport->west > 180 || viewport->east < -180 || viewport->east > 180)
+                return -1;
+        return 0;
+} /* parseViewport */
+
+/* writeViewportJson
+   Writes the markers within a viewport as JSON, along with the average temperature
+   and the ECS estimate: the clusters of its zoom level whose centres lie within it,
+   or beyond CLUSTER_MAX_ZOOM the stations with a reading themselves, as the page
+   would show them. Longitudes are given from -180 up to 180 degrees.
+*/
+void writeViewportJson(FILE *f, ServeState *state, Viewport *viewport){
+        PlotContext *context = state->context;
+        StationStore *store = &context->store;
+        StationRegistry *registry = context->options.registry;
+        int clustered = viewport->zoom <= CLUSTER_MAX_ZOOM;
+        fprintf(f, "{\"zoom\": %d, \"average\": ", viewport->zoom);
+        writeJsonNumber(f, context->avgTemp, 2);
+        fputs(", \"ecs\": ", f);
+        writeJsonNumber(f, context->ecsTemp, 2);
+        fprintf(f, ", \"clustered\": %s, \"markers\": [", clustered ? "true" : "false");
+        long i;
+        long count = 0;
+        if (clustered){
+                ClusterLevel *level = &state->levels[viewport->zoom];
+                for (i = 0; i < level->count; i++){
+                        Cluster *c = &level->clusters[i];
+                        double latitude = c->sumLatitude/c->count;
+                        double longitude = c->sumX/c->count*360 - 180;
+                        if (!viewportContains(viewport, latitude, longitude))
+                                continue;
+                        float temperature = c->sumTemperature/c->count;
+                        fputs(count++ > 0 ? ",\n" : "\n", f);
+                        fprintf(f, "{\"latitude\": %.6f, \"longitude\": %.6f, \"stations\": %ld, \"temperature\": %.2f, \"type\": %d}",
+                                latitude, longitude, c->count, temperature, bandTypeFor(&context->options.bands, temperature, context->avgTemp));
+                }
+        }else{
+                /* The stations are picked a block of rows at a time by selectInBox */
+                GeoBox box;
+                long selected[SERVE_SELECT_ROWS];
+                long from, n, k;
+                viewportBox(viewport, 0, &box);
+                for (from = 0; from < store->count; from += SERVE_SELECT_ROWS){
+                        n = selectInBox(&box, store, from, from + SERVE_SELECT_ROWS < store->count ? from + SERVE_SELECT_ROWS : store->count, selected);
+                        for (k = 0; k < n; k++){
+                                i = selected[k];
+                                double longitude = wrapLongitude(store->longitude[i]);
+                                unsigned int timestamp = store->timestamp[i];
+                                RegisteredStation *station = &registry->stations[stationNameHandle(registry, store->stationID[i])];
+                                fputs(count++ > 0 ? ",\n" : "\n", f);
+                                fprintf(f, "{\"id\": %d, \"name\": ", store->stationID[i]);
+                                writeJsString(f, registry->arena + station->name);
+                                fprintf(f, ", \"latitude\": %.6f, \"longitude\": %.6f, \"temperature\": %.2f, \"type\": %d, \"time\": \"%04u-%02u-%02u %02u:%02u\"}",
+                                        store->latitude[i], longitude, store->temperature[i], store->type[i],
+                                        TIMESTAMP_YEAR(timestamp), TIMESTAMP_MONTH(timestamp), TIMESTAMP_DAY(timestamp),
+                                        TIMESTAMP_HOUR(timestamp), TIMESTAMP_MINUTE(timestamp));
+                        }
+                }
+        }
+        fprintf(f, "%s], \"count\": %ld}\n", count > 0 ? "\n" : "", count);
+} /* writeViewportJson */
+
+/* Utility function comparing latencies for qsort */
+int compareLatencies(const void *a, const void *b){
+        double x = *(const double *)a, y = *(const double *)b;
+        return (x > y) - (x < y);
+} /* compareLatencies */
+
+/* Utility function returning the latency below which a fraction of n sorted latencies lie (the nearest rank) */
+double sortedPercentile(double *sorted, long n, double fraction){
+        long rank = (long)ceil(fraction*n);
+        return sorted[rank > 0 ? rank - 1 : 0];
+} /* sortedPercentile */
+
+/* serveLatencies
+   Finds the median and 99th percentile latency, in seconds, of the latest requests
+   answered by -serve (up to SERVE_LATENCY_SAMPLES of them), or 0 if there were none.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int serveLatencies(ServeState *state, double *p50, double *p99){
+        long n = state->requests < SERVE_LATENCY_SAMPLES ? state->requests : SERVE_LATENCY_SAMPLES;
+        *p50 = 0;
+        *p99 = 0;
+        if (n == 0)
+                return 0;
+        double *sorted = malloc(n*sizeof(double));
+        if (sorted == NULL)
+                return -1;
+        memcpy(sorted, state->latencies, n*sizeof(double));
+        qsort(sorted, n, sizeof(double), compareLatencies);
+        *p50 = sortedPercentile(sorted, n, 0.5);
+        *p99 = sortedPercentile(sorted, n, 0.99);
+        free(sorted);
+        return 0;
+} /* serveLatencies */
+
+/* Utility function writing the counts and latencies of -serve as JSON */
+void writeServeStats(FILE *f, ServeState *state){
+        double p50, p99;
+        serveLatencies(state, &p50, &p99);
+        fprintf(f, "{\"requests\": %ld, \"cacheHits\": %ld, \"cacheMisses\": %ld, \"reloads\": %ld, \"connections\": %ld, "
+                   "\"stations\": %ld, \"latencySamples\": %ld, \"p50Seconds\": %.6f, \"p99Seconds\": %.6f}\n",
+                state->requests, state->cacheHits, state->cacheMisses, state->reloads, state->numConnections,
+                state->context->store.count, state->requests < SERVE_LATENCY_SAMPLES ? state->requests : SERVE_LATENCY_SAMPLES, p50, p99);
+} /* writeServeStats */
+
+/* Utility function making a response of -serve from whatever a writing function writes, or returning NULL if out of memory */
+ServeResponse *capturedResponse(ServeState *state, void (*writeBody)(FILE *, ServeState *, Viewport *), Viewport *viewport){
+        char *text = NULL;
+        size_t length = 0;
+        FILE *memFp = open_memstream(&text, &length);
+        if (memFp == NULL)
+                return NULL;
+        writeBody(memFp, state, viewport);
+        if (fclose(memFp) != 0){
+                free(text);
+                return NULL;
+        }
+        ServeResponse *response = newServeResponse(200, "application/json", text, length);
+        free(text);
+        return response;
+} /* capturedResponse */
+
+/* Utility function writing the statistics of -serve through capturedResponse */
+void writeServeStatsBody(FILE *f, ServeState *state, Viewport *viewport){
+        (void)viewport;
+        writeServeStats(f, state);
+} /* writeServeStatsBody */
+
+/* routeRequest
+   Returns the response of -serve to a GET for target, with one reference taken for
+   the caller: the page at /, the markers of a viewport at /markers (from the cache
+   if it has been asked for since the last load), and the counts and latencies of the
+   server at /stats. Returns NULL if out of memory.
+*/
+ServeResponse *routeRequest(ServeState *state, char *target){
+        char *query = strchr(target, '?');
+        if (query)
+                *query++ = '\0';
+        if (strcmp(target, "/") == 0 || strcmp(target, "/index.html") == 0){
+                state->page->references++;
+                return state->page;
+        }
+        if (strcmp(target, "/markers") == 0){
+                Viewport viewport;
+                if (parseViewport(query ? query : "", &viewport) != 0){
+                        const char *message = "The viewport must be given as numbers: south, west, north and east in degrees, and a zoom level\n";
+                        return newServeResponse(400, "text/plain", message, strlen(message));
+                }
+                ServeCacheEntry *entry = &state->cache[hashBytes(&viewport, sizeof(Viewport), 0) % SERVE_CACHE_SLOTS];
+                if (entry->response && memcmp(&entry->viewport, &viewport, sizeof(Viewport)) == 0){
+                        state->cacheHits++;
+                }else{
+                        ServeResponse *response = capturedResponse(state, writeViewportJson, &viewport);
+                        if (response == NULL)
+                                return NULL;
+                        state->cacheMisses++;
+                        releaseServeResponse(entry->response);
+                        entry->viewport = viewport;
+                        entry->response = response;
+                }
+                entry->response->references++;
+                return entry->response;
+        }
+        if (strcmp(target, "/stats") == 0)
+                return capturedResponse(state, writeServeStatsBody, NULL);
+        const char *message = "Not found\n";
+        return newServeResponse(404, "text/plain", message, strlen(message));
+} /* routeRequest */
+
+/* Utility function returning the reason phrase of an HTTP status */
+const char *statusReason(int status){
+        switch (status){
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        default: return "Internal Server Error";
+        }
+} /* statusReason */
+
+/* startResponse
+   Looks for a complete request (its request line and headers) at the start of what
+   a connection has read, and if there is one, sets up the response to it. Only GET
+   and HEAD are answered; requests with bodies are not read. A connection is kept
+   open after the response unless the client asks otherwise, or uses HTTP/1.0
+   without asking for it to be kept. Returns 1 if a response was set up, 0 if the
+   request is still to be read in full, or -1 if out of memory.
+*/
+int startResponse(ServeState *state, ServeConnection *connection){
+        char *request = connection->request;
+        char *end = NULL;
+        size_t k;
+        for (k = 0; k + 4 <= connection->received; k++){
+                if (memcmp(request + k, "\r\n\r\n", 4) == 0){
+                        end = request + k;
+                        break;
+                }
+        }
+        ServeResponse *response = NULL;
+        connection->started = monotonicSeconds();
+        connection->headOnly = 0;
+        if (end == NULL){
+                if (connection->received < SERVE_REQUEST_MAX)
+                        return 0;
+                const char *message = "Request too long\n";
+                response = newServeResponse(431, "text/plain", message, strlen(message));
+                connection->consumed = connection->received;
+                connection->closeAfter = 1;
+        }else{
+                *end = '\0';
+                connection->consumed = end + 4 - request;
+
+                /* The request line, then each header line */
+                char *lineEnd = strstr(request, "\r\n");
+                if (lineEnd)
+                        *lineEnd = '\0';
+                char *method = request;
+                char *target = strchr(method, ' ');
+                char *version = target ? strchr(target + 1, ' ') : NULL;
+                if (target)
+                        *target++ = '\0';
+                if (version)
+                        *version++ = '\0';
+                connection->closeAfter = version == NULL || strcmp(version, "HTTP/1.1") != 0;
+                char *line = lineEnd ? lineEnd + 2 : end;
+                while (line < end){
+                        char *next = strstr(line, "\r\n");
+                        if (next)
+                                *next = '\0';
+                        if (strncasecmp(line, "Connection:", 11) == 0){
+                                char *value = line + 11;
+                                while (*value == ' ' || *value == '\t')
+                                        value++;
+                                if (strncasecmp(value, "close", 5) == 0)
+                                        connection->closeAfter = 1;
+                                else if (strncasecmp(value, "keep-alive", 10) == 0)
+                                        connection->closeAfter = 0;
+                        }
+                        line = next ? next + 2 : end;
+                }
+
+                if (version == NULL || target[0] != '/'){
+                        const char *message = "Malformed request\n";
+                        response = newServeResponse(400, "text/plain", message, strlen(message));
+                        connection->closeAfter = 1;
+                }else if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0){
+                        connection->headOnly = method[0] == 'H';
+                        response = routeRequest(state, target);
+                }else{
+                        const char *message = "Only GET and HEAD are supported\n";
+                        response = newServeResponse(405, "text/plain", message, strlen(message));
+                        connection->closeAfter = 1;
+                }
+        }
+        if (response == NULL)
+                return -1;
+        connection->response = response;
+        connection->sent = 0;
+        connection->headerLength = snprintf(connection->header, sizeof(connection->header),
+                "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nCache-Control: no-cache\r\n%s\r\n",
+                response->status, statusReason(response->status), response->contentType, (unsigned long)response->length,
+                connection->closeAfter ? "Connection: close\r\n" : "");
+        return 1;
+} /* startResponse */
+
+/* sendResponse
+   Sends as much of the response of a connection as its socket takes. Returns 1 once
+   all of it has been sent, 0 if the rest must wait for the socket, or -1 if the
+   connection has failed.
+*/
+int sendResponse(ServeConnection *connection){
+        ServeResponse *response = connection->response;
+        size_t bodyLength = connection->headOnly ? 0 : response->length;
+        size_t total = connection->headerLength + bodyLength;
+        while (connection->sent < total){
+                struct iovec parts[2];
+                int numParts = 0;
+                if (connection->sent < connection->headerLength){
+                        parts[numParts].iov_base = connection->header + connection->sent;
+                        parts[numParts++].iov_len = connection->headerLength - connection->sent;
+                        if (bodyLength > 0){
+                                parts[numParts].iov_base = response->body;
+                                parts[numParts++].iov_len = bodyLength;
+                        }
+                }else{
+                        parts[numParts].iov_base = response->body + (connection->sent - connection->headerLength);
+                        parts[numParts++].iov_len = total - connection->sent;
+                }
+                struct msghdr message;
+                memset(&message, 0, sizeof(message));
+                message.msg_iov = parts;
+                message.msg_iovlen = numParts;
+                ssize_t written = sendmsg(connection->fd, &message, MSG_NOSIGNAL);
+                if (written < 0){
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 0;
+                        return -1;
+                }
+                connection->sent += written;
+        }
+        return 1;
+} /* sendResponse */
+
+/* Utility function setting what epoll waits for on a connection of -serve: for it to be readable, or writable while a response waits for it */
+void watchServeConnection(ServeState *state, ServeConnection *connection, int operation){
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = connection->waiting ? EPOLLOUT : EPOLLIN;
+        event.data.ptr = connection;
+        epoll_ctl(state->epollFd, operation, connection->fd, &event);
+} /* watchServeConnection */
+
+/* Utility function closing a connection of -serve and releasing what it holds */
+void closeServeConnection(ServeState *state, ServeConnection *connection){
+        epoll_ctl(state->epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+        close(connection->fd);
+        releaseServeResponse(connection->response);
+        if (connection->previous)
+                connection->previous->next = connection->next;
+        else
+                state->connections = connection->next;
+        if (connection->next)
+                connection->next->previous = connection->previous;
+        free(connection);
+        state->numConnections--;
+} /* closeServeConnection */
+
+/* serveConnection
+   Reads what a client has sent and answers each complete request in turn, for as
+   long as the socket takes the responses without waiting. Each request's latency is
+   recorded once its response has been sent. The connection is closed when the client
+   closes it, after a response that closes it, or if it fails.
+*/
+void serveConnection(ServeState *state, ServeConnection *connection){
+        while (1){
+                if (connection->response){
+                        int sent = sendResponse(connection);
+                        if (sent < 0){
+                                closeServeConnection(state, connection);
+                                return;
+                        }
+                        if (sent == 0){
+                                if (!connection->waiting){
+                                        connection->waiting = 1;
+                                        watchServeConnection(state, connection, EPOLL_CTL_MOD);
+                                }
+                                return;
+                        }
+                        state->latencies[state->requests++ % SERVE_LATENCY_SAMPLES] = monotonicSeconds() - connection->started;
+                        releaseServeResponse(connection->response);
+                        connection->response = NULL;
+                        if (connection->closeAfter){
+                                closeServeConnection(state, connection);
+                                return;
+                        }
+                        if (connection->waiting){
+                                connection->waiting = 0;
+                                watchServeConnection(state, connection, EPOLL_CTL_MOD);
+                        }
+                        /* Keep any requests sent after the one answered */
+                        connection->received -= connection->consumed;
+                        memmove(connection->request, connection->request + connection->consumed, connection->received);
+                        connection->consumed = 0;
+                }
+                int found = startResponse(state, connection);
+                if (found < 0){
+                        closeServeConnection(state, connection);
+                        return;
+                }
+                if (found > 0)
+                        continue;
+                ssize_t got = read(connection->fd, connection->request + connection->received, SERVE_REQUEST_MAX - connection->received);
+                if (got > 0){
+                        connection->received += got;
+                        continue;
+                }
+                if (got < 0 && errno == EINTR)
+                        continue;
+                if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                closeServeConnection(state, connection);
+                return;
+        }
+} /* serveConnection */
+
+/* Utility function accepting every connection waiting on the listening socket of -serve */
+void acceptServeConnections(ServeState *state){
+        while (1){
+                int fd = accept(state->listenFd, NULL, NULL);
+                if (fd < 0){
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+                ServeConnection *connection = NULL;
+                if (state->numConnections < SERVE_MAX_CONNECTIONS)
+                        connection = malloc(sizeof(ServeConnection));
+                if (connection == NULL){
+                        close(fd);
+                        continue;
+                }
+                int on = 1;
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                connection->fd = fd;
+                connection->received = 0;
+                connection->consumed = 0;
+                connection->response = NULL;
+                connection->closeAfter = 0;
+                connection->waiting = 0;
+                connection->previous = NULL;
+                connection->next = state->connections;
+                if (state->connections)
+                        state->connections->previous = connection;
+                state->connections = connection;
+                state->numConnections++;
+                watchServeConnection(state, connection, EPOLL_CTL_ADD);
+        }
+} /* acceptServeConnections */
+
+/* Utility function adding a file descriptor of -serve other than a connection to its epoll instance, tagged with the address it is held at */
+int watchServeFd(ServeState *state, int *fd){
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = fd;
+        return epoll_ctl(state->epollFd, EPOLL_CTL_ADD, *fd, &event);
+} /* watchServeFd */
+
+/* closeServer
+   Closes every connection and file descriptor of -serve and releases what it holds.
+*/
+void closeServer(ServeState *state){
+        while (state->connections)
+                closeServeConnection(state, state->connections);
+        if (state->listenFd >= 0)
+                close(state->listenFd);
+        if (state->epollFd >= 0)
+                close(state->epollFd);
+        if (state->notifyFd >= 0)
+                close(state->notifyFd);
+        if (state->stopFds[0] >= 0){
+                close(state->stopFds[0]);
+                close(state->stopFds[1]);
+        }
+        clearServeCache(state);
+        if (state->page){
+                releaseServeResponse(state->page);
+                freeClusterLevels(state->levels);
+                freeServedContext(state->context);
+                state->context = NULL;
+                state->page = NULL;
+        }
+        free(state->latencies);
+        state->latencies = NULL;
+} /* closeServer */
+
+/* openServer
+   Loads the input file for -serve and opens its listening socket on the given port
+   of the loopback interface (or on any free port if it is 0, which is then found in
+   state->port). Returns 0 on success, or -1 after printing an error message.
+*/
+int openServer(ServeState *state, const char *inputName, int port, int numThreads, int useCache, MapOptions *options){
+        memset(state, 0, sizeof(ServeState));
+        state->inputName = inputName;
+        state->useCache = useCache;
+        state->numThreads = numThreads;
+        state->options = *options;
+        state->listenFd = -1;
+        state->epollFd = -1;
+        state->notifyFd = -1;
+        state->stopFds[0] = state->stopFds[1] = -1;
+        state->latencies = malloc(SERVE_LATENCY_SAMPLES*sizeof(double));
+        if (state->latencies == NULL){
+                printf("Out of memory\n");
+                return -1;
+        }
+        if (loadServedStations(state) != 0){
+                closeServer(state);
+                return -1;
+        }
+        state->checked = monotonicSeconds();
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t addressLength = sizeof(address);
+        int on = 1;
+        state->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (state->listenFd < 0 ||
+            setsockopt(state->listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+            bind(state->listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+            listen(state->listenFd, SOMAXCONN) != 0 ||
+            getsockname(state->listenFd, (struct sockaddr *)&address, &addressLength) != 0){
+                printf("Port %d cannot be listened on (%s)\n", port, strerror(errno));
+                closeServer(state);
+                return -1;
+        }
+        state->port = ntohs(address.sin_port);
+        fcntl(state->listenFd, F_SETFL, fcntl(state->listenFd, F_GETFL) | O_NONBLOCK);
+
+        state->epollFd = epoll_create1(0);
+        if (state->epollFd < 0 || pipe(state->stopFds) != 0 ||
+            watchServeFd(state, &state->listenFd) != 0 || watchServeFd(state, &state->stopFds[0]) != 0){
+                printf("The server cannot be started (%s)\n", strerror(errno));
+                closeServer(state);
+                return -1;
+        }
+#ifdef HAVE_INOTIFY
+        state->notifyFd = inotify_init();
+        if (state->notifyFd >= 0 &&
+            (inotify_add_watch(state->notifyFd, inputName, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0 ||
+             watchServeFd(state, &state->notifyFd) != 0)){
+                close(state->notifyFd);
+                state->notifyFd = -1;
+        }
+#endif
+        return 0;
+} /* openServer */
+
+/* runServer
+   Answers the clients of -serve, and loads the input file again whenever it changes
+   (as inotify reports, or as found by checking it every WATCH_POLL_MS milliseconds),
+   until interrupted or until a byte is written to state->stopFds[1].
+*/
+void runServer(ServeState *state){
+        struct epoll_event events[64];
+        while (!serveInterrupted){
+                int n = epoll_wait(state->epollFd, events, 64, WATCH_POLL_MS);
+                if (n < 0){
+                        if (errno == EINTR)
+                                continue;
+                        printf("The server has failed (%s)\n", strerror(errno));
+                        return;
+                }
+                int changed = 0;
+                int k;
+                for (k = 0; k < n; k++){
+                        void *tag = events[k].data.ptr;
+                        if (tag == &state->listenFd){
+                                acceptServeConnections(state);
+                        }else if (tag == &state->stopFds[0]){
+                                return;
+                        }else if (tag == &state->notifyFd){
+                                char notices[4096];
+                                if (read(state->notifyFd, notices, sizeof(notices)) > 0)
+                                        changed = 1;
+                        }else{
+                                serveConnection(state, tag);
+                        }
+                }
+                if (changed || monotonicSeconds() - state->checked >= WATCH_POLL_MS/1000.0)
+                        reloadIfChanged(state);
+        }
+} /* runServer */
+
+/* serveMaps
+   Serves the map of the input file at http://127.0.0.1:PORT/, and the markers of any
+   viewport as JSON at /markers, until interrupted, then prints the number of requests
+   answered and their median and 99th percentile latency.
+*/
+int serveMaps(const char *inputName, int port, int numThreads, int useCache, MapOptions *options){
+        ServeState state;
+        if (openServer(&state, inputName, port, numThreads, useCache, options) != 0)
+                return EXIT_FAILURE;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = interruptServer;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        printf("Serving the map of %s (%ld stations) at http://127.0.0.1:%d/\n", inputName, state.context->store.count, state.port);
+        fflush(stdout);
+
+        runServer(&state);
+
+        double p50, p99;
+        serveLatencies(&state, &p50, &p99);
+        printf("%ld requests answered (%ld viewports from the cache, %ld made), latency p50 %.3f ms, p99 %.3f ms\n",
+               state.requests, state.cacheHits, state.cacheMisses, 1000*p50, 1000*p99);
+        closeServer(&state);
+        return EXIT_SUCCESS;
+} /* serveMaps */
+
+/* Utility function running a server of -serve on its own thread, for benchmarkServe */
+void *serverThreadMain(void *arg){
+        runServer(arg);
+        return NULL;
+} /* serverThreadMain */
+
+/* Utility function reading one whole response from a blocking socket into *buffer (grown as needed), storing its length in *length and returning its status, or -1 if the connection failed */
+int readHttpResponse(int fd, char **buffer, size_t *size, size_t *length){
+        size_t received = 0;
+        size_t total = 0;
+        int status = -1;
+        while (total == 0 || received < total){
+                if (received == *size){
+                        size_t grown = *size ? 2**size : 65536;
+                        char *bigger = realloc(*buffer, grown + 1);
+                        if (bigger == NULL)
+                                return -1;
+                        *buffer = bigger;
+                        *size = grown;
+                }
+                ssize_t got = read(fd, *buffer + received, *size - received);
+                if (got < 0 && errno == EINTR)
+                        continue;
+                if (got <= 0)
+                        return -1;
+                received += got;
+                if (total == 0){
+                        (*buffer)[received] = '\0';
+                        char *end = strstr(*buffer, "\r\n\r\n");
+                        char *contentLength = strstr(*buffer, "Content-Length: ");
+                        if (end && contentLength && sscanf(*buffer, "HTTP/1.1 %d", &status) == 1)
+                                total = end + 4 - *buffer + strtoul(contentLength + 16, NULL, 10);
+                }
+        }
+        *length = total;
+        return status;
+} /* readHttpResponse */
+
+/* benchmarkServe
+   Starts a server of -serve on a free port and makes SERVE_BENCH_REQUESTS requests
+   to it one after another over one connection, as a client would: mostly for the
+   markers of 64 different viewports around the ECS Building at zoom levels 8 to 16
+   (so that all but the first request for each is answered from the cache), and every
+   500th for the page. Prints the requests answered per second and the median and
+   99th percentile latency seen by the client.
+*/
+int benchmarkServe(const char *inputName, int numThreads, BenchReport *report){
+        MapOptions options;
+        memset(&options, 0, sizeof(options));
+        StationRegistry registry;
+        if (loadDefaultStations(&registry) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        options.registry = &registry;
+        ServeState state;
+        if (openServer(&state, inputName, 0, numThreads, 0, &options) != 0){
+                freeStationRegistry(&registry);
+                return EXIT_FAILURE;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serverThreadMain, &state) != 0){
+                printf("The server thread cannot be started\n");
+                closeServer(&state);
+                freeStationRegistry(&registry);
+                return EXIT_FAILURE;
+        }
+
+        double *latencies = malloc(SERVE_BENCH_REQUESTS*sizeof(double));
+        char *buffer = NULL;
+        size_t size = 0;
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(state.port);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        int result = EXIT_SUCCESS;
+        if (latencies == NULL || fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0){
+                printf("The server cannot be reached\n");
+                result = EXIT_FAILURE;
+        }else{
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        double bytes = 0;
+        double start = monotonicSeconds();
+        long r;
+        for (r = 0; r < SERVE_BENCH_REQUESTS && result == EXIT_SUCCESS; r++){
+                char request[256];
+                int v = r % 64;
+                double half = 0.01*(1 + v/8);
+                if (r % 500 == 0)
+                        snprintf(request, sizeof(request), "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n");
+                else
+                        snprintf(request, sizeof(request), "GET /markers?south=%.4f&west=%.4f&north=%.4f&east=%.4f&zoom=%d HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+                                 ECS_LATITUDE - half, ECS_LONGITUDE - half, ECS_LATITUDE + half, ECS_LONGITUDE + half, 8 + v % 9);
+                double sent = monotonicSeconds();
+                size_t length;
+                if (writeFully(fd, request, strlen(request)) != 0 || readHttpResponse(fd, &buffer, &size, &length) != 200){
+                        printf("serve: request %ld failed\n", r);
+                        result = EXIT_FAILURE;
                         break;
+                }
+                latencies[r] = monotonicSeconds() - sent;
+                bytes += length;
+        }
+        double seconds = monotonicSeconds() - start;
+        if (fd >= 0)
+                close(fd);
+        if (write(state.stopFds[1], "", 1) != 1)
+                result = EXIT_FAILURE;
+        pthread_join(thread, NULL);
+
+        if (result == EXIT_SUCCESS){
+                qsort(latencies, SERVE_BENCH_REQUESTS, sizeof(double), compareLatencies);
+                double p50 = sortedPercentile(latencies, SERVE_BENCH_REQUESTS, 0.5);
+                double p99 = sortedPercentile(latencies, SERVE_BENCH_REQUESTS, 0.99);
+                printf("serve: %d requests in %.4f s (%.0f requests/s, %.1f MB/s), latency p50 %.3f ms, p99 %.3f ms, %ld viewports from the cache and %ld made\n",
+                       SERVE_BENCH_REQUESTS, seconds, SERVE_BENCH_REQUESTS/seconds, bytes/seconds/1e6, 1000*p50, 1000*p99, state.cacheHits, state.cacheMisses);
+                benchRecord(report, "serve", 1, seconds, SERVE_BENCH_REQUESTS, "requests", bytes);
+                benchRecord(report, "serve.p50", 1, p50, 1, "requests", 0);
+                benchRecord(report, "serve.p99", 1, p99, 1, "requests", 0);
+        }
+        free(buffer);
+        free(latencies);
+        closeServer(&state);
+        freeStationRegistry(&registry);
+        return result;
+} /* benchmarkServe */
+
+#endif
+
+
+/* ========================================================================= */
+/*                             Viewport Culling                              */
+/*     With -viewport or -centre, the page opens on one area of the map and  */
+/*     holds only the stations within it (and a margin). Every other         */
+/*     station goes to a chunk file for the box of the page's own size that  */
+/*     it lies in, and the page loads each chunk the first time its box      */
+/*     comes into view. The stations are picked by comparing whole vectors   */
+/*     of the latitude and longitude columns against the box at once.        */
+/* ========================================================================= */
+
+/* wrapLongitude
+   Returns a longitude given in any turn of the globe as one from -180 up to 180
+   degrees.
+*/
+double wrapLongitude(double longitude){
+        longitude = fmod(longitude + 180, 360);
+        if (longitude < 0)
+                longitude += 360;
+        return longitude - 180;
+} /* wrapLongitude */
+
+/* Utility function setting a viewport to the area a window of VIEWPORT_WIDTH_PIXELS by VIEWPORT_HEIGHT_PIXELS shows around a centre at a zoom level */
+void viewportAround(double latitude, double longitude, int zoom, Viewport *viewport){
+        double worldPixels = 256*ldexp(1, zoom);
+        double width = 360*VIEWPORT_WIDTH_PIXELS/worldPixels;
+        double y = mercatorY(latitude), halfHeight = VIEWPORT_HEIGHT_PIXELS/2.0/worldPixels;
+        memset(viewport, 0, sizeof(Viewport));
+        viewport->north = mercatorLatitude(y - halfHeight > 0 ? y - halfHeight : 0);
+        viewport->south = mercatorLatitude(y + halfHeight < 1 ? y + halfHeight : 1);
+        if (width >= 360){
+                viewport->west = -180;
+                viewport->east = 180;
+        }else{
+                viewport->west = wrapLongitude(longitude - width/2);
+                viewport->east = wrapLongitude(longitude + width/2);
+        }
+        viewport->zoom = zoom;
+} /* viewportAround */
+
+/* parseBoundingBox
+   Reads a viewport given as "SOUTH,WEST,NORTH,EAST" in degrees, whose longitudes may
+   be given in any turn of the globe (west may be greater than east across the 180th
+   meridian). The page of a viewport read this way is fitted to it, so its zoom level
+   is set to -1. Returns 0 on success, or -1 if it is malformed or empty.
+*/
+int parseBoundingBox(const char *text, Viewport *viewport){
+        double south, west, north, east;
+        char extra;
+        memset(viewport, 0, sizeof(Viewport));
+        if (sscanf(text, "%lf,%lf,%lf,%lf%c", &south, &west, &north, &east, &extra) != 4 ||
+            !isfinite(south) || !isfinite(west) || !isfinite(north) || !isfinite(east) ||
+            south < -90 || north > 90 || south >= north)
+                return -1;
+        viewport->south = south;
+        viewport->north = north;
+        if (east - west >= 360){
+                viewport->west = -180;
+                viewport->east = 180;
+        }else{
+                viewport->west = wrapLongitude(west);
+                viewport->east = wrapLongitude(east);
+                if (viewport->west == viewport->east)
+                        return -1;
+        }
+        viewport->zoom = -1;
+        return 0;
+} /* parseBoundingBox */
+
+/* parseCentre
+   Reads a viewport given as "LATITUDE,LONGITUDE,ZOOM": the area a window of
+   VIEWPORT_WIDTH_PIXELS by VIEWPORT_HEIGHT_PIXELS shows around that centre at that
+   zoom level (from 0 up to VIEWPORT_MAX_ZOOM), which the page opens on. Returns 0 on
+   success, or -1 if it is malformed or out of range.
+*/
+int parseCentre(const char *text, Viewport *viewport){
+        double latitude, longitude;
+        int zoom;
+        char extra;
+        if (sscanf(text, "%lf,%lf,%d%c", &latitude, &longitude, &zoom, &extra) != 3 ||
+            !isfinite(latitude) || !isfinite(longitude) || latitude < -CLUSTER_MAX_LATITUDE ||
+            latitude > CLUSTER_MAX_LATITUDE || zoom < 0 || zoom > VIEWPORT_MAX_ZOOM)
+                return -1;
+        viewportAround(latitude, longitude, zoom, viewport);
+        return 0;
+} /* parseCentre */
+
+/* viewportBox
+   Sets up a box holding a viewport and margin times its height and width beyond each
+   of its edges (latitudes stop at the poles). A box a whole turn of the globe wide
+   takes every longitude; any other has the span from its west edge (from -180 up to
+   180 degrees) to its east edge, and the same span one turn east and one turn west,
+   so that it holds stations given with longitudes from -540 up to 900 degrees.
+*/
+void viewportBox(Viewport *viewport, double margin, GeoBox *box){
+        double height = viewport->north - viewport->south;
+        double width = viewport->east - viewport->west;
+        if (width < 0)
+                width += 360;
+        memset(box, 0, sizeof(GeoBox));
+        box->south = viewport->south - margin*height > -90 ? viewport->south - margin*height : -90;
+        box->north = viewport->north + margin*height < 90 ? viewport->north + margin*height : 90;
+        if (width*(1 + 2*margin) >= 360){
+                box->numSpans = 1;
+                box->west[0] = -INFINITY;
+                box->east[0] = INFINITY;
+                return;
+        }
+        double west = wrapLongitude(viewport->west - margin*width);
+        int s;
+        box->numSpans = GEOBOX_SPANS;
+        for (s = 0; s < GEOBOX_SPANS; s++){
+                box->west[s] = west + 360*(s - 1);
+                box->east[s] = west + width*(1 + 2*margin) + 360*(s - 1);
+        }
+} /* viewportBox */
+
+/* selectInBoxScalar
+   The scalar form of selectInBox, used for the rows after the last whole vector and
+   on CPUs without SIMD support. Returns the number of rows selected.
+*/
+long selectInBoxScalar(GeoBox *box, StationStore *store, long from, long to, long *selected){
+        long i, n = 0;
+        for (i = from; i < to; i++){
+                float latitude = store->latitude[i], longitude = store->longitude[i];
+                if (!store->valid[i] || !(latitude >= box->south && latitude <= box->north))
+                        continue;
+                int s;
+                for (s = 0; s < box->numSpans; s++){
+                        if (longitude >= box->west[s] && longitude <= box->east[s]){
+                                selected[n++] = i;
+                                break;
+                        }
+                }
+        }
+        return n;
+} /* selectInBoxScalar */
+
+#ifdef HAVE_X86_SIMD
+
+/* selectInBoxAvx2
+   The selectInBox kernel for 8 rows at a time, on CPUs with AVX2. The rows in the box
+   are found with one mask from the compares of each vector, and their rows stored in
+   turn from its set bits. Adds the number of rows selected to *numSelected, and
+   returns the row it stopped at; the rest are left to selectInBoxScalar.
+*/
+__attribute__((target("avx2")))
+long selectInBoxAvx2(GeoBox *box, StationStore *store, long from, long to, long *selected, long *numSelected){
+        __m256 south = _mm256_set1_ps(box->south), north = _mm256_set1_ps(box->north);
+        __m256 west[GEOBOX_SPANS], east[GEOBOX_SPANS];
+        int s;
+        for (s = 0; s < box->numSpans; s++){
+                west[s] = _mm256_set1_ps(box->west[s]);
+                east[s] = _mm256_set1_ps(box->east[s]);
+        }
+        long i, n = *numSelected;
+        for (i = from; i + 8 <= to; i += 8){
+                __m256 latitude = _mm256_loadu_ps(store->latitude + i);
+                __m256 longitude = _mm256_loadu_ps(store->longitude + i);
+                __m256 inside = _mm256_and_ps(_mm256_cmp_ps(latitude, south, _CMP_GE_OQ), _mm256_cmp_ps(latitude, north, _CMP_LE_OQ));
+                __m256 spans = _mm256_setzero_ps();
+                for (s = 0; s < box->numSpans; s++)
+                        spans = _mm256_or_ps(spans, _mm256_and_ps(_mm256_cmp_ps(longitude, west[s], _CMP_GE_OQ),
+                                                                 _mm256_cmp_ps(longitude, east[s], _CMP_LE_OQ)));
+                unsigned int mask = _mm256_movemask_ps(_mm256_and_ps(inside, spans));
+                if (mask == 0)
+                        continue;
+                __m128i valid = _mm_loadl_epi64((const __m128i *)(store->valid + i));
+                mask &= ~_mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128()));
+                while (mask){
+                        selected[n++] = i + __builtin_ctz(mask);
+                        mask &= mask - 1;
+                }
+        }
+        *numSelected = n;
         return i;
-} /* strnlen2 */
+} /* selectInBoxAvx2 */
 
-#define NUM_MARKER_TYPES 5
-char *MarkerPaths[] = {
-        [MARKER_RED] = "http://maps.google.com/mapfiles/ms/icons/red-dot.png",
-        [MARKER_GREEN] = "http://maps.google.com/mapfiles/ms/icons/green-dot.png",
-        [MARKER_BLUE] = "http://maps.google.com/mapfiles/ms/icons/blue-dot.png",
-        [MARKER_PURPLE] = "http://maps.google.com/mapfiles/ms/icons/purple-dot.png",
-    [MARKER_YELLOW] = "http://maps.google.com/mapfiles/ms/icons/yellow-dot.png"
+/* selectInBoxSse2
+   The selectInBox kernel for 4 rows at a time, for any x86 CPU with SSE2. Adds the
+   number of rows selected to *numSelected, and returns the row it stopped at.
+*/
+long selectInBoxSse2(GeoBox *box, StationStore *store, long from, long to, long *selected, long *numSelected){
+        __m128 south = _mm_set1_ps(box->south), north = _mm_set1_ps(box->north);
+        __m128 west[GEOBOX_SPANS], east[GEOBOX_SPANS];
+        int s;
+        for (s = 0; s < box->numSpans; s++){
+                west[s] = _mm_set1_ps(box->west[s]);
+                east[s] = _mm_set1_ps(box->east[s]);
+        }
+        long i, n = *numSelected;
+        for (i = from; i + 4 <= to; i += 4){
+                __m128 latitude = _mm_loadu_ps(store->latitude + i);
+                __m128 longitude = _mm_loadu_ps(store->longitude + i);
+                __m128 inside = _mm_and_ps(_mm_cmpge_ps(latitude, south), _mm_cmple_ps(latitude, north));
+                __m128 spans = _mm_setzero_ps();
+                for (s = 0; s < box->numSpans; s++)
+                        spans = _mm_or_ps(spans, _mm_and_ps(_mm_cmpge_ps(longitude, west[s]), _mm_cmple_ps(longitude, east[s])));
+                unsigned int mask = _mm_movemask_ps(_mm_and_ps(inside, spans));
+                while (mask){
+                        long row = i + __builtin_ctz(mask);
+                        if (store->valid[row])
+                                selected[n++] = row;
+                        mask &= mask - 1;
+                }
+        }
+        *numSelected = n;
+        return i;
+} /* selectInBoxSse2 */
+
+#endif /* HAVE_X86_SIMD */
+
+/* The vector kernel selectInBox uses on this CPU (NULL if there is none) and its
+   name, chosen once, on first use */
+long (*selectInBoxVector)(GeoBox *box, StationStore *store, long from, long to, long *selected, long *numSelected) = NULL;
+const char *selectInBoxVectorName = "scalar";
+pthread_once_t selectInBoxChosen = PTHREAD_ONCE_INIT;
+
+/* Utility function choosing the kernel selectInBox uses on this CPU */
+void chooseSelectInBoxKernel(){
+#ifdef HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2")){
+                selectInBoxVector = selectInBoxAvx2;
+                selectInBoxVectorName = "avx2";
+        }else{
+                selectInBoxVector = selectInBoxSse2;
+                selectInBoxVectorName = "sse2";
+        }
+#endif
+} /* chooseSelectInBoxKernel */
+
+/* Utility function naming the kernel selectInBox uses on this CPU */
+const char *selectInBoxKernel(){
+        pthread_once(&selectInBoxChosen, chooseSelectInBoxKernel);
+        return selectInBoxVectorName;
+} /* selectInBoxKernel */
+
+/* selectInBox
+   Stores the rows from row from up to row to of a store that hold stations with a
+   reading within a box into selected (which must have room for to - from rows), in
+   order, and returns their number. A station is in the box if its latitude and its
+   longitude (as given, in any of the box's spans) are each between the box's edges
+   or on them.
+*/
+long selectInBox(GeoBox *box, StationStore *store, long from, long to, long *selected){
+        long n = 0, done = from;
+        selectInBoxKernel();
+        if (selectInBoxVector != NULL)
+                done = selectInBoxVector(box, store, from, to, selected, &n);
+        return n + selectInBoxScalar(box, store, done, to, selected + n);
+} /* selectInBox */
+
+/* Utility function comparing stations by chunk, and then by row, for qsort */
+int compareChunkedStations(const void *a, const void *b){
+        const ChunkedStation *x = a, *y = b;
+        if (x->chunk != y->chunk)
+                return x->chunk > y->chunk ? 1 : -1;
+        return (x->row > y->row) - (x->row < y->row);
+} /* compareChunkedStations */
+
+/* cullStations
+   Splits the stations with a reading among the first t stations of a store into
+   those in the page of a viewport (within it, or within VIEWPORT_MARGIN of its height
+   and width of it) and those outside it. The map is tiled with boxes of the page's
+   size, lined up with it, and each box holding any of the stations outside becomes a
+   chunk, with the chunks in order from south to north and then eastward from the
+   page's west edge. Stations without a finite location are left out, as are all the
+   stations outside the page if chunked is not set.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int cullStations(CulledStations *culled, StationStore *store, long t, Viewport *viewport, int chunked){
+        memset(culled, 0, sizeof(CulledStations));
+        GeoBox *box = &culled->box;
+        viewportBox(viewport, VIEWPORT_MARGIN, box);
+        culled->inside = malloc((t + 1)*sizeof(long));
+        if (culled->inside == NULL)
+                return -1;
+        culled->numInside = selectInBox(box, store, 0, t, culled->inside);
+        if (!chunked)
+                return 0;
+
+        /* The tiles are numbered row by row from the one at the south pole, each row
+           numColumns tiles wide eastward from the page's west edge */
+        double height = box->north - box->south;
+        double west = box->numSpans == 1 ? -180 : box->west[1];
+        double width = box->numSpans == 1 ? 360 : box->east[1] - box->west[1];
+        long firstRow = (long)floor((-90 - box->south)/height);
+        long numColumns = (long)ceil(360/width);
+        ChunkedStation *stations = malloc((t - culled->numInside + 1)*sizeof(ChunkedStation));
+        if (stations == NULL){
+                freeCulledStations(culled);
+                return -1;
+        }
+        long i, k = 0, n = 0;
+        for (i = 0; i < t; i++){
+                if (k < culled->numInside && culled->inside[k] == i){
+                        k++;
+                        continue;
+                }
+                float latitude = store->latitude[i], longitude = store->longitude[i];
+                if (!store->valid[i] || !isfinite(latitude) || !isfinite(longitude))
+                        continue;
+                double east = fmod(longitude - west, 360);
+                if (east < 0)
+                        east += 360;
+                long row = (long)floor((latitude - box->south)/height) - firstRow;
+                long column = (long)(east/width);
+                if (column >= numColumns)
+                        column = numColumns - 1;
+                stations[n].chunk = row*numColumns + column;
+                stations[n].row = i;
+                n++;
+        }
+        qsort(stations, n, sizeof(ChunkedStation), compareChunkedStations);
+
+        /* Make a chunk for each run of stations in the same tile */
+        culled->outside = malloc((n + 1)*sizeof(long));
+        culled->chunks = malloc((n + 1)*sizeof(MarkerChunk));
+        if (culled->outside == NULL || culled->chunks == NULL){
+                free(stations);
+                freeCulledStations(culled);
+                return -1;
+        }
+        for (i = 0; i < n; i++){
+                culled->outside[i] = stations[i].row;
+                if (i > 0 && stations[i].chunk == stations[i - 1].chunk){
+                        culled->chunks[culled->numChunks - 1].count++;
+                        continue;
+                }
+                long row = stations[i].chunk/numColumns + firstRow, column = stations[i].chunk % numColumns;
+                MarkerChunk *chunk = &culled->chunks[culled->numChunks++];
+                double south = box->south + row*height, north = box->south + (row + 1)*height;
+                double right = (column + 1)*width;
+                chunk->south = south > -90 ? south : -90;
+                chunk->north = north < 90 ? north : 90;
+                chunk->west = wrapLongitude(west + column*width);
+                chunk->east = wrapLongitude(west + (right < 360 ? right : 360 - 1e-6));
+                chunk->first = i;
+                chunk->count = 1;
+        }
+        culled->numOutside = n;
+        free(stations);
+        return 0;
+} /* cullStations */
+
+/* freeCulledStations
+   Releases the memory held by a CulledStations.
+*/
+void freeCulledStations(CulledStations *culled){
+        free(culled->inside);
+        free(culled->outside);
+        free(culled->chunks);
+        memset(culled, 0, sizeof(CulledStations));
+} /* freeCulledStations */
+
+/* Utility function writing the name of the chunk directory of an output file to dest */
+void chunkDirectoryName(char *dest, size_t size, const char *outputName){
+        snprintf(dest, size, "%s%s", outputName, MARKER_CHUNK_SUFFIX);
+} /* chunkDirectoryName */
+
+/* removeMarkerChunks
+   Removes the chunk files of an earlier culled map written to outputName from its
+   chunk directory, and the directory itself if nothing else is left in it, so that
+   no map written to outputName afterwards leaves them behind.
+*/
+void removeMarkerChunks(const char *outputName){
+        char directory[PATH_MAX];
+        chunkDirectoryName(directory, sizeof(directory), outputName);
+        DIR *dir = opendir(directory);
+        if (dir == NULL)
+                return;
+        struct dirent *entry;
+        char name[PATH_MAX + NAME_MAX + 2];
+        while ((entry = readdir(dir)) != NULL){
+                char *end;
+                strtol(entry->d_name, &end, 10);
+                if (end == entry->d_name || strcmp(end, ".js") != 0)
+                        continue;
+                snprintf(name, sizeof(name), "%s/%s", directory, entry->d_name);
+                unlink(name);
+        }
+        closedir(dir);
+        rmdir(directory);
+} /* removeMarkerChunks */
+
+/* writeMarkerChunks
+   Writes each chunk of a culled map to its own file, named by its number, in the
+   chunk directory of outputName (outputName followed by MARKER_CHUNK_SUFFIX), from
+   which writeMap has removed the chunks of any map written there before. Each file
+   is a script calling addChunk with the records of its stations, as
+   writerStationRecord writes them. Returns the number of records written, or -1
+   after printing an error message.
+*/
+long writeMarkerChunks(const char *outputName, StationStore *store, CulledStations *culled, StationRegistry *registry){
+        char directory[PATH_MAX], name[PATH_MAX + 32];
+        chunkDirectoryName(directory, sizeof(directory), outputName);
+        if (culled->numChunks == 0)
+                return 0;
+        long records = 0;
+        if (mkdir(directory, 0777) != 0 && errno != EEXIST){
+                printf("Directory %s cannot be created\n", directory);
+                return -1;
+        }
+        long c, k;
+        for (c = 0; c < culled->numChunks; c++){
+                MarkerChunk *chunk = &culled->chunks[c];
+                HtmlWriter writer;
+                snprintf(name, sizeof(name), "%s/%ld.js", directory, c);
+                if (openHtmlWriter(&writer, name) != 0){
+                        printf("File %s cannot be opened\n", name);
+                        return -1;
+                }
+                writer.registry = registry;
+                writerAppend(&writer, "addChunk([\n", strlen("addChunk([\n"));
+                for (k = chunk->first; k < chunk->first + chunk->count; k++)
+                        writerStationRecord(&writer, store, culled->outside[k]);
+                writerAppend(&writer, "\n]);\n", strlen("\n]);\n"));
+                records += writer.numMarkers;
+                if (closeHtmlWriter(&writer) != 0){
+                        printf("File %s cannot be written\n", name);
+                        return -1;
+                }
+        }
+        return records;
+} /* writeMarkerChunks */
+
+/* writerCulledView
+   Adds the code that opens the page of a culled map on its viewport (around its
+   centre at its zoom level, or fitted to it if its zoom level is -1), then the name of
+   its chunk directory relative to the page and the south, west, north and east edges
+   of each chunk. Without an output file, the map has no chunks.
+*/
+void writerCulledView(HtmlWriter *writer, CulledStations *culled, Viewport *viewport, const char *outputName){
+        char text[256];
+        int length;
+        if (viewport->zoom >= 0){
+                double width = viewport->east - viewport->west;
+                if (width < 0)
+                        width += 360;
+                double y = (mercatorY(viewport->south) + mercatorY(viewport->north))/2;
+                length = snprintf(text, sizeof(text), "\tmap.setCenter(new google.maps.LatLng(%f,%f));\n\tmap.setZoom(%d);\n",
+                                  mercatorLatitude(y), wrapLongitude(viewport->west + width/2), viewport->zoom);
+        }else{
+                length = snprintf(text, sizeof(text), "\tmap.fitBounds(new google.maps.LatLngBounds(new google.maps.LatLng(%f,%f), new google.maps.LatLng(%f,%f)));\n",
+                                  viewport->south, viewport->west, viewport->north, viewport->east);
+        }
+        writerAppend(writer, text, length);
+
+        char directory[PATH_MAX] = "";
+        long c;
+        if (outputName){
+                const char *base = strrchr(outputName, '/');
+                chunkDirectoryName(directory, sizeof(directory), base ? base + 1 : outputName);
+        }
+        writerAppend(writer, "\tvar chunkDirectory = ", strlen("\tvar chunkDirectory = "));
+        char *start = writerReserve(writer, 6*strlen(directory) + 3);
+        writer->used += copyJsString(start, directory) - start;
+        writerAppend(writer, ";\n\t/* south, west, north and east edges of each chunk */\n\tvar chunkBounds = [",
+                     strlen(";\n\t/* south, west, north and east edges of each chunk */\n\tvar chunkBounds = ["));
+        for (c = 0; outputName && c < culled->numChunks; c++){
+                MarkerChunk *chunk = &culled->chunks[c];
+                char *p = start = writerReserve(writer, 128);
+                if (c > 0)
+                        *p++ = ',';
+                *p++ = '[';
+                p = formatTrimmed(p, chunk->south, 6);
+                *p++ = ',';
+                p = formatTrimmed(p, chunk->west, 6);
+                *p++ = ',';
+                p = formatTrimmed(p, chunk->north, 6);
+                *p++ = ',';
+                p = formatTrimmed(p, chunk->east, 6);
+                *p++ = ']';
+                writer->used += p - start;
+        }
+        writerAppend(writer, "];\n", 3);
+} /* writerCulledView */
+
+/* writeChunkLoader
+   Writes the code that loads each chunk of a culled map, by adding a script element
+   for its file (which works for a page opened from disk as well as over HTTP), once
+   the map first comes to rest with any of the chunk's box in view. Each chunk file
+   calls addChunk, which creates the markers of its stations with addStation.
+*/
+void writeChunkLoader(FILE *f){
+        if (!f){
+                printf("writeChunkLoader error: output file == NULL\n");
+                exit(1);
+        }
+        fputs("\tvar chunkRequested = [];\n",f);
+        fputs("\twindow.addChunk = function(data) {\n",f);
+        fputs("\t\tstationData = data;\n",f);
+        fputs("\t\tfor (var i = 0; i < data.length; i += 6) addStation(i);\n",f);
+        fputs("\t};\n",f);
+        fputs("\tfunction loadChunks() {\n",f);
+        fputs("\t\tvar view = map.getBounds();\n",f);
+        fputs("\t\tif (!view) return;\n",f);
+        fputs("\t\tfor (var c = 0; c < chunkBounds.length; c++) {\n",f);
+        fputs("\t\t\tvar b = chunkBounds[c];\n",f);
+        fputs("\t\t\tif (chunkRequested[c] || !view.intersects(new google.maps.LatLngBounds(new google.maps.LatLng(b[0],b[1]), new google.maps.LatLng(b[2],b[3])))) continue;\n",f);
+        fputs("\t\t\tchunkRequested[c] = true;\n",f);
+        fputs("\t\t\tvar script = document.createElement('script');\n",f);
+        fputs("\t\t\tscript.src = encodeURIComponent(chunkDirectory) + '/' + c + '.js';\n",f);
+        fputs("\t\t\tdocument.getElementsByTagName('head')[0].appendChild(script);\n",f);
+        fputs("\t\t}\n",f);
+        fputs("\t}\n",f);
+        fputs("\tgoogle.maps.event.addListener(map, 'idle', loadChunks);\n",f);
+} /* writeChunkLoader */
+
+/* benchmarkViewport
+   Picks the stations of the input file within the page of the viewport -centre gives
+   for the ECS Building at zoom level 13, with scalar code and with selectInBox, checks
+   that both pick the same stations and compares their speed in rows per second. Then
+   writes that culled page (in memory, without its chunks) and the whole compact page,
+   and compares their size and time.
+*/
+int benchmarkViewport(const char *inputName, int numThreads, BenchReport *report){
+        MapOptions options;
+        memset(&options, 0, sizeof(options));
+        options.compact = 1;
+        PlotContext context;
+        if (openPlotContext(&context, &options, NULL, numThreads) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        if (plotLoad(&context, inputName, 0) != 0){
+                closePlotContext(&context);
+                return EXIT_FAILURE;
+        }
+        plotAggregate(&context);
+        StationStore *store = &context.store;
+        long count = store->count;
+        long *expected = malloc((count + 1)*sizeof(long));
+        long *selected = malloc((count + 1)*sizeof(long));
+        if (expected == NULL || selected == NULL || plotClassify(&context) != 0 || plotEstimateECS(&context) != 0){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        Viewport viewport;
+        GeoBox box;
+        viewportAround(ECS_LATITUDE, ECS_LONGITUDE, 13, &viewport);
+        viewportBox(&viewport, VIEWPORT_MARGIN, &box);
+
+        double bestScalar = 0, bestSelect = 0;
+        long numExpected = 0, numSelected = 0;
+        int run;
+        for (run = 0; run < BENCH_RUNS; run++){
+                double start = monotonicSeconds();
+                numExpected = selectInBoxScalar(&box, store, 0, count, expected);
+                double elapsed = monotonicSeconds() - start;
+                if (run == 0 || elapsed < bestScalar)
+                        bestScalar = elapsed;
+                start = monotonicSeconds();
+                numSelected = selectInBox(&box, store, 0, count, selected);
+                elapsed = monotonicSeconds() - start;
+                if (run == 0 || elapsed < bestSelect)
+                        bestSelect = elapsed;
+        }
+        int identical = numSelected == numExpected && memcmp(selected, expected, numSelected*sizeof(long)) == 0;
+        free(expected);
+        free(selected);
+
+        /* Write the culled page and the compact page in memory */
+        double pageTime[2];
+        size_t pageBytes[2];
+        int form;
+        for (form = 0; form < 2; form++){
+                HtmlWriter writer;
+                if (initHtmlWriter(&writer, -1) != 0){
+                        printf("Out of memory\n");
+                        return EXIT_FAILURE;
+                }
+                context.options.culled = form == 0;
+                context.options.viewport = viewport;
+                double start = monotonicSeconds();
+                if (writeMapPage(&writer, NULL, store, count, context.avgTemp, context.ecsTemp, &context.options) < 0)
+                        return EXIT_FAILURE;
+                pageTime[form] = monotonicSeconds() - start;
+                pageBytes[form] = writer.used;
+                closeHtmlWriter(&writer);
+        }
+        printf("viewport: %ld of %ld rows in the page at zoom 13, scalar %.1f Mrows/s, select (%s) %.1f Mrows/s, speedup %.1fx, selections %s\n",
+                                numSelected, count, count/bestScalar/1e6, selectInBoxKernel(), count/bestSelect/1e6,
+                                bestScalar/bestSelect, identical ? "identical" : "DIFFERENT");
+        printf("viewport page: %lu bytes (%.1f%% of compact) in %.4f s, compact %lu bytes in %.4f s\n",
+                                (unsigned long)pageBytes[0], 100.0*pageBytes[0]/pageBytes[1], pageTime[0],
+                                (unsigned long)pageBytes[1], pageTime[1]);
+        benchRecord(report, "viewport.scalar", 1, bestScalar, count, "rows", 0);
+        benchRecord(report, "viewport.select", 1, bestSelect, count, "rows", 0);
+        benchRecord(report, "viewport.page", 1, pageTime[0], numSelected, "markers", pageBytes[0]);
+        closePlotContext(&context);
+        return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+} /* benchmarkViewport */
+
+
+/* ========================================================================= */
+/*                               Colour Bands                                */
+/*     With -bands, the markers are coloured by a table of bands given at    */
+/*     run time instead of the Program Key: thresholds of one kind, in       */
+/*     ascending order, between the colours of the bands. The thresholds     */
+/*     are first resolved against the readings (quantiles by selection,      */
+/*     not by sorting), and then each vector of readings is compared with    */
+/*     every threshold at once, the band being the count of thresholds a     */
+/*     reading is not below, and its colour looked up in the table.          */
+/* ========================================================================= */
+
+/* The names of the marker colours a table of bands may use, indexed by MARKER_* */
+const char *MarkerColourNames[NUM_MARKER_TYPES] = {
+        [MARKER_RED] = "red",
+        [MARKER_BLUE] = "blue",
+        [MARKER_GREEN] = "green",
+        [MARKER_YELLOW] = "yellow",
+        [MARKER_PURPLE] = "purple"
+};
+
+/* The names of the kinds of threshold, indexed by BANDS_* */
+const char *BandKindNames[] = {
+        [BANDS_OFFSET] = "offset",
+        [BANDS_ABSOLUTE] = "absolute",
+        [BANDS_STDDEV] = "stddev",
+        [BANDS_QUANTILE] = "quantile"
 };
 
-/* writePoint
-   This function adds a Google Maps marker to the output file for the MapMarker
-   provided.
+/* Utility function returning the marker colour with the given name of length characters, or -1 if there is none */
+int colourNamed(const char *name, size_t length){
+        int c;
+        for (c = 0; c < NUM_MARKER_TYPES; c++){
+                if (strlen(MarkerColourNames[c]) == length && strncmp(name, MarkerColourNames[c], length) == 0)
+                        return c;
+        }
+        return -1;
+} /* colourNamed */
+
+/* parseBandSpec
+   Reads a table of colour bands given as "KIND:COLOUR,THRESHOLD,...,COLOUR", with no
+   spaces. KIND is offset, absolute, stddev or quantile, the colours are names from
+   MarkerColourNames and there are from 1 to BANDS_MAX_THRESHOLDS thresholds, in
+   ascending order (from 0 to 1 for quantiles). The colours may be left out of a table
+   of three thresholds, which then takes the Program Key's blue, green, yellow and red.
+   Returns 0 on success, or -1 if the table is malformed.
+*/
+int parseBandSpec(const char *text, BandTable *bands){
+        static const int KeyColours[] = {MARKER_BLUE, MARKER_GREEN, MARKER_YELLOW, MARKER_RED};
+        memset(bands, 0, sizeof(BandTable));
+        const char *colon = strchr(text, ':');
+        if (colon == NULL)
+                return -1;
+        int kind;
+        for (kind = BANDS_OFFSET; kind <= BANDS_QUANTILE; kind++){
+                if (strlen(BandKindNames[kind]) == (size_t)(colon - text) && strncmp(text, BandKindNames[kind], colon - text) == 0)
+                        break;
+        }
+        if (kind > BANDS_QUANTILE)
+                return -1;
+        bands->kind = kind;
+
+        /* The items alternate between colours and thresholds, starting and ending with a
+           colour, or are all thresholds */
+        int numColours = 0;
+        const char *item = colon + 1;
+        while (1){
+                const char *end = strchr(item, ',');
+                if (end == NULL)
+                        end = item + strlen(item);
+                int colour = colourNamed(item, end - item);
+                if (colour >= 0){
+                        if (numColours != bands->numThresholds)
+                                return -1;
+                        bands->colours[numColours++] = colour;
+                }else{
+                        char *stop;
+                        double value = strtod(item, &stop);
+                        if (stop != end || stop == item || !isfinite(value) || bands->numThresholds == BANDS_MAX_THRESHOLDS ||
+                            (numColours > 0 && numColours != bands->numThresholds + 1) ||
+                            (kind == BANDS_QUANTILE && (value < 0 || value > 1)) ||
+                            (bands->numThresholds > 0 && (float)value <= bands->values[bands->numThresholds - 1]))
+                                return -1;
+                        bands->values[bands->numThresholds++] = value;
+                }
+                if (*end == '\0')
+                        break;
+                item = end + 1;
+        }
+        if (bands->numThresholds == 0)
+                return -1;
+        if (numColours == 0){
+                if (bands->numThresholds != 3)
+                        return -1;
+                memcpy(bands->colours, KeyColours, sizeof(KeyColours));
+        }else if (numColours != bands->numThresholds + 1){
+                return -1;
+        }
+        return 0;
+} /* parseBandSpec */
+
+/* parseBands
+   Reads a table of colour bands given as parseBandSpec takes it, or, if the text holds
+   no ':', from the file it names, which holds the same table with any white space and
+   # comments (to the end of their line) in it.
+   Returns 0 on success, or -1 after printing an error message.
+*/
+int parseBands(const char *text, BandTable *bands){
+        char spec[4096];
+        if (strchr(text, ':') == NULL){
+                FILE *bandsFp = fopen(text, "r");
+                if (bandsFp == NULL){
+                        printf("File %s cannot be opened\n", text);
+                        return -1;
+                }
+                size_t length = 0;
+                int c, comment = 0;
+                while ((c = getc(bandsFp)) != EOF){
+                        if (c == '\n')
+                                comment = 0;
+                        else if (c == '#')
+                                comment = 1;
+                        if (comment || isspace(c))
+                                continue;
+                        if (length + 1 == sizeof(spec))
+                                break;
+                        spec[length++] = c;
+                }
+                spec[length] = '\0';
+                fclose(bandsFp);
+                text = spec;
+        }
+        if (parseBandSpec(text, bands) != 0){
+                printf("The bands must be given as KIND:COLOUR,THRESHOLD,...,COLOUR, with KIND offset, absolute, stddev or quantile and from 1 to %d thresholds in ascending order\n",
+                       BANDS_MAX_THRESHOLDS);
+                return -1;
+        }
+        return 0;
+} /* parseBands */
+
+/* selectRank
+   Returns the value of rank k (from 0) among n values, as they would be in ascending
+   order, by quickselect with a three-way partition (so that runs of equal readings
+   are settled in one pass). The values are reordered so that none before place k is
+   greater than it and none after it is smaller.
 */
-void writePoint(FILE *f, MapMarker *marker){
-        static int numMarkers = 0;
-        char escapedName[2*sizeof(marker->markerName)],escapedText[2*sizeof(marker->markerText)];
-        int markerNum = numMarkers++;
-        if (!f){
-                printf("writePoint error: output file == NULL\n");
-                exit(1);
+float selectRank(float *values, long n, long k){
+        long lo = 0, hi = n;
+        while (hi - lo > 1){
+                float a = values[lo], b = values[lo + (hi - lo)/2], c = values[hi - 1];
+                float pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+                long lt = lo, i = lo, gt = hi;
+                while (i < gt){
+                        float value = values[i];
+                        if (value < pivot){
+                                values[i++] = values[lt];
+                                values[lt++] = value;
+                        }else if (value > pivot){
+                                values[i] = values[--gt];
+                                values[gt] = value;
+                        }else{
+                                i++;
+                        }
+                }
+                if (k < lt)
+                        hi = lt;
+                else if (k >= gt)
+                        lo = gt;
+                else
+                        return pivot;
         }
-        /* Try to make sure that the input data is properly set */
-        if (!marker){
-                printf("writePoint error: marker == NULL\n");
-                exit(1);
+        return values[lo];
+} /* selectRank */
+
+/* Utility function setting the thresholds of a table of quantile bands to the readings of the ranks its quantiles give among n values, each selected from the values above the last */
+void quantileThresholds(BandTable *bands, float *values, long n){
+        long from = 0;
+        int j;
+        for (j = 0; j < bands->numThresholds; j++){
+                if (n == 0){
+                        bands->thresholds[j] = 0;
+                        continue;
+                }
+                long k = (long)(bands->values[j]*n);
+                if (k > n - 1)
+                        k = n - 1;
+                if (k < from)
+                        k = from;
+                bands->thresholds[j] = selectRank(values + from, n - from, k - from);
+                from = k;
         }
-        if (strnlen2(marker->markerName,sizeof(marker->markerName)) == sizeof(marker->markerName)){
-                printf("writePoint error: marker->markerName is not null-terminated\n");
-                exit(1);
+} /* quantileThresholds */
+
+/* resolveBands
+   Turns the thresholds of a table of colour bands (the Program Key, if it has none)
+   into differences from an offset, for the readings among the first count stations
+   of a store: from the average avgTemp for offset and stddev bands (stddev thresholds
+   being scaled by the standard deviation of stats, which may be NULL for the other
+   kinds), and from 0 for absolute and quantile bands. The threshold of a quantile q
+   is the reading of rank q times the number of readings, counted from 0, so that
+   about that share of the readings lies below it.
+   Returns 0 on success, or -1 if out of memory.
+*/
+int resolveBands(BandTable *bands, StationStore *store, long count, const TemperatureStats *stats, float avgTemp){
+        static const float KeyThresholds[] = {-1, 0, 1};
+        static const int KeyColours[] = {MARKER_BLUE, MARKER_GREEN, MARKER_YELLOW, MARKER_RED};
+        if (bands->numThresholds == 0){
+                bands->kind = BANDS_OFFSET;
+                bands->numThresholds = 3;
+                memcpy(bands->values, KeyThresholds, sizeof(KeyThresholds));
+                memcpy(bands->colours, KeyColours, sizeof(KeyColours));
         }
-        if (strnlen2(marker->markerText,sizeof(marker->markerText)) == sizeof(marker->markerText)){
-                printf("writePoint error: marker->markerText is not null-terminated\n");
-                exit(1);
+        int j;
+        bands->offset = (bands->kind == BANDS_OFFSET || bands->kind == BANDS_STDDEV) ? avgTemp : 0;
+        if (bands->kind == BANDS_QUANTILE){
+                float *values = malloc((count + 1)*sizeof(float));
+                if (values == NULL)
+                        return -1;
+                long i, n = 0;
+                for (i = 0; i < count; i++){
+                        if (store->valid[i])
+                                values[n++] = store->temperature[i];
+                }
+                quantileThresholds(bands, values, n);
+                free(values);
+        }else{
+                double scale = bands->kind == BANDS_STDDEV ? sqrt(temperatureVariance(stats)) : 1;
+                for (j = 0; j < bands->numThresholds; j++)
+                        bands->thresholds[j] = bands->kind == BANDS_STDDEV ? bands->values[j]*scale : bands->values[j];
         }
-        if (marker->type < 0 || marker->type >= NUM_MARKER_TYPES || !MarkerPaths[marker->type]){
-                printf("writePoint error: invalid marker type\n");
-                exit(1);
+        /* The colours past the last band are never looked up, but fill the vector */
+        for (j = bands->numThresholds + 1; j <= BANDS_MAX_THRESHOLDS; j++)
+                bands->colours[j] = bands->colours[bands->numThresholds];
+        bands->resolved = 1;
+        return 0;
+} /* resolveBands */
+
+/* bandTypeFor
+   Returns the marker colour of one temperature in a resolved table of colour bands:
+   the colour of the band after the last threshold that its difference from the
+   table's offset is not below (so a missing reading takes the last colour, as
+   markerTypeFor gives it). If the table is unresolved, the colour is that of the
+   Program Key against avgTemp.
+*/
+int bandTypeFor(BandTable *bands, float temperature, float avgTemp){
+        if (!bands->resolved)
+                return markerTypeFor(temperature, avgTemp);
+        float difference = temperature - bands->offset;
+        int band = 0, j;
+        for (j = 0; j < bands->numThresholds; j++)
+                band += !(difference < bands->thresholds[j]);
+        return bands->colours[band];
+} /* bandTypeFor */
+
+/* classifyBandsScalar
+   The scalar form of classifyColumn, used for the readings after the last whole
+   vector and on CPUs without SIMD support.
+*/
+void classifyBandsScalar(BandTable *bands, float *temperature, unsigned char *type, long from, long to){
+        long i;
+        int j;
+        for (i = from; i < to; i++){
+                float difference = temperature[i] - bands->offset;
+                int band = 0;
+                for (j = 0; j < bands->numThresholds; j++)
+                        band += !(difference < bands->thresholds[j]);
+                type[i] = bands->colours[band];
         }
-        escapeQuotes(escapedName,marker->markerName);
-        escapeQuotes(escapedText,marker->markerText);
-        fprintf(f,"\tvar iw%d = new google.maps.InfoWindow({content: '%s'});\n",markerNum,escapedText);
-        fprintf(f,"\tvar marker%d = new google.maps.Marker({position: new google.maps.LatLng(%f,%f), map: map, title: '%s', icon: '%s'});\n",
-                                markerNum,marker->location.latitude,marker->location.longitude,escapedName,MarkerPaths[marker->type]);
-        fprintf(f,"\tgoogle.maps.event.addListener(marker%d, 'click', function(){ iw%d.open(map,marker%d); } );\n",
-                                markerNum, markerNum, markerNum);
-} /* writePoint */
+} /* classifyBandsScalar */
 
-/* A large array of every VWSN station name, for use by the getStationName function */
-/* Notice that the C99 sparse array initializer syntax is used here, since some entries */
-/* of the array have no value (due to some stations being retired) */
-char *AllStationNames[MAX_STATIONS] = {
-[1] = "Ian Stewart Complex/Mt. Douglas High School",
-[3] = "Strawberry Vale Elementary School",
-[4] = "Oaklands Elementary School",
-[5] = "Cedar Hill Middle School",
-[6] = "Marigold Elementary School/Spectrum High School",
-[7] = "Campus View Elementary",
-[8] = "Victoria High School",
-[9] = "Frank Hobbs Elementary School",
-[10] = "MacAulay Elementary School",
-[11] = "James Bay Elementary School",
-[12] = "Victoria West Elementary School",
-[13] = "Shoreline Middle School",
-[14] = "Willows Elementary School",
-[15] = "Sir James Douglas Elementary School",
-[16] = "Tillicum Elementary School",
-[17] = "Eagle View Elementary School",
-[18] = "Torquay Elementary School",
-[19] = "Monterey Middle School",
-[20] = "Lake Hill Elementary School",
-[21] = "Rogers Elementary School",
-[22] = "Cloverdale Elementary School",
-[24] = "Hillcrest Elementary School",
-[25] = "Lansdowne Middle School",
-[26] = "Doncaster Elementary School",
-[27] = "Glanford Middle School",
-[28] = "Sundance Elementary School",
-[29] = "George Jay Elementary School",
-[30] = "Northridge Elementary School",
-[31] = "Sangster Elementary School",
-[32] = "Colwood Elementary School",
-[33] = "Reynolds High School",
-[34] = "Crystal View Elementary School",
-[35] = "David Cameron Elementary School",
-[36] = "Hans Helgesen Elementary School",
-[37] = "John Muir Elementary School",
-[39] = "Lakewood Elementary School",
-[40] = "Ruth King Elementary School",
-[41] = "CTV Victoria",
-[42] = "Butchart Gardens",
-[46] = "CTV Nanaimo",
-[50] = "Ocean Trails Resort",
-[55] = "Savory Elementary School",
-[56] = "Willway Elementary School",
-[57] = "Wishart Elementary School",
-[58] = "Dunsmuir Middle School",
-[59] = "Journey Middle School/Poirier Elementary School",
-[60] = "Esquimalt High School",
-[61] = "Cordova Bay Elementary School",
-[62] = "Deep Cove Elementary School",
-[63] = "Keating Elementary School",
-[64] = "Lochside Elementary School",
-[66] = "Prospect Lake Elementary School",
-[67] = "Sidney Elementary School",
-[68] = "Bayside Middle School",
-[70] = "Parkland Secondary School",
-[71] = "Cal Revelle Nature Sanctuary",
-[72] = "Race Rocks Ecological Reserve",
-[73] = "Craigflower Elementary School",
-[75] = "Central Middle School",
-[76] = "Lambrick Park High School",
-[77] = "McKenzie Elementary School",
-[78] = "SJ Willis Alternative School",
-[79] = "Arbutus Middle School",
-[80] = "Gordon Head Middle School",
-[81] = "Braefoot Elementary School",
-[82] = "Colquitz Middle School",
-[83] = "Winchelsea Elementary School",
-[84] = "Qualicum Beach Middle School",
-[85] = "Palsson Elementary School",
-[86] = "Randerson Ridge Elementary School",
-[88] = "PASS/Woodwinds Alternate School",
-[89] = "Springwood Middle School",
-[90] = "View Royal Elementary School",
-[91] = "French Creek Community School",
-[92] = "False Bay School",
-[93] = "Shawnigan Lake Museum",
-[94] = "Pender Islands Elementary and Secondary School",
-[95] = "Arrowview Elementary School",
-[96] = "Bowser Elementary School",
-[97] = "Qualicum Beach Elementary School",
-[98] = "Margaret Jenkins Elementary School",
-[99] = "East Highlands District Firehall",
-[100] = "District of Highlands Office",
-[101] = "West Highlands District Firehall",
-[103] = "Frances Kelsey Secondary School",
-[104] = "Happy Valley Elementary School",
-[105] = "Port Renfrew Elementary School",
-[106] = "Edward Milne Community School",
-[107] = "Millstream Elementary School",
-[108] = "Alberni Weather",
-[109] = "Brentwood Elementary School",
-[110] = "Nanoose Bay Elementary School",
-[111] = "Parksville Elementary School",
-[112] = "Saturna Elementary School",
-[113] = "Mayne Island Elementary &amp; Junior Secondary School",
-[114] = "Galiano Island Community School",
-[115] = "L'Ecole Victor Brodeur",
-[117] = "Salt Spring Elementary School &amp;Saltspring Middle School",
-[119] = "Fernwood Elementary School",
-[120] = "Fulford Elementary School",
-[121] = "Gulf Islands Secondary School",
-[122] = "Phoenix Elementary School",
-[123] = "Vancouver Island University",
-[124] = "Seaview Elementary School",
-[125] = "St. Patrick's Elementary School",
-[126] = "Quamichan Middle School",
-[127] = "Cowichan Valley Open Learning Cooperative",
-[128] = "John Stubbs Memorial School",
-[129] = "G.R. Paine Horticultural Training Centre",
-[131] = "Glenlyon Norfolk Junior School",
-[132] = "Shawnigan Lake",
-[133] = "Discovery Elementary School",
-[134] = "Swan Lake Nature House",
-[136] = "Pleasant Valley Elementary School",
-[137] = "McGirr Elementary School",
-[138] = "Bayview Elementary School",
-[139] = "L'Ecole Hammond Bay Elementary",
-[140] = "Uplands Park Elementary",
-[141] = "Mountain View Elementary",
-[142] = "View Royal Fire Department",
-[143] = "UVic Science Building",
-[144] = "Elizabeth Buckley School - Cridge Centre",
-[145] = "Chilliwack Education Centre",
-[159] = "Camosun College Lansdowne",
-[160] = "Shawnigan Lake School",
-[161] = "Bamfield Marine Sciences Centre",
-[162] = "St. Michaels University School Senior Campus",
-[163] = "UVic Social Sciences and Mathematics Building",
-[165] = "Alberni Elementary School",
-[166] = "Maquinna Elementary School",
-[167] = "Wikaninnish Community School",
-[168] = "Ucluelet High School",
-[169] = "Lighthouse Christian Academy",
-[174] = "Kelset Elementary School",
-[176] = "St. Michaels University School Junior Campus",
-[177] = "Ladysmith Secondary School",
-[179] = "Ray Watkins Elementary",
-[180] = "Captain Meares Elementary Secondary School",
-[181] = "West-Mont Montessori School",
-[182] = "Pacific Biological Station, DFO-MPO",
-[183] = "Brentwood College",
-[184] = "NEPTUNE Port Alberni",
-[185] = "Mt. Washington Alpine Resort-Nordic",
-[186] = "Mt. Washington Alpine Resort-Alpine",
-[187] = "Portage Inlet",
-[188] = "North Saanich Middle School",
-[189] = "Airport Elementary School",
-[190] = "Courtenay Elementary School",
-[191] = "Cumberland Junior Secondary School",
-[192] = "Denman Island Community School",
-[193] = "Hornby Island Community School",
-[194] = "Miracle Beach Elementary",
-[195] = "North Island Distance Education School",
-[196] = "Valley View Elementary School",
-[197] = "RASC Victoria Centre",
-[199] = "Trial Island Lightstation",
-[200] = "Longacre",
-};
+#ifdef HAVE_X86_SIMD
 
-/* getStationName
-   This function takes a numerical VWSN station ID, and returns a C string
-   containing the station name, or "Unknown" if no station with that name is found.
+/* classifyBandsAvx2
+   The classifyColumn kernel for 8 readings at a time, on CPUs with AVX2. Each compare
+   gives a lane of all ones (-1) where a reading is not below a threshold, so
+   subtracting the masks counts the band of each reading, whose colour is then looked
+   up with one permute of the table and packed down to bytes. Returns the number of
+   readings done; the rest are left to classifyBandsScalar.
 */
-char* getStationName(int stationID){
-        if (stationID < 0 || stationID >= MAX_STATIONS || !AllStationNames[stationID])
-                return "Unknown";
-        return AllStationNames[stationID];
-} /* getStationName */
+__attribute__((target("avx2")))
+long classifyBandsAvx2(BandTable *bands, float *temperature, unsigned char *type, long count){
+        __m256 offset = _mm256_set1_ps(bands->offset);
+        __m256 thresholds[BANDS_MAX_THRESHOLDS];
+        __m256i colours = _mm256_loadu_si256((const __m256i *)bands->colours);
+        int j;
+        for (j = 0; j < bands->numThresholds; j++)
+                thresholds[j] = _mm256_set1_ps(bands->thresholds[j]);
+        long i, end = count & ~7L;
+        for (i = 0; i < end; i += 8){
+                __m256 difference = _mm256_sub_ps(_mm256_loadu_ps(temperature + i), offset);
+                __m256i band = _mm256_setzero_si256();
+                for (j = 0; j < bands->numThresholds; j++)
+                        band = _mm256_sub_epi32(band, _mm256_castps_si256(_mm256_cmp_ps(difference, thresholds[j], _CMP_NLT_UQ)));
+                __m256i colour = _mm256_permutevar8x32_epi32(colours, band);
+                __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(colour), _mm256_extracti128_si256(colour, 1));
+                _mm_storel_epi64((__m128i *)(type + i), _mm_packus_epi16(words, words));
+        }
+        return end;
+} /* classifyBandsAvx2 */
 
-/* surfaceDistance
-   Given two geographic points, compute the distance between the two points in kilometers.
+/* classifyBandsSse2
+   The classifyColumn kernel for 4 readings at a time, for any x86 CPU with SSE2. The
+   bands are counted as by classifyBandsAvx2, and their colours looked up one lane at
+   a time. Returns the number of readings done.
+*/
+long classifyBandsSse2(BandTable *bands, float *temperature, unsigned char *type, long count){
+        __m128 offset = _mm_set1_ps(bands->offset);
+        __m128 thresholds[BANDS_MAX_THRESHOLDS];
+        int j, lanes[4];
+        for (j = 0; j < bands->numThresholds; j++)
+                thresholds[j] = _mm_set1_ps(bands->thresholds[j]);
+        long i, end = count & ~3L;
+        for (i = 0; i < end; i += 4){
+                __m128 difference = _mm_sub_ps(_mm_loadu_ps(temperature + i), offset);
+                __m128i band = _mm_setzero_si128();
+                for (j = 0; j < bands->numThresholds; j++)
+                        band = _mm_sub_epi32(band, _mm_castps_si128(_mm_cmpnlt_ps(difference, thresholds[j])));
+                _mm_storeu_si128((__m128i *)lanes, band);
+                type[i] = bands->colours[lanes[0]];
+                type[i + 1] = bands->colours[lanes[1]];
+                type[i + 2] = bands->colours[lanes[2]];
+                type[i + 3] = bands->colours[lanes[3]];
+        }
+        return end;
+} /* classifyBandsSse2 */
 
-   The formula used in this function is called the "Haversine formula". More information
-   can be found at its Wikipedia page: http://en.wikipedia.org/wiki/Haversine_formula.
-   Note that the distance computed here is approximate, since the Earth is not a perfect
-   sphere, but the formula is sufficiently accurate for this assignment.
+#endif /* HAVE_X86_SIMD */
+
+/* The vector kernel classifyColumn uses on this CPU (NULL if there is none) and its
+   name, chosen once, on first use */
+long (*classifyBandsVector)(BandTable *bands, float *temperature, unsigned char *type, long count) = NULL;
+const char *classifyBandsVectorName = "scalar";
+pthread_once_t classifyBandsChosen = PTHREAD_ONCE_INIT;
+
+/* Utility function choosing the kernel classifyColumn uses on this CPU */
+void chooseClassifyBandsKernel(){
+#ifdef HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2")){
+                classifyBandsVector = classifyBandsAvx2;
+                classifyBandsVectorName = "avx2";
+        }else{
+                classifyBandsVector = classifyBandsSse2;
+                classifyBandsVectorName = "sse2";
+        }
+#endif
+} /* chooseClassifyBandsKernel */
+
+/* Utility function naming the kernel classifyColumn uses on this CPU */
+const char *classifyBandsKernel(){
+        pthread_once(&classifyBandsChosen, chooseClassifyBandsKernel);
+        return classifyBandsVectorName;
+} /* classifyBandsKernel */
+
+/* classifyColumn
+   Fills in the marker colour of each of count temperatures from a resolved table of
+   colour bands, as bandTypeFor gives it.
 */
-float surfaceDistance(GeographicPoint* point1, GeographicPoint* point2){
-        if (!point1){
-                printf("surfaceDistance error: point1 is invalid\n");
-                exit(1);
+void classifyColumn(BandTable *bands, float *temperature, unsigned char *type, long count){
+        long done = 0;
+        classifyBandsKernel();
+        if (classifyBandsVector != NULL)
+                done = classifyBandsVector(bands, temperature, type, count);
+        classifyBandsScalar(bands, temperature, type, done, count);
+} /* classifyColumn */
+
+/* classifyBands
+   Fills in the marker colour of the first count stations of a store from a resolved
+   table of colour bands.
+*/
+void classifyBands(BandTable *bands, StationStore *store, long count){
+        classifyColumn(bands, store->temperature, store->type, count);
+} /* classifyBands */
+
+/* Utility function comparing floats for qsort */
+int compareFloats(const void *a, const void *b){
+        float x = *(const float *)a, y = *(const float *)b;
+        return (x > y) - (x < y);
+} /* compareFloats */
+
+/* benchmarkClassify
+   Colours BENCH_CLASSIFY_READINGS pseudo-random readings (to 2 decimals, as in the
+   input file, with a missing reading now and then) by the Program Key, once with
+   markerTypeFor and once with classifyColumn, checks that both give the same colours
+   and compares their speed. Then finds the quartiles of the readings by selection and
+   by sorting them, and checks that both give the same thresholds.
+   Returns EXIT_FAILURE if either check fails.
+*/
+int benchmarkClassify(BenchReport *report){
+        long count = BENCH_CLASSIFY_READINGS, i;
+        float *temperature = malloc(count*sizeof(float));
+        float *values = malloc(count*sizeof(float));
+        unsigned char *expected = malloc(count);
+        unsigned char *type = malloc(count);
+        if (!temperature || !values || !expected || !type){
+                printf("Out of memory\n");
+                return EXIT_FAILURE;
         }
-        if (!point2){
-                printf("surfaceDistance error: point2 is invalid\n");
-                exit(1);
+        unsigned long long seed = 1;
+        double sum = 0;
+        long n = 0;
+        for (i = 0; i < count; i++){
+                if (i % 1000 == 999){
+                        temperature[i] = NAN;
+                        continue;
+                }
+                temperature[i] = roundf(100*(10 + 4*nextGaussian(&seed)))/100;
+                sum += temperature[i];
+                values[n++] = temperature[i];
         }
-        const float RADIUS_OF_EARTH = 6371;
-        float lat1 = point1->latitude*M_PI/180.0;
-        float lon1 = point1->longitude*M_PI/180.0;
-        float lat2 = point2->latitude*M_PI/180.0;
-        float lon2 = point2->longitude*M_PI/180.0;
-        float lat_diff = fabs(lat1-lat2);
-        float lon_diff = fabs(lon1-lon2);
-        float latsin = sin(lat_diff/2);
-        float lonsin = sin(lon_diff/2);
-        float angle_diff = 2*asin(sqrt(latsin*latsin + cos(lat1)*cos(lat2)*lonsin*lonsin));
-        return RADIUS_OF_EARTH*angle_diff;
-} /* surfaceDistance */
+        float avgTemp = sum/n;
+        BandTable bands;
+        memset(&bands, 0, sizeof(BandTable));
+        resolveBands(&bands, NULL, 0, NULL, avgTemp);
+
+        double bestScalar = 0, bestBatch = 0;
+        int run;
+        for (run = 0; run < BENCH_RUNS; run++){
+                double start = monotonicSeconds();
+                for (i = 0; i < count; i++)
+                        expected[i] = markerTypeFor(temperature[i], avgTemp);
+                double elapsed = monotonicSeconds() - start;
+                if (run == 0 || elapsed < bestScalar)
+                        bestScalar = elapsed;
+                start = monotonicSeconds();
+                classifyColumn(&bands, temperature, type, count);
+                elapsed = monotonicSeconds() - start;
+                if (run == 0 || elapsed < bestBatch)
+                        bestBatch = elapsed;
+        }
+        int identical = memcmp(expected, type, count) == 0;
+
+        /* Find the quartiles by selection, then by sorting a copy of the readings */
+        BandTable quartiles;
+        if (parseBandSpec("quantile:0.25,0.5,0.75", &quartiles) != 0)
+                return EXIT_FAILURE;
+        memcpy(temperature, values, n*sizeof(float));
+        double start = monotonicSeconds();
+        quantileThresholds(&quartiles, temperature, n);
+        double selectTime = monotonicSeconds() - start;
+        start = monotonicSeconds();
+        qsort(values, n, sizeof(float), compareFloats);
+        double sortTime = monotonicSeconds() - start;
+        int j, sameThresholds = 1;
+        for (j = 0; j < quartiles.numThresholds; j++){
+                if (quartiles.thresholds[j] != values[(long)(quartiles.values[j]*n)])
+                        sameThresholds = 0;
+        }
+        printf("classify: %ld readings, markerTypeFor %.4f s (%.0f Mreadings/s), classifyBands (%s) %.4f s (%.0f Mreadings/s), speedup %.1fx, colours %s\n",
+                                count, bestScalar, count/bestScalar/1e6, classifyBandsKernel(), bestBatch, count/bestBatch/1e6,
+                                bestScalar/bestBatch, identical ? "identical" : "DIFFERENT");
+        printf("quantiles: quartiles %.2f %.2f %.2f of %ld readings, selection %.4f s, sort %.4f s, speedup %.1fx, thresholds %s\n",
+                                quartiles.thresholds[0], quartiles.thresholds[1], quartiles.thresholds[2], n, selectTime, sortTime,
+                                sortTime/selectTime, sameThresholds ? "identical" : "DIFFERENT");
+        benchRecord(report, "classify.scalar", 1, bestScalar, count, "readings", 0);
+        benchRecord(report, "classify.batch", 1, bestBatch, count, "readings", 0);
+        benchRecord(report, "quantiles.select", 1, selectTime, n, "readings", 0);
+        benchRecord(report, "quantiles.sort", 1, sortTime, n, "readings", 0);
+        free(temperature);
+        free(values);
+        free(expected);
+        free(type);
+        return identical && sameThresholds ? EXIT_SUCCESS : EXIT_FAILURE;
+} /* benchmarkClassify */